@@ -0,0 +1,2 @@
+build/cache.o: src/cache.c src/cache.h src/common.h src/mem.h src/expr.h \
+ src/logging.h src/util.h
@@ -0,0 +1,2 @@
+build/groups.o: src/groups.c src/groups.h src/common.h src/mem.h \
+ src/logging.h src/numbers.h src/expr.h src/util.h
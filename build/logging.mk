@@ -0,0 +1 @@
+build/logging.o: src/logging.c src/logging.h src/common.h
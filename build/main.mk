@@ -0,0 +1,3 @@
+build/main.o: src/main.c src/common.h src/cache.h src/mem.h src/expr.h \
+ src/groups.h src/logging.h src/memo.h src/numbers.h src/prefetch.h \
+ src/scan.h src/util.h
@@ -0,0 +1,2 @@
+build/mem.o: src/mem.c src/mem.h src/common.h src/expr.h src/util.h \
+ src/logging.h
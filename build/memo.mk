@@ -0,0 +1,2 @@
+build/memo.o: src/memo.c src/memo.h src/common.h src/expr.h src/mem.h \
+ src/logging.h src/numbers.h src/util.h
@@ -0,0 +1,2 @@
+build/numbers.o: src/numbers.c src/numbers.h src/common.h src/expr.h \
+ src/mem.h src/logging.h src/util.h
@@ -0,0 +1 @@
+build/pow5.o: src/pow5.c src/pow5.h src/common.h
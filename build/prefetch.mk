@@ -0,0 +1,2 @@
+build/prefetch.o: src/prefetch.c src/prefetch.h src/common.h src/mem.h \
+ src/cache.h src/logging.h src/uring.h src/util.h
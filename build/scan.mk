@@ -0,0 +1 @@
+build/scan.o: src/scan.c src/scan.h src/common.h src/logging.h src/util.h
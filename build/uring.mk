@@ -0,0 +1,2 @@
+build/uring.o: src/uring.c src/uring.h src/common.h src/mem.h \
+ src/logging.h src/util.h
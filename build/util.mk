@@ -0,0 +1 @@
+build/util.o: src/util.c src/util.h src/common.h src/logging.h src/pow5.h
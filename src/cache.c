@@ -0,0 +1,784 @@
+#include "cache.h"
+
+#include "expr.h"
+#include "logging.h"
+#include "util.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/* NOTE: bump this whenever the meaning of anything we store changes (e.g.,
+ * the numbering of enum expr_func). Changes in size are caught by Layout. */
+#define CACHE_VERSION 3
+#define CACHE_LAYOUT ((u32)(sizeof (struct expr_node) << 16 | sizeof (struct cached_cell)))
+#define CACHE_ALIGN 16
+
+/* The file is laid out as
+ *
+ *     header | columns | cells | formulas | macros | nodes | source 0
+ *
+ * with every section starting on a CACHE_ALIGN boundary. Nothing holds a
+ * pointer: spans are stored as offsets into the source, and links to formulas
+ * as one more than the index of what is linked to (0 being null). The nodes
+ * are the document's own, which already link by index (see expr.h). */
+struct cache_header {
+    char Magic[8];
+    u32 Version;
+    u32 Layout;
+
+    u64 Device, Inode;
+    s64 MTimeSec, MTimeNsec;
+    s64 CTimeSec, CTimeNsec;
+    u64 SourceSize;
+    u64 FileSize;
+
+    s32 Cols, Rows;
+    s32 FirstBodyRow, FirstFootRow;
+    s32 Summarized;
+    struct cell_ref Summary;
+    s32 NumFormulas;
+    s32 NumMacros;
+    u32 NumNodes;
+
+    u64 ColumnsAt, CellsAt, FormulasAt, MacrosAt, NodesAt, SourceAt;
+};
+
+struct cached_column {
+    s32 Width;
+    u32 Bar;
+};
+
+struct cached_cell {
+    struct fmt_header Fmt;
+    u32 Type;
+    u32 Formula;
+    union {
+        struct { u32 At; s32 Len; } AsSpan;
+        f64 AsNumber;
+        u32 AsError;
+    };
+};
+
+struct cached_formula {
+    u32 TextAt;
+    s32 TextLen;
+    u32 Root;
+};
+
+struct cached_macro {
+    u32 NameAt;
+    s32 NameLen;
+    u32 Body;
+};
+
+static constexpr char CacheMagic[8] = "tabcache";
+
+static bool CacheDisabled = false;
+
+static fd
+OpenCacheDir(void)
+{
+    /* NOTE: documents may be made on several threads at once */
+    static pthread_mutex_t CacheDirLock = PTHREAD_MUTEX_INITIALIZER;
+    static fd CacheDir = -2;
+
+    pthread_mutex_lock(&CacheDirLock);
+    if (CacheDir == -2) {
+        char Path[PATH_MAX];
+        char *Env;
+        s32 Len = -1;
+
+        CacheDir = -1;
+        if (CacheDisabled || ((Env = getenv("TABULATE_NO_CACHE")) && *Env)) {
+            /* nop. there is no cache */
+        }
+        else if ((Env = getenv("XDG_CACHE_HOME")) && *Env) {
+            Len = snprintf(Path, sizeof Path, "%s/tabulate", Env);
+        }
+        else if ((Env = getenv("HOME")) && *Env) {
+            Len = snprintf(Path, sizeof Path, "%s/.cache/tabulate", Env);
+        }
+
+        if (0 < Len && Len < (s32)sizeof Path) {
+            /* make the parent first; it's fine if either already exists */
+            s32 Errno = errno;
+            char *Slash = strrchr(Path, '/');
+            *Slash = 0;
+            mkdir(Path, 0755);
+            *Slash = '/';
+            mkdir(Path, 0755);
+            errno = Errno;
+
+            if ((CacheDir = open(Path, O_DIRECTORY | O_RDONLY)) < 0) {
+                LogError("open(\"%s\", O_DIRECTORY | O_RDONLY)", Path);
+            }
+        }
+    }
+    fd Dir = CacheDir;
+    pthread_mutex_unlock(&CacheDirLock);
+
+    return Dir;
+}
+
+/* NOTE: before any document is made */
+void
+DisableDiskCache(void)
+{
+    CacheDisabled = true;
+}
+
+bool
+HaveDiskCache(void)
+{
+    return OpenCacheDir() >= 0;
+}
+
+static void
+CacheName(char *Buf, umm Size, struct stat *Stat)
+{
+    snprintf(Buf, Size, "%016lx%016lx", (u64)Stat->st_dev, (u64)Stat->st_ino);
+}
+
+fd
+CacheEntry(struct stat *Stat, char *Name, umm Size)
+{
+    fd CacheDir = OpenCacheDir();
+    if (CacheDir >= 0) {
+        CacheName(Name, Size, Stat);
+    }
+    return CacheDir;
+}
+
+
+/* *** LOADING *** */
+
+static bool
+InSource(struct cache_header *Header, u64 At, s64 Len)
+{
+    return Len >= 0 && At + Len <= Header->SourceSize;
+}
+
+static bool
+InFile(struct cache_header *Header, u64 At, u64 Count, u64 Size)
+{
+    return At % CACHE_ALIGN == 0 && At <= Header->FileSize
+        && Count <= (Header->FileSize - At) / Size;
+}
+
+static struct span
+UnpackSpan(struct cache_header *Header, char *Source, struct span Span, bool *Ok)
+{
+    u64 At = (ptr)Span.Str;
+    *Ok &= InSource(Header, At, Span.Len);
+    return (struct span){ Source + At, Span.Len };
+}
+
+static bool
+IsChainOp(enum expr_operator Op)
+{
+    return Op == EN_OP_ADD || Op == EN_OP_SUB || Op == EN_OP_MUL || Op == EN_OP_DIV;
+}
+
+/* Turn the stored offsets back into pointers, in place, and make sure that the
+ * nodes form proper trees: evaluation trusts every Start and Count. */
+static bool
+UnpackNodes(struct cache_header *Header, struct expr_node *Nodes, char *Source)
+{
+    bool Ok = Header->NumNodes == 0 || Nodes[0].Type == EN_NULL;
+    u32 NumOperands = 0, NumChained = 0;
+
+    for (u32 Idx = 1; Ok && Idx < Header->NumNodes; ++Idx) {
+        struct expr_node *Node = Nodes + Idx;
+        s32 MinCount = 0, MaxCount = 0;
+
+        switch (Node->Type) {
+        case EN_ERROR:
+        case EN_NUMBER:
+        case EN_CELL:
+        case EN_RANGE:
+            break;
+
+        case EN_MACRO:
+        case EN_FUNC_IDENT:
+            Node->AsIdent = UnpackSpan(Header, Source, Node->AsIdent, &Ok);
+            break;
+
+        case EN_STRING:
+            Node->AsString = UnpackSpan(Header, Source, Node->AsString, &Ok);
+            break;
+
+        case EN_XENO:
+            Node->AsXeno.Reference = UnpackSpan(Header, Source, Node->AsXeno.Reference, &Ok);
+            break;
+
+        case EN_ROOT:
+        case EN_TERM:
+            MinCount = MaxCount = 1;
+            break;
+
+        case EN_SUM:
+        case EN_PROD:
+            MinCount = 1;
+            MaxCount = UINT16_MAX;
+            break;
+
+        case EN_FUNC:
+            MaxCount = UINT16_MAX;
+            break;
+
+        default:
+            Ok = false;
+            break;
+        }
+
+        /* the children must exactly tile this node's subtree */
+        Ok &= 1 <= Node->Start && Node->Start <= Idx;
+        Ok &= MinCount <= Node->Count && Node->Count <= MaxCount;
+        u32 Child = Idx - 1;
+        for (s32 Remaining = Node->Count; Ok && Remaining > 0; --Remaining) {
+            Ok = Node->Start <= Child;
+            if (Ok) {
+                enum expr_operator Op = Nodes[Child].Op;
+                if (Node->Count > 1 && (Node->Type == EN_SUM || Node->Type == EN_PROD)) {
+                    Ok = (Remaining == 1)? Op == EN_OP_SET: IsChainOp(Op);
+                }
+                Child = Nodes[Child].Start - 1;
+            }
+        }
+        Ok &= Child + 1 == Node->Start;
+
+        NumOperands += (Node->Op != EN_OP_NULL);
+        if (Node->Count > 1 && (Node->Type == EN_SUM || Node->Type == EN_PROD)) {
+            NumChained += Node->Count;
+        }
+    }
+
+    /* NOTE: then no node has an operator without being in a sum or product */
+    return Ok && NumOperands == NumChained;
+}
+
+static bool
+CheckHeader(struct cache_header *Header, struct stat *Stat, umm FileSize)
+{
+    return memcmp(Header->Magic, CacheMagic, sizeof CacheMagic) == 0
+        && Header->Version == CACHE_VERSION
+        && Header->Layout == CACHE_LAYOUT
+        && Header->Device == (u64)Stat->st_dev
+        && Header->Inode == (u64)Stat->st_ino
+        && Header->MTimeSec == Stat->st_mtim.tv_sec
+        && Header->MTimeNsec == Stat->st_mtim.tv_nsec
+        && Header->CTimeSec == Stat->st_ctim.tv_sec
+        && Header->CTimeNsec == Stat->st_ctim.tv_nsec
+        && Header->SourceSize == (u64)Stat->st_size
+        && Header->FileSize == FileSize
+        && 0 <= Header->Cols && 0 <= Header->Rows
+        && 0 <= Header->NumFormulas
+        && 0 <= Header->NumMacros && Header->NumMacros <= MACRO_MAX_COUNT
+        && InFile(Header, Header->ColumnsAt, Header->Cols, sizeof (struct cached_column))
+        && InFile(Header, Header->CellsAt, (u64)Header->Cols * Header->Rows, sizeof (struct cached_cell))
+        && InFile(Header, Header->FormulasAt, Header->NumFormulas, sizeof (struct cached_formula))
+        && InFile(Header, Header->MacrosAt, Header->NumMacros, sizeof (struct cached_macro))
+        && InFile(Header, Header->NodesAt, Header->NumNodes, sizeof (struct expr_node))
+        && InFile(Header, Header->SourceAt, Header->SourceSize + 1, 1);
+}
+
+static bool
+CheckCells(struct cache_header *Header, struct cached_cell *Cells)
+{
+    bool Ok = true;
+    u64 NumCells = (u64)Header->Cols * Header->Rows;
+    for (u64 Idx = 0; Ok && Idx < NumCells; ++Idx) {
+        struct cached_cell *Cell = Cells + Idx;
+        Ok = Cell->Formula <= (u32)Header->NumFormulas;
+        switch (Cell->Type) {
+        case CELL_NULL:
+        case CELL_NUMBER:
+        case CELL_ERROR:
+            break;
+        case CELL_STRING:
+            Ok &= InSource(Header, Cell->AsSpan.At, Cell->AsSpan.Len);
+            break;
+        case CELL_EXPR:
+            Ok &= InSource(Header, Cell->AsSpan.At, Cell->AsSpan.Len);
+            Ok &= Cell->Formula != 0;
+            break;
+        default:
+            Ok = false;
+            break;
+        }
+    }
+    return Ok;
+}
+
+struct document *
+LoadCachedDoc(fd Dir, struct stat *Stat)
+{
+    Assert(Stat);
+
+    struct document *Doc = nullptr;
+    char Name[64];
+    struct stat CacheStat;
+    fd CacheDir, File;
+    s32 Errno = errno;
+
+    if (!S_ISREG(Stat->st_mode) || (CacheDir = OpenCacheDir()) < 0) {
+        return nullptr;
+    }
+
+    CacheName(Name, sizeof Name, Stat);
+    if ((File = openat(CacheDir, Name, O_RDONLY)) < 0) {
+        if (errno != ENOENT) {
+            LogError("openat(%d, \"%s\", O_RDONLY)", CacheDir, Name);
+        }
+        /* NOTE: a miss is not an error, and later logging reports errno */
+        errno = Errno;
+    }
+    else if (fstat(File, &CacheStat)) {
+        LogError("fstat(%d, ...)", File);
+        close(File);
+    }
+    else if ((umm)CacheStat.st_size < sizeof (struct cache_header)) {
+        close(File);
+    }
+    else {
+        umm MapSize = CacheStat.st_size;
+        /* NOTE: the mapping is private, so unpacking the nodes in place
+         * never writes back to the file; they are copied out once checked */
+        char *Map = mmap(0, MapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE, File, 0);
+        close(File);
+
+        struct cache_header *Header = (struct cache_header *)Map;
+        if (Map == MAP_FAILED) {
+            LogError("mmap(0, %lu, ...)", MapSize);
+        }
+        else if (!CheckHeader(Header, Stat, MapSize)
+                || Map[Header->SourceAt + Header->SourceSize] != 0
+                || !CheckCells(Header, (struct cached_cell *)(Map + Header->CellsAt))
+                || !UnpackNodes(Header, (struct expr_node *)(Map + Header->NodesAt), Map + Header->SourceAt)) {
+#if ANNOUNCE_DISK_CACHE
+            LogInfo("Stale cache entry %s", Name);
+#endif
+            munmap(Map, MapSize);
+        }
+        else {
+            char *Source = Map + Header->SourceAt;
+            struct cached_column *Columns = (struct cached_column *)(Map + Header->ColumnsAt);
+            struct cached_cell *Cells = (struct cached_cell *)(Map + Header->CellsAt);
+            struct cached_formula *Formulas = (struct cached_formula *)(Map + Header->FormulasAt);
+            struct cached_macro *Macros = (struct cached_macro *)(Map + Header->MacrosAt);
+            struct expr_node *Nodes = (struct expr_node *)(Map + Header->NodesAt);
+
+            /* these are checked here, before we commit to a document */
+            bool Ok = true;
+            for (s32 Idx = 0; Idx < Header->NumFormulas; ++Idx) {
+                Ok &= InSource(Header, Formulas[Idx].TextAt, Formulas[Idx].TextLen);
+                u32 Root = Formulas[Idx].Root;
+                Ok &= !Root || (Root < Header->NumNodes && Nodes[Root].Op == EN_OP_NULL);
+            }
+            for (s32 Idx = 0; Idx < Header->NumMacros; ++Idx) {
+                Ok &= InSource(Header, Macros[Idx].NameAt, Macros[Idx].NameLen);
+                u32 Body = Macros[Idx].Body;
+                Ok &= !Body || (Body < Header->NumNodes && Nodes[Body].Op == EN_OP_NULL);
+            }
+
+            if (!Ok) {
+                munmap(Map, MapSize);
+            }
+            else {
+                *(Doc = AllocAndLogDoc(Stat->st_dev, Stat->st_ino)) = (struct document){
+                    .Dir = Dir,
+                    .Device = Stat->st_dev,
+                    .Inode = Stat->st_ino,
+                    .Source = { Source, Header->SourceSize, Map, MapSize },
+                    .Summarized = Header->Summarized,
+                    .Summary = Header->Summary,
+                    .FirstBodyRow = Header->FirstBodyRow,
+                    .FirstFootRow = Header->FirstFootRow,
+                    .NumMacros = Header->NumMacros,
+                };
+#if ANNOUNCE_DISK_CACHE
+                LogInfo("Loaded cache entry %s", Name);
+#endif
+                /* NOTE: an entry's mtime is when it was last used, which is
+                 * what TrimCache() goes by */
+                if (utimensat(CacheDir, Name, nullptr, 0)) {
+                    errno = Errno;
+                }
+
+                if (Header->NumNodes) {
+                    ReserveNodes(Doc, Header->NumNodes - 1);
+                    memcpy(Doc->Nodes, Nodes, Header->NumNodes * sizeof *Nodes);
+                }
+
+                struct formula *DocFormulas = ReserveFormulas(Doc, Header->NumFormulas);
+                for (s32 Idx = 0; Idx < Header->NumFormulas; ++Idx) {
+                    DocFormulas[Idx] = (struct formula){
+                        .Text = { Source + Formulas[Idx].TextAt, Formulas[Idx].TextLen },
+                        .Root = Formulas[Idx].Root,
+                    };
+                }
+                Doc->NumFormulas = Header->NumFormulas;
+
+                if (Header->Cols) ReserveColumn(Doc, Header->Cols - 1);
+                if (Header->Cols && Header->Rows) ReserveCell(Doc, Header->Cols - 1, Header->Rows - 1);
+                Doc->Cols = Header->Cols;
+                Doc->Rows = Header->Rows;
+
+                for (s32 ColIdx = 0; ColIdx < Doc->Cols; ++ColIdx) {
+                    struct column *Column = GetColumn(Doc, ColIdx);
+                    Column->Width = Columns[ColIdx].Width;
+                    Column->Sep = Columns[ColIdx].Bar? BAR_SEPERATOR: COLUMN_SEPERATOR;
+
+                    for (s32 RowIdx = 0; RowIdx < Doc->Rows; ++RowIdx) {
+                        struct cached_cell *From = Cells++;
+                        struct cell *Cell = GetCell(Doc, ColIdx, RowIdx);
+                        Cell->Fmt = From->Fmt;
+                        Cell->Type = From->Type;
+                        Cell->Formula = From->Formula? DocFormulas + From->Formula - 1: nullptr;
+                        switch (Cell->Type) {
+                        case CELL_NULL:   break;
+                        case CELL_NUMBER: Cell->AsNumber = From->AsNumber; break;
+                        case CELL_ERROR:  Cell->AsError = From->AsError; break;
+                        case CELL_STRING:
+                        case CELL_EXPR:
+                            Cell->AsString = (struct span){ Source + From->AsSpan.At, From->AsSpan.Len };
+                            break;
+                        default_unreachable;
+                        }
+                    }
+                }
+
+                for (s32 Idx = 0; Idx < Doc->NumMacros; ++Idx) {
+                    Doc->Macros[Idx] = (struct macro_def){
+                        .Name = { Source + Macros[Idx].NameAt, Macros[Idx].NameLen },
+                        .Body = Macros[Idx].Body,
+                    };
+                }
+            }
+        }
+    }
+
+    return Doc;
+}
+
+
+/* *** SAVING *** */
+
+struct packer {
+    char *Data;
+    umm Used;
+    umm Size;
+
+    struct document *Doc;
+    bool Ok;
+};
+
+static char *
+Grow(struct packer *Packer, umm Size)
+{
+    umm At = Packer->Used;
+    if (At + Size > Packer->Size) {
+        Packer->Size = NextPow2(At + Size);
+        Packer->Data = NotNull(realloc(Packer->Data, Packer->Size));
+    }
+    Packer->Used += Size;
+    return Packer->Data + At;
+}
+
+static void
+Append(struct packer *Packer, void *Data, umm Size)
+{
+    if (Size) memcpy(Grow(Packer, Size), Data, Size);
+}
+
+/* Start a new section. */
+static umm
+Align(struct packer *Packer)
+{
+    umm Pad = -Packer->Used & (CACHE_ALIGN-1);
+    memset(Grow(Packer, Pad), 0, Pad);
+    return Packer->Used;
+}
+
+static u32
+PackOffset(struct packer *Packer, struct span Span)
+{
+    struct source *Source = &Packer->Doc->Source;
+    umm At = Span.Str - Source->Data;
+    if (Span.Str < Source->Data || Span.Len < 0 || At + Span.Len > Source->Size) {
+        /* NOTE: not from the source, so there is nothing to point back into */
+        Packer->Ok = false;
+        At = 0;
+    }
+    return At;
+}
+
+static struct span
+PackSpan(struct packer *Packer, struct span Span)
+{
+    return (struct span){ (char *)(ptr)PackOffset(Packer, Span), Span.Len };
+}
+
+static struct expr_node
+PackNode(struct packer *Packer, struct expr_node Node)
+{
+    switch (Node.Type) {
+    case EN_MACRO:
+    case EN_FUNC_IDENT:
+        Node.AsIdent = PackSpan(Packer, Node.AsIdent);
+        break;
+    case EN_STRING:
+        Node.AsString = PackSpan(Packer, Node.AsString);
+        break;
+    case EN_XENO:
+        Node.AsXeno.Reference = PackSpan(Packer, Node.AsXeno.Reference);
+        break;
+    default:
+        break;
+    }
+    return Node;
+}
+
+static bool
+WriteAll(fd File, char *Data, umm Size)
+{
+    while (Size) {
+        smm Wrote = write(File, Data, Size);
+        if (Wrote < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        Data += Wrote;
+        Size -= Wrote;
+    }
+    return true;
+}
+
+struct cache_file {
+    char Name[64];
+    s64 Used;
+    umm Size;
+};
+
+static s32
+ByLastUse(const void *A, const void *B)
+{
+    s64 UsedA = ((struct cache_file *)A)->Used;
+    s64 UsedB = ((struct cache_file *)B)->Used;
+    return (UsedA > UsedB) - (UsedA < UsedB);
+}
+
+/* Remove the entries that have not been used for MAX_CACHE_AGE, and then the
+ * least recently used ones, until the rest take MAX_CACHE_SIZE at most. Files
+ * that are still being written start with a '.', and are only ever removed
+ * for their age. */
+static void
+TrimCache(fd CacheDir)
+{
+    s32 Errno = errno;
+    fd Listed = openat(CacheDir, ".", O_DIRECTORY | O_RDONLY);
+    DIR *Listing = Listed < 0? nullptr: fdopendir(Listed);
+    if (!Listing) {
+        LogError("fdopendir(%d)", Listed);
+        if (Listed >= 0) close(Listed);
+        return;
+    }
+
+    s64 Now = time(nullptr);
+    s32 NumFiles = 0, MaxFiles = 0;
+    struct cache_file *Files = nullptr;
+    umm Total = 0;
+
+    struct dirent *Entry;
+    while ((Entry = readdir(Listing))) {
+        char *Name = Entry->d_name;
+        struct stat Stat;
+        if (StrEq(Name, ".") || StrEq(Name, "..")
+                || fstatat(CacheDir, Name, &Stat, AT_SYMLINK_NOFOLLOW)
+                || !S_ISREG(Stat.st_mode)) {
+            continue;
+        }
+
+        if (Now - Stat.st_mtim.tv_sec > MAX_CACHE_AGE) {
+            unlinkat(CacheDir, Name, 0);
+        }
+        else if (Name[0] != '.' && strlen(Name) < sizeof Files->Name) {
+            if (NumFiles == MaxFiles) {
+                MaxFiles = MaxFiles? 2*MaxFiles: 64;
+                Files = ResizeTemp(Files, MaxFiles * sizeof *Files);
+            }
+            struct cache_file *File = Files + NumFiles++;
+            strcpy(File->Name, Name);
+            File->Used = Stat.st_mtim.tv_sec;
+            File->Size = Stat.st_size;
+            Total += File->Size;
+        }
+    }
+    closedir(Listing);
+
+    if (Total > MAX_CACHE_SIZE) {
+        qsort(Files, NumFiles, sizeof *Files, ByLastUse);
+        for (s32 Idx = 0; Idx < NumFiles && Total > MAX_CACHE_SIZE; ++Idx) {
+            if (!unlinkat(CacheDir, Files[Idx].Name, 0)) {
+                Total -= Files[Idx].Size;
+            }
+        }
+    }
+
+    FreeTemp(Files);
+    errno = Errno;
+}
+
+void
+SaveCachedDoc(struct document *Doc, struct stat *Stat)
+{
+    Assert(Doc);
+    Assert(Stat);
+
+    fd CacheDir;
+    if (!S_ISREG(Stat->st_mode)
+            || Doc->Source.Size != (umm)Stat->st_size
+            || (CacheDir = OpenCacheDir()) < 0) {
+        return;
+    }
+
+    struct cache_header Header = {
+        .Version = CACHE_VERSION,
+        .Layout = CACHE_LAYOUT,
+        .Device = Stat->st_dev,
+        .Inode = Stat->st_ino,
+        .MTimeSec = Stat->st_mtim.tv_sec,
+        .MTimeNsec = Stat->st_mtim.tv_nsec,
+        .CTimeSec = Stat->st_ctim.tv_sec,
+        .CTimeNsec = Stat->st_ctim.tv_nsec,
+        .SourceSize = Doc->Source.Size,
+        .Cols = Doc->Cols,
+        .Rows = Doc->Rows,
+        .FirstBodyRow = Doc->FirstBodyRow,
+        .FirstFootRow = Doc->FirstFootRow,
+        .Summarized = Doc->Summarized,
+        .Summary = Doc->Summary,
+        .NumFormulas = Doc->NumFormulas,
+        .NumMacros = Doc->NumMacros,
+    };
+    memcpy(Header.Magic, CacheMagic, sizeof Header.Magic);
+
+    struct packer Packer = { .Doc = Doc, .Ok = true };
+    Append(&Packer, &Header, sizeof Header);
+
+    Header.ColumnsAt = Align(&Packer);
+    for (s32 ColIdx = 0; ColIdx < Doc->Cols; ++ColIdx) {
+        struct column *Column = GetColumn(Doc, ColIdx);
+        struct cached_column Packed = { Column->Width, 0 };
+        if (StrEq(Column->Sep, BAR_SEPERATOR)) {
+            Packed.Bar = 1;
+        }
+        else if (!StrEq(Column->Sep, COLUMN_SEPERATOR)) {
+            Packer.Ok = false;
+        }
+        Append(&Packer, &Packed, sizeof Packed);
+    }
+
+    Header.CellsAt = Align(&Packer);
+    for (s32 ColIdx = 0; ColIdx < Doc->Cols; ++ColIdx) {
+        for (s32 RowIdx = 0; RowIdx < Doc->Rows; ++RowIdx) {
+            struct cell *Cell = GetCell(Doc, ColIdx, RowIdx);
+            struct cached_cell Packed = {
+                .Fmt = Cell->Fmt,
+                .Type = Cell->Type,
+                .Formula = Cell->Formula? Cell->Formula - Doc->Formulas + 1: 0,
+            };
+            switch (Cell->Type) {
+            case CELL_NULL:   break;
+            case CELL_NUMBER: Packed.AsNumber = Cell->AsNumber; break;
+            case CELL_ERROR:  Packed.AsError = Cell->AsError; break;
+            case CELL_STRING:
+            case CELL_EXPR:
+                Packed.AsSpan.At = PackOffset(&Packer, Cell->AsString);
+                Packed.AsSpan.Len = Cell->AsString.Len;
+                break;
+            default:
+                Packer.Ok = false;
+                break;
+            }
+            Append(&Packer, &Packed, sizeof Packed);
+        }
+    }
+
+    Header.FormulasAt = Align(&Packer);
+    for (s32 Idx = 0; Idx < Doc->NumFormulas; ++Idx) {
+        struct formula *Formula = Doc->Formulas + Idx;
+        struct cached_formula Packed = {
+            .TextAt = PackOffset(&Packer, Formula->Text),
+            .TextLen = Formula->Text.Len,
+            .Root = Formula->Root,
+        };
+        Append(&Packer, &Packed, sizeof Packed);
+    }
+
+    Header.MacrosAt = Align(&Packer);
+    for (s32 Idx = 0; Idx < Doc->NumMacros; ++Idx) {
+        struct cached_macro Packed = {
+            .NameAt = PackOffset(&Packer, Doc->Macros[Idx].Name),
+            .NameLen = Doc->Macros[Idx].Name.Len,
+            .Body = Doc->Macros[Idx].Body,
+        };
+        Append(&Packer, &Packed, sizeof Packed);
+    }
+
+    Header.NumNodes = Doc->NumNodes;
+    Header.NodesAt = Align(&Packer);
+    for (u32 Idx = 0; Idx < Doc->NumNodes; ++Idx) {
+        struct expr_node Packed = PackNode(&Packer, Doc->Nodes[Idx]);
+        Append(&Packer, &Packed, sizeof Packed);
+    }
+    Header.SourceAt = Align(&Packer);
+    Append(&Packer, Doc->Source.Data, Doc->Source.Size + 1);
+    Header.FileSize = Packer.Used;
+    memcpy(Packer.Data, &Header, sizeof Header);
+
+    if (Packer.Ok && Packer.Used <= MAX_CACHE_SIZE) {
+        char Name[64], Temp[96];
+        CacheName(Name, sizeof Name, Stat);
+        snprintf(Temp, sizeof Temp, ".%s.%d", Name, getpid());
+
+        /* write to the side and then rename, so that no one ever maps a
+         * partially written entry */
+        fd File = openat(CacheDir, Temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (File < 0) {
+            LogError("openat(%d, \"%s\", ...)", CacheDir, Temp);
+        }
+        else {
+            bool Wrote = WriteAll(File, Packer.Data, Packer.Used);
+            close(File);
+            if (!Wrote) {
+                LogError("write(%d, ...)", File);
+                unlinkat(CacheDir, Temp, 0);
+            }
+            else if (renameat(CacheDir, Temp, CacheDir, Name)) {
+                LogError("renameat(%d, \"%s\", ...)", CacheDir, Temp);
+                unlinkat(CacheDir, Temp, 0);
+            }
+#if ANNOUNCE_DISK_CACHE
+            else {
+                LogInfo("Saved cache entry %s", Name);
+            }
+#endif
+        }
+
+        /* NOTE: once for each run that adds to the cache */
+        static bool Trimmed = false;
+        if (!__atomic_exchange_n(&Trimmed, true, __ATOMIC_RELAXED)) {
+            TrimCache(CacheDir);
+        }
+    }
+
+    free(Packer.Data);
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include "common.h"
+
+#include "mem.h"
+
+#include <sys/stat.h>
+
+/* An on-disk copy of freshly parsed documents, kept under
+ * $XDG_CACHE_HOME/tabulate/ and keyed by the device and inode of the source
+ * file. An entry is only used while the file's mtime, ctime and size still
+ * match those it was saved with. Entries are removed once they have not been
+ * used for MAX_CACHE_AGE, or when they take more than MAX_CACHE_SIZE between
+ * them. There is no cache when $TABULATE_NO_CACHE is set, or when
+ * DisableDiskCache() was called before any document was made. */
+struct document *LoadCachedDoc(fd Dir, struct stat *Stat);
+void SaveCachedDoc(struct document *Doc, struct stat *Stat);
+void DisableDiskCache(void);
+bool HaveDiskCache(void);
+
+/* NOTE: where the entry of the file Stat would be, for looking at it without
+ * loading it; -1 when there is no cache */
+fd CacheEntry(struct stat *Stat, char *Name, umm Size);
@@ -16,6 +16,8 @@
 #define PRINT_MEM_INFO                 (0 && DEBUG)
 #define DUMP_MEM_INFO                  (0 && DEBUG)
 #define ANNOUNCE_DOCUMENT_CACHE_RESIZE (0 && DEBUG)
+#define ANNOUNCE_DISK_CACHE            (0 && DEBUG)
+#define ANNOUNCE_CONSTANT_FOLDING      (0 && DEBUG)
 #define TIME_MAIN                      (0 && DEBUG)
 
 #define USE_FULL_PARSE_TREE 0
@@ -24,6 +26,22 @@
 #define USE_UNDERLINE 1
 #define DEDUPLICATE_STRINGS 0
 #define SORT_PAGES 1
+#define USE_DISK_CACHE 1
+#define USE_BYTECODE 1
+#define USE_CONSTANT_FOLDING 1
+#define USE_DEPENDENCY_GRAPH 1 /* NOTE: requires USE_BYTECODE */
+#define USE_PARALLEL_EVALUATION 1 /* NOTE: requires USE_DEPENDENCY_GRAPH */
+#define USE_NUMBER_COLUMNS 1
+#define USE_REGROUPED_SUMS 0 /* NOTE: requires USE_NUMBER_COLUMNS; sums round apart from one cell at a time */
+#define USE_PREFIX_SUMS 1 /* NOTE: requires USE_NUMBER_COLUMNS */
+#define USE_RANGE_INDEX 1 /* NOTE: requires USE_NUMBER_COLUMNS */
+#define USE_GROUP_INDEX 1 /* NOTE: requires USE_NUMBER_COLUMNS */
+#define USE_AGGREGATE_MEMO 1 /* NOTE: requires USE_NUMBER_COLUMNS */
+#define USE_RUNNING_SCAN 1 /* NOTE: requires USE_BYTECODE and USE_NUMBER_COLUMNS */
+#define USE_ROW_LOCAL_SCAN 1 /* NOTE: requires USE_BYTECODE and USE_NUMBER_COLUMNS */
+#define USE_PREFETCH 1 /* NOTE: requires USE_BYTECODE */
+#define USE_IO_URING 1 /* NOTE: requires USE_PREFETCH */
+#define USE_LAZY_ROWS 1 /* NOTE: requires USE_DEPENDENCY_GRAPH */
 
 /* constants */
 #define DEFAULT_CELL_PRECISION 2
@@ -32,7 +50,18 @@
 #define INIT_ROW_COUNT 16
 #define INIT_COL_COUNT 8
 #define COLUMN_SEPERATOR "  "
+#define BAR_SEPERATOR " │ "
 #define INIT_DOC_CACHE_SIZE 32
+#define MAX_JOBS 64
+#define MIN_PARALLEL_LEVEL 64 /* cells; any fewer are evaluated by the main thread alone */
+#define MIN_PREFIX_ROWS 64 /* rows; a column's running sums are made for the first range this long */
+#define MIN_INDEX_BLOCKS 4 /* of 64 rows; MIN and MAX scan any range with fewer whole ones */
+#define MIN_MEMO_CELLS 64 /* cells; aggregates over any fewer are not remembered */
+#define MAX_ROW_LOCAL_DEPTH 8 /* values; a formula that stacks more is evaluated a cell at a time */
+#define PREFETCH_THREADS 4 /* that make referenced documents ahead of their use */
+#define IO_RING_ENTRIES 64 /* operations; larger batches are submitted that many at a time */
+#define MAX_CACHE_SIZE ((umm)256 << 20) /* bytes; the least recently used entries past this are removed */
+#define MAX_CACHE_AGE (30*24*60*60) /* seconds; entries not used for this long are removed */
 
 #define BRACKETED (BRACKET_CELLS || OVERDRAW_COL || OVERDRAW_ROW)
 
@@ -82,6 +111,12 @@ typedef double f64;
 
 typedef int fd;
 
+/* a string that is not null terminated */
+struct span {
+    char *Str;
+    s32 Len;
+};
+
 /* put the canary into its cage */
 static_assert(sizeof (ptr) == sizeof (sptr));
 static_assert(sizeof (dptr) == sizeof (sptr));
@@ -91,6 +126,7 @@ static_assert(sizeof (umm) == sizeof (smm));
 static_assert(sizeof (smm) == sizeof (dptr));
 
 #define atomic _Atomic
+#define thread_local _Thread_local
 
 #define STDIN_FILENO 0
 #define STDOUT_FILENO 1
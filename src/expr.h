@@ -0,0 +1,137 @@
+#pragma once
+#include "common.h"
+
+#include "mem.h"
+
+enum expr_func {
+    EF_NULL = 0,
+
+    EF_ABS,
+    EF_AVERAGE,
+    EF_BODY_COL,
+    EF_CEIL,
+    EF_CELL,
+    EF_COL,
+    EF_COUNT,
+    EF_FLOOR,
+    EF_MASK_SUM,
+    EF_MAX,
+    EF_MIN,
+    EF_NUMBER,
+    EF_PCENT,
+    EF_POW,
+    EF_ROUND,
+    EF_ROW,
+    EF_SIGN,
+    EF_SUM,
+    EF_TRUNC,
+
+    EXPR_FUNC_COUNT,
+};
+
+enum expr_operator {
+    EN_OP_NULL = 0,
+    EN_OP_SET,
+
+    EN_OP_NEGATIVE,
+
+    EN_OP_ADD,
+    EN_OP_SUB,
+    EN_OP_MUL,
+    EN_OP_DIV,
+};
+
+/* The nodes of an expression are stored contiguously and in post-order, so
+ * that a node follows all of its children: the last child of node N is N-1,
+ * and each child's previous sibling sits just before that child's Start. Only
+ * sums, products and funcs have more than one child, and they keep the count
+ * of them. Reduced values are expr_nodes too, which ignore all of this. */
+struct expr_node {
+    enum expr_node_type {
+        EN_NULL = 0,
+
+        EN_ERROR,
+        EN_NUMBER,
+        EN_MACRO,
+        EN_FUNC_IDENT,
+        EN_STRING,
+        EN_CELL,
+        EN_RANGE,
+
+        EN_ROOT, /* the topmost node only */
+        EN_TERM,
+
+        EN_SUM,
+        EN_PROD,
+        EN_FUNC,
+        EN_XENO,
+    } Type: 8;
+    /* NOTE: how an operand of a sum or product combines with those before it;
+     * the first operand has EN_OP_SET */
+    enum expr_operator Op: 8;
+    u16 Count;
+    u32 Start; /* the first node of this one's subtree */
+    union {
+        enum expr_error AsError;
+        f64 AsNumber;
+        struct span AsIdent;
+        struct span AsString;
+        struct cell_ref AsCell;
+        struct cell_block {
+            s32 FirstCol, FirstRow;
+            s32 LastCol, LastRow;
+        } AsRange;
+        struct {
+            enum expr_operator Op;
+        } AsUnary;
+        struct {
+            struct cell_ref Cell;
+            struct span Reference;
+        } AsXeno;
+        enum expr_func AsFunc;
+    };
+};
+static_assert(sizeof (struct expr_node) == 32);
+
+/* Formulas are compiled to code for a small stack machine (see
+ * CompileFormulas() and Execute() in main.c). Every value on its stack is a
+ * final expr_node, so that it shares its functions with ReduceFormula(). */
+enum vm_op {
+    OP_HALT = 0, /* the top is the result */
+    OP_PUSH,     /* push Consts[Arg] */
+    OP_CELL,     /* push the value of the cell Consts[Arg] */
+    OP_RANGE,    /* push the range Consts[Arg] */
+    OP_XENO,     /* push the value of the reference Consts[Arg] */
+    OP_NEGATE,
+    OP_SET,      /* begin accumulating into the top; on error jump to Arg */
+    OP_ACCUM,    /* pop into the top with operator Sub; on error jump to Arg */
+    OP_CALL,     /* pop Arity args and push func Sub called with form Arg */
+};
+
+/* NOTE: Sub of OP_CELL and OP_RANGE flags which of the dimensions are offsets
+ * from the evaluating cell */
+enum vm_relative {
+    VM_REL_COL = 1 << 0,
+    VM_REL_ROW = 1 << 1,
+    VM_REL_LAST_COL = 1 << 2,
+    VM_REL_LAST_ROW = 1 << 3,
+};
+
+struct vm_inst {
+    u8 Op;
+    u8 Sub;
+    u16 Arity;
+    s32 Arg;
+};
+static_assert(sizeof (struct vm_inst) == 8);
+
+/* A block of cells that a formula reads, as found in its code (see
+ * BuildDependencyGraph() in main.c). The dimensions flagged in Relative (see
+ * enum vm_relative) are offsets from the cell being evaluated. Hard
+ * dependencies are read as values, and so can be part of a cycle; the rest
+ * are only read through ranges, which skip whatever is still evaluating. */
+struct cell_dep {
+    struct cell_block Block;
+    u8 Relative;
+    bool Hard;
+};
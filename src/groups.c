@@ -0,0 +1,164 @@
+#include "groups.h"
+
+#include "logging.h"
+#include "numbers.h"
+#include "util.h"
+
+#include <pthread.h>
+
+/* NOTE: taken to build any column's group index */
+static pthread_mutex_t GroupsLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns whether Cell can equal anything, as CellsEq() compares cells, and if
+ * so puts its hash in *Out */
+static bool
+HashValue(struct cell *Cell, u64 *Out)
+{
+    switch (Cell->Type) {
+    case CELL_STRING:
+        *Out = HashSpan(Cell->AsString);
+        return true;
+
+    case CELL_NUMBER: {
+        /* NOTE: adding 0 turns -0 into 0, which it equals; NaN equals nothing */
+        f64 Number = Cell->AsNumber + 0.0;
+        if (Number != Number) return false;
+        u64 Bits;
+        memcpy(&Bits, &Number, sizeof Bits);
+        *Out = (Bits ^ (Bits >> 32)) * 0x9e3779b97f4a7c15;
+        return true;
+    }
+
+    default:
+        return false;
+    }
+}
+
+bool
+CellsEq(struct cell *A, struct cell *B)
+{
+    if (!A || !B) {
+        return (!A && !B);
+    }
+    else if (A->Type != B->Type) {
+        return false;
+    }
+    else switch (A->Type) {
+    case CELL_STRING:
+        return SpanEq(A->AsString, B->AsString);
+
+    case CELL_NUMBER:
+        /* TODO(levirak): fuzzy eq? */
+        return A->AsNumber == B->AsNumber;
+
+    default:
+        not_implemented;
+        return false;
+    }
+}
+
+/* The slot of the group of Cell, or the empty slot where it would go */
+static struct group_slot *
+FindSlot(struct group_index *Groups, struct document *Doc, s32 Col, struct cell *Cell, u64 Hash)
+{
+    u32 Mask = Groups->Size - 1;
+    for (u32 Idx = Hash & Mask;; Idx = (Idx + 1) & Mask) {
+        struct group_slot *Slot = Groups->Slots + Idx;
+        if (Slot->Row < 0) {
+            return Slot;
+        }
+        else if (Slot->Hash == Hash && CellsEq(GetCell(Doc, Col, Slot->Row), Cell)) {
+            return Slot;
+        }
+    }
+}
+
+/* Group the rows from FirstRow up to EndRow of Col, every one of which must be
+ * done. The rows of each group are counted first, so that they can then be
+ * laid out one group after another. */
+static struct group_index *
+BuildGroupIndex(struct document *Doc, s32 Col, s32 FirstRow, s32 EndRow)
+{
+    Assert(FirstRow < EndRow);
+    struct group_index *Groups = ReserveGroupIndex(16, EndRow - FirstRow);
+    Groups->FirstRow = FirstRow;
+    Groups->EndRow = EndRow;
+
+    for (s32 Row = FirstRow; Row < EndRow; ++Row) {
+        struct cell *Cell = GetCell(Doc, Col, Row);
+        u64 Hash;
+        if (HashValue(Cell, &Hash)) {
+            struct group_slot *Slot = FindSlot(Groups, Doc, Col, Cell, Hash);
+            if (Slot->Row < 0) {
+                /* NOTE: kept at most half full */
+                if (2*(Groups->NumGroups + 1) > Groups->Size) {
+                    GrowGroupIndex(Groups);
+                    Slot = FindSlot(Groups, Doc, Col, Cell, Hash);
+                }
+                *Slot = (struct group_slot){ .Hash = Hash, .Row = Row };
+                ++Groups->NumGroups;
+            }
+            ++Slot->Count;
+        }
+    }
+
+    s32 Used = 0;
+    for (s32 Idx = 0; Idx < Groups->Size; ++Idx) {
+        struct group_slot *Slot = Groups->Slots + Idx;
+        if (Slot->Row >= 0) {
+            Slot->First = Used;
+            Used += Slot->Count;
+            Slot->Count = 0;
+        }
+    }
+
+    for (s32 Row = FirstRow; Row < EndRow; ++Row) {
+        struct cell *Cell = GetCell(Doc, Col, Row);
+        u64 Hash;
+        if (HashValue(Cell, &Hash)) {
+            struct group_slot *Slot = FindSlot(Groups, Doc, Col, Cell, Hash);
+            Groups->Rows[Slot->First + Slot->Count++] = Row;
+        }
+    }
+
+    return Groups;
+}
+
+s32 *
+FindGroup(struct document *Doc, s32 Col, s32 FirstRow, s32 EndRow, struct cell *Proto, s32 *Count)
+{
+    Assert(0 <= Col && Col < Doc->Cols);
+    Assert(FirstRow < EndRow);
+
+    struct group_index **All = __atomic_load_n(&Doc->Groups, __ATOMIC_ACQUIRE);
+    struct group_index *Groups = All? __atomic_load_n(All + Col, __ATOMIC_ACQUIRE): nullptr;
+
+    if (!Groups) {
+        /* NOTE: cells only ever change from an expression to its value, so once
+         * none of them are left the index holds for good */
+        if (NextExprRow(Doc, Col, FirstRow, EndRow - 1) < EndRow) {
+            return nullptr;
+        }
+
+        pthread_mutex_lock(&GroupsLock);
+        if (!Doc->Groups) {
+            __atomic_store_n(&Doc->Groups, ReserveGroups(Doc), __ATOMIC_RELEASE);
+        }
+        if (!(Groups = Doc->Groups[Col])) {
+            Groups = BuildGroupIndex(Doc, Col, FirstRow, EndRow);
+            __atomic_store_n(Doc->Groups + Col, Groups, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&GroupsLock);
+    }
+
+    Assert(Groups->FirstRow == FirstRow && Groups->EndRow == EndRow);
+    u64 Hash;
+    struct group_slot *Slot = HashValue(Proto, &Hash)? FindSlot(Groups, Doc, Col, Proto, Hash): nullptr;
+    if (!Slot || Slot->Row < 0) {
+        *Count = 0;
+        return Groups->Rows;
+    }
+
+    *Count = Slot->Count;
+    return Groups->Rows + Slot->First;
+}
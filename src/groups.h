@@ -0,0 +1,14 @@
+#pragma once
+#include "common.h"
+
+#include "mem.h"
+
+/* Whether the cells hold the same string or number. This is how mask_sum
+ * matches cells, and so how the rows of a column are grouped. */
+bool CellsEq(struct cell *A, struct cell *B);
+
+/* The rows from FirstRow up to EndRow, which must be the body of Doc, where
+ * column Col holds the same as Proto, in order. Their number is put in
+ * *Count. Returns nullptr while any of those cells of Col are not done yet,
+ * for the caller to go through them itself. */
+s32 *FindGroup(struct document *Doc, s32 Col, s32 FirstRow, s32 EndRow, struct cell *Proto, s32 *Count);
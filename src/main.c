@@ -1,14 +1,21 @@
 #include "common.h"
 
+#include "cache.h"
+#include "expr.h"
+#include "groups.h"
 #include "logging.h"
 #include "mem.h"
+#include "memo.h"
+#include "numbers.h"
+#include "prefetch.h"
+#include "scan.h"
 #include "util.h"
 
-#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <locale.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,32 +36,6 @@
 
 static constexpr struct fmt_header DefaultHeader = DEFAULT_HEADER;
 
-enum expr_func {
-    EF_NULL = 0,
-
-    EF_ABS,
-    EF_AVERAGE,
-    EF_BODY_COL,
-    EF_CEIL,
-    EF_CELL,
-    EF_COL,
-    EF_COUNT,
-    EF_FLOOR,
-    EF_MASK_SUM,
-    EF_MAX,
-    EF_MIN,
-    EF_NUMBER,
-    EF_PCENT,
-    EF_POW,
-    EF_ROUND,
-    EF_ROW,
-    EF_SIGN,
-    EF_SUM,
-    EF_TRUNC,
-
-    EXPR_FUNC_COUNT,
-};
-
 struct expr_func_map_entry {
     char Name[15+1];
     enum expr_func Func;
@@ -259,9 +240,9 @@ struct expr_token {
     } Type;
     union {
         enum expr_func AsFunc;
-        char *AsString;
-        char *AsMacro;
-        char *AsXeno;
+        struct span AsString;
+        struct span AsMacro;
+        struct span AsXeno;
         f64 AsNumber;
         struct cell_ref AsCell;
     };
@@ -269,13 +250,10 @@ struct expr_token {
 
 struct expr_lexer {
     char *Cur;
+    char *End;
 
     s32 NumHeld;
     struct expr_token Held[1];
-
-    /* TODO(lrak): don't rely on a buffer */
-    char *Buf;
-    umm Sz;
 };
 
 enum line_type {
@@ -286,43 +264,78 @@ enum line_type {
     LINE_COMMAND,
 };
 
+/* Lexes lines from the delimiters found by ScanDelims. A source too large to
+ * be scanned at once is lexed as many runs of lines, which are each scanned
+ * into Delims as the one before is finished; offsets are from Data, the start
+ * of the run. */
+struct doc_lexer {
+    char *Data;
+    u32 Cur;        /* offset of the next line */
+    u32 Size;
+    u32 *Delim;     /* the first delimiter at or past Cur */
+    u32 *LineDelim; /* the first delimiter of the last line lexed */
+    umm Rest;       /* bytes past Size, which are yet to be scanned */
+    struct delims *Delims;
+};
+
+static void
+ScanNextLines(struct doc_lexer *State)
+{
+    char *Data = State->Data + State->Size;
+    FreeDelims(State->Delims);
+    if (!ScanDelims(Data, State->Rest, State->Delims)) {
+        LogError("ScanDelims");
+        State->Rest = 0;
+        return;
+    }
+
+    State->Data = Data;
+    State->Cur = 0;
+    State->Size = State->Delims->Scanned;
+    State->Delim = State->Delims->Data;
+    State->Rest -= State->Size;
+}
+
+/* NOTE: the line does not include its '\n', nor the leading '#' or '#:' */
 static enum line_type
-ReadLine(FILE *File, char *Buf, umm Sz)
+NextLine(struct doc_lexer *State, struct span *Out)
 {
-    Assert(File);
-    Assert(Buf);
-    Assert(Sz > 0);
+    Assert(State);
+    Assert(Out);
 
     /* TODO(lrak): what do we do if we find a \0 in our file? */
 
-    char *End = Buf + Sz - 2;
-    enum line_type Type = LINE_ROW;
-
-    s32 Char = fgetc(File);
-    switch (Char) {
-    case EOF: Type = LINE_NULL; break;
-    case '\n': Type = LINE_EMPTY; break;
-    case '#':
-        Char = fgetc(File);
-        if (Char == ':') {
-            Type = LINE_COMMAND;
-            Char = fgetc(File);
-        }
-        else {
-            Type = LINE_COMMENT;
-        }
-        [[fallthrough]];
-    default:
-        while (Char != EOF && Char != '\n') {
-            if (Buf < End) *Buf++ = Char;
-            Char = fgetc(File);
+    enum line_type Type = LINE_NULL;
+    if (State->Cur >= State->Size && State->Rest) {
+        ScanNextLines(State);
+    }
+    u32 Cur = State->Cur;
+
+    if (Cur < State->Size) {
+        u32 *Delim = State->LineDelim = State->Delim;
+        while (!(*Delim & DELIM_LINE)) ++Delim;
+        u32 Eol = *Delim & DELIM_OFFSET;
+
+        switch (State->Data[Cur]) {
+        case '\n': Type = LINE_EMPTY; break;
+        case '#':
+            ++Cur;
+            if (Cur < Eol && State->Data[Cur] == ':') {
+                Type = LINE_COMMAND;
+                ++Cur;
+            }
+            else {
+                Type = LINE_COMMENT;
+            }
+            break;
+        default: Type = LINE_ROW; break;
         }
-        *Buf++ = '\n';
-        break;
+
+        *Out = (struct span){ State->Data + Cur, Eol - Cur };
+        State->Cur = Eol + 1;
+        State->Delim = Delim + 1;
     }
 
-    Assert(Buf <= End);
-    *Buf = 0;
     return Type;
 }
 
@@ -338,11 +351,16 @@ MergeHeader(struct fmt_header *Dst, const struct fmt_header *Src)
 
 static void SetAsError(struct cell *C, enum expr_error V) { C->Type = CELL_ERROR; C->AsError = V; }
 static void SetAsNumber(struct cell *C, f64 V) { C->Type = CELL_NUMBER; C->AsNumber = V; }
-static void SetAsString(struct cell *C, char *V) { C->Type = CELL_STRING; C->AsString = V; }
-static void SetAsExpr(struct cell *C, char *V) { C->Type = CELL_EXPR; C->AsExpr = V; }
+static void SetAsString(struct cell *C, struct span V) { C->Type = CELL_STRING; C->AsString = V; }
+static void SetAsExpr(struct cell *C, struct span V) { C->Type = CELL_EXPR; C->AsExpr = V; }
 
+/* NOTE: End is the offset of the end of the line, so the row is finished once
+ * Cur passes it */
 struct row_lexer {
-    char *Cur;
+    char *Data;
+    u32 *Delim; /* the delimiter that ends the next cell */
+    u32 Cur;
+    u32 End;
 };
 
 static char *
@@ -366,88 +384,120 @@ CellErrStr(enum expr_error Error)
     Unreachable;
 }
 
+static char *
+FindOrEnd(char *Cur, char *End, char Char)
+{
+    char *Found = memchr(Cur, Char, End - Cur);
+    return Found? Found: End;
+}
+
+/* Pretyped cells are settled here; only cells that the scanner found to be
+ * made entirely of number characters are tried as numbers. */
 static enum cell_type
-NextCell(struct row_lexer *State, char *Buf, umm Sz)
+NextCell(struct row_lexer *State, struct span *OutStr, f64 *OutNumber)
 {
     Assert(State);
-    Assert(Buf);
-    Assert(Sz > 0);
+    Assert(OutStr);
+    Assert(OutNumber);
 
-    enum cell_type Type = CELL_PRETYPED;
-    char *End = Buf + Sz - 1;
+    enum cell_type Type = CELL_STRING;
+    char *Start = State->Data + State->Cur;
+    char *End = State->Data + State->End;
 
-    switch (*State->Cur) {
-    case 0:
+    if (State->Cur > State->End) {
         Type = CELL_NULL;
-        break;
-
-    case '"':
-        Type = CELL_STRING;
-        ++State->Cur;
-        while (*State->Cur && *State->Cur != '\n') {
-            char Char = *State->Cur++;
-            if (Char == '"') {
-                break;
-            }
-            else if (Buf < End) {
-                /* TODO(lrak): handle special chars in string cells */
-                *Buf++ = Char;
-            }
+        *OutStr = (struct span){};
+    }
+    else if (Start < End && *Start == '"') {
+        /* TODO(lrak): handle special chars in string cells */
+        ++Start;
+        char *Quote = FindOrEnd(Start, End, '"');
+        *OutStr = (struct span){ Start, Quote - Start };
+
+        /* tabs within the quotes are not delimiters, and anything between
+         * the closing quote and the next tab is dropped */
+        while ((*State->Delim & DELIM_OFFSET) < (u32)(Quote - State->Data)) {
+            ++State->Delim;
         }
-        while (*State->Cur == ' ') ++State->Cur;
-        while (*State->Cur != '\t' && *State->Cur != '\n') ++State->Cur;
-        ++State->Cur;
-        break;
+    }
+    else {
+        u32 Delim = *State->Delim;
+        char *Stop = State->Data + (Delim & DELIM_OFFSET);
 
-    case '=':
-        Type = CELL_EXPR;
-        ++State->Cur;
-        [[fallthrough]];
-    default:
-        while (*State->Cur) {
-            if (*State->Cur == '\t' || *State->Cur == '\n') {
-                ++State->Cur;
-                break;
-            }
-            else {
-                if (Buf < End) *Buf++ = *State->Cur;
-                ++State->Cur;
+        if (Start < End && *Start == '=') {
+            Type = CELL_EXPR;
+            ++Start;
+        }
+        *OutStr = (struct span){ Start, Stop - Start };
+
+        char *Rem;
+        if (Type == CELL_STRING && OutStr->Len && (Delim & DELIM_NUMERIC)) {
+            f64 Value = Str2f64(Start, Stop, &Rem);
+            if (Rem == Stop) {
+                Type = CELL_NUMBER;
+                *OutNumber = Value;
             }
         }
-        break;
     }
 
-    *Buf = 0;
+    if (Type) {
+        State->Cur = (*State->Delim++ & DELIM_OFFSET) + 1;
+    }
+
     return Type;
 }
 
+#if USE_LAZY_ROWS
+/* As NextCell(), without reading the cell, but for whether it holds an
+ * expression. Returns false once the row is finished. */
+static bool
+SkipCell(struct row_lexer *State, bool *OutExpr)
+{
+    Assert(State);
+    Assert(OutExpr);
+
+    if (State->Cur > State->End) return false;
+
+    char *Start = State->Data + State->Cur;
+    char *End = State->Data + State->End;
+    *OutExpr = Start < End && *Start == '=';
+
+    if (Start < End && *Start == '"') {
+        char *Quote = FindOrEnd(Start + 1, End, '"');
+        while ((*State->Delim & DELIM_OFFSET) < (u32)(Quote - State->Data)) {
+            ++State->Delim;
+        }
+    }
+
+    State->Cur = (*State->Delim++ & DELIM_OFFSET) + 1;
+    return true;
+}
+#endif
+
 struct cmd_lexer {
     char *Cur;
+    char *End;
 };
 
 static bool
-NextCmdWord(struct cmd_lexer *State, char *Buf, umm Sz)
+NextCmdWord(struct cmd_lexer *State, struct span *Out)
 {
     Assert(State);
-    Assert(Buf);
-    Assert(Sz > 0);
+    Assert(Out);
 
     bool NotLast = 0; /* pessimistic */
-    char *Cur = Buf;
-    char *End = Buf + Sz - 1;
-    *Cur = 0;
+    char *Cur = State->Cur;
+    char *End = State->End;
 
-    while (isspace(*State->Cur)) ++State->Cur;
-    if (*State->Cur) {
+    while (Cur < End && IsSpace(*Cur)) ++Cur;
+    char *Start = Cur;
+    if (Cur < End) {
         NotLast = 1;
-        while (*State->Cur && !isspace(*State->Cur)) {
-            if (Cur < End) *Cur++ = *State->Cur;
-            ++State->Cur;
-        }
-        *Cur = 0;
-
+        while (Cur < End && !IsSpace(*Cur)) ++Cur;
     }
 
+    *Out = (struct span){ Start, Cur - Start };
+    State->Cur = Cur;
     return NotLast;
 }
 
@@ -478,20 +528,6 @@ EditToBaseName(char *Buf, umm Sz)
     return Buf;
 }
 
-static FILE *
-fopenat(fd At, char *Path)
-{
-    FILE *File = 0;
-    fd Fd = openat(At, Path, O_RDONLY);
-    if (Fd < 0) {
-        /* nop */
-    }
-    else if (!(File = fdopen(Fd, "r"))) {
-        close(Fd);
-    }
-    return File;
-}
-
 static bool
 ParseCellRef(char **pCur, s32 *pCol, s32 *pRow)
 {
@@ -504,20 +540,20 @@ ParseCellRef(char **pCur, s32 *pCol, s32 *pRow)
     s32 Col = 0;
     s32 Row = 0;
 
-    if (isupper(*Cur)) {
+    if (IsUpper(*Cur)) {
         Accept = 1;
         do Col = 10*Col + (*Cur - 'A');
-        while (isupper(*++Cur));
+        while (IsUpper(*++Cur));
     }
     else if (*Cur == '@') { Accept = 1; ++Cur; Col = THIS; }
 
     if (Accept) {
-        if (isdigit(*Cur)) {
+        if (IsDigit(*Cur)) {
             do Row = 10*Row + (*Cur - '0');
-            while (isdigit(*++Cur));
+            while (IsDigit(*++Cur));
         }
         else if (*Cur == '$') {
-            for (++Cur; isdigit(*Cur); ++Cur) {
+            for (++Cur; IsDigit(*Cur); ++Cur) {
                 Row = 10*Row + (*Cur - '0');
             }
             Row = FOOT0 - Row;
@@ -602,13 +638,39 @@ UngetExprToken(struct expr_lexer *State, struct expr_token *Token)
     State->Held[State->NumHeld++] = *Token;
 }
 
-enum expr_func
-MatchFunc(const char *Str)
+/* NOTE: an open addressed index into ExprFuncMap, holding one more than the
+ * index of each entry; filled once by InitFuncIndex() */
+#define FUNC_INDEX_SIZE 64
+static_assert(sArrayCount(ExprFuncMap) <= FUNC_INDEX_SIZE/2);
+static u8 FuncIndex[FUNC_INDEX_SIZE];
+
+static void
+InitFuncIndex(void)
 {
-    for (s32 Idx = 1; Idx < sArrayCount(ExprFuncMap); ++Idx) {
+    for (s32 Idx = 0; Idx < sArrayCount(ExprFuncMap); ++Idx) {
         auto It = ExprFuncMap + Idx;
-        if (StrEq(Str, It->Name)) {
-            return It->Func;
+        /* NOTE: NextExprToken() only looks for functions by lower case */
+        Assert(IsLower(It->Name[0]));
+
+        struct span Name = { (char *)It->Name, strlen(It->Name) };
+        u32 Slot = HashSpan(Name) & (FUNC_INDEX_SIZE-1);
+        while (FuncIndex[Slot]) {
+            Slot = (Slot + 1) & (FUNC_INDEX_SIZE-1);
+        }
+        FuncIndex[Slot] = Idx + 1;
+    }
+}
+
+enum expr_func
+MatchFunc(struct span Str)
+{
+    if (Str.Len < (s32)sizeof ExprFuncMap->Name) {
+        u32 Slot = HashSpan(Str) & (FUNC_INDEX_SIZE-1);
+        for (u8 Entry; (Entry = FuncIndex[Slot]); Slot = (Slot + 1) & (FUNC_INDEX_SIZE-1)) {
+            auto It = ExprFuncMap + Entry - 1;
+            if (SpanEqStr(Str, It->Name)) {
+                return It->Func;
+            }
         }
     }
 
@@ -620,86 +682,76 @@ static enum expr_token_type
 NextExprToken(struct expr_lexer *State, struct expr_token *Out)
 {
     Assert(State);
-    Assert(State->Buf);
-    Assert(State->Sz > 0);
+    Assert(State->Cur <= State->End);
     Assert(Out);
 
     if (State->NumHeld > 0) {
         *Out = State->Held[--State->NumHeld];
     }
     else {
-        char *Cur = State->Buf;
-        char *End = State->Buf + State->Sz - 1;
-        *Cur = 0;
+        char *Cur = State->Cur;
+        char *End = State->End;
 
-        while (isspace(*State->Cur)) ++State->Cur;
+        while (Cur < End && IsSpace(*Cur)) ++Cur;
 
-        switch (*State->Cur) {
+        switch (Cur < End? *Cur: 0) {
         case 0: Out->Type = ET_NULL; break;
 
-        case '(': ++State->Cur; Out->Type = ET_LEFT_PAREN; break;
-        case ')': ++State->Cur; Out->Type = ET_RIGHT_PAREN; break;
-        case '+': ++State->Cur; Out->Type = ET_PLUS; break;
-        case '-': ++State->Cur; Out->Type = ET_MINUS; break;
-        case '*': ++State->Cur; Out->Type = ET_MULT; break;
-        case '/': ++State->Cur; Out->Type = ET_DIV; break;
-        case ':': ++State->Cur; Out->Type = ET_COLON; break;
-        case ';': ++State->Cur; Out->Type = ET_LIST_SEP; break;
+        case '(': ++Cur; Out->Type = ET_LEFT_PAREN; break;
+        case ')': ++Cur; Out->Type = ET_RIGHT_PAREN; break;
+        case '+': ++Cur; Out->Type = ET_PLUS; break;
+        case '-': ++Cur; Out->Type = ET_MINUS; break;
+        case '*': ++Cur; Out->Type = ET_MULT; break;
+        case '/': ++Cur; Out->Type = ET_DIV; break;
+        case ':': ++Cur; Out->Type = ET_COLON; break;
+        case ';': ++Cur; Out->Type = ET_LIST_SEP; break;
 
-        case '"':
-            ++State->Cur;
-            while (*State->Cur && *State->Cur != '"') {
-                if (Cur < End) *Cur++ = *State->Cur;
-                ++State->Cur;
-            }
-            *Cur = 0;
-            if (*State->Cur == '"') ++State->Cur;
+        case '"': {
+            char *Start = ++Cur;
+            while (Cur < End && *Cur != '"') ++Cur;
 
             Out->Type = ET_STRING;
-            Out->AsString = SaveStr(State->Buf);
-            break;
+            Out->AsString = (struct span){ Start, Cur - Start };
+            if (Cur < End) ++Cur;
+        } break;
 
-        case '{':
-            ++State->Cur;
-            while (*State->Cur && *State->Cur != ':' && *State->Cur != '}') {
-                if (Cur < End) *Cur++ = *State->Cur;
-                ++State->Cur;
-            }
-            *Cur = 0;
-            if (*State->Cur == ':') ++State->Cur;
+        case '{': {
+            char *Start = ++Cur;
+            while (Cur < End && *Cur != ':' && *Cur != '}') ++Cur;
 
             Out->Type = ET_BEGIN_XENO_REF;
-            Out->AsXeno = SaveStr(State->Buf);
-            break;
+            Out->AsXeno = (struct span){ Start, Cur - Start };
+            if (Cur < End && *Cur == ':') ++Cur;
+        } break;
 
         case '}':
-            ++State->Cur;
+            ++Cur;
             Out->Type = ET_END_XENO_REF;
             break;
 
         case '0' ... '9':
             Out->Type = ET_NUMBER;
-            Out->AsNumber = Str2f64(State->Cur, &State->Cur);
+            Out->AsNumber = Str2f64(Cur, End, &Cur);
             break;
 
-        default:
-            if (!IsExprIdentifierChar(*State->Cur)) {
-                LogError("Expected identifier character, got '%c'", *State->Cur);
-                Assert(IsExprIdentifierChar(*State->Cur));
-            }
-            do {
-                if (Cur < End) *Cur++ = *State->Cur;
-                ++State->Cur;
+        default: {
+            if (!IsExprIdentifierChar(*Cur)) {
+                LogError("Expected identifier character, got '%c'", *Cur);
+                Assert(IsExprIdentifierChar(*Cur));
             }
-            while (IsExprIdentifierChar(*State->Cur));
-            *Cur = 0;
+            char *Start = Cur;
+            do ++Cur;
+            while (Cur < End && IsExprIdentifierChar(*Cur));
+            struct span Ident = { Start, Cur - Start };
 
             enum expr_func Function = 0;
-            if (State->Buf[0] == '!') {
+            if (Ident.Str[0] == '!') {
                 Out->Type = ET_MACRO;
-                Out->AsMacro = SaveStr(State->Buf + 1);
+                Out->AsMacro = (struct span){ Ident.Str + 1, Ident.Len - 1 };
             }
-            else if ((Function = MatchFunc(State->Buf)) != 0) {
+            /* NOTE: cell references, by far the most common identifiers, start
+             * where no function name can */
+            else if (IsLower(Ident.Str[0]) && (Function = MatchFunc(Ident)) != 0) {
                 Out->Type = ET_FUNC;
                 Out->AsFunc = Function;
             }
@@ -707,9 +759,9 @@ NextExprToken(struct expr_lexer *State, struct expr_token *Out)
                 bool IsCellRef = 0;
                 s32 Col, Row;
 
-                Cur = State->Buf;
-                if (ParseCellRef(&Cur, &Col, &Row)) {
-                    IsCellRef = (*Cur == 0);
+                char *RefEnd = Start;
+                if (ParseCellRef(&RefEnd, &Col, &Row)) {
+                    IsCellRef = (RefEnd == Cur);
                 }
 
                 if (IsCellRef) {
@@ -720,8 +772,10 @@ NextExprToken(struct expr_lexer *State, struct expr_token *Out)
                     Out->Type = ET_UNKNOWN;
                 }
             }
-            break;
+        } break;
         }
+
+        State->Cur = Cur;
     }
 
     return Out->Type;
@@ -760,69 +814,6 @@ PeekExprToken(struct expr_lexer *State, struct expr_token *Out)
 // Range    := cell ':'
 // Range    := cell ':' cell
 
-enum expr_operator {
-    EN_OP_NULL = 0,
-    EN_OP_SET,
-
-    EN_OP_NEGATIVE,
-
-    EN_OP_ADD,
-    EN_OP_SUB,
-    EN_OP_MUL,
-    EN_OP_DIV,
-};
-
-struct expr_node {
-    enum expr_node_type {
-        EN_NULL = 0,
-
-        EN_ERROR,
-        EN_NUMBER,
-        EN_MACRO,
-        EN_FUNC_IDENT,
-        EN_STRING,
-        EN_CELL,
-        EN_RANGE,
-
-        EN_ROOT, /* the topmost node only */
-        EN_TERM,
-
-        EN_SUM,  EN_SUM_CONT,
-        EN_PROD, EN_PROD_CONT,
-        EN_LIST, EN_LIST_CONT,
-        EN_FUNC,
-        EN_XENO,
-    } Type;
-    union {
-        enum expr_error AsError;
-        f64 AsNumber;
-        char *AsIdent;
-        char *AsString;
-        struct cell_ref AsCell;
-        struct cell_block {
-            s32 FirstCol, FirstRow;
-            s32 LastCol, LastRow;
-        } AsRange;
-        struct {
-            struct expr_node *Child;
-            enum expr_operator Op;
-        } AsUnary;
-        struct {
-            struct cell_ref Cell;
-            char *Reference;
-        } AsXeno;
-        struct {
-            enum expr_func Func;
-            struct expr_node *Args;
-        } AsFunc;
-        struct {
-            struct expr_node *This;
-            struct expr_node *Next;
-            enum expr_operator Op;
-        } AsList;
-    };
-};
-
 #define ErrorNode(V)     (struct expr_node){ EN_ERROR, .AsError = (V) }
 #define NumberNode(V)    (struct expr_node){ EN_NUMBER, .AsNumber = (V) }
 #define MacroNode(V)     (struct expr_node){ EN_MACRO, .AsIdent = (V) }
@@ -831,48 +822,41 @@ struct expr_node {
 #define CellNode2(C,R)   (struct expr_node){ EN_CELL, .AsCell = { (C), (R) } }
 #define XenoNode2(F,C,R) (struct expr_node){ EN_XENO, .AsXeno = { { (C), (R) }, (F) } }
 
-static inline struct expr_node *
-NextOf(struct expr_node *Node)
-[[gnu::nonnull]]
+/* Append Node over the last Count subtrees, which become its children. */
+static u32
+PushNode(struct document *Doc, struct expr_node Node, s32 Count)
 {
-    switch (Node->Type) {
-    case EN_LIST:
-    case EN_LIST_CONT:
-        return Node->AsList.Next;
-    default:
-        return nullptr;
-    }
-}
+    Assert(0 <= Count && Count <= UINT16_MAX);
+    u32 Idx = ReserveNodes(Doc, 1);
 
-static inline struct expr_node *
-NodeOf(struct expr_node *Node)
-[[gnu::nonnull]]
-{
-    switch (Node->Type) {
-    case EN_LIST:
-    case EN_LIST_CONT:
-        return Node->AsList.This;
-    default:
-        return Node;
+    u32 Start = Idx;
+    for (s32 Child = 0; Child < Count; ++Child) {
+        Assert(Start > 1);
+        Start = Doc->Nodes[Start - 1].Start;
     }
+
+    Node.Count = Count;
+    Node.Start = Start;
+    Doc->Nodes[Idx] = Node;
+    return Idx;
 }
 
-static struct expr_node *ParseSum(struct expr_lexer *);
+static u32 ParseSum(struct document *, struct expr_lexer *);
 
-static struct expr_node *
-NodeFromToken(struct expr_token *Token)
+static u32
+NodeFromToken(struct document *Doc, struct expr_token *Token)
 {
     Assert(Token);
-    struct expr_node *Node = ReserveData(sizeof *Node);
+    struct expr_node Node;
     switch (Token->Type) {
-    case ET_NUMBER:         *Node = NumberNode(Token->AsNumber); break;
-    case ET_STRING:         *Node = StringNode(Token->AsString); break;
-    case ET_MACRO:          *Node = MacroNode(Token->AsMacro); break;
-    case ET_BEGIN_XENO_REF: *Node = StringNode(Token->AsXeno); break;
-    case ET_CELL_REF:       *Node = CellNode(Token->AsCell); break;
+    case ET_NUMBER:         Node = NumberNode(Token->AsNumber); break;
+    case ET_STRING:         Node = StringNode(Token->AsString); break;
+    case ET_MACRO:          Node = MacroNode(Token->AsMacro); break;
+    case ET_BEGIN_XENO_REF: Node = StringNode(Token->AsXeno); break;
+    case ET_CELL_REF:       Node = CellNode(Token->AsCell); break;
     default_unreachable;
     }
-    return Node;
+    return PushNode(Doc, Node, 0);
 }
 
 static struct expr_node *
@@ -922,62 +906,33 @@ SetCellFromNode(struct cell *Out, struct expr_node *Node)
     return Out;
 }
 
-static struct expr_node *
-ParseListCont(struct expr_lexer *Lexer)
-{
-    struct expr_node *Node = 0, *Child = 0, *Next = 0;
-    struct expr_token Token;
-
-    NextExprToken(Lexer, &Token);
-    if (Token.Type != ET_LIST_SEP) {
-        LogError("Expected a ';' token");
-    }
-    else if (!(Child = ParseSum(Lexer))) { /* nop */ }
-    else {
-        if (PeekExprToken(Lexer, &Token) == ET_LIST_SEP) {
-            Next = NotNull(ParseListCont(Lexer));
-        }
-
-        *(Node = ReserveData(sizeof *Node)) = (struct expr_node){
-            EN_LIST_CONT, .AsList = { Child, Next, 0 }
-        };
-    }
-
-    return Node;
-}
+/* NOTE: each parse function leaves nothing behind when it fails, so a caller
+ * that carries on past a failure does not find stray nodes among its
+ * children */
 
-static struct expr_node *
-ParseList(struct expr_lexer *Lexer)
+/* Returns the number of items parsed */
+static s32
+ParseList(struct document *Doc, struct expr_lexer *Lexer)
 {
-    struct expr_node *Node = 0, *Child = 0, *Next = 0;
+    s32 Count = 0;
     struct expr_token Token;
 
-    if (!(Child = ParseSum(Lexer))) { /* nop */ }
+    if (!ParseSum(Doc, Lexer)) { /* nop */ }
     else {
-        if (PeekExprToken(Lexer, &Token) == ET_LIST_SEP) {
-            Next = NotNull(ParseListCont(Lexer));
-        }
-
-#if !USE_FULL_PARSE_TREE
-        if (!Next) {
-            Node = Child;
-        }
-        else
-#endif
-        {
-            *(Node = ReserveData(sizeof *Node)) = (struct expr_node){
-                EN_LIST, .AsList = { Child, Next, 0 },
-            };
+        for (Count = 1; PeekExprToken(Lexer, &Token) == ET_LIST_SEP; ++Count) {
+            NextExprToken(Lexer, &Token);
+            if (!NotNull(ParseSum(Doc, Lexer))) break;
         }
     }
 
-    return Node;
+    return Count;
 }
 
-static struct expr_node *
-ParseFunc(struct expr_lexer *Lexer)
+static u32
+ParseFunc(struct document *Doc, struct expr_lexer *Lexer)
 {
-    struct expr_node *Node = nullptr;
+    u32 Node = 0;
+    u32 Mark = Doc->NumNodes;
     struct expr_token Token;
 
     if (NextExprToken(Lexer, &Token) != ET_FUNC) {
@@ -985,19 +940,16 @@ ParseFunc(struct expr_lexer *Lexer)
         Assert(!Node);
     }
     else {
-        *(Node = ReserveData(sizeof *Node)) = (struct expr_node){
-            EN_FUNC, .AsFunc = { Token.AsFunc, nullptr },
-        };
+        struct expr_node Func = { EN_FUNC, .AsFunc = Token.AsFunc };
+        s32 Count = 0;
+        bool Ok = true;
 
         switch (NextExprToken(Lexer, &Token)) {
         case ET_LEFT_PAREN: {
-            struct expr_node *Child = ParseList(Lexer);
+            Count = ParseList(Doc, Lexer);
             if (NextExprToken(Lexer, &Token) != ET_RIGHT_PAREN) {
                 LogError("Expected a ')' token");
-                Node = nullptr;
-            }
-            else {
-                Node->AsFunc.Args = Child;
+                Ok = false;
             }
         } break;
         case ET_CELL_REF:
@@ -1007,21 +959,26 @@ ParseFunc(struct expr_lexer *Lexer)
         case ET_MACRO:
             /* TODO(levirak): think harder about when I can omit the parens */
             UngetExprToken(Lexer, &Token);
-            Node->AsFunc.Args = ParseSum(Lexer);
+            Count = ParseSum(Doc, Lexer)? 1: 0;
             break;
         default:
             UngetExprToken(Lexer, &Token);
             break;
         }
+
+        if (Ok) {
+            Node = PushNode(Doc, Func, Count);
+        }
     }
 
+    if (!Node) Doc->NumNodes = Mark;
     return Node;
 }
 
-static struct expr_node *
-ParseRange(struct expr_lexer *Lexer)
+static u32
+ParseRange(struct document *Doc, struct expr_lexer *Lexer)
 {
-    struct expr_node *Node = 0;
+    u32 Node = 0;
     struct expr_token First, Colon, Last;
 
     if (NextExprToken(Lexer, &First) != ET_CELL_REF) {
@@ -1031,10 +988,10 @@ ParseRange(struct expr_lexer *Lexer)
     else {
         if (NextExprToken(Lexer, &Colon) != ET_COLON) {
             UngetExprToken(Lexer, &Colon);
-            Node = NodeFromToken(&First);
+            Node = NodeFromToken(Doc, &First);
         }
         else {
-            *(Node = ReserveData(sizeof *Node)) = (struct expr_node){
+            struct expr_node Range = {
                 EN_RANGE, .AsRange = {
                     First.AsCell.Col, First.AsCell.Row,
                     First.AsCell.Col, First.AsCell.Row,
@@ -1045,19 +1002,21 @@ ParseRange(struct expr_lexer *Lexer)
                 UngetExprToken(Lexer, &Last);
             }
             else {
-                Node->AsRange.LastCol = Last.AsCell.Col;
-                Node->AsRange.LastRow = Last.AsCell.Row;
+                Range.AsRange.LastCol = Last.AsCell.Col;
+                Range.AsRange.LastRow = Last.AsCell.Row;
             }
+
+            Node = PushNode(Doc, Range, 0);
         }
     }
 
     return Node;
 }
 
-static struct expr_node *
-ParseXeno(struct expr_lexer *Lexer)
+static u32
+ParseXeno(struct document *Doc, struct expr_lexer *Lexer)
 {
-    struct expr_node *Node = 0;
+    u32 Node = 0;
     struct expr_token Begin, Cell, End;
 
     if (NextExprToken(Lexer, &Begin) != ET_BEGIN_XENO_REF) {
@@ -1077,19 +1036,19 @@ ParseXeno(struct expr_lexer *Lexer)
             LogError("Expected a end-xeno token");
         }
         else {
-            *(Node = ReserveData(sizeof *Node)) = (struct expr_node){
-                EN_XENO, .AsXeno = { XenoCell, Begin.AsXeno },
-            };
+            struct expr_node Xeno = { EN_XENO, .AsXeno = { XenoCell, Begin.AsXeno } };
+            Node = PushNode(Doc, Xeno, 0);
         }
     }
 
     return Node;
 }
 
-static struct expr_node *
-ParseTerm(struct expr_lexer *Lexer)
+static u32
+ParseTerm(struct document *Doc, struct expr_lexer *Lexer)
 {
-    struct expr_node *Node = 0, *Child = 0;
+    u32 Node = 0, Child = 0;
+    u32 Mark = Doc->NumNodes;
     struct expr_token Token;
     bool Negate = 0;
 
@@ -1102,239 +1061,1069 @@ ParseTerm(struct expr_lexer *Lexer)
     switch (Token.Type) {
     case ET_FUNC:
         UngetExprToken(Lexer, &Token);
-        Child = ParseFunc(Lexer);
+        Child = ParseFunc(Doc, Lexer);
         break;
     case ET_CELL_REF:
         UngetExprToken(Lexer, &Token);
-        Child = ParseRange(Lexer);
+        Child = ParseRange(Doc, Lexer);
         break;
     case ET_BEGIN_XENO_REF:
         UngetExprToken(Lexer, &Token);
-        Child = ParseXeno(Lexer);
+        Child = ParseXeno(Doc, Lexer);
         break;
     case ET_LEFT_PAREN:
-        Child = ParseSum(Lexer);
+        Child = ParseSum(Doc, Lexer);
         if (NextExprToken(Lexer, &Token) != ET_RIGHT_PAREN) {
             LogError("Expected a ')' token");
             Child = 0;
         }
         break;
     case ET_NUMBER:
-        Child = NodeFromToken(&Token);
+        Child = NodeFromToken(Doc, &Token);
         break;
     case ET_STRING:
-        Child = NodeFromToken(&Token);
+        Child = NodeFromToken(Doc, &Token);
         break;
     case ET_MACRO:
-        Child = NodeFromToken(&Token);
+        Child = NodeFromToken(Doc, &Token);
         break;
     default: break;
     }
 
     if (Child) {
+        struct expr_node Term = { EN_TERM, .AsUnary = { EN_OP_NEGATIVE } };
 #if USE_FULL_PARSE_TREE
-        *(Node = ReserveData(sizeof *Node)) = (struct expr_node){
-            EN_TERM, .AsUnary = { Child, Negate? EN_OP_NEGATIVE: 0 },
-        };
+        Term.AsUnary.Op = Negate? EN_OP_NEGATIVE: 0;
+        Node = PushNode(Doc, Term, 1);
 #else
-        if (!Negate) {
-            Node = Child;
-        }
-        else {
-            *(Node = ReserveData(sizeof *Node)) = (struct expr_node){
-                EN_TERM, .AsUnary = { Child, EN_OP_NEGATIVE },
-            };
-        }
+        Node = Negate? PushNode(Doc, Term, 1): Child;
 #endif
     }
 
+    if (!Node) Doc->NumNodes = Mark;
     return Node;
 }
 
-static struct expr_node *
-ParseProdCont(struct expr_lexer *Lexer)
+static u32
+ParseProd(struct document *Doc, struct expr_lexer *Lexer)
 {
-    struct expr_node *Node = 0, *This = 0, *Cont = 0;
+    u32 Node = 0, This = 0;
     struct expr_token Token;
 
-    NextExprToken(Lexer, &Token);
-    s32 Op = (Token.Type == ET_MULT)? EN_OP_MUL: EN_OP_DIV;
-    if (Token.Type != ET_MULT && Token.Type != ET_DIV) {
-        LogError("Expected either a '*' or '/' token");
-    }
-    else if (!(This = ParseTerm(Lexer))) { /* nop */ }
+    if (!(This = ParseTerm(Doc, Lexer))) { /* nop */ }
     else {
-        PeekExprToken(Lexer, &Token);
-        if (Token.Type == ET_MULT || Token.Type == ET_DIV) {
-            Cont = NotNull(ParseProdCont(Lexer));
+        s32 Count = 1;
+        while (PeekExprToken(Lexer, &Token) == ET_MULT || Token.Type == ET_DIV) {
+            NextExprToken(Lexer, &Token);
+            enum expr_operator Op = (Token.Type == ET_MULT)? EN_OP_MUL: EN_OP_DIV;
+
+            u32 Next = ParseTerm(Doc, Lexer);
+            if (!NotNull(Next)) break;
+            Doc->Nodes[Next].Op = Op;
+            ++Count;
         }
 
-        *(Node = ReserveData(sizeof *Node)) = (struct expr_node){
-            EN_PROD_CONT, .AsList = { This, Cont, Op },
-        };
-    }
-
-    return Node;
-}
-
-static struct expr_node *
-ParseProd(struct expr_lexer *Lexer)
-{
-    struct expr_node *Node = 0, *This = 0, *Cont = 0;
-    struct expr_token Token;
-
-    if (!(This = ParseTerm(Lexer))) { /* nop */ }
-    else {
-        PeekExprToken(Lexer, &Token);
-        if (Token.Type == ET_MULT || Token.Type == ET_DIV) {
-            Cont = NotNull(ParseProdCont(Lexer));
+        if (Count > 1) {
+            Doc->Nodes[This].Op = EN_OP_SET;
         }
 
 #if !USE_FULL_PARSE_TREE
-        if (!Cont) {
+        if (Count == 1) {
             Node = This;
         }
         else
 #endif
         {
-            *(Node = ReserveData(sizeof *Node)) = (struct expr_node){
-                EN_PROD, .AsList = { This, Cont, 0 },
-            };
+            Node = PushNode(Doc, (struct expr_node){ .Type = EN_PROD }, Count);
         }
     }
 
     return Node;
 }
 
-static struct expr_node *
-ParseSumCont(struct expr_lexer *Lexer)
+static u32
+ParseSum(struct document *Doc, struct expr_lexer *Lexer)
 {
-    struct expr_node *Node = 0, *This = 0, *Cont = 0;
+    u32 Node = 0, This = 0;
     struct expr_token Token;
 
-    NextExprToken(Lexer, &Token);
-    s32 Op = (Token.Type == ET_PLUS)? EN_OP_ADD: EN_OP_SUB;
-    if (Token.Type != ET_PLUS && Token.Type != ET_MINUS) {
-        LogError("Expected a '+' or '-' token");
-    }
-    else if (!(This = ParseProd(Lexer))) { /* nop */ }
+    if (!(This = ParseProd(Doc, Lexer))) { /* nop */ }
     else {
-        PeekExprToken(Lexer, &Token);
-        if (Token.Type == ET_PLUS || Token.Type == ET_MINUS) {
-            Cont = NotNull(ParseSumCont(Lexer));
+        s32 Count = 1;
+        while (PeekExprToken(Lexer, &Token) == ET_PLUS || Token.Type == ET_MINUS) {
+            NextExprToken(Lexer, &Token);
+            enum expr_operator Op = (Token.Type == ET_PLUS)? EN_OP_ADD: EN_OP_SUB;
+
+            u32 Next = ParseProd(Doc, Lexer);
+            if (!NotNull(Next)) break;
+            Doc->Nodes[Next].Op = Op;
+            ++Count;
         }
 
-        *(Node = ReserveData(sizeof *Node)) = (struct expr_node){
-            EN_SUM_CONT, .AsList = { This, Cont, Op },
-        };
-    }
-
-    return Node;
-}
-
-static struct expr_node *
-ParseSum(struct expr_lexer *Lexer)
-{
-    struct expr_node *Node = 0, *This = 0, *Cont = 0;
-    struct expr_token Token;
-
-    if (!(This = ParseProd(Lexer))) { /* nop */ }
-    else {
-        PeekExprToken(Lexer, &Token);
-        if (Token.Type == ET_PLUS || Token.Type == ET_MINUS) {
-            Cont = NotNull(ParseSumCont(Lexer));
+        if (Count > 1) {
+            Doc->Nodes[This].Op = EN_OP_SET;
         }
 
 #if !USE_FULL_PARSE_TREE
-        if (!Cont) {
+        if (Count == 1) {
             Node = This;
         }
         else
 #endif
         {
-            *(Node = ReserveData(sizeof *Node)) = (struct expr_node){
-                EN_SUM, .AsList = { This, Cont, 0 },
-            };
+            Node = PushNode(Doc, (struct expr_node){ .Type = EN_SUM }, Count);
         }
     }
 
     return Node;
 }
 
-static struct expr_node *
-ParseExpr(struct expr_lexer *Lexer)
+static u32
+ParseExpr(struct document *Doc, struct expr_lexer *Lexer)
 {
-    struct expr_node *Node = 0, *Child = 0;
+    u32 Node = 0, Child = 0;
+    u32 Mark = Doc->NumNodes;
     struct expr_token Token;
 
-    if (!(Child = ParseSum(Lexer))) { /* nop */ }
+    if (!(Child = ParseSum(Doc, Lexer))) { /* nop */ }
     else if (NextExprToken(Lexer, &Token) != ET_NULL) {
         LogError("Expected a null token");
         Assert(!Node);
     }
     else {
 #if USE_FULL_PARSE_TREE
-        *(Node = ReserveData(sizeof *Node)) = (struct expr_node){
-            EN_ROOT, .AsUnary = { Child, 0 },
-        };
+        Node = PushNode(Doc, (struct expr_node){ .Type = EN_ROOT }, 1);
 #else
         Node = Child;
 #endif
     }
 
+    if (!Node) Doc->NumNodes = Mark;
     return Node;
 }
 
-static struct document *
-MakeDocument(fd Dir, char *Path)
+#if USE_CONSTANT_FOLDING
+static u32 FoldExpr(struct document *, u32);
+#endif
+
+/* Give Cell, which holds an expression, its formula. Because relative
+ * references are only resolved when reducing, cells with the same text (e.g.,
+ * a formula copied down a column) can share one parse, so only a formula that
+ * is new, as *Added tells, is parsed. */
+static struct formula *
+ParseFormula(struct document *Doc, struct cell *Cell, bool *Added)
 {
-    Assert(Path);
+    Assert(Cell->Type == CELL_EXPR);
 
-    char Buf[1024];
-    FILE *File;
-    struct stat Stat;
-    fd NewDir = -1;
-    struct document *Doc = 0;
+    struct formula *Formula = InternFormula(Doc, Cell->AsExpr, Added);
+    if (*Added) {
+        struct expr_lexer Lexer = {
+            .Cur = Cell->AsExpr.Str,
+            .End = Cell->AsExpr.Str + Cell->AsExpr.Len,
+        };
+        Formula->Root = ParseExpr(Doc, &Lexer);
+#if USE_CONSTANT_FOLDING
+        Formula->Root = FoldExpr(Doc, Formula->Root);
+#endif
+    }
+    return Cell->Formula = Formula;
+}
 
-    strncpy(Buf, Path, sizeof Buf - 1);
-    EditToBaseName(Buf, sizeof Buf);
+/* Parse every expression of a freshly lexed document exactly once, so that
+ * evaluation never has to go back to the lexer */
+static void
+ParseFormulas(struct document *Doc)
+{
+    Assert(Doc);
 
-    if (fstatat(Dir, Path, &Stat, 0)) {
-        if (errno == ENOENT) {
-            /* nop. assume no file */
-        }
-        else {
-            LogError("fstatat(%d, \"%s\", ...)", Dir, Path);
+    s32 NumExprs = 0;
+    for (s32 Col = 0; Col < Doc->Cols; ++Col) {
+        for (s32 Row = 0; Row < Doc->Rows; ++Row) {
+            NumExprs += (GetCell(Doc, Col, Row)->Type == CELL_EXPR);
         }
     }
-    else if ((Doc = FindExistingDoc(Stat.st_dev, Stat.st_ino))) {
-        /* nop. we got the document */
+
+    ReserveFormulas(Doc, NumExprs);
+    for (s32 Col = 0; Col < Doc->Cols; ++Col) {
+        for (s32 Row = 0; Row < Doc->Rows; ++Row) {
+            struct cell *Cell = GetCell(Doc, Col, Row);
+            if (Cell->Type == CELL_EXPR) {
+                bool Added;
+                ParseFormula(Doc, Cell, &Added);
+            }
+        }
     }
-    else if ((NewDir = openat(Dir, Buf, O_DIRECTORY | O_RDONLY)) < 0) {
-        LogError("openat");
+    Assert(Doc->NumFormulas <= NumExprs);
+}
+
+/* NOTE: a macro that failed to parse is as good as undefined */
+static u32
+FindMacro(struct document *Doc, struct span Name)
+{
+    u32 Body = 0;
+    for (s32 Idx = 0; !Body && Idx < Doc->NumMacros; ++Idx) {
+        if (SpanEq(Doc->Macros[Idx].Name, Name)) {
+            Body = Doc->Macros[Idx].Body;
+        }
     }
-    else if (!(File = fopenat(Dir, Path))) {
-        LogError("fopenat");
-        close(NewDir);
+    return Body;
+}
+
+/* NOTE: the last matching form wins */
+static const struct expr_func_form *
+FindForm(enum expr_func Func, s32 Arity)
+{
+    const struct expr_func_spec *Spec = &ExprFuncSpec[Func];
+    Assert(Spec->Func == Func);
+
+    const struct expr_func_form *Form = nullptr;
+    for (umm Idx = 0; Idx < Spec->NumForms; ++Idx) {
+        const struct expr_func_form *Candidate = Spec->Forms + Idx;
+
+        switch (Spec->FormType) {
+        case ARITY_INVALID: invalid_code_path; break;
+        case ARITY_SIMPLE:
+            if (Arity == Candidate->Arity) {
+                Form = Candidate;
+            }
+            break;
+        case ARITY_VARIADIC:
+            if (Arity >= Candidate->Arity) {
+                Form = Candidate;
+            }
+            break;
+        }
     }
-    else {
-        *(Doc = AllocAndLogDoc()) = (struct document){
-            .Dir = NewDir,
-            .FirstBodyRow = 0,
-            .FirstFootRow = INT32_MAX,
-            .Device = Stat.st_dev,
-            .Inode = Stat.st_ino,
-        };
-#if ANNOUNCE_NEW_DOCUMENT
-        LogInfo("Making document %s", Path);
-#endif
 
-        s32 RowIdx = 0;
-        s32 FmtRowIdx = -1;
-        enum line_type LineType;
-        while ((LineType = ReadLine(File, Buf, sizeof Buf))) {
-#if PREPRINT_ROWS
-            char *Prefix = "UNK";
+    return Form;
+}
+
+#if USE_BYTECODE
+struct vm_compiler {
+    struct document *Doc;
+    s32 Depth, MaxDepth;
+    s32 MacroDepth;
+};
+
+/* Returns the index of the new instruction */
+static s32
+Emit(struct vm_compiler *Compiler, enum vm_op Op, s32 Sub, s32 Arity, s32 Arg, s32 Pushed)
+{
+    Assert(0 <= Sub && Sub <= UINT8_MAX);
+    Assert(0 <= Arity && Arity <= UINT16_MAX);
+    s32 Idx = EmitInst(Compiler->Doc, (struct vm_inst){ Op, Sub, Arity, Arg });
+
+    Compiler->Depth += Pushed;
+    Assert(Compiler->Depth >= 0);
+    Compiler->MaxDepth = Max(Compiler->MaxDepth, Compiler->Depth);
+    return Idx;
+}
+
+static void
+EmitConst(struct vm_compiler *Compiler, enum vm_op Op, s32 Sub, struct expr_node Node)
+{
+    /* NOTE: constants are values, which have no place in a tree */
+    Node.Op = 0;
+    Node.Count = 0;
+    Node.Start = 0;
+    Emit(Compiler, Op, Sub, 0, AddConst(Compiler->Doc, &Node), 1);
+}
+
+/* Resolve as much of a dimension as is known before evaluation. The summary and
+ * footer of a document are fixed once it is parsed, which leaves only PREV,
+ * THIS and NEXT to be offset from the evaluating cell (see CanonicalCol()). */
+static bool
+LowerCol(struct document *Doc, s32 *Col)
+{
+    bool Relative = false;
+    switch (*Col) {
+    case SUMMARY: *Col = Doc->Summarized? Doc->Summary.Col: 0; break;
+    case PREV: *Col = -1; Relative = true; break;
+    case THIS: *Col = 0; Relative = true; break;
+    case NEXT: *Col = +1; Relative = true; break;
+    default: break;
+    }
+    return Relative;
+}
+
+static bool
+LowerRow(struct document *Doc, s32 *Row)
+{
+    bool Relative = false;
+    switch (*Row) {
+    case SUMMARY: *Row = Doc->Summarized? Doc->Summary.Row: Doc->FirstFootRow; break;
+    case PREV: *Row = -1; Relative = true; break;
+    case THIS: *Row = 0; Relative = true; break;
+    case NEXT: *Row = +1; Relative = true; break;
+    default:
+        if (*Row <= FOOT0) {
+            *Row = Doc->FirstFootRow + (FOOT0 - *Row);
+        }
+        break;
+    }
+    return Relative;
+}
+
+/* Nodes are stored in post-order, which is already the order of evaluation,
+ * so an expression compiles in one sweep over its nodes. */
+static void
+CompileExpr(struct vm_compiler *Compiler, u32 Root)
+{
+    struct document *Doc = Compiler->Doc;
+
+    if (!Root) {
+        EmitConst(Compiler, OP_PUSH, 0, (struct expr_node){0});
+        return;
+    }
+
+    u32 First = Doc->Nodes[Root].Start;
+    Assert(First <= Root);
+
+    /* NOTE: the jumps out of each open sum or product are chained through
+     * their Args until the end of it is known */
+    s32 Open[Root - First + 1];
+    s32 NumOpen = 0;
+
+    for (u32 Idx = First; Idx <= Root; ++Idx) {
+        struct expr_node *Node = Doc->Nodes + Idx;
+
+        switch (Node->Type) {
+        case EN_NULL:
+        case EN_ERROR:
+        case EN_NUMBER:
+        case EN_FUNC_IDENT:
+        case EN_STRING:
+            EmitConst(Compiler, OP_PUSH, 0, *Node);
+            break;
+
+        case EN_RANGE: {
+            struct cell_block Range = Node->AsRange;
+            s32 Relative = 0;
+            if (LowerCol(Doc, &Range.FirstCol)) Relative |= VM_REL_COL;
+            if (LowerRow(Doc, &Range.FirstRow)) Relative |= VM_REL_ROW;
+            if (LowerCol(Doc, &Range.LastCol))  Relative |= VM_REL_LAST_COL;
+            if (LowerRow(Doc, &Range.LastRow))  Relative |= VM_REL_LAST_ROW;
+
+            struct expr_node Lowered = { EN_RANGE, .AsRange = Range };
+            EmitConst(Compiler, Relative? OP_RANGE: OP_PUSH, Relative, Lowered);
+        } break;
+
+        case EN_MACRO: {
+            u32 Body = FindMacro(Doc, Node->AsIdent);
+            if (!Body) {
+                EmitConst(Compiler, OP_PUSH, 0, ErrorNode(ERROR_IMPL));
+            }
+            else if (Compiler->MacroDepth >= MACRO_MAX_COUNT) {
+                /* NOTE: only a macro that expands to itself can get this deep */
+                EmitConst(Compiler, OP_PUSH, 0, ErrorNode(ERROR_CYCLE));
+            }
+            else {
+                ++Compiler->MacroDepth;
+                CompileExpr(Compiler, Body);
+                --Compiler->MacroDepth;
+            }
+        } break;
+
+        case EN_CELL: {
+            struct cell_ref Cell = Node->AsCell;
+            s32 Relative = 0;
+            if (LowerCol(Doc, &Cell.Col)) Relative |= VM_REL_COL;
+            if (LowerRow(Doc, &Cell.Row)) Relative |= VM_REL_ROW;
+            EmitConst(Compiler, OP_CELL, Relative, CellNode(Cell));
+        } break;
+
+        case EN_ROOT:
+            break;
+
+        case EN_TERM: {
+            if (Node->AsUnary.Op == EN_OP_NEGATIVE) {
+                Emit(Compiler, OP_NEGATE, 0, 0, 0, 0);
+            }
+        } break;
+
+        case EN_SUM:
+        case EN_PROD: {
+            if (Node->Count > 1) {
+                Assert(NumOpen > 0);
+                s32 End = Doc->Program.CodeUsed;
+                for (s32 At = Open[--NumOpen]; At >= 0;) {
+                    struct vm_inst *Inst = Doc->Program.Code + At;
+                    At = Inst->Arg;
+                    Inst->Arg = End;
+                }
+            }
+        } break;
+
+        case EN_FUNC: {
+            enum expr_func Func = Node->AsFunc;
+            s32 Arity = Node->Count;
+
+            s32 Form = -1;
+            if (0 <= Func && Func < EXPR_FUNC_COUNT) {
+                const struct expr_func_form *Found = FindForm(Func, Arity);
+                if (Found) Form = Found - ExprFuncSpec[Func].Forms;
+            }
+
+#if USE_PREFETCH
+            /* NOTE: a cell() of a file named outright is linked now, so the
+             * file is prefetched along with those of the xeno references */
+            if (Func == EF_CELL && Arity == 3) {
+                u32 Arg = Idx - 1;
+                for (s32 It = 1; It < Arity; ++It) Arg = Doc->Nodes[Arg].Start - 1;
+                if (Doc->Nodes[Arg].Type == EN_STRING) {
+                    AddXenoLink(Doc, Doc->Nodes[Arg].AsString);
+                }
+            }
+#endif
+            Emit(Compiler, OP_CALL, Func, Arity, Form, 1 - Arity);
+        } break;
+
+        case EN_XENO: {
+            /* NOTE: its dimensions can only be resolved against the sub
+             * document, which Arity links to (see ResolveXeno()) */
+            struct expr_node Xeno = { EN_XENO, .AsXeno = Node->AsXeno };
+            s32 Link = AddXenoLink(Doc, Xeno.AsXeno.Reference);
+            Emit(Compiler, OP_XENO, 0, Link, AddConst(Doc, &Xeno), 1);
+        } break;
+
+        default:
+            LogError("Got unhandeled case %d", Node->Type);
+            not_implemented;
+        }
+
+        /* this node is complete; combine it into the sum or product it is an
+         * operand of */
+        if (Node->Op == EN_OP_SET) {
+            Open[NumOpen++] = Emit(Compiler, OP_SET, 0, 0, -1, 0);
+        }
+        else if (Node->Op) {
+            Assert(NumOpen > 0);
+            Open[NumOpen-1] = Emit(Compiler, OP_ACCUM, Node->Op, 0, Open[NumOpen-1], -1);
+        }
+    }
+
+    Assert(NumOpen == 0);
+}
+
+#if USE_RUNNING_SCAN
+/* Returns whether the code of Formula is just the cell above it in its own
+ * column plus or minus numbers and cells of its own row, as a running balance
+ * like =@^+B@-C@ is. A column of those is evaluated a row after the other by
+ * ScanRunningCells(). */
+static bool
+IsRunningFormula(struct document *Doc, struct formula *Formula)
+{
+    struct vm_inst *Code = Doc->Program.Code + Formula->CodeAt;
+    struct expr_node *Consts = Doc->Program.Consts;
+
+    if (Code[0].Op != OP_CELL || Code[0].Sub != (VM_REL_COL | VM_REL_ROW)) return false;
+    struct cell_ref Above = Consts[Code[0].Arg].AsCell;
+    if (Above.Col != 0 || Above.Row != -1 || Code[1].Op != OP_SET) return false;
+
+    s32 At = 2;
+    for (; Code[At].Op != OP_HALT; At += 2) {
+        struct vm_inst Inst = Code[At];
+        struct vm_inst Accum = Code[At + 1];
+        bool Operand = (Inst.Op == OP_PUSH && Consts[Inst.Arg].Type == EN_NUMBER)
+            || (Inst.Op == OP_CELL && (Inst.Sub & VM_REL_ROW) && Consts[Inst.Arg].AsCell.Row == 0);
+        if (!Operand || Accum.Op != OP_ACCUM || (Accum.Sub != EN_OP_ADD && Accum.Sub != EN_OP_SUB)) {
+            return false;
+        }
+    }
+    return At > 2;
+}
+#endif
+
+#if USE_ROW_LOCAL_SCAN
+/* Returns whether the code of Formula is just arithmetic on numbers and cells
+ * of its own row other than itself, as =B@*C@ is. A run of those down a column
+ * is evaluated 64 rows at a time by ScanRowLocalCells(). */
+static bool
+IsRowLocalFormula(struct document *Doc, struct formula *Formula)
+{
+    struct vm_inst *Code = Doc->Program.Code + Formula->CodeAt;
+    struct expr_node *Consts = Doc->Program.Consts;
+
+    if (Formula->MaxStack > MAX_ROW_LOCAL_DEPTH) return false;
+
+    for (; Code->Op != OP_HALT; ++Code) {
+        switch (Code->Op) {
+        case OP_PUSH:
+            if (Consts[Code->Arg].Type != EN_NUMBER) return false;
+            break;
+        case OP_CELL: {
+            struct cell_ref Cell = Consts[Code->Arg].AsCell;
+            if (!(Code->Sub & VM_REL_ROW) || Cell.Row != 0) return false;
+            if ((Code->Sub & VM_REL_COL) && Cell.Col == 0) return false;
+        } break;
+        case OP_NEGATE:
+        case OP_SET:
+        case OP_ACCUM:
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+/* Compile a parsed formula of Doc onto the end of its program */
+static void
+CompileFormula(struct document *Doc, struct formula *Formula)
+{
+    Formula->CodeAt = -1;
+    Formula->MaxStack = 0;
+
+    if (Formula->Root) {
+        struct vm_compiler Compiler = { .Doc = Doc };
+        Formula->CodeAt = Doc->Program.CodeUsed;
+        CompileExpr(&Compiler, Formula->Root);
+        Emit(&Compiler, OP_HALT, 0, 0, 0, -1);
+
+        Assert(Compiler.Depth == 0);
+        Formula->MaxStack = Compiler.MaxDepth;
+    }
+
+#if USE_RUNNING_SCAN
+    Formula->Running = Formula->CodeAt >= 0 && IsRunningFormula(Doc, Formula);
+#endif
+#if USE_ROW_LOCAL_SCAN
+    Formula->RowLocal = Formula->CodeAt >= 0 && IsRowLocalFormula(Doc, Formula);
+#endif
+}
+
+/* Compile every parsed formula of Doc into its program. This is not kept in
+ * the disk cache, so it happens on every load. */
+static void
+CompileFormulas(struct document *Doc)
+{
+    Assert(Doc);
+    Assert(!Doc->Program.CodeUsed);
+
+    for (s32 Idx = 0; Idx < Doc->NumFormulas; ++Idx) {
+        CompileFormula(Doc, Doc->Formulas + Idx);
+    }
+}
+#endif
+
+#if USE_DEPENDENCY_GRAPH
+#if !USE_BYTECODE
+#error "the dependency graph is found in the compiled code"
+#endif
+/* Place Dep as it is read from the cell at Col, Row, clipped to the cells of
+ * the document. Returns false when none of it is left. */
+static bool
+PlaceDep(struct document *Doc, struct cell_dep *Dep, s32 Col, s32 Row, struct cell_block *Out)
+{
+    struct cell_block Block = Dep->Block;
+    if (Dep->Relative & VM_REL_COL)      Block.FirstCol += Col;
+    if (Dep->Relative & VM_REL_ROW)      Block.FirstRow += Row;
+    if (Dep->Relative & VM_REL_LAST_COL) Block.LastCol += Col;
+    if (Dep->Relative & VM_REL_LAST_ROW) Block.LastRow += Row;
+
+    Block.FirstCol = Max(Block.FirstCol, 0);
+    Block.FirstRow = Max(Block.FirstRow, 0);
+    Block.LastCol = Min(Block.LastCol, Doc->Cols - 1);
+    Block.LastRow = Min(Block.LastRow, Doc->Rows - 1);
+
+    *Out = Block;
+    return Block.FirstCol <= Block.LastCol && Block.FirstRow <= Block.LastRow;
+}
+
+static struct cycle_search
+BeginCycleSearch(struct document *Doc)
+{
+    s32 NumCells = Doc->Cols * Doc->Rows;
+    return (struct cycle_search){
+        .Cells = AllocTemp(NumCells * sizeof(struct scc_cell)),
+        .Frames = AllocTemp(NumCells * sizeof(struct scc_frame)),
+        .Stack = AllocTemp(NumCells * sizeof(s32)),
+        .NextIndex = 1,
+    };
+}
+
+/* Mark every cell of Row, and every cell it reaches, that is part of a cycle of
+ * hard dependencies as ERROR_CYCLE, passing over the cells that Search has
+ * visited already. This is Tarjan's algorithm for strongly connected
+ * components, with its recursion kept in Frames. */
+static void
+FindCyclesFrom(struct document *Doc, struct cycle_search *Search, s32 Row)
+{
+    s32 Rows = Doc->Rows;
+    struct scc_cell *Cells = Search->Cells;
+    struct scc_frame *Frames = Search->Frames;
+    s32 *Stack = Search->Stack;
+
+    /* NOTE: a cell is on each of these at most once, and they are both empty
+     * again once a root is done */
+    s32 NumFrames = 0, StackUsed = 0;
+
+    for (s32 Col = 0; Col < Doc->Cols; ++Col) {
+        s32 Root = Col*Rows + Row;
+        s32 Next = Root;
+        if (Cells[Root].Index || GetCell(Doc, Col, Row)->Type != CELL_EXPR) {
+            continue;
+        }
+
+        do {
+            if (Next >= 0) {
+                Cells[Next] = (struct scc_cell){ Search->NextIndex, Search->NextIndex, true, false };
+                ++Search->NextIndex;
+                Stack[StackUsed++] = Next;
+                Frames[NumFrames++] = (struct scc_frame){ Next, 0 };
+            }
+
+            struct scc_frame *Frame = Frames + NumFrames - 1;
+            s32 This = Frame->Cell;
+            struct formula *Formula = GetCell(Doc, This / Rows, This % Rows)->Formula;
+
+            Next = -1;
+            while (Next < 0 && Frame->Dep < Formula->NumDeps) {
+                struct cell_dep *Dep = Doc->Deps + Formula->DepsAt + Frame->Dep++;
+                struct cell_block To;
+                if (!Dep->Hard || !PlaceDep(Doc, Dep, This / Rows, This % Rows, &To)) continue;
+                if (GetCell(Doc, To.FirstCol, To.FirstRow)->Type != CELL_EXPR) continue;
+
+                s32 That = To.FirstCol*Rows + To.FirstRow;
+                if (That == This) {
+                    Cells[This].SelfRef = true;
+                }
+                else if (!Cells[That].Index) {
+                    Next = That;
+                }
+                else if (Cells[That].OnStack) {
+                    Cells[This].Low = Min(Cells[This].Low, Cells[That].Index);
+                }
+            }
+
+            if (Next < 0) {
+                /* every dependency of This has been followed */
+                if (--NumFrames) {
+                    s32 Parent = Frames[NumFrames - 1].Cell;
+                    Cells[Parent].Low = Min(Cells[Parent].Low, Cells[This].Low);
+                }
+
+                if (Cells[This].Low == Cells[This].Index) {
+                    bool Cyclic = Cells[This].SelfRef || Stack[StackUsed - 1] != This;
+                    s32 Member;
+                    do {
+                        Member = Stack[--StackUsed];
+                        Cells[Member].OnStack = false;
+                        if (Cyclic) {
+                            SetAsError(GetCell(Doc, Member / Rows, Member % Rows), ERROR_CYCLE);
+                        }
+                    } while (Member != This);
+                }
+            }
+        } while (NumFrames);
+    }
+}
+
+static void
+EndCycleSearch(struct cycle_search *Search)
+{
+    FreeTemp(Search->Stack);
+    FreeTemp(Search->Frames);
+    FreeTemp(Search->Cells);
+    *Search = (struct cycle_search){};
+}
+
+/* Mark every cell that is part of a cycle of hard dependencies as ERROR_CYCLE */
+static void
+FindCycles(struct document *Doc)
+{
+    if (!Doc->Cols || !Doc->Rows || !Doc->NumDeps) return;
+
+    struct cycle_search Search = BeginCycleSearch(Doc);
+    for (s32 Row = 0; Row < Doc->Rows; ++Row) {
+        FindCyclesFrom(Doc, &Search, Row);
+    }
+    EndCycleSearch(&Search);
+}
+
+/* Find every block of cells that Formula reads in its code. Together with the
+ * cells that hold them, these make the document's dependency graph, without a
+ * copy of its edges for every cell down a column. A formula that reads cells
+ * that are only known once it runs is marked as Dynamic. */
+static void
+AddFormulaDeps(struct document *Doc, struct formula *Formula)
+{
+    struct vm_inst *Code = Doc->Program.Code;
+    struct expr_node *Consts = Doc->Program.Consts;
+
+    Formula->DepsAt = Doc->NumDeps;
+    Formula->NumDeps = 0;
+    Formula->Dynamic = false;
+    Formula->AnyRow = false;
+
+    for (s32 At = Formula->CodeAt; At >= 0 && Code[At].Op != OP_HALT; ++At) {
+        struct vm_inst Inst = Code[At];
+        struct cell_dep Dep = {0};
+
+        switch ((enum vm_op)Inst.Op) {
+        case OP_CELL: {
+            struct cell_ref Cell = Consts[Inst.Arg].AsCell;
+            Dep.Block = (struct cell_block){ Cell.Col, Cell.Row, Cell.Col, Cell.Row };
+            if (Inst.Sub & VM_REL_COL) Dep.Relative |= VM_REL_COL | VM_REL_LAST_COL;
+            if (Inst.Sub & VM_REL_ROW) Dep.Relative |= VM_REL_ROW | VM_REL_LAST_ROW;
+            Dep.Hard = true;
+        } break;
+
+        case OP_RANGE: {
+            Dep.Block = Consts[Inst.Arg].AsRange;
+            Dep.Relative = Inst.Sub;
+        } break;
+
+        case OP_PUSH: {
+            if (Consts[Inst.Arg].Type != EN_RANGE) continue;
+            Dep.Block = Consts[Inst.Arg].AsRange;
+        } break;
+
+        case OP_CALL: {
+            if (Inst.Sub == EF_CELL || Inst.Sub == EF_MASK_SUM) {
+                /* NOTE: cell/3 reads another document */
+                Formula->AnyRow |= Inst.Sub != EF_CELL || Inst.Arity != 3;
+                Formula->Dynamic = true;
+                continue;
+            }
+            else if (Inst.Sub != EF_BODY_COL) continue;
+            else if (Inst.Arity != 0) {
+                Formula->AnyRow = true;
+                Formula->Dynamic = true;
+                continue;
+            }
+
+            /* NOTE: the body of the evaluating cell's column */
+            Dep.Block = (struct cell_block){ 0, Doc->FirstBodyRow, 0, Doc->FirstFootRow - 1 };
+            Dep.Relative = VM_REL_COL | VM_REL_LAST_COL;
+        } break;
+
+        case OP_XENO: {
+            Formula->Dynamic = true;
+        } continue;
+
+        default: continue;
+        }
+
+        AddDep(Doc, Dep);
+        ++Formula->NumDeps;
+    }
+}
+
+/* Find the dependencies of every formula of Doc, and what cycles they make */
+static void
+BuildDependencyGraph(struct document *Doc)
+{
+    Assert(Doc);
+    Assert(!Doc->NumDeps);
+
+    for (s32 Idx = 0; Idx < Doc->NumFormulas; ++Idx) {
+        AddFormulaDeps(Doc, Doc->Formulas + Idx);
+    }
+
+    FindCycles(Doc);
+}
+#endif
+
+/* Lex the cells of the row RowIdx, which take the formats of those of the row
+ * FmtRowIdx, if it is another */
+static void
+LexRow(struct document *Doc, struct row_lexer *Lexer, s32 RowIdx, s32 FmtRowIdx)
+{
+    struct span CellStr;
+    f64 CellNumber;
+    enum cell_type Type;
+
+    s32 ColIdx = 0;
+    while ((Type = NextCell(Lexer, &CellStr, &CellNumber))) {
+        struct cell *Cell = ReserveCell(Doc, ColIdx, RowIdx);
+        switch (Type) {
+        case CELL_NUMBER:
+            SetAsNumber(Cell, CellNumber);
+            break;
+
+        case CELL_EXPR:
+            SetAsExpr(Cell, CellStr);
+            break;
+
+        case CELL_STRING:
+            SetAsString(Cell, CellStr);
+            break;
+
+        default_unreachable;
+        }
+#if PREPRINT_ROWS
+        switch (Cell->Type) {
+        case CELL_STRING: printf("[%.*s]", Cell->AsString.Len, Cell->AsString.Str); break;
+        case CELL_NUMBER: printf("(%f)", Cell->AsNumber); break;
+        case CELL_EXPR:   printf("{%.*s}", Cell->AsExpr.Len, Cell->AsExpr.Str); break;
+        case CELL_ERROR:  printf("<%s>", CellErrStr(Cell->AsError)); break;
+        default:
+            LogWarn("Preprint wants to print type %d", Cell->Type);
+            invalid_code_path;
+        }
+#endif
+
+        if (FmtRowIdx >= 0 && FmtRowIdx != RowIdx) {
+            struct cell *FmtCell = GetCell(Doc, ColIdx, FmtRowIdx);
+            MergeHeader(&Cell->Fmt, &FmtCell->Fmt);
+        }
+
+        ++ColIdx;
+    }
+}
+
+#if USE_LAZY_ROWS
+#if !USE_DEPENDENCY_GRAPH
+#error "rows are loaded along the dependency graph"
+#endif
+/* Note where the row RowIdx of a document that is loaded lazily lies, and make
+ * room for its cells, giving them the formats that LexRow() would have. Returns
+ * how many of them hold expressions. */
+static s32
+IndexRow(struct document *Doc, struct row_lexer *Lexer, s32 RowIdx, s32 FmtRowIdx)
+{
+    struct lazy_row Row = {
+        .Start = Lexer->Cur,
+        .End = Lexer->End,
+        .Delim = Lexer->Delim - Doc->Lazy.Delims,
+    };
+    CheckEq(AddLazyRow(Doc, Row), RowIdx);
+
+    s32 NumExprs = 0;
+    s32 ColIdx = 0;
+    bool IsExpr;
+    while (SkipCell(Lexer, &IsExpr)) {
+        NumExprs += IsExpr;
+        if (FmtRowIdx >= 0 && FmtRowIdx != RowIdx) {
+            struct cell *Cell = ReserveCell(Doc, ColIdx, RowIdx);
+            MergeHeader(&Cell->Fmt, &GetCell(Doc, ColIdx, FmtRowIdx)->Fmt);
+        }
+        ++ColIdx;
+    }
+
+    /* NOTE: so that the table never moves once cells are being read */
+    ReserveCell(Doc, ColIdx - 1, RowIdx);
+    return NumExprs;
+}
+
+/* Lex Row of a document that is loaded lazily, and parse, compile and find the
+ * dependencies of the formulas among its cells that are new */
+static void
+LoadRow(struct document *Doc, s32 Row)
+{
+    struct lazy_rows *Lazy = &Doc->Lazy;
+    struct lazy_row *Line = Lazy->Rows + Row;
+    Assert(!Line->Loaded);
+    Line->Loaded = true;
+    ++Lazy->NumLoaded;
+
+    struct row_lexer Lexer = {
+        .Data = Doc->Source.Data,
+        .Delim = Lazy->Delims + Line->Delim,
+        .Cur = Line->Start,
+        .End = Line->End,
+    };
+    LexRow(Doc, &Lexer, Row, -1);
+
+    for (s32 Col = 0; Col < Doc->Cols; ++Col) {
+        struct cell *Cell = GetCell(Doc, Col, Row);
+        if (Cell->Type == CELL_EXPR) {
+            bool Added;
+            struct formula *Formula = ParseFormula(Doc, Cell, &Added);
+            if (Added) {
+                CompileFormula(Doc, Formula);
+                AddFormulaDeps(Doc, Formula);
+            }
+        }
+    }
+}
+
+static inline void
+QueueRow(struct document *Doc, s32 Row, s32 *Queue, s32 *Tail)
+{
+    if (!Doc->Lazy.Rows[Row].Loaded) {
+        LoadRow(Doc, Row);
+        Queue[(*Tail)++] = Row;
+    }
+}
+
+/* Load Row of Doc, which is loaded lazily, along with every row that the
+ * formulas of those rows read, so that no cell that is loaded has to wait on a
+ * row that is not. A formula that may read any row loads every one of them, as
+ * does a Row that is negative. */
+static void
+LoadRows(struct document *Doc, s32 Row)
+{
+    struct lazy_rows *Lazy = &Doc->Lazy;
+    s32 NumRows = Lazy->NumRows;
+    s32 FirstLink = Doc->NumLinks;
+    s32 *Queue = AllocTemp(Max(NumRows, 1) * sizeof *Queue);
+    s32 Tail = 0;
+
+    for (s32 R = Max(Row, 0); R < NumRows && (Row < 0 || R == Row); ++R) {
+        QueueRow(Doc, R, Queue, &Tail);
+    }
+
+    for (s32 Head = 0; Head < Tail && Lazy->NumLoaded < NumRows; ++Head) {
+        s32 This = Queue[Head];
+        for (s32 Col = 0; Col < Doc->Cols; ++Col) {
+            struct formula *Formula = GetCell(Doc, Col, This)->Formula;
+            if (!Formula) continue;
+
+            if (Formula->AnyRow) {
+                for (s32 R = 0; R < NumRows; ++R) {
+                    QueueRow(Doc, R, Queue, &Tail);
+                }
+            }
+            for (s32 Idx = 0; Idx < Formula->NumDeps; ++Idx) {
+                struct cell_block Block;
+                if (PlaceDep(Doc, Doc->Deps + Formula->DepsAt + Idx, Col, This, &Block)) {
+                    for (s32 R = Block.FirstRow; R <= Block.LastRow && R < NumRows; ++R) {
+                        QueueRow(Doc, R, Queue, &Tail);
+                    }
+                }
+            }
+        }
+    }
+
+    /* NOTE: no row that was loaded before reads one of these, so a new cycle
+     * can only be among them, and what was found of the others still holds */
+    if (!Lazy->Cycles.Cells) {
+        Lazy->Cycles = BeginCycleSearch(Doc);
+    }
+    for (s32 Idx = 0; Idx < Tail; ++Idx) {
+        FindCyclesFrom(Doc, &Lazy->Cycles, Queue[Idx]);
+    }
+#if USE_NUMBER_COLUMNS
+    for (s32 Idx = 0; Idx < Tail; ++Idx) {
+        FillNumberRow(Doc, Queue[Idx]);
+    }
+#endif
+    FreeTemp(Queue);
+
+    if (Lazy->NumLoaded == NumRows) {
+        ReleaseLazyRows(Doc);
+    }
+#if USE_PREFETCH
+    PrefetchLinks(Doc, FirstLink);
+#endif
+}
+#endif
+
+/* Make the document of the file at Path, from Dir, or find the one that was
+ * made of it already. A document that is made Lazy only has its rows loaded as
+ * they are read (see struct lazy_rows). */
+static struct document *
+LoadDocument(fd Dir, char *Path, bool Lazy)
+{
+    Assert(Path);
+
+    char Buf[PATH_MAX];
+    struct source Source;
+    struct delims Delims;
+    struct stat Stat;
+    fd NewDir = -1;
+    struct document *Doc = 0;
+#if USE_PREFETCH
+    bool Loading = false;
+#endif
+
+    strncpy(Buf, Path, sizeof Buf - 1);
+    Buf[sizeof Buf - 1] = 0;
+    EditToBaseName(Buf, sizeof Buf);
+
+    if (fstatat(Dir, Path, &Stat, 0)) {
+        if (errno == ENOENT) {
+            /* nop. assume no file */
+        }
+        else {
+            LogError("fstatat(%d, \"%s\", ...)", Dir, Path);
+        }
+    }
+#if USE_PREFETCH
+    else if (!(Loading = BeginLoad(&Stat))) {
+        /* NOTE: it was made already, or is known not to make */
+        Doc = FindExistingDoc(Stat.st_dev, Stat.st_ino);
+    }
+#else
+    else if ((Doc = FindExistingDoc(Stat.st_dev, Stat.st_ino))) {
+        /* nop. we got the document */
+    }
+#endif
+    else if ((NewDir = OpenSharedDir(Dir, Buf)) < 0) {
+        LogError("OpenSharedDir");
+    }
+#if USE_DISK_CACHE
+    else if ((Doc = LoadCachedDoc(NewDir, &Stat))) {
+        /* the cache had an up to date parse of the document */
+#if USE_BYTECODE
+        CompileFormulas(Doc);
+#endif
+#if USE_DEPENDENCY_GRAPH
+        BuildDependencyGraph(Doc);
+#endif
+#if USE_NUMBER_COLUMNS
+        FillNumberColumns(Doc);
+#endif
+    }
+#endif
+#if USE_IO_URING
+    else if (!TakeSource(&Stat, &Source) && !LoadSource(Dir, Path, &Source)) {
+#else
+    else if (!LoadSource(Dir, Path, &Source)) {
+#endif
+        LogError("LoadSource");
+        ReleaseSharedDir(NewDir);
+    }
+    else if (!ScanDelims(Source.Data, Source.Size, &Delims)) {
+        LogError("ScanDelims");
+        UnloadSource(&Source);
+        ReleaseSharedDir(NewDir);
+    }
+    else {
+        *(Doc = AllocAndLogDoc(Stat.st_dev, Stat.st_ino)) = (struct document){
+            .Dir = NewDir,
+            .FirstBodyRow = 0,
+            .FirstFootRow = INT32_MAX,
+            .Device = Stat.st_dev,
+            .Inode = Stat.st_ino,
+            .Source = Source,
+        };
+#if ANNOUNCE_NEW_DOCUMENT
+        LogInfo("Making document %s", Path);
+#endif
+
+#if USE_LAZY_ROWS
+        /* NOTE: rows are found again by where they are in the source, which
+         * must then have been scanned at once */
+        Lazy = Lazy && Delims.Scanned == Source.Size;
+#if USE_DISK_CACHE
+        /* NOTE: the cache only keeps a document whole, so one that would be
+         * kept is parsed whole, to be loaded from there the next time */
+        Lazy = Lazy && !HaveDiskCache();
+#endif
+        s32 NumExprs = 0;
+        if (Lazy) {
+            Doc->Lazy.Delims = Delims.Data;
+        }
+#endif
+
+        s32 RowIdx = 0;
+        s32 FmtRowIdx = -1;
+        struct doc_lexer DocLexer = {
+            .Data = Source.Data,
+            .Size = Delims.Scanned,
+            .Delim = Delims.Data,
+            .Rest = Source.Size - Delims.Scanned,
+            .Delims = &Delims,
+        };
+        struct span Line;
+        enum line_type LineType;
+        while ((LineType = NextLine(&DocLexer, &Line))) {
+#if PREPRINT_ROWS
+            char *Prefix = "UNK";
             switch (LineType) {
             case LINE_EMPTY:   Prefix = "NUL"; break;
             case LINE_ROW:     Prefix = "ROW"; break;
@@ -1342,1209 +2131,2346 @@ MakeDocument(fd Dir, char *Path)
             case LINE_COMMENT: Prefix = "REM"; break;
             default_unreachable;
             }
-            printf("%s%c", Prefix, FmtRowIdx < 0? '.': '!');
+            printf("%s%c", Prefix, FmtRowIdx < 0? '.': '!');
+#endif
+            switch (LineType) {
+            case LINE_EMPTY:
+                if (Doc->FirstBodyRow == 0) {
+                    Doc->FirstBodyRow = RowIdx;
+                }
+                else {
+                    Doc->FirstFootRow = RowIdx;
+                }
+                FmtRowIdx = -1;
+                break;
+
+            case LINE_ROW: {
+                struct row_lexer Lexer = {
+                    .Data = DocLexer.Data,
+                    .Delim = DocLexer.LineDelim,
+                    .Cur = Line.Str - DocLexer.Data,
+                    .End = Line.Str + Line.Len - DocLexer.Data,
+                };
+#if USE_LAZY_ROWS
+                if (Lazy) {
+                    NumExprs += IndexRow(Doc, &Lexer, RowIdx, FmtRowIdx);
+                }
+                else
+#endif
+                LexRow(Doc, &Lexer, RowIdx, FmtRowIdx);
+                ++RowIdx;
+            } break;
+
+            case LINE_COMMAND: {
+                struct span Word;
+                struct cmd_lexer Lexer = { Line.Str, Line.Str + Line.Len };
+
+                enum {
+                    STATE_FIRST = 0,
+
+                    STATE_SEP,
+                    STATE_FMT,
+                    STATE_PRCSN,
+                    STATE_SUMMARY,
+                    STATE_DEFINE,
+
+                    STATE_ERROR,
+                } State = 0;
+
+                s32 ArgPos = 0;
+                while (NextCmdWord(&Lexer, &Word)) {
+#if PREPRINT_ROWS
+                    printf("(%.*s)", Word.Len, Word.Str);
+#endif
+                    switch (State) {
+                    case STATE_FIRST:
+#define MATCH(S,V,...) else if (SpanEqStr(Word, S)) { State = V; __VA_ARGS__; }
+                        if (0);
+                        MATCH ("sep", STATE_SEP)
+                        MATCH ("fmt", STATE_FMT)
+                        MATCH ("prcsn", STATE_PRCSN, FmtRowIdx = RowIdx)
+                        MATCH ("summary", STATE_SUMMARY)
+                        MATCH ("define", STATE_DEFINE)
+                        else { State = STATE_ERROR; }
+#undef MATCH
+                        break;
+
+                    case STATE_SEP: {
+                        if (SpanEqStr(Word, "-")) {
+                            /* do not set this column */
+                        }
+                        else if (SpanEqStr(Word, "|")) {
+                            ReserveColumn(Doc, ArgPos)->Sep = BAR_SEPERATOR;
+                        }
+                        else {
+                            not_implemented;
+                        }
+                    } break;
+
+                    case STATE_FMT: {
+                        s32 ColIdx = ArgPos - 1;
+                        struct column *Column = ReserveColumn(Doc, ColIdx);
+                        struct fmt_header New = DEFAULT_HEADER;
+                        char *Cur = Word.Str;
+
+                        /* TODO(lrak): real parser? */
+
+                        if (SpanEqStr(Word, "-")) {
+                            /* do not set this column */
+                        }
+                        else {
+                            switch (*Cur) {
+                            case 'l': ++Cur; New.Align = ALIGN_LEFT; break;
+                            case 'r': ++Cur; New.Align = ALIGN_RIGHT; break;
+                            }
+
+                            if (IsDigit(*Cur)) {
+                                s32 Width = 0;
+                                do Width = 10*Width + (*Cur-'0');
+                                while (IsDigit(*++Cur));
+                                Column->Width = Max(Width, MIN_COLUMN_WIDTH);
+                            }
+
+                            if (*Cur == '.') {
+                                ++Cur;
+                                if (IsDigit(*Cur)) {
+                                    New.Prcsn = 0;
+                                    do New.Prcsn = 10*New.Prcsn + (*Cur-'0');
+                                    while (IsDigit(*++Cur));
+                                }
+                            }
+
+                            struct cell *TopCell = ReserveCell(Doc, ColIdx, 0);
+                            MergeHeader(&TopCell->Fmt, &New);
+                        }
+                    } break;
+
+                    case STATE_PRCSN: {
+                        Assert(FmtRowIdx == RowIdx);
+                        u8 Prcsn = DEFAULT_CELL_PRECISION;
+                        char *Cur = Word.Str;
+
+                        /* TODO(lrak): real parser? */
+
+                        if (SpanEqStr(Word, "-")) {
+                            /* do not set this column */
+                        }
+                        if (SpanEqStr(Word, "reset")) {
+                            FmtRowIdx = -1;
+                            State = STATE_ERROR;
+                        }
+                        else {
+                            if (IsDigit(*Cur)) {
+                                Prcsn = 0;
+                                do Prcsn = 10*Prcsn + (*Cur-'0');
+                                while (IsDigit(*++Cur));
+                            }
+
+                            struct cell *Cell;
+                            Cell = ReserveCell(Doc, ArgPos-1, FmtRowIdx);
+                            Cell->Fmt.Prcsn = Prcsn;
+                            Cell->Fmt.SetMask |= SET_PRCSN;
+                        }
+                    } break;
+
+                    case STATE_SUMMARY: {
+                        s32 RefCol, RefRow;
+                        char *Cur = Word.Str;
+                        if (!ParseCellRef(&Cur, &RefCol, &RefRow) || Cur != Word.Str + Word.Len) {
+                            LogError("Could not parse cell ref [%.*s]", Word.Len, Word.Str);
+                        }
+                        else if (RefCol == SUMMARY || RefRow == SUMMARY) {
+                            LogError("Summary cell references summary [%.*s]", Word.Len, Word.Str);
+                        }
+                        else {
+                            Doc->Summarized = 1;
+                            Doc->Summary.Col = AbsoluteDim(RefCol, 0);
+                            Doc->Summary.Row = AbsoluteDim(RefRow, RowIdx);
+                        }
+
+                        State = STATE_ERROR;
+                    } break;
+
+                    case STATE_DEFINE: {
+                        if (Doc->NumMacros >= MACRO_MAX_COUNT) {
+                            LogError("Too many macros defined; can't define !%.*s", Word.Len, Word.Str);
+                        }
+                        else {
+                            s32 Idx = Doc->NumMacros++;
+
+                            struct expr_lexer ExprLexer = {
+                                .Cur = Lexer.Cur, .End = Lexer.End,
+                            };
+                            u32 Body = ParseExpr(Doc, &ExprLexer);
+#if USE_CONSTANT_FOLDING
+                            Body = FoldExpr(Doc, Body);
+#endif
+                            Doc->Macros[Idx] = (struct macro_def){
+                                .Name = Word,
+                                .Body = Body,
+                            };
+#if PREPRINT_ROWS
+                            char *Str = Lexer.Cur;
+                            while (Str < Lexer.End && IsSpace(*Str)) ++Str;
+                            printf("[%.*s]", (s32)(Lexer.End - Str), Str);
+#endif
+                        }
+                        State = STATE_ERROR;
+                    } break;
+
+                    default: State = STATE_ERROR; break;
+                    }
+                    ++ArgPos;
+                }
+            } break;
+
+#if PREPRINT_ROWS
+            case LINE_COMMENT: {
+                printf("%.*s", Line.Len, Line.Str);
+            } break;
+
+#endif
+            default: break;
+            }
+#if PREPRINT_ROWS
+            printf("\n");
+#endif
+        }
+#if PREPRINT_ROWS
+        printf("\n");
+#endif
+
+        if (!Lazy) {
+            FreeDelims(&Delims);
+            ParseFormulas(Doc);
+#if ANNOUNCE_CONSTANT_FOLDING
+            LogInfo("Folded away %u of %u nodes in %s",
+                    Doc->NumFoldedNodes, Doc->NumNodes + Doc->NumFoldedNodes, Path);
+#endif
+#if USE_DISK_CACHE
+            SaveCachedDoc(Doc, &Stat);
+#endif
+#if USE_BYTECODE
+            CompileFormulas(Doc);
+#endif
+#if USE_DEPENDENCY_GRAPH
+            BuildDependencyGraph(Doc);
+#endif
+        }
+#if USE_LAZY_ROWS
+        else {
+            /* NOTE: the rest is done a row at a time by LoadRows() */
+            ReserveFormulas(Doc, NumExprs);
+            Doc->Lazy.Load = LoadRows;
+        }
+#endif
+#if USE_NUMBER_COLUMNS
+        FillNumberColumns(Doc);
+#endif
+    }
+
+#if USE_PREFETCH
+    if (Loading) {
+        if (Doc) PrefetchLinks(Doc, 0);
+        EndLoad(&Stat);
+    }
+#endif
+    return Doc;
+}
+
+/* Make a document that is to be printed, all of which is loaded at once */
+static struct document *
+MakeDocument(fd Dir, char *Path)
+{
+    return LoadDocument(Dir, Path, false);
+}
+
+/* Make a document that another one references, which is usually only read
+ * for its summary or a few cells of its foot */
+static struct document *
+MakeSubDocument(fd Dir, char *Path)
+{
+    return LoadDocument(Dir, Path, USE_LAZY_ROWS);
+}
+
+#if PREPRINT_PARSING
+/* Fill Children with the indices of Node's Count children, in order. */
+static void
+ChildrenOf(struct expr_node *Nodes, u32 Node, s32 Count, u32 *Children)
+{
+    u32 Child = Node - 1;
+    for (s32 Idx = Count - 1; Idx >= 0; --Idx) {
+        Children[Idx] = Child;
+        Child = Nodes[Child].Start - 1;
+    }
+    Assert(Child + 1 == Nodes[Node].Start);
+}
+
+static char *
+OpStr(enum expr_operator Op)
+{
+    switch (Op) {
+    case EN_OP_NULL:     return "NULL";
+    case EN_OP_SET:      return "=";
+    case EN_OP_NEGATIVE: return "-";
+    case EN_OP_ADD:      return "+";
+    case EN_OP_SUB:      return "-";
+    case EN_OP_MUL:      return "*";
+    case EN_OP_DIV:      return "/";
+    }
+    Unreachable;
+}
+
+static void
+PrintNode(struct expr_node *Nodes, struct expr_node *Node, s32 Depth)
+{
+    s32 NextDepth = Depth + 2;
+    if (Node) {
+        u32 Idx = Nodes? Node - Nodes: 0;
+        u32 Children[Max(Node->Count, 1)];
+        if (Nodes) {
+            ChildrenOf(Nodes, Idx, Node->Count, Children);
+        }
+
+        printf("%*s", Depth, "");
+        if (Node->Op) {
+            printf("%s ", OpStr(Node->Op));
+        }
+        switch (Node->Type) {
+        case EN_NULL:
+            printf("NULL\n");
+            break;
+        case EN_ROOT:
+            printf("Root:\n");
+            PrintNode(Nodes, Nodes + Idx - 1, NextDepth);
+            break;
+        case EN_TERM:
+            printf("Term %s:\n", OpStr(Node->AsUnary.Op));
+            PrintNode(Nodes, Nodes + Idx - 1, NextDepth);
+            break;
+        case EN_ERROR:
+            printf("error %d\n", Node->AsError);
+            break;
+        case EN_FUNC_IDENT:
+            printf("func %d\n", Node->AsFunc);
+            break;
+        case EN_MACRO:
+            printf("macro %.*s\n", Node->AsIdent.Len, Node->AsIdent.Str);
+            break;
+        case EN_CELL:
+            printf("cell %d,%d\n", Node->AsCell.Col, Node->AsCell.Row);
+            break;
+        case EN_STRING:
+            printf("string %.*s\n", Node->AsString.Len, Node->AsString.Str);
+            break;
+        case EN_NUMBER:
+            printf("number %f\n", Node->AsNumber);
+            break;
+        case EN_SUM:
+            printf("Sum:\n");
+            for (s32 Child = 0; Child < Node->Count; ++Child) {
+                PrintNode(Nodes, Nodes + Children[Child], NextDepth);
+            }
+            break;
+        case EN_PROD:
+            printf("Prod:\n");
+            for (s32 Child = 0; Child < Node->Count; ++Child) {
+                PrintNode(Nodes, Nodes + Children[Child], NextDepth);
+            }
+            break;
+        case EN_FUNC:
+            printf("Func %d:\n", Node->AsFunc);
+            for (s32 Child = 0; Child < Node->Count; ++Child) {
+                PrintNode(Nodes, Nodes + Children[Child], NextDepth);
+            }
+            break;
+        case EN_RANGE:
+            printf("Range %d,%d -- %d,%d:\n",
+                    Node->AsRange.FirstCol, Node->AsRange.FirstRow,
+                    Node->AsRange.LastCol, Node->AsRange.LastRow);
+            break;
+        case EN_XENO:
+            printf("Xeno %.*s: %d,%d\n", Node->AsXeno.Reference.Len, Node->AsXeno.Reference.Str,
+                    Node->AsXeno.Cell.Col, Node->AsXeno.Cell.Row);
+            break;
+        default:
+            LogError("cannot handle type %d", Node->Type);
+            not_implemented;
+        }
+    }
+}
+#endif
+
+/* NOTE: a cell's value is only read by another thread once it is seen to be
+ * stable again */
+static inline enum cell_state
+GetState(struct cell *Cell)
+{
+    return __atomic_load_n(&Cell->State, __ATOMIC_ACQUIRE);
+}
+
+static inline void
+SetState(struct cell *Cell, enum cell_state State)
+{
+    __atomic_store_n(&Cell->State, State, __ATOMIC_RELEASE);
+}
+
+/* Returns whether the calling thread is the one to evaluate Cell */
+static inline bool
+ClaimCell(struct cell *Cell)
+{
+    u8 Expected = CELL_STATE_STABLE;
+    return Cell->Type == CELL_EXPR && __atomic_compare_exchange_n(&Cell->State,
+            &Expected, CELL_STATE_EVALUATING, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/* A cell yet to be evaluated, which whatever reads it has to wait for */
+static inline bool
+IsPending(struct cell *Cell)
+{
+    return Cell->Type == CELL_EXPR && GetState(Cell) == CELL_STATE_STABLE;
+}
+
+/* NOTE: the cells being evaluated, each above the ones waiting on it, so that
+ * no chain of references takes any call stack. Their formulas keep what they
+ * have reduced so far in Values, and resume where they left off. */
+static thread_local struct eval_stack {
+    s32 Used, Size;
+    struct eval_frame {
+        struct document *Doc;
+        s32 Col, Row;
+        s32 Dep; /* of its formula's dependencies, the one being visited */
+        struct eval_walk {
+            struct document *Doc;
+            struct cell_block Block; /* what is being visited */
+            s32 AtCol, AtRow; /* the next cell of Block to visit */
+            /* NOTE: when Masked, only the rows of Block whose first column
+             * holds Proto have their last column visited (see mask_sum) */
+            bool Masked;
+            struct cell Proto;
+        } Walk;
+        s32 Level; /* see FindLevels() */
+        s32 At; /* where its formula resumes; -1 until it starts */
+        s32 Base, Top; /* of its values */
+#if !USE_BYTECODE
+        s32 End; /* the last node of what is being reduced */
+        s32 Returns; /* of the macros it is in the middle of */
+#endif
+    } *Frames;
+
+    s32 ValuesUsed, ValuesSize;
+    struct expr_node *Values;
+#if !USE_BYTECODE
+    s32 ReturnsUsed, ReturnsSize;
+    struct macro_return {
+        u32 Macro, End;
+    } *Returns;
+#endif
+    bool Shared; /* evaluating a level alongside other threads (see RunJobs()) */
+} EvalStack;
+
+static void
+PushFrame(struct document *Doc, s32 Col, s32 Row)
+{
+    if (EvalStack.Used == EvalStack.Size) {
+        EvalStack.Size = EvalStack.Size? 2*EvalStack.Size: 64;
+        EvalStack.Frames = ResizeTemp(EvalStack.Frames, EvalStack.Size * sizeof *EvalStack.Frames);
+    }
+
+    /* NOTE: starts out past the end of an empty block */
+    EvalStack.Frames[EvalStack.Used++] = (struct eval_frame){
+        .Doc = Doc, .Col = Col, .Row = Row, .Dep = -1,
+        .Walk = { .Doc = Doc, .Block = { 0, 0, -1, -1 } },
+        .At = -1,
+    };
+}
+
+static void
+PushEvalFrame(struct document *Doc, struct cell *Cell, s32 Col, s32 Row)
+{
+    PushFrame(Doc, Col, Row);
+    SetState(Cell, CELL_STATE_EVALUATING);
+}
+
+static void
+PopFrame(void)
+{
+    struct eval_frame *Frame = EvalStack.Frames + --EvalStack.Used;
+    if (Frame->At >= 0) {
+        EvalStack.ValuesUsed = Frame->Base;
+#if !USE_BYTECODE
+        EvalStack.ReturnsUsed = Frame->Returns;
+#endif
+    }
+}
+
+/* Make room for Count more values, which may move them */
+static void
+ReserveValues(s32 Count)
+{
+    if (EvalStack.ValuesUsed + Count > EvalStack.ValuesSize) {
+        EvalStack.ValuesSize = Max(2*EvalStack.ValuesSize, EvalStack.ValuesUsed + Count + 64);
+        EvalStack.Values = ResizeTemp(EvalStack.Values, EvalStack.ValuesSize * sizeof *EvalStack.Values);
+    }
+}
+
+/* Leave the evaluating formula waiting for the pending cells of Block in Doc,
+ * from AtCol, AtRow on, to be evaluated. Returns false, for its caller to
+ * return in turn. */
+static bool
+WaitOnBlock(struct document *Doc, struct cell_block Block, s32 AtCol, s32 AtRow)
+{
+    Assert(EvalStack.Used);
+    EvalStack.Frames[EvalStack.Used - 1].Walk = (struct eval_walk){
+        .Doc = Doc, .Block = Block, .AtCol = AtCol, .AtRow = AtRow,
+    };
+    return false;
+}
+
+/* As WaitOnBlock(), for the rows FirstRow to LastRow of TrgtC where TestC
+ * holds Proto, in the order that mask_sum reads them */
+static bool
+WaitOnMask(struct document *Doc, s32 TestC, s32 TrgtC, struct cell *Proto, s32 FirstRow, s32 LastRow)
+{
+    Assert(EvalStack.Used);
+    EvalStack.Frames[EvalStack.Used - 1].Walk = (struct eval_walk){
+        .Doc = Doc, .Block = { TestC, FirstRow, TrgtC, LastRow },
+        .AtCol = TestC, .AtRow = FirstRow, .Masked = true, .Proto = *Proto,
+    };
+    return false;
+}
+
+#if USE_NUMBER_COLUMNS
+/* Clip Range to the cells of Doc, as the functions that read ranges see them */
+static struct cell_block
+ClipRange(struct document *Doc, struct cell_block Range)
+{
+    /* NOTE: any cells past these are empty, so they add nothing */
+    s32 LastCol = Doc->Numbers.Cols - 1;
+    s32 LastRow = Doc->Rows - 1;
+    if (LastCol < 0 || LastRow < 0) {
+        return (struct cell_block){ 0, 0, -1, -1 };
+    }
+    return (struct cell_block){
+        Clamp(0, Range.FirstCol, LastCol), Clamp(0, Range.FirstRow, LastRow),
+        Clamp(0, Range.LastCol, LastCol), Clamp(0, Range.LastRow, LastRow),
+    };
+}
+
+/* Returns whether every cell of Block has its value in the number columns. If
+ * not, it is left waiting as with WaitOnBlock(). */
+static bool
+NumbersReady(struct document *Doc, struct cell_block Block)
+{
+    for (s32 C = Block.FirstCol; C <= Block.LastCol; ++C) {
+        s32 R = NextExprRow(Doc, C, Block.FirstRow, Block.LastRow);
+        for (; R <= Block.LastRow; R = NextExprRow(Doc, C, R + 1, Block.LastRow)) {
+            /* NOTE: those that are still evaluating are read as empty */
+            if (IsPending(GetCell(Doc, C, R))) {
+                return WaitOnBlock(Doc, Block, C, R);
+            }
+        }
+    }
+    return true;
+}
 #endif
-            switch (LineType) {
-            case LINE_EMPTY:
-                if (Doc->FirstBodyRow == 0) {
-                    Doc->FirstBodyRow = RowIdx;
+
+static bool
+IsFinal(struct expr_node *Node)
+{
+    switch (NotNull(Node)->Type) {
+    case EN_NULL:
+    case EN_ERROR:
+    case EN_NUMBER:
+    case EN_MACRO:
+    case EN_FUNC_IDENT:
+    case EN_STRING:
+    case EN_CELL:
+    case EN_RANGE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static enum expr_error
+AccumulateMathOp(f64 *Acc, enum expr_operator Op, struct expr_node *Node)
+[[gnu::nonnull]]
+{
+    enum expr_error Error = 0;
+
+    switch (Node->Type) {
+    case EN_STRING:
+        if (!Node->AsString.Len) {
+            /* treat as equivalent to 0 */
+            switch (Op) {
+            case EN_OP_SET: *Acc = 0; break;
+            case EN_OP_ADD: /* nop */ break;
+            case EN_OP_SUB: /* nop */ break;
+            case EN_OP_MUL: *Acc = 0; break;
+            case EN_OP_DIV: *Acc = NAN; break;
+            default: invalid_code_path;
+            }
+        }
+        else {
+            Error = ERROR_TYPE;
+        }
+        break;
+
+    case EN_NUMBER:
+        switch (Op) {
+        case EN_OP_SET: *Acc  = Node->AsNumber; break;
+        case EN_OP_ADD: *Acc += Node->AsNumber; break;
+        case EN_OP_SUB: *Acc -= Node->AsNumber; break;
+        case EN_OP_MUL: *Acc *= Node->AsNumber; break;
+        case EN_OP_DIV: *Acc /= Node->AsNumber; break;
+        default: invalid_code_path;
+        }
+        break;
+
+    case EN_ERROR:
+        Error = Node->AsError;
+        break;
+
+    default:
+        Error = ERROR_TYPE;
+        switch (Op) {
+        case EN_OP_SET: LogError("Cannot set with type %d", Node->Type); break;
+        case EN_OP_ADD: LogError("Cannot add with type %d", Node->Type); break;
+        case EN_OP_SUB: LogError("Cannot subtract with type %d", Node->Type); break;
+        case EN_OP_MUL: LogError("Cannot multiply with type %d", Node->Type); break;
+        case EN_OP_DIV: LogError("Cannot divide with type %d", Node->Type); break;
+        default: invalid_code_path;
+        }
+        break;
+    }
+
+    return Error;
+}
+
+/* Returns false when the cell has yet to be evaluated (see WaitOnBlock()) */
+static bool
+EvaluateIntoNode(struct document *Doc, s32 Col, s32 Row, struct expr_node *Node)
+{
+    struct cell *Cell;
+    if (Col < 0 || Row < 0) {
+        *Node = ErrorNode(ERROR_RELATIVE);
+    }
+    else if (!CellExists(Doc, Col, Row)) {
+        *Node = ErrorNode(ERROR_DNE);
+    }
+    else if (IsPending(Cell = GetCell(Doc, Col, Row))) {
+        return WaitOnBlock(Doc, (struct cell_block){ Col, Row, Col, Row }, Col, Row);
+    }
+    else if (Cell->Type == CELL_EXPR) {
+        /* NOTE: it is still evaluating, so this is a cycle */
+        *Node = ErrorNode(ERROR_SUB);
+    }
+    else {
+        SetAsNodeFrom(Node, Cell);
+    }
+    return true;
+}
+
+static inline bool
+MatchArgType(enum expr_func_arg Spec, enum expr_node_type Node)
+{
+    return (!Spec && !Node)
+        || ((Spec & EFA_NUMBER) && (Node == EN_NUMBER))
+        || ((Spec & EFA_STRING) && (Node == EN_STRING))
+        || ((Spec & EFA_RANGE)  && (Node == EN_RANGE))
+        ;
+}
+
+static inline const char *
+ArgTypeStr(enum expr_func_arg Spec)
+{
+    constexpr s32 Mask = EFA_NUMBER | EFA_STRING | EFA_RANGE;
+    return ((const char *[Mask + 1]){
+        [EFA_NULL] = "NULL",
+        [EFA_NUMBER] = "a number",
+        [EFA_STRING] = "a string",
+        [EFA_NUMBER | EFA_STRING] = "a number or string",
+        [EFA_RANGE] = "a range",
+        [EFA_NUMBER | EFA_RANGE] = "a number or range",
+        [EFA_STRING | EFA_RANGE] = "a string or range",
+        [EFA_NUMBER | EFA_STRING | EFA_RANGE] = "a number, string or range",
+    })[Spec & Mask];
+}
+
+/* Returns the document that Link, of Doc, is to, or nullptr when there is
+ * none. Only the first time does this go looking for it. */
+static struct document *
+ResolveXeno(struct document *Doc, struct xeno_link *Link)
+{
+    if (!Link->Resolved) {
+        char Path[PATH_MAX];
+        snprintf(Path, sizeof Path, "%.*s", Link->Reference.Len, Link->Reference.Str);
+        Link->Doc = MakeSubDocument(Doc->Dir, Path);
+        Link->Resolved = true;
+    }
+    return Link->Doc;
+}
+
+static bool
+EvaluateXeno(struct document *Doc, struct xeno_link *Link, struct cell_ref Cell, s32 Col, s32 Row, struct expr_node *Out)
+{
+    struct document *SubDoc = ResolveXeno(Doc, Link);
+    if (!SubDoc) {
+        *Out = ErrorNode(ERROR_FILE);
+    }
+    else {
+        s32 SubCol = CanonicalCol(SubDoc, Cell.Col, Col);
+        s32 SubRow = CanonicalRow(SubDoc, Cell.Row, Row);
+        return EvaluateIntoNode(SubDoc, SubCol, SubRow, Out);
+    }
+    return true;
+}
+
+/* Apply Func to its Arity already reduced Args. Form is the overload chosen
+ * for that arity (see FindForm), if there was one. Returns false when it has
+ * to wait for a cell that it reads to be evaluated first. */
+static bool
+CallFunc(struct document *Doc, enum expr_func Func, const struct expr_func_form *Form,
+        s32 Arity, struct expr_node *Args, s32 Col, s32 Row, struct expr_node *Out)
+{
+    const struct expr_func_spec *Spec = &ExprFuncSpec[Func];
+    Assert(Spec->Func == Func);
+
+    if (!Form) {
+        LogError("%s/%s cannot take %d arguments",
+                Spec->Name, Spec->ArityStr, Arity);
+        *Out = ErrorNode(ERROR_ARGC);
+        return true;
+    }
+
+    bool ValidTypes = true; /* optimistic */
+    Assert(Arity || Form->Arity == 0);
+    for (s32 Idx = 1; Idx <= Arity; ++Idx) {
+        struct expr_node *This = Args + Idx - 1;
+
+        auto ExpectedType = Form->Arg[Min(Idx, Form->Arity) - 1];
+        if (!MatchArgType(ExpectedType, This->Type)) {
+            ValidTypes = false;
+            LogError("%s/%d arg %d expects %s",
+                    Spec->Name, Arity, Idx,
+                    ArgTypeStr(ExpectedType));
+        }
+    }
+
+#if USE_AGGREGATE_MEMO
+    bool Memoize = false;
+    struct cell_block MemoBlock;
+    if (ValidTypes && Arity == 1 && Args[0].Type == EN_RANGE
+            && (Func == EF_AVERAGE || Func == EF_COUNT || Func == EF_MAX || Func == EF_MIN || Func == EF_SUM)) {
+        MemoBlock = ClipRange(Doc, Args[0].AsRange);
+        s64 NumCells = (s64)(MemoBlock.LastCol - MemoBlock.FirstCol + 1) * (MemoBlock.LastRow - MemoBlock.FirstRow + 1);
+        if (NumCells >= MIN_MEMO_CELLS) {
+            /* NOTE: a block is only remembered once each of its cells is done */
+            f64 Number;
+            if (RecallAggregate(Doc, Func, MemoBlock, &Number)) {
+                *Out = NumberNode(Number);
+                return true;
+            }
+            Memoize = true;
+        }
+    }
+#endif
+
+    if (!ValidTypes) {
+        *Out = ErrorNode(ERROR_TYPE);
+    }
+    else switch (Func) {
+    case EF_ABS: {
+        Assert(Arity == 1);
+        Assert(Args[0].Type == EN_NUMBER);
+        *Out = NumberNode(fabs(Args[0].AsNumber));
+    } break;
+
+    case EF_AVERAGE: {
+        Assert(Arity == 1);
+        Assert(Args[0].Type == EN_RANGE);
+
+        f64 Sum = 0;
+        f64 Count = 0;
+#if USE_NUMBER_COLUMNS
+        struct cell_block Block = ClipRange(Doc, Args[0].AsRange);
+        if (!NumbersReady(Doc, Block)) return false;
+        for (s32 C = Block.FirstCol; C <= Block.LastCol; ++C) {
+            Sum = SumNumbers(Doc, C, Block.FirstRow, Block.LastRow, Sum);
+            Count += CountNumbers(Doc, C, Block.FirstRow, Block.LastRow);
+        }
+#else
+        s32 FirstCol = Clamp(0, Args[0].AsRange.FirstCol, Doc->Cols);
+        s32 FirstRow = Clamp(0, Args[0].AsRange.FirstRow, Doc->Rows);
+        s32 LastCol = Clamp(0, Args[0].AsRange.LastCol, Doc->Cols);
+        s32 LastRow = Clamp(0, Args[0].AsRange.LastRow, Doc->Rows);
+
+        for (s32 C = FirstCol; C <= LastCol; ++C) {
+            for (s32 R = FirstRow; R <= LastRow; ++R) {
+                struct cell *Cell = GetCell(Doc, C, R);
+                if (IsPending(Cell)) {
+                    struct cell_block Block = { FirstCol, FirstRow, LastCol, LastRow };
+                    return WaitOnBlock(Doc, Block, C, R);
+                }
+                else if (Cell->Type == CELL_NUMBER) {
+                    Sum += Cell->AsNumber;
+                    Count += 1;
+                }
+            }
+        }
+#endif
+
+        *Out = NumberNode(Count? Sum / Count: 0);
+    } break;
+
+    case EF_BODY_COL: {
+        if (Arity == 0) {
+            *Out = (struct expr_node){ EN_RANGE, .AsRange = {
+                Col, Doc->FirstBodyRow,
+                Col, Doc->FirstFootRow - 1,
+            }};
+        }
+        else if (Arity == 1) {
+            Assert(Args[0].Type == EN_RANGE);
+            *Out = (struct expr_node){ EN_RANGE, .AsRange = {
+                (s32)Args[0].AsNumber, Doc->FirstBodyRow,
+                (s32)Args[0].AsNumber, Doc->FirstFootRow - 1,
+            }};
+        }
+        else {
+            invalid_code_path;
+        }
+    } break;
+
+    case EF_CEIL: {
+        Assert(Arity == 1);
+        Assert(Args[0].Type == EN_NUMBER);
+        *Out = NumberNode(ceil(Args[0].AsNumber));
+    } break;
+
+    case EF_CELL: {
+        if (Arity == 2) {
+            Assert(Args[0].Type == EN_NUMBER);
+            Assert(Args[1].Type == EN_NUMBER);
+            *Out = CellNode2(Args[0].AsNumber, Args[1].AsNumber);
+        }
+        else if (Arity == 3) {
+            Assert(Args[0].Type == EN_STRING);
+            Assert(Args[1].Type == EN_NUMBER);
+            Assert(Args[1].Type == EN_NUMBER);
+            struct cell_ref Cell = { Args[1].AsNumber, Args[2].AsNumber };
+            s32 Link = AddXenoLink(Doc, Args[0].AsString);
+            if (!EvaluateXeno(Doc, Doc->Links + Link, Cell, Col, Row, Out)) {
+                return false;
+            }
+        }
+        else {
+            invalid_code_path;
+        }
+    } break;
+
+    case EF_COL: {
+        Assert(Arity == 1);
+        *Out = NumberNode(Col);
+    } break;
+
+    case EF_COUNT: {
+        Assert(Arity == 1);
+        Assert(Args[0].Type == EN_RANGE);
+
+        f64 Acc = 0;
+#if USE_NUMBER_COLUMNS
+        struct cell_block Block = ClipRange(Doc, Args[0].AsRange);
+        if (!NumbersReady(Doc, Block)) return false;
+        for (s32 C = Block.FirstCol; C <= Block.LastCol; ++C) {
+            Acc += CountNumbers(Doc, C, Block.FirstRow, Block.LastRow);
+        }
+#else
+        s32 FirstCol = Clamp(0, Args[0].AsRange.FirstCol, Doc->Cols);
+        s32 FirstRow = Clamp(0, Args[0].AsRange.FirstRow, Doc->Rows);
+        s32 LastCol = Clamp(0, Args[0].AsRange.LastCol, Doc->Cols);
+        s32 LastRow = Clamp(0, Args[0].AsRange.LastRow, Doc->Rows);
+
+        for (s32 C = FirstCol; C <= LastCol; ++C) {
+            for (s32 R = FirstRow; R <= LastRow; ++R) {
+                struct cell *Cell = GetCell(Doc, C, R);
+                if (IsPending(Cell)) {
+                    struct cell_block Block = { FirstCol, FirstRow, LastCol, LastRow };
+                    return WaitOnBlock(Doc, Block, C, R);
+                }
+                Acc += (Cell->Type == CELL_NUMBER);
+            }
+        }
+#endif
+
+        *Out = NumberNode(Acc);
+    } break;
+
+    case EF_FLOOR: {
+        Assert(Arity == 1);
+        Assert(Args[0].Type == EN_NUMBER);
+        *Out = NumberNode(floor(Args[0].AsNumber));
+    } break;
+
+    case EF_MASK_SUM: {
+        Assert(Arity == 3);
+        Assert(Args[0].Type == EN_NUMBER);
+        Assert(Args[1].Type == EN_NUMBER || Args[1].Type == EN_STRING);
+        Assert(Args[2].Type == EN_NUMBER);
+
+        struct cell Proto;
+        s32 TestC = Args[0].AsNumber;
+        SetCellFromNode(&Proto, Args + 1);
+        s32 TrgtC = Args[2].AsNumber;
+
+        s32 First = Doc->FirstBodyRow;
+        s32 OnePastLast = Min(Doc->FirstFootRow, Doc->Rows);
+
+        Assert(First >= 0);
+        Assert(OnePastLast <= Doc->Rows);
+
+        f64 Acc = 0;
+#if USE_GROUP_INDEX
+        s32 Count;
+        s32 *Rows = (First < OnePastLast && 0 <= TestC && TestC < Doc->Cols)?
+            FindGroup(Doc, TestC, First, OnePastLast, &Proto, &Count): nullptr;
+        if (Rows) {
+            for (s32 Idx = 0; Idx < Count; ++Idx) {
+                struct cell *Trgt = GetCell(Doc, TrgtC, Rows[Idx]);
+                if (IsPending(Trgt)) {
+                    return WaitOnMask(Doc, TestC, TrgtC, &Proto, Rows[Idx], OnePastLast - 1);
+                }
+                else if (Trgt->Type == CELL_NUMBER) {
+                    Acc += Trgt->AsNumber;
+                }
+            }
+
+            *Out = NumberNode(Acc);
+            break;
+        }
+#endif
+        for (s32 R = First; R < OnePastLast; ++R) {
+            struct cell *Test = GetCell(Doc, TestC, R);
+            if (IsPending(Test)) {
+                return WaitOnMask(Doc, TestC, TrgtC, &Proto, R, OnePastLast - 1);
+            }
+            else if (CellsEq(&Proto, Test)) {
+                struct cell *Trgt = GetCell(Doc, TrgtC, R);
+                if (IsPending(Trgt)) {
+                    return WaitOnMask(Doc, TestC, TrgtC, &Proto, R, OnePastLast - 1);
                 }
-                else {
-                    Doc->FirstFootRow = RowIdx;
+                else if (Trgt->Type == CELL_NUMBER) {
+                    Acc += Trgt->AsNumber;
                 }
-                FmtRowIdx = -1;
-                break;
+            }
+        }
 
-            case LINE_ROW: {
-                char CellBuf[512];
-                enum cell_type Type;
-                struct row_lexer Lexer = { Buf };
-
-                s32 ColIdx = 0;
-                while ((Type = NextCell(&Lexer, CellBuf, sizeof CellBuf))) {
-                    struct cell *Cell = ReserveCell(Doc, ColIdx, RowIdx);
-                    switch (Type) {
-                        char *Rem; double Value;
-                    case CELL_PRETYPED:
-                        if (*CellBuf && (Value = Str2f64(CellBuf, &Rem), !*Rem)) {
-                            SetAsNumber(Cell, Value);
+        *Out = NumberNode(Acc);
+    } break;
+
+    case EF_MAX: {
+        bool Any = false;
+        f64 Number = -INFINITY;
+        for (s32 Idx = 0; Idx < Arity; ++Idx) {
+            struct expr_node *This = Args + Idx;
+
+            if (This->Type == EN_NUMBER) {
+                Number = Max(Number, This->AsNumber);
+                Any = true;
+            }
+            else if (This->Type == EN_RANGE) {
+#if USE_NUMBER_COLUMNS
+                struct cell_block Block = ClipRange(Doc, This->AsRange);
+                if (!NumbersReady(Doc, Block)) return false;
+                for (s32 C = Block.FirstCol; C <= Block.LastCol; ++C) {
+                    if (CountNumbers(Doc, C, Block.FirstRow, Block.LastRow)) {
+                        Number = Max(Number, MaxNumber(Doc, C, Block.FirstRow, Block.LastRow));
+                        Any = true;
+                    }
+                }
+#else
+                auto Range = &This->AsRange;
+                s32 FirstCol = Clamp(0, Range->FirstCol, Doc->Cols);
+                s32 FirstRow = Clamp(0, Range->FirstRow, Doc->Rows);
+                s32 LastCol = Clamp(0, Range->LastCol, Doc->Cols);
+                s32 LastRow = Clamp(0, Range->LastRow, Doc->Rows);
+
+                for (s32 C = FirstCol; C <= LastCol; ++C) {
+                    for (s32 R = FirstRow; R <= LastRow; ++R) {
+                        struct cell *Cell = GetCell(Doc, C, R);
+                        if (IsPending(Cell)) {
+                            struct cell_block Block = { FirstCol, FirstRow, LastCol, LastRow };
+                            return WaitOnBlock(Doc, Block, C, R);
                         }
-                        else {
-                            SetAsString(Cell, SaveStr(CellBuf));
+                        else if (Cell->Type == CELL_NUMBER) {
+                            Number = Max(Number, Cell->AsNumber);
+                            Any = true;
                         }
-                        break;
-
-                    case CELL_EXPR:
-                        SetAsExpr(Cell, SaveStr(CellBuf));
-                        break;
+                    }
+                }
+#endif
+            }
+            else {
+                invalid_code_path;
+            }
+        }
+        *Out = NumberNode(Any? Number: 0);
+    } break;
 
-                    case CELL_STRING:
-                        SetAsString(Cell, SaveStr(CellBuf));
-                        break;
+    case EF_MIN: {
+        bool Any = false;
+        f64 Number = INFINITY;
+        for (s32 Idx = 0; Idx < Arity; ++Idx) {
+            struct expr_node *This = Args + Idx;
 
-                    default_unreachable;
+            if (This->Type == EN_NUMBER) {
+                Number = Min(Number, This->AsNumber);
+                Any = true;
+            }
+            else if (This->Type == EN_RANGE) {
+#if USE_NUMBER_COLUMNS
+                struct cell_block Block = ClipRange(Doc, This->AsRange);
+                if (!NumbersReady(Doc, Block)) return false;
+                for (s32 C = Block.FirstCol; C <= Block.LastCol; ++C) {
+                    if (CountNumbers(Doc, C, Block.FirstRow, Block.LastRow)) {
+                        Number = Min(Number, MinNumber(Doc, C, Block.FirstRow, Block.LastRow));
+                        Any = true;
                     }
-#if PREPRINT_ROWS
-                    switch (Cell->Type) {
-                    case CELL_STRING: printf("[%s]", Cell->AsString); break;
-                    case CELL_NUMBER: printf("(%f)", Cell->AsNumber); break;
-                    case CELL_EXPR:   printf("{%s}", Cell->AsExpr); break;
-                    case CELL_ERROR:  printf("<%s>", CellErrStr(Cell->AsError)); break;
-                    default:
-                        LogWarn("Preprint wants to print type %d", Cell->Type);
-                        invalid_code_path;
+                }
+#else
+                auto Range = &This->AsRange;
+                s32 FirstCol = Clamp(0, Range->FirstCol, Doc->Cols);
+                s32 FirstRow = Clamp(0, Range->FirstRow, Doc->Rows);
+                s32 LastCol = Clamp(0, Range->LastCol, Doc->Cols);
+                s32 LastRow = Clamp(0, Range->LastRow, Doc->Rows);
+
+                for (s32 C = FirstCol; C <= LastCol; ++C) {
+                    for (s32 R = FirstRow; R <= LastRow; ++R) {
+                        struct cell *Cell = GetCell(Doc, C, R);
+                        if (IsPending(Cell)) {
+                            struct cell_block Block = { FirstCol, FirstRow, LastCol, LastRow };
+                            return WaitOnBlock(Doc, Block, C, R);
+                        }
+                        else if (Cell->Type == CELL_NUMBER) {
+                            Number = Min(Number, Cell->AsNumber);
+                            Any = true;
+                        }
                     }
+                }
 #endif
+            }
+            else {
+                invalid_code_path;
+            }
+        }
+        *Out = NumberNode(Any? Number: 0);
+    } break;
 
-                    if (FmtRowIdx >= 0 && FmtRowIdx != RowIdx) {
-                        struct cell *FmtCell = GetCell(Doc, ColIdx, FmtRowIdx);
-                        MergeHeader(&Cell->Fmt, &FmtCell->Fmt);
-                    }
+    case EF_NUMBER: {
+        f64 Number = 0;
+        for (s32 Idx = 0; Idx < Arity; ++Idx) {
+            struct expr_node *This = Args + Idx;
 
-                    ++ColIdx;
+            if (This->Type == EN_NUMBER) {
+                if (isnan(This->AsNumber)) { /* ignored */ }
+                else if (isinf(This->AsNumber)) { /* ignored */ }
+                else {
+                    Number = This->AsNumber;
+                    break; /* early out of this loop */
                 }
-                ++RowIdx;
-            } break;
+            }
+        }
+        *Out = NumberNode(Number);
+    } break;
 
-            case LINE_COMMAND: {
-                char CmdBuf[512];
-                struct cmd_lexer Lexer = { Buf };
+    case EF_PCENT: {
+        Assert(Arity == 1);
+        Assert(Args[0].Type == EN_NUMBER);
+        char Buf[32];
+        s32 Len = snprintf(Buf, sizeof Buf, "%0.2f%%", 100*Args[0].AsNumber);
+        /* TODO(levirak): is this leaking? */
+        struct span Str = { SaveStr(Buf), Min(Len, sArrayCount(Buf) - 1) };
+        *Out = StringNode(Str);
+    } break;
 
-                enum {
-                    STATE_FIRST = 0,
+    case EF_POW: {
+        Assert(Arity == 2);
+        Assert(Args[0].Type == EN_NUMBER);
+        Assert(Args[1].Type == EN_NUMBER);
+        *Out = NumberNode(pow(Args[0].AsNumber, Args[1].AsNumber));
+    } break;
 
-                    STATE_SEP,
-                    STATE_FMT,
-                    STATE_PRCSN,
-                    STATE_SUMMARY,
-                    STATE_DEFINE,
+    case EF_ROUND: {
+        f64 Number = 0;
+        f64 Prcsn = 0;
 
-                    STATE_ERROR,
-                } State = 0;
+        if (Arity == 1) {
+            Assert(Args[0].Type == EN_NUMBER);
 
-                s32 ArgPos = 0;
-                while (NextCmdWord(&Lexer, CmdBuf, sizeof CmdBuf)) {
-#if PREPRINT_ROWS
-                    printf("(%s)", CmdBuf);
-#endif
-                    switch (State) {
-                    case STATE_FIRST:
-#define MATCH(S,V,...) else if (StrEq(CmdBuf, S)) { State = V; __VA_ARGS__; }
-                        if (0);
-                        MATCH ("sep", STATE_SEP)
-                        MATCH ("fmt", STATE_FMT)
-                        MATCH ("prcsn", STATE_PRCSN, FmtRowIdx = RowIdx)
-                        MATCH ("summary", STATE_SUMMARY)
-                        MATCH ("define", STATE_DEFINE)
-                        else { State = STATE_ERROR; }
-#undef MATCH
-                        break;
+            struct fmt_header Fmt = GetCell(Doc, Col, 0)->Fmt;
+            MergeHeader(&Fmt, &GetCell(Doc, Col, Row)->Fmt);
+            MergeHeader(&Fmt, &DefaultHeader);
+            Number = Args[0].AsNumber;
+            Prcsn = Fmt.Prcsn;
+        }
+        else if (Arity == 2) {
+            Assert(Args[0].Type == EN_NUMBER);
+            Assert(Args[1].Type == EN_NUMBER);
+            Number = Args[0].AsNumber;
+            Prcsn = Args[1].AsNumber;
+        }
+        else {
+            invalid_code_path;
+        }
 
-                    case STATE_SEP: {
-                        if (StrEq(CmdBuf, "-")) {
-                            /* do not set this column */
-                        }
-                        else if (StrEq(CmdBuf, "|")) {
-                            ReserveColumn(Doc, ArgPos)->Sep = " │ ";
+        f64 Mul10 = pow(10, Prcsn);
+        *Out = NumberNode(round(Mul10 * Number) / Mul10);
+    } break;
+
+    case EF_ROW: {
+        Assert(Arity == 0);
+        *Out = NumberNode(Row);
+    } break;
+
+    case EF_SIGN: {
+        Assert(Arity == 1);
+        Assert(Args[0].Type == EN_NUMBER);
+        f64 Number = Args[0].AsNumber;
+        *Out = NumberNode((Number > 0)? 1: (Number < 0)? -1: 0);
+    } break;
+
+    case EF_SUM: {
+        f64 Acc = 0;
+        for (s32 Idx = 0; Idx < Arity; ++Idx) {
+            struct expr_node *This = Args + Idx;
+
+            if (This->Type == EN_NUMBER) {
+                Acc += This->AsNumber;
+            }
+            else if (This->Type == EN_RANGE) {
+#if USE_NUMBER_COLUMNS
+                struct cell_block Block = ClipRange(Doc, This->AsRange);
+                if (!NumbersReady(Doc, Block)) return false;
+                for (s32 C = Block.FirstCol; C <= Block.LastCol; ++C) {
+                    Acc = SumNumbers(Doc, C, Block.FirstRow, Block.LastRow, Acc);
+                }
+#else
+                auto Range = &This->AsRange;
+                s32 FirstCol = Clamp(0, Range->FirstCol, Doc->Cols);
+                s32 FirstRow = Clamp(0, Range->FirstRow, Doc->Rows);
+                s32 LastCol = Clamp(0, Range->LastCol, Doc->Cols);
+                s32 LastRow = Clamp(0, Range->LastRow, Doc->Rows);
+
+                for (s32 C = FirstCol; C <= LastCol; ++C) {
+                    for (s32 R = FirstRow; R <= LastRow; ++R) {
+                        struct cell *Cell = GetCell(Doc, C, R);
+                        if (IsPending(Cell)) {
+                            struct cell_block Block = { FirstCol, FirstRow, LastCol, LastRow };
+                            return WaitOnBlock(Doc, Block, C, R);
                         }
-                        else {
-                            not_implemented;
+                        else if (Cell->Type == CELL_NUMBER) {
+                            Acc += Cell->AsNumber;
                         }
-                    } break;
+                    }
+                }
+#endif
+            }
+            else {
+                invalid_code_path;
+            }
+        }
+        *Out = NumberNode(Acc);
+    } break;
 
-                    case STATE_FMT: {
-                        s32 ColIdx = ArgPos - 1;
-                        struct column *Column = ReserveColumn(Doc, ColIdx);
-                        struct fmt_header New = DEFAULT_HEADER;
-                        char *Cur = CmdBuf;
+    case EF_TRUNC: {
+        f64 Number = 0;
+        f64 Prcsn = 0;
 
-                        /* TODO(lrak): real parser? */
+        if (Arity == 1) {
+            Assert(Args[0].Type == EN_NUMBER);
 
-                        if (StrEq(Cur, "-")) {
-                            /* do not set this column */
-                        }
-                        else {
-                            switch (*Cur) {
-                            case 'l': ++Cur; New.Align = ALIGN_LEFT; break;
-                            case 'r': ++Cur; New.Align = ALIGN_RIGHT; break;
-                            }
+            struct fmt_header Fmt = GetCell(Doc, Col, 0)->Fmt;
+            MergeHeader(&Fmt, &GetCell(Doc, Col, Row)->Fmt);
+            MergeHeader(&Fmt, &DefaultHeader);
+            Number = Args[0].AsNumber;
+            Prcsn = Fmt.Prcsn;
+        }
+        else if (Arity == 2) {
+            Assert(Args[0].Type == EN_NUMBER);
+            Assert(Args[1].Type == EN_NUMBER);
+            Number = Args[0].AsNumber;
+            Prcsn = Args[1].AsNumber;
+        }
+        else {
+            invalid_code_path;
+        }
 
-                            if (isdigit(*Cur)) {
-                                s32 Width = 0;
-                                do Width = 10*Width + (*Cur-'0');
-                                while (isdigit(*++Cur));
-                                Column->Width = Max(Width, MIN_COLUMN_WIDTH);
-                            }
+        f64 Mul10 = pow(10, Prcsn);
+        *Out = NumberNode(trunc(Mul10 * Number) / Mul10);
+    } break;
 
-                            if (*Cur == '.') {
-                                ++Cur;
-                                if (isdigit(*Cur)) {
-                                    New.Prcsn = 0;
-                                    do New.Prcsn = 10*New.Prcsn + (*Cur-'0');
-                                    while (isdigit(*++Cur));
-                                }
-                            }
+    default:
+        *Out = ErrorNode(ERROR_IMPL);
+        break;
+    }
 
-                            struct cell *TopCell = ReserveCell(Doc, ColIdx, 0);
-                            MergeHeader(&TopCell->Fmt, &New);
-                        }
-                    } break;
+#if USE_AGGREGATE_MEMO
+    if (Memoize && Out->Type == EN_NUMBER) {
+        RememberAggregate(Doc, Func, MemoBlock, Out->AsNumber);
+    }
+#endif
+    return true;
+}
 
-                    case STATE_PRCSN: {
-                        Assert(FmtRowIdx == RowIdx);
-                        u8 Prcsn = DEFAULT_CELL_PRECISION;
-                        char *Cur = CmdBuf;
+#if USE_CONSTANT_FOLDING
+/* NOTE: the functions whose result depends on nothing but their arguments.
+ * pcent is left out, as the string it makes is not from the source. */
+static bool
+IsPureFunc(enum expr_func Func, s32 Arity)
+{
+    switch (Func) {
+    case EF_ABS:
+    case EF_CEIL:
+    case EF_FLOOR:
+    case EF_MAX:
+    case EF_MIN:
+    case EF_NUMBER:
+    case EF_POW:
+    case EF_SIGN:
+    case EF_SUM:
+        return true;
+    case EF_ROUND:
+    case EF_TRUNC:
+        /* NOTE: with one argument these round to the cell's precision */
+        return Arity == 2;
+    default:
+        return false;
+    }
+}
 
-                        /* TODO(lrak): real parser? */
+static inline bool
+IsConstant(struct expr_node *Node)
+{
+    return Node->Type == EN_NUMBER || Node->Type == EN_STRING;
+}
 
-                        if (StrEq(Cur, "-")) {
-                            /* do not set this column */
-                        }
-                        if (StrEq(Cur, "reset")) {
-                            FmtRowIdx = -1;
-                            State = STATE_ERROR;
-                        }
-                        else {
-                            if (isdigit(*Cur)) {
-                                Prcsn = 0;
-                                do Prcsn = 10*Prcsn + (*Cur-'0');
-                                while (isdigit(*++Cur));
-                            }
+/* Simplify the expression at Root, which must be the last one parsed into
+ * Doc. Every subtree of constants that would reduce to a number without error
+ * is replaced by that number, as is every reference to a macro whose body
+ * already is a constant; sums, products and terms that do nothing are dropped.
+ * The survivors are moved down over what was removed, so this returns the new
+ * index of Root. */
+static u32
+FoldExpr(struct document *Doc, u32 Root)
+{
+    if (!Root) return 0;
+    Assert(Root == Doc->NumNodes - 1);
 
-                            struct cell *Cell;
-                            Cell = ReserveCell(Doc, ArgPos-1, FmtRowIdx);
-                            Cell->Fmt.Prcsn = Prcsn;
-                            Cell->Fmt.SetMask |= SET_PRCSN;
-                        }
-                    } break;
+    struct expr_node *Nodes = Doc->Nodes;
+    u32 First = Nodes[Root].Start;
+    u32 To = First;
 
-                    case STATE_SUMMARY: {
-                        s32 RefCol, RefRow;
-                        char *Cur = CmdBuf;
-                        if (!ParseCellRef(&Cur, &RefCol, &RefRow) || *Cur) {
-                            LogError("Could not parse cell ref [%s]", CmdBuf);
-                        }
-                        else if (RefCol == SUMMARY || RefRow == SUMMARY) {
-                            LogError("Summary cell references summary [%s]", CmdBuf);
-                        }
-                        else {
-                            Doc->Summarized = 1;
-                            Doc->Summary.Col = AbsoluteDim(RefCol, 0);
-                            Doc->Summary.Row = AbsoluteDim(RefRow, RowIdx);
-                        }
+    for (u32 From = First; From <= Root; ++From) {
+        struct expr_node Node = Nodes[From];
 
-                        State = STATE_ERROR;
-                    } break;
+        /* NOTE: children that are all leaves sit right before To */
+        u32 Start = To;
+        for (s32 Child = 0; Child < Node.Count; ++Child) {
+            Start = Nodes[Start - 1].Start;
+        }
+        bool AllConstant = (Start == To - Node.Count);
+        for (u32 Child = Start; AllConstant && Child < To; ++Child) {
+            AllConstant = IsConstant(Nodes + Child);
+        }
 
-                    case STATE_DEFINE: {
-                        if (Doc->NumMacros >= MACRO_MAX_COUNT) {
-                            LogError("Too many macros defined; can't define !%s", CmdBuf);
-                        }
-                        else {
-                            s32 Idx = Doc->NumMacros++;
+        /* NOTE: a node with a single child that does nothing to it gives its
+         * place as an operand over to that child */
+        bool DoesNothing = (Node.Type == EN_TERM && Node.AsUnary.Op != EN_OP_NEGATIVE)
+            || ((Node.Type == EN_SUM || Node.Type == EN_PROD) && Node.Count == 1);
+        if (DoesNothing) {
+            Nodes[To - 1].Op = Node.Op;
+            continue;
+        }
 
-                            char Buf[128];
-                            struct expr_lexer ExprLexer = {
-                                .Cur = Lexer.Cur,
-                                .Buf = Buf, .Sz = sizeof Buf,
-                            };
-                            Doc->Macros[Idx] = (struct macro_def){
-                                .Name = SaveStr(CmdBuf),
-                                .Body = ParseExpr(&ExprLexer),
-                            };
-#if PREPRINT_ROWS
-                            char *Str = Lexer.Cur;
-                            while (isspace(*Str)) ++Str;
-                            s32 Len = strlen(Str);
-                            while (Len > 0 && Str[Len-1] == '\n') --Len;
-                            printf("[%.*s]", Len, Str);
-#endif
-                        }
-                        State = STATE_ERROR;
-                    } break;
+        struct expr_node Folded = {0};
+        switch (Node.Type) {
+        case EN_TERM: {
+            if (AllConstant && Nodes[Start].Type == EN_NUMBER) {
+                Folded = Nodes[Start];
+                Folded.AsNumber *= -1;
+            }
+        } break;
 
-                    default: State = STATE_ERROR; break;
-                    }
-                    ++ArgPos;
+        case EN_SUM:
+        case EN_PROD: {
+            if (AllConstant) {
+                f64 Acc = 0;
+                enum expr_error Error = 0;
+                for (u32 Child = Start; !Error && Child < To; ++Child) {
+                    Error = AccumulateMathOp(&Acc, Nodes[Child].Op, Nodes + Child);
                 }
-            } break;
+                if (!Error) Folded = NumberNode(Acc);
+            }
+        } break;
 
-#if PREPRINT_ROWS
-            case LINE_COMMENT: {
-                char *Cur = Buf;
-                while (*Cur && *Cur != '\n') ++Cur;
-                *Cur = 0;
-                printf("%s", Buf);
-            } break;
+        case EN_FUNC: {
+            enum expr_func Func = Node.AsFunc;
+            const struct expr_func_form *Form = nullptr;
+            if (AllConstant && IsPureFunc(Func, Node.Count)) {
+                Form = FindForm(Func, Node.Count);
+            }
 
-#endif
-            default: break;
+            /* NOTE: only calls that would not log an error are made here */
+            bool ValidTypes = !!Form;
+            for (s32 Idx = 1; ValidTypes && Idx <= Node.Count; ++Idx) {
+                auto ExpectedType = Form->Arg[Min(Idx, Form->Arity) - 1];
+                ValidTypes = MatchArgType(ExpectedType, Nodes[Start + Idx - 1].Type);
             }
-#if PREPRINT_ROWS
-            printf("\n");
-#endif
+
+            /* NOTE: nor can these read any cells */
+            struct expr_node Out;
+            if (ValidTypes && CallFunc(Doc, Func, Form, Node.Count, Nodes + Start, 0, 0, &Out)
+                    && Out.Type == EN_NUMBER) {
+                Folded = Out;
+            }
+        } break;
+
+        case EN_MACRO: {
+            u32 Body = FindMacro(Doc, Node.AsIdent);
+            if (Body && !Nodes[Body].Count && IsConstant(Nodes + Body)) {
+                Folded = Nodes[Body];
+            }
+        } break;
+
+        default: break;
         }
-#if PREPRINT_ROWS
-        printf("\n");
-#endif
 
-        fclose(File);
+        if (Folded.Type) {
+            Folded.Op = Node.Op;
+            Folded.Count = 0;
+            Folded.Start = To = Start;
+            Node = Folded;
+        }
+        else {
+            Node.Start = Start;
+        }
+        Nodes[To++] = Node;
     }
 
-    return Doc;
+    Doc->NumFoldedNodes += Doc->NumNodes - To;
+    Doc->NumNodes = To;
+    return To - 1;
 }
+#endif
 
-#if PREPRINT_PARSING
-static char *
-OpStr(enum expr_operator Op)
+#if !USE_BYTECODE
+/* Returns the sum or product that the operand at Idx is part of, which is
+ * after every operand that follows it */
+static u32
+SkipOperands(struct expr_node *Nodes, u32 Idx)
 {
-    switch (Op) {
-    case EN_OP_NULL:     return "NULL";
-    case EN_OP_NEGATIVE: return "-";
-    case EN_OP_ADD:      return "+";
-    case EN_OP_SUB:      return "-";
-    case EN_OP_MUL:      return "*";
-    case EN_OP_DIV:      return "/";
+    /* NOTE: counts the sums and products that are still open */
+    s32 Open = 1;
+    for (;;) {
+        struct expr_node *Node = Nodes + ++Idx;
+        if ((Node->Type == EN_SUM || Node->Type == EN_PROD) && Node->Count > 1) {
+            if (--Open == 0) return Idx;
+        }
+        if (Node->Op == EN_OP_SET) ++Open;
     }
-    Unreachable;
 }
 
-static void
-PrintNode(struct expr_node *Node, s32 Depth)
+/* Reduce the formula of Frame's cell. Its nodes are in post-order, so this is
+ * one sweep from its first node up to its root, with the value of every
+ * finished subtree kept on the value stack. Returns false when it has to wait
+ * for a cell (see WaitOnBlock()); it then resumes at the node that read it. */
+static bool
+ReduceFormula(struct eval_frame *Frame, struct expr_node *Out)
 {
-    s32 NextDepth = Depth + 2;
-    if (Node) {
-        printf("%*s", Depth, "");
+    struct document *Doc = Frame->Doc;
+    struct expr_node *Nodes = Doc->Nodes;
+    s32 Col = Frame->Col;
+    s32 Row = Frame->Row;
+
+    if (Frame->At < 0) {
+        u32 Root = GetCell(Doc, Col, Row)->Formula->Root;
+        Frame->At = Nodes[Root].Start;
+        Frame->End = Root;
+        Frame->Base = EvalStack.ValuesUsed;
+        Frame->Returns = EvalStack.ReturnsUsed;
+    }
+
+    for (;;) {
+        u32 Idx = Frame->At;
+        struct expr_node *Node = Nodes + Idx;
+
+        /* NOTE: no node leaves more than one more value than it found */
+        ReserveValues(1);
+        struct expr_node *Top = EvalStack.Values + EvalStack.ValuesUsed - 1;
+
         switch (Node->Type) {
         case EN_NULL:
-            printf("NULL\n");
-            break;
-        case EN_ROOT:
-            printf("Root:\n");
-            PrintNode(Node->AsUnary.Child, NextDepth);
-            break;
-        case EN_TERM:
-            printf("Term:\n");
-            PrintNode(Node->AsUnary.Child, NextDepth);
-            break;
+            not_implemented;
         case EN_ERROR:
-            printf("error %d\n", Node->AsError);
-            break;
+        case EN_NUMBER:
         case EN_FUNC_IDENT:
-            printf("func %d\n", Node->AsFunc);
-            break;
-        case EN_MACRO:
-            printf("macro %s\n", Node->AsString);
-            break;
-        case EN_CELL:
-            printf("cell %d,%d\n", Node->AsCell.Col, Node->AsCell.Row);
-            break;
         case EN_STRING:
-            printf("string %s\n", Node->AsString);
-            break;
-        case EN_NUMBER:
-            printf("number %f\n", Node->AsNumber);
+            /* maximally reduced */
+            *++Top = *Node;
             break;
-        case EN_SUM:
-            printf("Sum:\n");
-            PrintNode(Node->AsList.This, NextDepth);
-            PrintNode(Node->AsList.Next, NextDepth);
+
+        case EN_RANGE:
+            /* needs to be canonicalized */
+            *++Top = (struct expr_node){ EN_RANGE, .AsRange = {
+                .FirstCol = CanonicalCol(Doc, Node->AsRange.FirstCol, Col),
+                .FirstRow = CanonicalRow(Doc, Node->AsRange.FirstRow, Row),
+                .LastCol = CanonicalCol(Doc, Node->AsRange.LastCol, Col),
+                .LastRow = CanonicalRow(Doc, Node->AsRange.LastRow, Row),
+            }};
             break;
-        case EN_SUM_CONT:
-            printf("SumCont %s:\n", OpStr(Node->AsList.Op));
-            PrintNode(Node->AsList.This, NextDepth);
-            PrintNode(Node->AsList.Next, NextDepth);
+
+        case EN_MACRO: {
+            u32 Body = FindMacro(Doc, Node->AsIdent);
+            if (!Body) {
+                *++Top = ErrorNode(ERROR_IMPL);
+            }
+            else if (EvalStack.ReturnsUsed - Frame->Returns >= MACRO_MAX_COUNT) {
+                /* NOTE: only a macro that expands to itself can get this deep */
+                *++Top = ErrorNode(ERROR_CYCLE);
+            }
+            else {
+                if (EvalStack.ReturnsUsed == EvalStack.ReturnsSize) {
+                    EvalStack.ReturnsSize = EvalStack.ReturnsSize? 2*EvalStack.ReturnsSize: 64;
+                    EvalStack.Returns = ResizeTemp(EvalStack.Returns,
+                            EvalStack.ReturnsSize * sizeof *EvalStack.Returns);
+                }
+                EvalStack.Returns[EvalStack.ReturnsUsed++] = (struct macro_return){ Idx, Frame->End };
+
+                Frame->At = Nodes[Body].Start;
+                Frame->End = Body;
+                continue;
+            }
+        } break;
+
+        case EN_CELL: {
+            s32 SubCol = CanonicalCol(Doc, Node->AsCell.Col, Col);
+            s32 SubRow = CanonicalRow(Doc, Node->AsCell.Row, Row);
+            if (!EvaluateIntoNode(Doc, SubCol, SubRow, ++Top)) {
+                return false;
+            }
+        } break;
+
+        case EN_ROOT:
             break;
+
+        case EN_TERM: {
+            Assert(IsFinal(Top));
+            if (Node->AsUnary.Op == EN_OP_NEGATIVE) {
+                if (Top->Type != EN_NUMBER) {
+                    LogError("Cannot negate type non-numbers");
+                    *Top = ErrorNode(ERROR_TYPE);
+                }
+                else {
+                    Top->AsNumber *= -1;
+                }
+            }
+        } break;
+
+        case EN_SUM:
         case EN_PROD:
-            printf("Prod:\n");
-            PrintNode(Node->AsList.This, NextDepth);
-            PrintNode(Node->AsList.Next, NextDepth);
-            break;
-        case EN_PROD_CONT:
-            printf("ProdCont %s:\n", OpStr(Node->AsList.Op));
-            PrintNode(Node->AsList.This, NextDepth);
-            PrintNode(Node->AsList.Next, NextDepth);
-            break;
-        case EN_LIST:
-            printf("List:\n");
-            PrintNode(Node->AsList.This, NextDepth);
-            PrintNode(Node->AsList.Next, NextDepth);
-            break;
-        case EN_LIST_CONT:
-            printf("ListCont:\n");
-            PrintNode(Node->AsList.This, NextDepth);
-            PrintNode(Node->AsList.Next, NextDepth);
-            break;
-        case EN_FUNC:
-            printf("Func:\n");
-            PrintNode(Node->AsList.This, NextDepth);
-            PrintNode(Node->AsList.Next, NextDepth);
-            break;
-        case EN_RANGE:
-            printf("Range %d,%d -- %d,%d:\n",
-                    Node->AsRange.FirstCol, Node->AsRange.FirstRow,
-                    Node->AsRange.LastCol, Node->AsRange.LastRow);
-            break;
-        case EN_XENO:
-            printf("Xeno %s:\n", Node->AsXeno.Reference);
-            PrintNode(Node->AsList.Next, NextDepth);
+            /* NOTE: its operands were accumulated into the first as they
+             * were reduced */
             break;
+
+        case EN_FUNC: {
+            enum expr_func Func = Node->AsFunc;
+            s32 Arity = Node->Count;
+            struct expr_node *Args = Top - Arity + 1;
+
+            struct expr_node Result;
+            if (!(0 <= Func && Func < EXPR_FUNC_COUNT)) {
+                LogError("func #%d has no spec", Func);
+                Result = ErrorNode(ERROR_IMPL);
+            }
+            else {
+                /* NOTE: an empty argument is no argument */
+                if (Arity == 1 && Args[0].Type == EN_NULL) Arity = 0;
+                if (!CallFunc(Doc, Func, FindForm(Func, Arity), Arity, Args, Col, Row, &Result)) {
+                    return false;
+                }
+            }
+            *(Top = Args) = Result;
+        } break;
+
+        case EN_XENO: {
+            s32 Link = AddXenoLink(Doc, Node->AsXeno.Reference);
+            if (!EvaluateXeno(Doc, Doc->Links + Link, Node->AsXeno.Cell, Col, Row, ++Top)) {
+                return false;
+            }
+        } break;
+
         default:
-            LogError("cannot handle type %d", Node->Type);
+            LogError("Got unhandeled case %d", Node->Type);
             not_implemented;
         }
+
+        /* NOTE: Node is reduced; this combines it with the operands before it,
+         * and finishes the macros that it completes */
+        for (;;) {
+            enum expr_operator Op = Nodes[Idx].Op;
+            enum expr_error Error = 0;
+            if (Op == EN_OP_SET) {
+                f64 Acc = 0;
+                Error = AccumulateMathOp(&Acc, EN_OP_SET, Top);
+                *Top = Error? ErrorNode(Error): NumberNode(Acc);
+            }
+            else if (Op) {
+                struct expr_node *Operand = Top--;
+                Assert(Top->Type == EN_NUMBER);
+                Error = AccumulateMathOp(&Top->AsNumber, Op, Operand);
+                if (Error) *Top = ErrorNode(Error);
+            }
+
+            if (Error) {
+                /* NOTE: the rest of the operands are not reduced at all */
+                Idx = SkipOperands(Nodes, Idx);
+            }
+            else if (Idx == (u32)Frame->End && EvalStack.ReturnsUsed > Frame->Returns) {
+                struct macro_return Return = EvalStack.Returns[--EvalStack.ReturnsUsed];
+                Idx = Return.Macro;
+                Frame->End = Return.End;
+            }
+            else break;
+        }
+        EvalStack.ValuesUsed = Top - EvalStack.Values + 1;
+
+        if (Idx == (u32)Frame->End) {
+            Assert(EvalStack.ValuesUsed == Frame->Base + 1);
+            if (!IsFinal(Top)) {
+                LogWarn("Node was not final (type %d)", Top->Type);
+                not_implemented;
+            }
+            *Out = *Top;
+            return true;
+        }
+        Frame->At = Idx + 1;
     }
 }
 #endif
 
-static enum expr_error EvaluateCell(struct document *, s32, s32);
-
-static inline s32
-CellsEq(struct cell *A, struct cell *B)
+#if USE_BYTECODE
+/* Run the program of Frame's cell. Returns false when it has to wait for a
+ * cell (see WaitOnBlock()); it then resumes at the instruction that read it. */
+static bool
+Execute(struct eval_frame *Frame, struct expr_node *Out)
 {
-    if (!A || !B) {
-        return (!A && !B);
-    }
-    else if (A->Type != B->Type) {
-        return false;
+    struct document *Doc = Frame->Doc;
+    s32 Col = Frame->Col;
+    s32 Row = Frame->Row;
+    struct formula *Formula = GetCell(Doc, Col, Row)->Formula;
+    Assert(Formula->CodeAt >= 0);
+    Assert(Formula->MaxStack > 0);
+
+    if (Frame->At < 0) {
+        ReserveValues(Formula->MaxStack);
+        Frame->At = Formula->CodeAt;
+        Frame->Base = EvalStack.ValuesUsed;
+        Frame->Top = -1;
+        EvalStack.ValuesUsed += Formula->MaxStack;
     }
-    else switch (A->Type) {
-    case CELL_STRING:
-        return StrEq(A->AsString, B->AsString);
 
-    case CELL_NUMBER:
-        /* TODO(levirak): fuzzy eq? */
-        return A->AsNumber == B->AsNumber;
+    /* NOTE: nothing is pushed above this frame while it runs, so the stack
+     * cannot move out from under us. The program only grows when a row of a
+     * document that is loaded lazily is loaded, which reading another
+     * document, even as itself, may do (see LoadRows()). */
+    struct vm_inst *Code = Doc->Program.Code;
+    struct expr_node *Consts = Doc->Program.Consts;
+    struct expr_node *Stack = EvalStack.Values + Frame->Base;
+    struct expr_node *Top = Stack + Frame->Top;
+
+    for (s32 At = Frame->At;;) {
+        struct vm_inst Inst = Code[At++];
+
+        switch ((enum vm_op)Inst.Op) {
+        case OP_HALT: {
+            Assert(Top == Stack);
+            if (!IsFinal(Top)) {
+                LogWarn("Node was not final (type %d)", Top->Type);
+                not_implemented;
+            }
+            *Out = *Top;
+            return true;
+        } break;
 
-    default:
-        not_implemented;
-        return false;
-    }
-}
+        case OP_PUSH: {
+            *++Top = Consts[Inst.Arg];
+        } break;
 
-static bool
-IsFinal(struct expr_node *Node)
-{
-    switch (NotNull(Node)->Type) {
-    case EN_NULL:
-    case EN_ERROR:
-    case EN_NUMBER:
-    case EN_MACRO:
-    case EN_FUNC_IDENT:
-    case EN_STRING:
-    case EN_CELL:
-    case EN_RANGE:
-        return true;
-    case EN_LIST:
-    case EN_LIST_CONT:
-        for (struct expr_node *Cur = Node; Cur; Cur = Cur->AsList.Next) {
-            if (!IsFinal(Cur->AsList.This)) return 0;
+        case OP_CELL: {
+            struct cell_ref Cell = Consts[Inst.Arg].AsCell;
+            if (Inst.Sub & VM_REL_COL) Cell.Col = CheckGe(Col + Cell.Col, 0);
+            if (Inst.Sub & VM_REL_ROW) Cell.Row = CheckGe(Row + Cell.Row, 0);
+            if (!EvaluateIntoNode(Doc, Cell.Col, Cell.Row, Top + 1)) {
+                Frame->At = At - 1;
+                Frame->Top = Top - Stack;
+                return false;
+            }
+            ++Top;
+        } break;
+
+        case OP_RANGE: {
+            struct cell_block Range = Consts[Inst.Arg].AsRange;
+            if (Inst.Sub & VM_REL_COL)      Range.FirstCol = CheckGe(Col + Range.FirstCol, 0);
+            if (Inst.Sub & VM_REL_ROW)      Range.FirstRow = CheckGe(Row + Range.FirstRow, 0);
+            if (Inst.Sub & VM_REL_LAST_COL) Range.LastCol = CheckGe(Col + Range.LastCol, 0);
+            if (Inst.Sub & VM_REL_LAST_ROW) Range.LastRow = CheckGe(Row + Range.LastRow, 0);
+            *++Top = (struct expr_node){ EN_RANGE, .AsRange = Range };
+        } break;
+
+        case OP_XENO: {
+            struct expr_node *Xeno = Consts + Inst.Arg;
+            if (!EvaluateXeno(Doc, Doc->Links + Inst.Arity, Xeno->AsXeno.Cell, Col, Row, Top + 1)) {
+                Frame->At = At - 1;
+                Frame->Top = Top - Stack;
+                return false;
+            }
+            ++Top;
+            Code = Doc->Program.Code;
+            Consts = Doc->Program.Consts;
+        } break;
+
+        case OP_NEGATE: {
+            if (Top->Type != EN_NUMBER) {
+                LogError("Cannot negate type non-numbers");
+                *Top = ErrorNode(ERROR_TYPE);
+            }
+            else {
+                Top->AsNumber *= -1;
+            }
+        } break;
+
+        case OP_SET: {
+            f64 Acc = 0;
+            enum expr_error Error = AccumulateMathOp(&Acc, EN_OP_SET, Top);
+            if (Error) {
+                *Top = ErrorNode(Error);
+                At = Inst.Arg;
+            }
+            else {
+                *Top = NumberNode(Acc);
+            }
+        } break;
+
+        case OP_ACCUM: {
+            struct expr_node *Operand = Top--;
+            Assert(Top->Type == EN_NUMBER);
+            enum expr_error Error = AccumulateMathOp(&Top->AsNumber, Inst.Sub, Operand);
+            if (Error) {
+                *Top = ErrorNode(Error);
+                At = Inst.Arg;
+            }
+        } break;
+
+        case OP_CALL: {
+            enum expr_func Func = Inst.Sub;
+            s32 Arity = Inst.Arity;
+            struct expr_node *Args = Top - Arity + 1;
+
+            struct expr_node Result;
+            bool Done = true;
+            if (!(0 <= Func && Func < EXPR_FUNC_COUNT)) {
+                LogError("func #%d has no spec", Func);
+                Result = ErrorNode(ERROR_IMPL);
+            }
+            else if (Arity == 1 && Args->Type == EN_NULL) {
+                /* NOTE: an empty argument is no argument */
+                Done = CallFunc(Doc, Func, FindForm(Func, 0), 0, Args, Col, Row, &Result);
+            }
+            else {
+                const struct expr_func_form *Form = (Inst.Arg < 0)? nullptr:
+                    ExprFuncSpec[Func].Forms + Inst.Arg;
+                Done = CallFunc(Doc, Func, Form, Arity, Args, Col, Row, &Result);
+            }
+
+            if (!Done) {
+                /* NOTE: its arguments are left for when it is called again */
+                Frame->At = At - 1;
+                Frame->Top = Top - Stack;
+                return false;
+            }
+            *(Top = Args) = Result;
+            Code = Doc->Program.Code;
+            Consts = Doc->Program.Consts;
+        } break;
+
+        default:
+            LogError("Got unhandeled op %d", Inst.Op);
+            not_implemented;
         }
-        return true;
-    default:
-        return false;
     }
 }
+#endif
 
-static enum expr_error
-AccumulateMathOp(f64 *Acc, enum expr_operator Op, struct expr_node *Node)
-[[gnu::nonnull]]
+#if USE_RUNNING_SCAN
+#if !USE_BYTECODE || !USE_NUMBER_COLUMNS
+#error "running formulas are found in the compiled code and scanned by number column"
+#endif
+/* Returns whether the cell at Col, Row has its value. Unlike IsPending(), this
+ * is safe to ask of a cell that another thread may be evaluating. */
+static inline bool
+HasValue(struct document *Doc, s32 Col, s32 Row)
 {
-    enum expr_error Error = 0;
+    return NextExprRow(Doc, Col, Row, Row) > Row;
+}
 
-    switch (Node->Type) {
-    case EN_STRING:
-        if (StrEq(Node->AsString, "")) {
-            /* treat as equivalent to 0 */
-            switch (Op) {
-            case EN_OP_SET: *Acc = 0; break;
-            case EN_OP_ADD: /* nop */ break;
-            case EN_OP_SUB: /* nop */ break;
-            case EN_OP_MUL: *Acc = 0; break;
-            case EN_OP_DIV: *Acc = NAN; break;
-            default: invalid_code_path;
+/* Evaluate the cells of Col from Row down that hold Formula, which is Running,
+ * for as long as each is pending and the cell above it and every cell that it
+ * adds have their values. Each gets exactly what Execute() would give it, so
+ * a whole running balance costs one pass down its column. */
+static void
+ScanRunningCells(struct document *Doc, s32 Col, s32 Row, struct formula *Formula)
+{
+    Assert(Formula->Running);
+    struct vm_inst *Code = Doc->Program.Code + Formula->CodeAt;
+    struct expr_node *Consts = Doc->Program.Consts;
+
+    for (; 0 < Row && Row < Doc->Rows; ++Row) {
+        /* NOTE: a row that is not loaded is not read by anything yet */
+        if (!RowLoaded(Doc, Row)) return;
+        struct cell *Cell = GetCell(Doc, Col, Row);
+        if (Cell->Formula != Formula || !HasValue(Doc, Col, Row - 1)) return;
+
+        for (s32 At = 2; Code[At].Op != OP_HALT; At += 2) {
+            struct vm_inst Inst = Code[At];
+            if (Inst.Op == OP_CELL) {
+                s32 AtCol = Consts[Inst.Arg].AsCell.Col + ((Inst.Sub & VM_REL_COL)? Col: 0);
+                if (0 <= AtCol && AtCol < Doc->Cols && !HasValue(Doc, AtCol, Row)) return;
             }
         }
-        else {
-            Error = ERROR_TYPE;
-        }
-        break;
 
-    case EN_NUMBER:
-        switch (Op) {
-        case EN_OP_SET: *Acc  = Node->AsNumber; break;
-        case EN_OP_ADD: *Acc += Node->AsNumber; break;
-        case EN_OP_SUB: *Acc -= Node->AsNumber; break;
-        case EN_OP_MUL: *Acc *= Node->AsNumber; break;
-        case EN_OP_DIV: *Acc /= Node->AsNumber; break;
-        default: invalid_code_path;
+        if (!ClaimCell(Cell)) return;
+
+        /* NOTE: none of these can wait, as every cell read has its value */
+        struct expr_node Node;
+        EvaluateIntoNode(Doc, Col, Row - 1, &Node);
+        f64 Acc = 0;
+        enum expr_error Error = AccumulateMathOp(&Acc, EN_OP_SET, &Node);
+        for (s32 At = 2; !Error && Code[At].Op != OP_HALT; At += 2) {
+            struct vm_inst Inst = Code[At];
+            if (Inst.Op == OP_PUSH) {
+                Node = Consts[Inst.Arg];
+            }
+            else {
+                s32 AtCol = Consts[Inst.Arg].AsCell.Col + ((Inst.Sub & VM_REL_COL)? Col: 0);
+                EvaluateIntoNode(Doc, AtCol, Row, &Node);
+            }
+            Error = AccumulateMathOp(&Acc, Code[At + 1].Sub, &Node);
         }
-        break;
-
-    case EN_ERROR:
-        Error = Node->AsError;
-        break;
 
-    default:
-        Error = ERROR_TYPE;
-        switch (Op) {
-        case EN_OP_SET: LogError("Cannot set with type %d", Node->Type); break;
-        case EN_OP_ADD: LogError("Cannot add with type %d", Node->Type); break;
-        case EN_OP_SUB: LogError("Cannot subtract with type %d", Node->Type); break;
-        case EN_OP_MUL: LogError("Cannot multiply with type %d", Node->Type); break;
-        case EN_OP_DIV: LogError("Cannot divide with type %d", Node->Type); break;
-        default: invalid_code_path;
-        }
-        break;
+        struct expr_node Result = Error? ErrorNode(Error): NumberNode(Acc);
+        SetCellFromNode(Cell, &Result);
+        UpdateNumberColumn(Doc, Col, Row);
+        SetState(Cell, CELL_STATE_STABLE);
     }
-
-    return Error;
 }
 
+/* Before Frame's running cell reads the one above it, evaluate the pending
+ * run of cells above it that hold the same formula, if the one above the run
+ * has its value */
 static void
-EvaluateIntoNode(struct document *Doc, s32 Col, s32 Row, struct expr_node *Node)
+ScanRunningAbove(struct eval_frame *Frame)
 {
-    if (Col < 0 || Row < 0) {
-        *Node = ErrorNode(ERROR_RELATIVE);
-    }
-    else if (!CellExists(Doc, Col, Row)) {
-        *Node = ErrorNode(ERROR_DNE);
+    struct document *Doc = Frame->Doc;
+    s32 Col = Frame->Col;
+    s32 Row = Frame->Row;
+    struct formula *Formula = GetCell(Doc, Col, Row)->Formula;
+
+    /* NOTE: a frame pushed by the one below it would only look over the same
+     * run again */
+    if (EvalStack.Used > 1) {
+        struct eval_frame *Below = Frame - 1;
+        if (Below->Doc == Doc && Below->Col == Col && Below->Row == Row + 1
+                && GetCell(Doc, Col, Row + 1)->Formula == Formula) {
+            return;
+        }
     }
-    else if (EvaluateCell(Doc, Col, Row)) {
-        *Node = ErrorNode(ERROR_SUB);
+
+    s32 Top = Row;
+    while (Top > 0 && GetCell(Doc, Col, Top - 1)->Formula == Formula
+            && IsPending(GetCell(Doc, Col, Top - 1))) {
+        --Top;
     }
-    else {
-        SetAsNodeFrom(Node, GetCell(Doc, Col, Row));
+    if (Top < Row) {
+        ScanRunningCells(Doc, Col, Top, Formula);
     }
 }
+#endif
 
-static inline s32
-ArgListLen(struct expr_node *Node)
-[[gnu::nonnull]]
+#if USE_ROW_LOCAL_SCAN
+#if !USE_BYTECODE || !USE_NUMBER_COLUMNS
+#error "row-local formulas are found in the compiled code and run over number columns"
+#endif
+/* Evaluate the cells of Col from Row down that hold Formula, which is RowLocal,
+ * 64 rows at a time (see RunRowLocal()). The ones that read anything but
+ * numbers, or cells still to be evaluated, are left to be evaluated a cell at
+ * a time, and so get their strings and errors just as before. It stops at the
+ * end of the run of Formula, or at a block where none of them could be done. */
+static void
+ScanRowLocalCells(struct document *Doc, s32 Col, s32 Row, struct formula *Formula)
 {
-    s32 Count = Node->Type? 1: 0;
-    if (Node->Type == EN_LIST) {
-        for (Node = Node->AsList.Next; Node; Node = Node->AsList.Next) {
-            Assert(Node->Type == EN_LIST_CONT);
-            ++Count;
+    Assert(Formula->RowLocal);
+    struct vm_inst *Code = Doc->Program.Code + Formula->CodeAt;
+    f64 Out[64];
+
+    /* NOTE: alongside other threads, the cells of the run are theirs to claim */
+    if (EvalStack.Shared) return;
+
+    while (Row < Doc->Rows) {
+        s32 Base = Row - Row % 64;
+        s32 End = Min(Base + 64, Doc->Rows);
+        u64 Want = 0;
+        for (s32 At = Row; At < End; ++At) {
+            if (!RowLoaded(Doc, At) || GetCell(Doc, Col, At)->Formula != Formula) {
+                End = At;
+                break;
+            }
+            Want |= (u64)1 << (At - Base);
         }
-    }
-    return Count;
-}
-
-static inline bool
-MatchArgType(enum expr_func_arg Spec, enum expr_node_type Node)
-{
-    return (!Spec && !Node)
-        || ((Spec & EFA_NUMBER) && (Node == EN_NUMBER))
-        || ((Spec & EFA_STRING) && (Node == EN_STRING))
-        || ((Spec & EFA_RANGE)  && (Node == EN_RANGE))
-        ;
-}
 
-static inline const char *
-ArgTypeStr(enum expr_func_arg Spec)
-{
-    constexpr s32 Mask = EFA_NUMBER | EFA_STRING | EFA_RANGE;
-    return ((const char *[Mask + 1]){
-        [EFA_NULL] = "NULL",
-        [EFA_NUMBER] = "a number",
-        [EFA_STRING] = "a string",
-        [EFA_NUMBER | EFA_STRING] = "a number or string",
-        [EFA_RANGE] = "a range",
-        [EFA_NUMBER | EFA_RANGE] = "a number or range",
-        [EFA_STRING | EFA_RANGE] = "a string or range",
-        [EFA_NUMBER | EFA_STRING | EFA_RANGE] = "a number, string or range",
-    })[Spec & Mask];
-}
+        s32 Done = 0;
+        for (u64 Ready = RunRowLocal(Doc, Code, Doc->Program.Consts, Col, Base, Want, Out);
+                Ready; Ready &= Ready - 1) {
+            s32 At = Base + __builtin_ctzll(Ready);
+            struct cell *Cell = GetCell(Doc, Col, At);
+            if (ClaimCell(Cell)) {
+                struct expr_node Result = NumberNode(Out[At - Base]);
+                SetCellFromNode(Cell, &Result);
+                UpdateNumberColumn(Doc, Col, At);
+                SetState(Cell, CELL_STATE_STABLE);
+                ++Done;
+            }
+        }
 
-static struct expr_node *
-ReduceNode(struct document *Doc, struct expr_node *Node, s32 Col, s32 Row, struct expr_node *Out)
-{
-    Assert(Doc);
-    if (!Node) {
-        *Out = (struct expr_node){0};
+        if (!Done || End < Base + 64) return;
+        Row = End;
     }
-    else switch (Node->Type) {
-    case EN_NULL:
-        not_implemented;
-    case EN_ERROR:
-    case EN_NUMBER:
-    case EN_FUNC_IDENT:
-    case EN_STRING:
-        /* maximally reduced */
-        *Out = *Node;
-        break;
+}
+#endif
 
-    case EN_RANGE:
-        *Out = *Node;
-        /* needs to be canonicalized */
-        *Out = (struct expr_node){ EN_RANGE, .AsRange = {
-            .FirstCol = CanonicalCol(Doc, Node->AsRange.FirstCol, Col),
-            .FirstRow = CanonicalRow(Doc, Node->AsRange.FirstRow, Row),
-            .LastCol = CanonicalCol(Doc, Node->AsRange.LastCol, Col),
-            .LastRow = CanonicalRow(Doc, Node->AsRange.LastRow, Row),
-        }};
-        break;
+/* Replace the expression of Frame's cell with its value. Returns false when it
+ * has to wait for a cell that it reads to be evaluated first, and picks up
+ * where it left off when called again. */
+static bool
+EvaluateFormula(struct eval_frame *Frame)
+{
+    struct document *Doc = Frame->Doc;
+    s32 Col = Frame->Col;
+    s32 Row = Frame->Row;
+    struct cell *Cell = GetCell(Doc, Col, Row);
+    struct formula *Formula = NotNull(Cell->Formula);
+    Assert(GetState(Cell) == CELL_STATE_EVALUATING);
+
+#if PREPRINT_PARSING
+    if (Frame->At < 0) {
+        struct expr_token Token;
+        struct expr_lexer Lexer = {
+            .Cur = Formula->Text.Str,
+            .End = Formula->Text.Str + Formula->Text.Len,
+        };
+        printf("%d,%d:\n", Col, Row);
+        printf("Raw:     %.*s\n", Formula->Text.Len, Formula->Text.Str);
+        printf("Lexed:  ");
+        while (NextExprToken(&Lexer, &Token)) {
+            printf(" ");
+            switch (Token.Type) {
+            default:
+                LogError("Encountered unsupported type %d", Token.Type);
+                not_implemented;
+
+            case ET_LEFT_PAREN:     printf("("); break;
+            case ET_RIGHT_PAREN:    printf(")"); break;
+            case ET_LIST_SEP:       printf(";"); break;
+            case ET_BEGIN_XENO_REF: printf("{%.*s:", Token.AsXeno.Len, Token.AsXeno.Str); break;
+            case ET_END_XENO_REF:   printf("}"); break;
+            case ET_PLUS:           printf("+"); break;
+            case ET_MINUS:          printf("-"); break;
+            case ET_MULT:           printf("*"); break;
+            case ET_DIV:            printf("/"); break;
+            case ET_COLON:          printf(":"); break;
+            case ET_NUMBER:         printf("%f", Token.AsNumber); break;
+            case ET_MACRO:          printf("!%.*s", Token.AsMacro.Len, Token.AsMacro.Str); break;
+
+            case ET_FUNC:
+                if (0 <= Token.AsFunc && Token.AsFunc < sArrayCount(ExprFuncCanonical)) {
+                    printf("%s", ExprFuncCanonical[Token.AsFunc]);
+                }
+                break;
 
-    case EN_MACRO: {
-        struct expr_node *Body = 0;
-        for (s32 Idx = 0; !Body && Idx < Doc->NumMacros; ++Idx) {
-            if (StrEq(Doc->Macros[Idx].Name, Node->AsString)) {
-                Body = Doc->Macros[Idx].Body;
+            case ET_CELL_REF:
+                printf("[%d,%d]", Token.AsCell.Col, Token.AsCell.Row);
+                break;
+
+            case ET_UNKNOWN: printf("?"); break;
             }
         }
+        printf("\n");
+    }
+#endif
 
-        if (!Body) {
-            *Out = ErrorNode(ERROR_IMPL);
-        }
-        else {
-            ReduceNode(Doc, Body, Col, Row, Out);
+    u32 Node = Formula->Root;
+    if (!Node) {
+        LogWarn("Failed to parse cell %d,%d", Col, Row);
+        SetAsError(Cell, ERROR_PARSE);
+    }
+    else {
+#if PREPRINT_PARSING
+        if (Frame->At < 0) {
+            printf("Parsed:\n");
+            PrintNode(Doc->Nodes, Doc->Nodes + Node, 2);
         }
-    } break;
+#endif
+        struct expr_node Result;
+#if USE_BYTECODE
+        if (!Execute(Frame, &Result)) return false;
+#else
+        if (!ReduceFormula(Frame, &Result)) return false;
+#endif
+#if PREPRINT_PARSING
+        printf("Reduced:\n");
+        PrintNode(nullptr, &Result, 2);
+        printf("\n");
+#endif
+        SetCellFromNode(Cell, &Result);
+    }
 
-    case EN_CELL: {
-        s32 SubCol = CanonicalCol(Doc, Node->AsCell.Col, Col);
-        s32 SubRow = CanonicalRow(Doc, Node->AsCell.Row, Row);
-        EvaluateIntoNode(Doc, SubCol, SubRow, Out);
-    } break;
+#if USE_NUMBER_COLUMNS
+    UpdateNumberColumn(Doc, Col, Row);
+#endif
+    SetState(Cell, CELL_STATE_STABLE);
+#if USE_RUNNING_SCAN
+    if (Formula->Running) {
+        ScanRunningCells(Doc, Col, Row + 1, Formula);
+    }
+#endif
+#if USE_ROW_LOCAL_SCAN
+    if (Formula->RowLocal) {
+        ScanRowLocalCells(Doc, Col, Row + 1, Formula);
+    }
+#endif
+    return true;
+}
 
-    case EN_ROOT: {
-        ReduceNode(Doc, Node->AsUnary.Child, Col, Row, Out);
-    } break;
+/* Returns the next cell that Frame's cell reads that is still to be evaluated,
+ * if there is one: first whatever its formula is waiting on, then, before it
+ * starts, whatever the dependency graph says it reads. */
+static struct cell *
+NextDependency(struct eval_frame *Frame, struct document **OutDoc, s32 *OutCol, s32 *OutRow)
+{
+    struct eval_walk *Walk = &Frame->Walk;
+    struct cell_block *Block = &Walk->Block;
+
+    for (;;) {
+        while (Walk->Masked? Walk->AtRow <= Block->LastRow: Walk->AtCol <= Block->LastCol) {
+            s32 Col = Walk->AtCol;
+            s32 Row = Walk->AtRow;
+
+#if USE_NUMBER_COLUMNS
+            /* NOTE: only cells with expressions can be pending, so the rest of
+             * a column of a block is skipped at once */
+            if (!Walk->Masked && Col < Walk->Doc->Cols) {
+                s32 LastRow = Min(Block->LastRow, Walk->Doc->Rows - 1);
+                Row = NextExprRow(Walk->Doc, Col, Row, LastRow);
+                if (Row > LastRow) {
+                    Walk->AtRow = Block->FirstRow;
+                    ++Walk->AtCol;
+                    continue;
+                }
+                Walk->AtRow = Row;
+            }
+#endif
+            struct cell *Cell = GetCell(Walk->Doc, Col, Row);
 
-    case EN_TERM: {
-        ReduceNode(Doc, Node->AsUnary.Child, Col, Row, Out);
-        Assert(IsFinal(Out));
-        if (Node->AsUnary.Op == EN_OP_NEGATIVE) {
-            if (Out->Type != EN_NUMBER) {
-                LogError("Cannot negate type non-numbers");
-                *Out = ErrorNode(ERROR_TYPE);
+            if (!Walk->Masked) {
+                if (++Walk->AtRow > Block->LastRow) {
+                    Walk->AtRow = Block->FirstRow;
+                    ++Walk->AtCol;
+                }
+            }
+            else if (IsPending(Cell)) {
+                /* NOTE: whether the rest of its row is read is only known once
+                 * it is evaluated, so this is where the walk resumes */
+            }
+            else if (Col == Block->FirstCol && Col != Block->LastCol && CellsEq(&Walk->Proto, Cell)) {
+                Walk->AtCol = Block->LastCol;
             }
             else {
-                Out->AsNumber *= -1;
+                Walk->AtCol = Block->FirstCol;
+                ++Walk->AtRow;
             }
-        }
-    } break;
-
-    case EN_SUM:
-    case EN_PROD: {
-        if (!Node->AsList.Next) {
-            ReduceNode(Doc, Node->AsList.This, Col, Row, Out);
-        }
-        else {
-            f64 Acc = 0;
 
-            ReduceNode(Doc, Node->AsList.This, Col, Row, Out);
-            enum expr_error Error = AccumulateMathOp(&Acc, EN_OP_SET, Out);
-
-            struct expr_node *Cur;
-            for (Cur = Node->AsList.Next; Cur && !Error; Cur = Cur->AsList.Next) {
-                Assert(Cur->Type == EN_SUM_CONT || Cur->Type == EN_PROD_CONT);
-                ReduceNode(Doc, Cur->AsList.This, Col, Row, Out);
-                Error = AccumulateMathOp(&Acc, Cur->AsList.Op, Out);
+            if (IsPending(Cell)) {
+                *OutDoc = Walk->Doc;
+                *OutCol = Col;
+                *OutRow = Row;
+                return Cell;
             }
-
-            *Out = Error? ErrorNode(Error): NumberNode(Acc);
         }
-    } break;
-
-    case EN_SUM_CONT: invalid_code_path;
-    case EN_PROD_CONT: invalid_code_path;
 
-    case EN_LIST: {
-        Assert(Node->AsList.This);
-        if (!Node->AsList.Next) {
-            ReduceNode(Doc, Node->AsList.This, Col, Row, Out);
+#if USE_DEPENDENCY_GRAPH
+        struct formula *Formula = GetCell(Frame->Doc, Frame->Col, Frame->Row)->Formula;
+        if (Frame->At >= 0 || ++Frame->Dep >= Formula->NumDeps) {
+            return nullptr;
+        }
+        else if (PlaceDep(Frame->Doc, Frame->Doc->Deps + Formula->DepsAt + Frame->Dep,
+                    Frame->Col, Frame->Row, Block)) {
+            Walk->Doc = Frame->Doc;
+            Walk->AtCol = Block->FirstCol;
+            Walk->AtRow = Block->FirstRow;
         }
         else {
-            struct expr_node *CurIn = Node, *CurOut = Out;
-            constexpr umm NodeSz = sizeof *CurIn->AsList.This;
+            Walk->AtCol = Block->LastCol + 1;
+        }
+#else
+        return nullptr;
+#endif
+    }
+}
 
-            Assert(CurIn->AsList.Op == EN_OP_NULL);
-            *CurOut = (struct expr_node){ EN_LIST, .AsList = {
-                ReduceNode(Doc, CurIn->AsList.This, Col, Row, ReserveData(NodeSz)),
-            }};
+/* Evaluate the cells of the frames above Base, and whatever they read. This is
+ * a depth first walk of the cells that each one reads, so every cell is
+ * evaluated after what it reads, in the order that it reads them. */
+static void
+RunFrames(s32 Base)
+{
+    while (EvalStack.Used > Base) {
+        struct eval_frame *Frame = EvalStack.Frames + EvalStack.Used - 1;
+        struct document *DepDoc;
+        s32 DepCol, DepRow;
+#if USE_RUNNING_SCAN
+        if (Frame->Dep < 0 && Frame->At < 0 && GetCell(Frame->Doc, Frame->Col, Frame->Row)->Formula->Running) {
+            ScanRunningAbove(Frame);
+        }
+#endif
+        struct cell *Dep = NextDependency(Frame, &DepDoc, &DepCol, &DepRow);
+        if (Dep) {
+            PushEvalFrame(DepDoc, Dep, DepCol, DepRow);
+        }
+        else if (EvaluateFormula(Frame)) {
+            PopFrame();
+        }
+    }
+}
 
-            for (CurIn = CurIn->AsList.Next; CurIn; CurIn = CurIn->AsList.Next) {
-                Assert(CurIn->Type == EN_LIST_CONT);
-                Assert(CurIn->AsList.This);
-                Assert(CurIn->AsList.Op == EN_OP_NULL);
+static enum expr_error
+EvaluateCell(struct document *Doc, s32 Col, s32 Row)
+{
+    Assert(Doc);
+    Assert(CellExists(Doc, Col, Row));
 
-                struct expr_node *NewLink = ReserveData(sizeof *NewLink);
-                *NewLink = (struct expr_node){ EN_LIST_CONT, .AsList = {
-                    ReduceNode(Doc, CurIn->AsList.This, Col, Row, ReserveData(NodeSz)),
-                }};
-                CurOut = (CurOut->AsList.Next = NewLink);
-            }
-        }
-    } break;
+    struct cell *Cell = GetCell(Doc, Col, Row);
+    enum expr_error Error = 0;
 
-    case EN_LIST_CONT: invalid_code_path;
+    if (Cell->Type != CELL_EXPR) { /* nop */ }
+    else if (GetState(Cell) == CELL_STATE_EVALUATING) {
+        Error = ERROR_CYCLE;
+    }
+    else {
+        s32 Base = EvalStack.Used;
+        PushEvalFrame(Doc, Cell, Col, Row);
+        RunFrames(Base);
+    }
 
-    case EN_FUNC: {
-        enum expr_func Func = Node->AsFunc.Func;
+    return Error;
+}
 
-        struct expr_node Arg;
-        ReduceNode(Doc, Node->AsFunc.Args, Col, Row, &Arg);
+/* NOTE: how many threads evaluate a document; see --jobs */
+static s32 NumJobs = 1;
 
-        if (!(0 <= Func && Func < EXPR_FUNC_COUNT)) {
-            LogError("func #%d has no spec", Func);
-            *Out = ErrorNode(ERROR_IMPL);
+#if USE_PARALLEL_EVALUATION
+#if !USE_DEPENDENCY_GRAPH
+#error "parallel evaluation is scheduled from the dependency graph"
+#endif
+#define LEVEL_SERIAL  (-1) /* left for the serial pass */
+#define LEVEL_PENDING (-2) /* its dependencies are still being found */
+
+/* Find the level of every formula cell of Doc that is free to be evaluated in
+ * parallel: one more than the highest level of the cells that it reads, so
+ * that every cell of a level can be evaluated at once. Returns the number of
+ * levels.
+ *
+ * The value of such a cell cannot depend on the order in which it and what it
+ * reads are evaluated. That leaves out cells that are part of a cycle, that
+ * are Dynamic, or that read any of those; the serial pass evaluates them just
+ * as it would have otherwise. */
+static s32
+FindLevels(struct document *Doc, s32 *Levels)
+{
+    s32 Rows = Doc->Rows;
+    s32 NumCells = Doc->Cols * Rows;
+    s32 NumLevels = 0;
+    Assert(!EvalStack.Used);
+
+    for (s32 Root = 0; Root < NumCells; ++Root) {
+        if (Levels[Root] || GetCell(Doc, Root / Rows, Root % Rows)->Type != CELL_EXPR) {
+            continue;
         }
-        else {
-            const struct expr_func_spec *Spec = &ExprFuncSpec[Func];
-            Assert(Spec->Func == Func);
-
-            s32 Arity = ArgListLen(&Arg);
 
-            const struct expr_func_form *Form = nullptr;
-            for (umm Idx = 0; Idx < Spec->NumForms; ++Idx) {
-                const struct expr_func_form *Candidate = Spec->Forms + Idx;
-
-                switch (Spec->FormType) {
-                case ARITY_INVALID: invalid_code_path; break;
-                case ARITY_SIMPLE:
-                    if (Arity == Candidate->Arity) {
-                        Form = Candidate;
-                    }
-                    break;
-                case ARITY_VARIADIC:
-                    if (Arity >= Candidate->Arity) {
-                        Form = Candidate;
-                    }
-                    break;
+        Levels[Root] = LEVEL_PENDING;
+        PushFrame(Doc, Root / Rows, Root % Rows);
+        while (EvalStack.Used) {
+            struct eval_frame *Frame = EvalStack.Frames + EvalStack.Used - 1;
+            s32 This = Frame->Col*Rows + Frame->Row;
+            struct document *DepDoc;
+            s32 DepCol, DepRow;
+
+            /* NOTE: nothing is evaluating, so this is every formula it reads */
+            if (NextDependency(Frame, &DepDoc, &DepCol, &DepRow)) {
+                s32 That = DepCol*Rows + DepRow;
+                s32 Level = Levels[That];
+                if (!Level) {
+                    Levels[That] = LEVEL_PENDING;
+                    PushFrame(Doc, DepCol, DepRow);
+                }
+                else if (Level == LEVEL_PENDING) {
+                    /* NOTE: a range over the cell itself only ever skips it */
+                    if (That != This) Frame->Level = LEVEL_SERIAL;
+                }
+                else if (Level == LEVEL_SERIAL || Frame->Level == LEVEL_SERIAL) {
+                    Frame->Level = LEVEL_SERIAL;
+                }
+                else {
+                    Frame->Level = Max(Frame->Level, Level);
                 }
-            }
-
-            if (!Form) {
-                LogError("%s/%s cannot take %d arguments",
-                        Spec->Name, Spec->ArityStr, Arity);
-                *Out = ErrorNode(ERROR_ARGC);
             }
             else {
-                bool ValidTypes = true; /* optimistic */
-
-                if (!Arg.Type) {
-                    /* no arguments to check */
-                    Assert(Arity == 0);
-                    Assert(Form->Arity == 0);
+                s32 Level = Frame->Level;
+                if (Level == LEVEL_SERIAL || GetCell(Doc, Frame->Col, Frame->Row)->Formula->Dynamic) {
+                    Level = LEVEL_SERIAL;
                 }
                 else {
-                    s32 Idx = 1;
-                    for (struct expr_node *List = &Arg; List; ++Idx, List = NextOf(List)) {
-                        struct expr_node *This = NodeOf(List);
-
-                        auto ExpectedType = Form->Arg[Min(Idx, Form->Arity) - 1];
-                        if (!MatchArgType(ExpectedType, This->Type)) {
-                            ValidTypes = false;
-                            LogError("%s/%d arg %d expects %s",
-                                    Spec->Name, Arity, Idx,
-                                    ArgTypeStr(ExpectedType));
-                        }
-                    }
-                }
-
-                if (!ValidTypes) {
-                    *Out = ErrorNode(ERROR_TYPE);
+                    NumLevels = Max(NumLevels, ++Level);
                 }
-                else switch (Func) {
-                case EF_ABS: {
-                    Assert(Arity == 1);
-                    Assert(Arg.Type == EN_NUMBER);
-                    *Out = NumberNode(fabs(Arg.AsNumber));
-                } break;
-
-                case EF_AVERAGE: {
-                    Assert(Arity == 1);
-                    Assert(Arg.Type == EN_RANGE);
-
-                    s32 FirstCol = Clamp(0, Arg.AsRange.FirstCol, Doc->Cols);
-                    s32 FirstRow = Clamp(0, Arg.AsRange.FirstRow, Doc->Rows);
-                    s32 LastCol = Clamp(0, Arg.AsRange.LastCol, Doc->Cols);
-                    s32 LastRow = Clamp(0, Arg.AsRange.LastRow, Doc->Rows);
-
-                    f64 Sum = 0;
-                    f64 Count = 0;
-                    for (s32 C = FirstCol; C <= LastCol; ++C) {
-                        for (s32 R = FirstRow; R <= LastRow; ++R) {
-                            EvaluateCell(Doc, C, R);
-                            struct cell *Cell = GetCell(Doc, C, R);
-                            if (Cell->Type == CELL_NUMBER) {
-                                Sum += Cell->AsNumber;
-                                Count += 1;
-                            }
-                        }
-                    }
-
-                    *Out = NumberNode(Count? Sum / Count: 0);
-                } break;
+                Levels[This] = Level;
 
-                case EF_BODY_COL: {
-                    if (Arity == 0) {
-                        *Out = (struct expr_node){ EN_RANGE, .AsRange = {
-                            Col, Doc->FirstBodyRow,
-                            Col, Doc->FirstFootRow - 1,
-                        }};
-                    }
-                    else if (Arity == 1) {
-                        Assert(Arg.Type == EN_RANGE);
-                        *Out = (struct expr_node){ EN_RANGE, .AsRange = {
-                            (s32)Arg.AsNumber, Doc->FirstBodyRow,
-                            (s32)Arg.AsNumber, Doc->FirstFootRow - 1,
-                        }};
-                    }
-                    else {
-                        invalid_code_path;
-                    }
-                } break;
-
-                case EF_CEIL: {
-                    Assert(Arity == 1);
-                    Assert(Arg.Type == EN_NUMBER);
-                    *Out = NumberNode(ceil(Arg.AsNumber));
-                } break;
-
-                case EF_CELL: {
-                    struct expr_node *List = &Arg;
-                    if (Arity == 2) {
-                        struct expr_node *Arg0 = NodeOf(List); List = NextOf(List);
-                        struct expr_node *Arg1 = NodeOf(List); List = NextOf(List);
-                        Assert(!List);
-
-                        Assert(Arg0->Type == EN_NUMBER);
-                        Assert(Arg1->Type == EN_NUMBER);
-                        *Out = CellNode2(Arg0->AsNumber, Arg1->AsNumber);
-                    }
-                    else if (Arity == 3) {
-                        struct expr_node *Arg0 = NodeOf(List); List = NextOf(List);
-                        struct expr_node *Arg1 = NodeOf(List); List = NextOf(List);
-                        struct expr_node *Arg2 = NodeOf(List); List = NextOf(List);
-                        Assert(!List);
-
-                        Assert(Arg0->Type == EN_STRING);
-                        Assert(Arg1->Type == EN_NUMBER);
-                        Assert(Arg1->Type == EN_NUMBER);
-                        struct expr_node XenoNode = XenoNode2(Arg0->AsString, Arg1->AsNumber, Arg2->AsNumber);
-                        ReduceNode(Doc, &XenoNode, Col, Row, Out);
+                if (--EvalStack.Used) {
+                    struct eval_frame *Parent = Frame - 1;
+                    if (Level == LEVEL_SERIAL || Parent->Level == LEVEL_SERIAL) {
+                        Parent->Level = LEVEL_SERIAL;
                     }
                     else {
-                        invalid_code_path;
-                    }
-                } break;
-
-                case EF_COL: {
-                    Assert(Arity == 1);
-                    *Out = NumberNode(Col);
-                } break;
-
-                case EF_COUNT: {
-                    Assert(Arity == 1);
-                    Assert(Arg.Type == EN_RANGE);
-
-                    s32 FirstCol = Clamp(0, Arg.AsRange.FirstCol, Doc->Cols);
-                    s32 FirstRow = Clamp(0, Arg.AsRange.FirstRow, Doc->Rows);
-                    s32 LastCol = Clamp(0, Arg.AsRange.LastCol, Doc->Cols);
-                    s32 LastRow = Clamp(0, Arg.AsRange.LastRow, Doc->Rows);
-
-                    f64 Acc = 0;
-                    for (s32 C = FirstCol; C <= LastCol; ++C) {
-                        for (s32 R = FirstRow; R <= LastRow; ++R) {
-                            EvaluateCell(Doc, C, R);
-                            Acc += (GetCell(Doc, C, R)->Type == CELL_NUMBER);
-                        }
-                    }
-
-                    *Out = NumberNode(Acc);
-                } break;
-
-                case EF_FLOOR: {
-                    Assert(Arity == 1);
-                    Assert(Arg.Type == EN_NUMBER);
-                    *Out = NumberNode(floor(Arg.AsNumber));
-                } break;
-
-                case EF_MASK_SUM: {
-                    Assert(Arity == 3);
-                    struct expr_node *List = &Arg;
-                    struct expr_node *Arg0 = NodeOf(List); List = NextOf(List);
-                    struct expr_node *Arg1 = NodeOf(List); List = NextOf(List);
-                    struct expr_node *Arg2 = NodeOf(List); List = NextOf(List);
-                    Assert(!List);
-
-                    Assert(Arg0->Type == EN_NUMBER);
-                    Assert(Arg1->Type == EN_NUMBER || Arg1->Type == EN_STRING);
-                    Assert(Arg2->Type == EN_NUMBER);
-
-                    struct cell Proto;
-                    s32 TestC = Arg0->AsNumber;
-                    SetCellFromNode(&Proto, Arg1);
-                    s32 TrgtC = Arg2->AsNumber;
-
-                    s32 First = Doc->FirstBodyRow;
-                    s32 OnePastLast = Min(Doc->FirstFootRow, Doc->Rows);
-
-                    Assert(First >= 0);
-                    Assert(OnePastLast <= Doc->Rows);
-
-                    f64 Acc = 0;
-                    for (s32 R = First; R < OnePastLast; ++R) {
-                        EvaluateCell(Doc, TestC, R);
-                        if (CellsEq(&Proto, GetCell(Doc, TestC, R))) {
-                            EvaluateCell(Doc, TrgtC, R);
-                            struct cell *Trgt = GetCell(Doc, TrgtC, R);
-                            if (Trgt->Type == CELL_NUMBER) {
-                                Acc += Trgt->AsNumber;
-                            }
-                        }
-                    }
-
-                    *Out = NumberNode(Acc);
-                } break;
-
-                case EF_MAX: {
-                    bool Any = false;
-                    f64 Number = -INFINITY;
-                    for (struct expr_node *List = &Arg; List; List = NextOf(List)) {
-                        struct expr_node *This = NodeOf(List);
-
-                        if (This->Type == EN_NUMBER) {
-                            Number = Max(Number, This->AsNumber);
-                            Any = true;
-                        }
-                        else if (This->Type == EN_RANGE) {
-                            auto Range = &This->AsRange;
-                            s32 FirstCol = Clamp(0, Range->FirstCol, Doc->Cols);
-                            s32 FirstRow = Clamp(0, Range->FirstRow, Doc->Rows);
-                            s32 LastCol = Clamp(0, Range->LastCol, Doc->Cols);
-                            s32 LastRow = Clamp(0, Range->LastRow, Doc->Rows);
-
-                            for (s32 C = FirstCol; C <= LastCol; ++C) {
-                                for (s32 R = FirstRow; R <= LastRow; ++R) {
-                                    EvaluateCell(Doc, C, R);
-                                    struct cell *Cell = GetCell(Doc, C, R);
-                                    if (Cell->Type == CELL_NUMBER) {
-                                        Number = Max(Number, Cell->AsNumber);
-                                        Any = true;
-                                    }
-                                }
-                            }
-                        }
-                        else {
-                            invalid_code_path;
-                        }
+                        Parent->Level = Max(Parent->Level, Level);
                     }
-                    *Out = NumberNode(Any? Number: 0);
-                } break;
-
-                case EF_MIN: {
-                    bool Any = false;
-                    f64 Number = INFINITY;
-                    for (struct expr_node *List = &Arg; List; List = NextOf(List)) {
-                        struct expr_node *This = NodeOf(List);
+                }
+            }
+        }
+    }
 
-                        if (This->Type == EN_NUMBER) {
-                            Number = Min(Number, This->AsNumber);
-                            Any = true;
-                        }
-                        else if (This->Type == EN_RANGE) {
-                            auto Range = &This->AsRange;
-                            s32 FirstCol = Clamp(0, Range->FirstCol, Doc->Cols);
-                            s32 FirstRow = Clamp(0, Range->FirstRow, Doc->Rows);
-                            s32 LastCol = Clamp(0, Range->LastCol, Doc->Cols);
-                            s32 LastRow = Clamp(0, Range->LastRow, Doc->Rows);
-
-                            for (s32 C = FirstCol; C <= LastCol; ++C) {
-                                for (s32 R = FirstRow; R <= LastRow; ++R) {
-                                    EvaluateCell(Doc, C, R);
-                                    struct cell *Cell = GetCell(Doc, C, R);
-                                    if (Cell->Type == CELL_NUMBER) {
-                                        Number = Min(Number, Cell->AsNumber);
-                                        Any = true;
-                                    }
-                                }
-                            }
-                        }
-                        else {
-                            invalid_code_path;
-                        }
-                    }
-                    *Out = NumberNode(Any? Number: 0);
-                } break;
-
-                case EF_NUMBER: {
-                    f64 Number = 0;
-                    for (struct expr_node *List = &Arg; List; List = NextOf(List)) {
-                        struct expr_node *This = NodeOf(List);
-
-                        if (This->Type == EN_NUMBER) {
-                            if (isnan(This->AsNumber)) { /* ignored */ }
-                            else if (isinf(This->AsNumber)) { /* ignored */ }
-                            else {
-                                Number = This->AsNumber;
-                                break; /* early out of this loop */
-                            }
-                        }
-                    }
-                    *Out = NumberNode(Number);
-                } break;
-
-                case EF_PCENT: {
-                    Assert(Arity == 1);
-                    Assert(Arg.Type == EN_NUMBER);
-                    char Buf[32];
-                    snprintf(Buf, sizeof Buf, "%0.2f%%", 100*Arg.AsNumber);
-                    /* TODO(levirak): is this leaking? */
-                    *Out = StringNode(SaveStr(Buf));
-                } break;
-
-                case EF_POW: {
-                    Assert(Arity == 2);
-
-                    struct expr_node *List = &Arg;
-                    struct expr_node *Arg0 = NodeOf(List); List = NextOf(List);
-                    struct expr_node *Arg1 = NodeOf(List); List = NextOf(List);
-                    Assert(!List);
-
-                    Assert(Arg0->Type == EN_NUMBER);
-                    Assert(Arg1->Type == EN_NUMBER);
-                    *Out = NumberNode(pow(Arg0->AsNumber, Arg1->AsNumber));
-                } break;
-
-                case EF_ROUND: {
-                    f64 Number = 0;
-                    f64 Prcsn = 0;
-
-                    if (Arity == 1) {
-                        Assert(Arg.Type == EN_NUMBER);
-
-                        struct fmt_header Fmt = GetCell(Doc, Col, 0)->Fmt;
-                        MergeHeader(&Fmt, &GetCell(Doc, Col, Row)->Fmt);
-                        MergeHeader(&Fmt, &DefaultHeader);
-                        Number = Arg.AsNumber;
-                        Prcsn = Fmt.Prcsn;
-                    }
-                    else if (Arity == 2) {
-                        struct expr_node *List = &Arg;
-                        struct expr_node *Arg0 = NodeOf(List); List = NextOf(List);
-                        struct expr_node *Arg1 = NodeOf(List); List = NextOf(List);
-                        Assert(!List);
-
-                        Assert(Arg0->Type == EN_NUMBER);
-                        Assert(Arg1->Type == EN_NUMBER);
-                        Number = Arg0->AsNumber;
-                        Prcsn = Arg1->AsNumber;
-                    }
-                    else {
-                        invalid_code_path;
-                    }
+    return NumLevels;
+}
 
-                    f64 Mul10 = pow(10, Prcsn);
-                    *Out = NumberNode(round(Mul10 * Number) / Mul10);
-                } break;
-
-                case EF_ROW: {
-                    Assert(Arity == 0);
-                    *Out = NumberNode(Row);
-                } break;
-
-                case EF_SIGN: {
-                    Assert(Arity == 1);
-                    Assert(Arg.Type == EN_NUMBER);
-                    f64 Number = Arg.AsNumber;
-                    *Out = NumberNode((Number > 0)? 1: (Number < 0)? -1: 0);
-                } break;
-
-                case EF_SUM: {
-                    f64 Acc = 0;
-                    for (struct expr_node *List = &Arg; List; List = NextOf(List)) {
-                        struct expr_node *This = NodeOf(List);
-
-                        if (This->Type == EN_NUMBER) {
-                            Acc += This->AsNumber;
-                        }
-                        else if (This->Type == EN_RANGE) {
-                            auto Range = &This->AsRange;
-                            s32 FirstCol = Clamp(0, Range->FirstCol, Doc->Cols);
-                            s32 FirstRow = Clamp(0, Range->FirstRow, Doc->Rows);
-                            s32 LastCol = Clamp(0, Range->LastCol, Doc->Cols);
-                            s32 LastRow = Clamp(0, Range->LastRow, Doc->Rows);
-
-                            for (s32 C = FirstCol; C <= LastCol; ++C) {
-                                for (s32 R = FirstRow; R <= LastRow; ++R) {
-                                    EvaluateCell(Doc, C, R);
-                                    struct cell *Cell = GetCell(Doc, C, R);
-                                    if (Cell->Type == CELL_NUMBER) {
-                                        Acc += Cell->AsNumber;
-                                    }
-                                }
-                            }
-                        }
-                        else {
-                            invalid_code_path;
-                        }
-                    }
-                    *Out = NumberNode(Acc);
-                } break;
+/* NOTE: the threads that evaluate a level of cells. Each one takes from the
+ * back of its own share of the level, and steals from the front of the rest
+ * when it runs out. */
+static struct eval_pool {
+    struct document *Doc;
+    s32 *Order; /* the cells, by level */
+    s32 NumThreads;
+
+    pthread_mutex_t Lock;
+    pthread_cond_t Wake, Idle;
+    u32 Generation; /* of the level being evaluated */
+    s32 Busy; /* the threads besides this one still on it */
+    bool Quit;
+
+    struct job_share {
+        _Alignas(64) u64 Range; /* First in the low half, End in the high */
+    } Shares[MAX_JOBS];
+} Pool = {
+    .Lock = PTHREAD_MUTEX_INITIALIZER,
+    .Wake = PTHREAD_COND_INITIALIZER,
+    .Idle = PTHREAD_COND_INITIALIZER,
+};
 
-                case EF_TRUNC: {
-                    f64 Number = 0;
-                    f64 Prcsn = 0;
+/* Returns the index into Pool.Order of the job taken, or -1 */
+static s32
+TakeJob(struct job_share *Share, bool Steal)
+{
+    u64 Range = __atomic_load_n(&Share->Range, __ATOMIC_RELAXED);
+    for (;;) {
+        u32 First = (u32)Range;
+        u32 End = Range >> 32;
+        if (First >= End) {
+            return -1;
+        }
 
-                    if (Arity == 1) {
-                        Assert(Arg.Type == EN_NUMBER);
+        u64 Left = Steal? ((u64)End << 32 | (First + 1)): ((u64)(End - 1) << 32 | First);
+        if (__atomic_compare_exchange_n(&Share->Range, &Range, Left, true,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return Steal? First: End - 1;
+        }
+    }
+}
 
-                        struct fmt_header Fmt = GetCell(Doc, Col, 0)->Fmt;
-                        MergeHeader(&Fmt, &GetCell(Doc, Col, Row)->Fmt);
-                        MergeHeader(&Fmt, &DefaultHeader);
-                        Number = Arg.AsNumber;
-                        Prcsn = Fmt.Prcsn;
-                    }
-                    else if (Arity == 2) {
-                        struct expr_node *List = &Arg;
-                        struct expr_node *Arg0 = NodeOf(List); List = NextOf(List);
-                        struct expr_node *Arg1 = NodeOf(List); List = NextOf(List);
-                        Assert(!List);
-
-                        Assert(Arg0->Type == EN_NUMBER);
-                        Assert(Arg1->Type == EN_NUMBER);
-                        Number = Arg0->AsNumber;
-                        Prcsn = Arg1->AsNumber;
-                    }
-                    else {
-                        invalid_code_path;
-                    }
+static void
+RunJobs(s32 Self)
+{
+    struct document *Doc = Pool.Doc;
+    s32 Rows = Doc->Rows;
+
+    EvalStack.Shared = true;
+    for (;;) {
+        s32 At = TakeJob(Pool.Shares + Self, false);
+        for (s32 Other = 1; At < 0 && Other < Pool.NumThreads; ++Other) {
+            At = TakeJob(Pool.Shares + (Self + Other) % Pool.NumThreads, true);
+        }
+        if (At < 0) {
+            /* NOTE: whatever is left is already being evaluated */
+            break;
+        }
 
-                    f64 Mul10 = pow(10, Prcsn);
-                    *Out = NumberNode(trunc(Mul10 * Number) / Mul10);
-                } break;
+        s32 Idx = Pool.Order[At];
+        if (ClaimCell(GetCell(Doc, Idx / Rows, Idx % Rows))) {
+            /* NOTE: whatever it reads was evaluated by an earlier level */
+            PushFrame(Doc, Idx / Rows, Idx % Rows);
+            RunFrames(0);
+        }
+    }
+    EvalStack.Shared = false;
+}
 
-                default:
-                    *Out = ErrorNode(ERROR_IMPL);
-                    break;
-                }
-            }
+static void *
+EvalWorker(void *Arg)
+{
+    s32 Self = (s32)(sptr)Arg;
+    u32 Seen = 0;
+
+    BeginThreadPages();
+    for (;;) {
+        pthread_mutex_lock(&Pool.Lock);
+        while (!Pool.Quit && Pool.Generation == Seen) {
+            pthread_cond_wait(&Pool.Wake, &Pool.Lock);
         }
-    } break;
+        Seen = Pool.Generation;
+        bool Quit = Pool.Quit;
+        pthread_mutex_unlock(&Pool.Lock);
+        if (Quit) break;
 
-    case EN_XENO: {
-        struct cell_ref Cell = Node->AsXeno.Cell;
-        char *Reference = Node->AsXeno.Reference;
+        RunJobs(Self);
 
-        struct document *SubDoc = MakeDocument(Doc->Dir, Reference);
-        if (!SubDoc) {
-            *Out = ErrorNode(ERROR_FILE);
-        }
-        else {
-            s32 SubCol = CanonicalCol(SubDoc, Cell.Col, Col);
-            s32 SubRow = CanonicalRow(SubDoc, Cell.Row, Row);
-            EvaluateIntoNode(SubDoc, SubCol, SubRow, Out);
+        pthread_mutex_lock(&Pool.Lock);
+        if (--Pool.Busy == 0) {
+            pthread_cond_signal(&Pool.Idle);
         }
-    } break;
-
-    default:
-        LogError("Got unhandeled case %d", Node->Type);
-        not_implemented;
+        pthread_mutex_unlock(&Pool.Lock);
     }
 
-    Assert(Out);
-    if (!IsFinal(Out)) {
-        LogWarn("Node was not final (type %d)", Out->Type);
-        not_implemented;
-    }
-    return Out;
+    FreeTemp(EvalStack.Frames);
+    FreeTemp(EvalStack.Values);
+    EndThreadPages();
+    return nullptr;
 }
 
-static enum expr_error
-EvaluateCell(struct document *Doc, s32 Col, s32 Row)
+/* Evaluate the cells Order[First] to Order[End-1], which do not read each
+ * other, on every thread of the pool. */
+static void
+RunLevel(s32 First, s32 End)
 {
-    Assert(Doc);
-    Assert(CellExists(Doc, Col, Row));
+    s32 NumThreads = Pool.NumThreads;
+    s64 Count = End - First;
+    for (s32 Idx = 0; Idx < NumThreads; ++Idx) {
+        u64 ShareFirst = First + Count*Idx/NumThreads;
+        u64 ShareEnd = First + Count*(Idx + 1)/NumThreads;
+        __atomic_store_n(&Pool.Shares[Idx].Range, ShareEnd << 32 | ShareFirst, __ATOMIC_RELAXED);
+    }
 
-    struct cell *Cell = GetCell(Doc, Col, Row);
-    enum expr_error Error = 0;
+    pthread_mutex_lock(&Pool.Lock);
+    Pool.Busy = NumThreads - 1;
+    ++Pool.Generation;
+    pthread_cond_broadcast(&Pool.Wake);
+    pthread_mutex_unlock(&Pool.Lock);
 
-    if (Cell->Type == CELL_EXPR) {
-        char Buf[128];
-        struct expr_lexer Lexer = {
-            .Cur = Cell->AsExpr,
-            .Buf = Buf, .Sz = sizeof Buf,
-        };
+    RunJobs(0);
 
-        if (Cell->State == CELL_STATE_EVALUATING) {
-            Error = ERROR_CYCLE;
-        }
-        else {
-            Cell->State = CELL_STATE_EVALUATING;
+    pthread_mutex_lock(&Pool.Lock);
+    while (Pool.Busy) {
+        pthread_cond_wait(&Pool.Idle, &Pool.Lock);
+    }
+    pthread_mutex_unlock(&Pool.Lock);
+}
 
-#if PREPRINT_PARSING
-            struct expr_token Token;
-            printf("%d,%d:\n", Col, Row);
-            printf("Raw:     %s\n", Cell->AsExpr);
-            printf("Lexed:  ");
-            while (NextExprToken(&Lexer, &Token)) {
-                printf(" ");
-                switch (Token.Type) {
-                default:
-                    LogError("Encountered unsupported type %d", Token.Type);
-                    not_implemented;
-
-                case ET_LEFT_PAREN:     printf("("); break;
-                case ET_RIGHT_PAREN:    printf(")"); break;
-                case ET_LIST_SEP:       printf(";"); break;
-                case ET_BEGIN_XENO_REF: printf("{%s:", Token.AsXeno); break;
-                case ET_END_XENO_REF:   printf("}"); break;
-                case ET_PLUS:           printf("+"); break;
-                case ET_MINUS:          printf("-"); break;
-                case ET_MULT:           printf("*"); break;
-                case ET_DIV:            printf("/"); break;
-                case ET_COLON:          printf(":"); break;
-                case ET_NUMBER:         printf("%f", Token.AsNumber); break;
-                case ET_MACRO:          printf("!%s", Token.AsMacro); break;
-
-                case ET_FUNC:
-                    if (0 <= Token.AsFunc && Token.AsFunc < sArrayCount(ExprFuncCanonical)) {
-                        printf("%s", ExprFuncCanonical[Token.AsFunc]);
-                    }
-                    break;
+/* Evaluate every cell of Doc that FindLevels() gives a level, a level at a
+ * time. Levels too small to be worth waking the pool for are evaluated by
+ * this thread alone. */
+static void
+EvaluateLevels(struct document *Doc)
+{
+    s32 Rows = Doc->Rows;
+    s32 NumCells = Doc->Cols * Rows;
+    if (!NumCells) return;
+
+    s32 *Levels = AllocTemp(NumCells * sizeof *Levels);
+    s32 NumLevels = FindLevels(Doc, Levels);
+
+    /* NOTE: a counting sort of the cells by level. Once filled, level L is
+     * from LevelEnd[L-1] up to LevelEnd[L] */
+    s32 *LevelEnd = AllocTemp((NumLevels + 2) * sizeof *LevelEnd);
+    for (s32 Idx = 0; Idx < NumCells; ++Idx) {
+        if (Levels[Idx] > 0) ++LevelEnd[Levels[Idx] + 1];
+    }
+    bool Wide = false;
+    for (s32 Level = 1; Level <= NumLevels + 1; ++Level) {
+        Wide |= LevelEnd[Level] >= MIN_PARALLEL_LEVEL;
+        LevelEnd[Level] += LevelEnd[Level - 1];
+    }
 
-                case ET_CELL_REF:
-                    printf("[%d,%d]", Token.AsCell.Col, Token.AsCell.Row);
-                    break;
+    s32 *Order = AllocTemp((LevelEnd[NumLevels + 1] + 1) * sizeof *Order);
+    for (s32 Idx = 0; Idx < NumCells; ++Idx) {
+        if (Levels[Idx] > 0) Order[LevelEnd[Levels[Idx]]++] = Idx;
+    }
 
-                case ET_UNKNOWN: printf("?%s", Lexer.Buf); break;
-                }
-            }
-            printf("\n");
-            Lexer.Cur = Cell->AsExpr; /* reset */
-#endif
+    pthread_t Threads[MAX_JOBS];
+    Pool.Doc = Doc;
+    Pool.Order = Order;
+    Pool.NumThreads = 1;
+    Pool.Generation = 0;
+    Pool.Quit = false;
+    while (Wide && Pool.NumThreads < NumJobs) {
+        s32 Self = Pool.NumThreads;
+        if (pthread_create(Threads + Self, nullptr, EvalWorker, (void *)(sptr)Self)) {
+            LogError("pthread_create");
+            break;
+        }
+        ++Pool.NumThreads;
+    }
 
-            struct expr_node *Node = ParseExpr(&Lexer);
-            if (!Node) {
-                LogWarn("Failed to parse cell %d,%d", Col, Row);
-                SetAsError(Cell, ERROR_PARSE);
-            }
-            else {
-#if PREPRINT_PARSING
-                printf("Parsed:\n");
-                PrintNode(Node, 2);
-                printf("Reduced:\n");
-#endif
-                struct expr_node Result;
-                ReduceNode(Doc, Node, Col, Row, &Result);
-#if PREPRINT_PARSING
-                PrintNode(&Result, 2);
-                printf("\n");
-#endif
-                SetCellFromNode(Cell, &Result);
+    for (s32 Level = 1; Level <= NumLevels; ++Level) {
+        s32 First = LevelEnd[Level - 1], End = LevelEnd[Level];
+        if (Pool.NumThreads > 1 && End - First >= MIN_PARALLEL_LEVEL) {
+            RunLevel(First, End);
+        }
+        else for (s32 At = First; At < End; ++At) {
+            s32 Idx = Order[At];
+            if (ClaimCell(GetCell(Doc, Idx / Rows, Idx % Rows))) {
+                PushFrame(Doc, Idx / Rows, Idx % Rows);
+                RunFrames(0);
             }
-
-            Cell->State = CELL_STATE_STABLE;
         }
     }
 
-    return Error;
+    pthread_mutex_lock(&Pool.Lock);
+    Pool.Quit = true;
+    pthread_cond_broadcast(&Pool.Wake);
+    pthread_mutex_unlock(&Pool.Lock);
+    for (s32 Idx = 1; Idx < Pool.NumThreads; ++Idx) {
+        pthread_join(Threads[Idx], nullptr);
+    }
+
+    FreeTemp(Order);
+    FreeTemp(LevelEnd);
+    FreeTemp(Levels);
 }
+#endif
 
 static void
 EvaluateDocument(struct document *Doc)
@@ -2555,6 +4481,19 @@ EvaluateDocument(struct document *Doc)
     s32 NumCols = Doc->Cols;
     s32 NumRows = Doc->Rows;
 
+#if USE_LAZY_ROWS
+    /* NOTE: it was made for another document that references it first */
+    if (Doc->Lazy.Load) {
+        LoadRows(Doc, -1);
+    }
+#endif
+#if USE_PARALLEL_EVALUATION
+    if (NumJobs > 1) {
+        /* NOTE: the serial pass below evaluates whatever is left */
+        EvaluateLevels(Doc);
+    }
+#endif
+
     for (s32 Col = 0; Col < NumCols; ++Col) {
         for (s32 Row = 0; Row < NumRows; ++Row) {
             EvaluateCell(Doc, Col, Row);
@@ -2651,13 +4590,13 @@ PrintDocument(struct document *Doc)
 # define X(S,...) printf(S, T(UL_START), __VA_ARGS__, T(UL_END));
             switch (Cell->Type) {
             case CELL_STRING:
-                X("[%s%-*s%s]", Column->Width, Cell->AsString);
+                X("[%s%-*.*s%s]", Column->Width, Cell->AsString.Len, Cell->AsString.Str);
                 break;
             case CELL_NUMBER:
                 X("(%s%'*.*f%s)", Column->Width, Cell->Fmt.Prcsn, Cell->AsNumber);
                 break;
             case CELL_EXPR:
-                X("{%s%-*s%s}", Column->Width, Cell->AsExpr);
+                X("{%s%-*.*s%s}", Column->Width, Cell->AsExpr.Len, Cell->AsExpr.Str);
                 break;
             case CELL_ERROR:
                 X("<%s%-*s%s>", Column->Width, CellErrStr(Cell->AsError));
@@ -2685,7 +4624,7 @@ PrintDocument(struct document *Doc)
 
             switch (Cell->Type) {
             case CELL_STRING:
-                printf("%*s", Align*Column->Width, Cell->AsString);
+                printf("%*.*s", Align*Column->Width, Cell->AsString.Len, Cell->AsString.Str);
                 break;
 
             case CELL_NUMBER: {
@@ -2714,7 +4653,7 @@ PrintDocument(struct document *Doc)
             } break;
 
             case CELL_EXPR:
-                printf("%*s", Align*Column->Width, Cell->AsString);
+                printf("%*.*s", Align*Column->Width, Cell->AsExpr.Len, Cell->AsExpr.Str);
                 break;
 
             case CELL_ERROR:
@@ -2779,12 +4718,47 @@ main(s32 ArgCount, char **Args)
 {
     /* NOTE: this call will get glibc to set all locals from the environment */
     setlocale(LC_ALL, "");
+    InitFuncIndex();
+#if USE_PREFETCH
+    StartPrefetch(MakeSubDocument);
+#endif
 
 #if TIME_MAIN
     clock_t Start = clock();
 #endif
 
-    if (ArgCount < 2) {
+    /* NOTE: options come before the documents */
+    s32 First = 1;
+    while (First < ArgCount && Args[First][0] == '-') {
+        char *Option = Args[First++];
+        if (StrEq(Option, "--")) {
+            break;
+        }
+        else if (StrEq(Option, "--no-cache")) {
+#if USE_DISK_CACHE
+            DisableDiskCache();
+#endif
+        }
+        else if (StrEq(Option, "--jobs") && First < ArgCount) {
+            char *End;
+            long Jobs = strtol(Args[First++], &End, 10);
+            if (*End || Jobs < 1) {
+                LogWarn("--jobs expects a positive count, not \"%s\"", Args[First-1]);
+            }
+            else {
+                NumJobs = Min(Jobs, MAX_JOBS);
+            }
+        }
+        else {
+            LogWarn("Unknown option %s", Option);
+        }
+    }
+
+#if USE_IO_URING
+    PreloadDocuments(AT_FDCWD, ArgCount - First, Args + First);
+#endif
+
+    if (First == ArgCount) {
         char *Path = "/dev/stdin";
         struct document *Doc = MakeDocument(AT_FDCWD, Path);
         if (!Doc) {
@@ -2795,7 +4769,7 @@ main(s32 ArgCount, char **Args)
             PrintDocument(Doc);
         }
     }
-    else for (s32 Idx = 1; Idx < ArgCount; ++Idx) {
+    else for (s32 Idx = First; Idx < ArgCount; ++Idx) {
         char *Path = Args[Idx];
 
         struct document *Doc = MakeDocument(AT_FDCWD, Path);
@@ -2805,8 +4779,8 @@ main(s32 ArgCount, char **Args)
         else {
             EvaluateDocument(Doc);
 
-            if (Idx != 1) putchar('\n');
-            if (ArgCount > 2) {
+            if (Idx != First) putchar('\n');
+            if (ArgCount - First > 1) {
                 printf("%s: %dx%d (%dx%d)\n", Path, Doc->Cols, Doc->Rows,
                         Doc->Table.Cols, Doc->Table.Rows);
             }
@@ -2819,6 +4793,10 @@ main(s32 ArgCount, char **Args)
     clock_t End = clock();
 #endif
 
+#if USE_PREFETCH
+    /* NOTE: before anything is freed, as they may be making documents still */
+    StopPrefetch();
+#endif
 #if PRINT_MEM_INFO
     PrintAllMemInfo();
 #endif
@@ -2826,6 +4804,11 @@ main(s32 ArgCount, char **Args)
     DumpMemInfo(STRING_PAGE, "mem_dump_strings");
 #endif
     ReleaseAllMem();
+    FreeTemp(EvalStack.Frames);
+    FreeTemp(EvalStack.Values);
+#if !USE_BYTECODE
+    FreeTemp(EvalStack.Returns);
+#endif
 
 #if TIME_MAIN
     printf("\nTime taken: %.3f ms\n", 1000.0 * (End - Start) / CLOCKS_PER_SEC);
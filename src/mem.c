@@ -1,10 +1,16 @@
 #include "mem.h"
 
+#include "expr.h"
 #include "util.h"
 #include "logging.h"
 
+#include <fcntl.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 static inline void *Alloc(umm Sz) { return NotNull(malloc(Sz)); }
 static inline void *Realloc(void *Ptr, umm Sz) { return NotNull(realloc(Ptr, Sz)); }
@@ -37,12 +43,50 @@ struct page {
     u32 Used;
 } *Category[TOTAL_CATEGORIES] = {};
 
+/* NOTE: the pages that the calling thread reserves from; its own after
+ * BeginThreadPages() */
+static thread_local struct page *OwnPages[TOTAL_CATEGORIES];
+static thread_local struct page **ThreadPages = Category;
+static pthread_mutex_t CategoryLock = PTHREAD_MUTEX_INITIALIZER;
+
 struct doc_cache {
     struct document **Data;
     umm Used;
     umm Size;
+
+    /* NOTE: of Data by the file each was made from, kept at most half full */
+    umm IndexSize; /* a power of two */
+    struct doc_slot {
+        dev_t Device;
+        ino_t Inode;
+        u32 Doc; /* one past its index into Data, or 0 for an empty slot */
+    } *Index;
 } DocCache = {};
 
+/* NOTE: the directories that documents are in, each opened once and shared by
+ * every document in it. A directory is closed when the last of those is
+ * deleted. */
+struct dir_cache {
+    umm Used;
+    umm Size; /* a power of two, kept at least twice Used */
+    struct dir_slot {
+        dev_t Device;
+        ino_t Inode;
+        fd Dir; /* or -1 for an empty slot */
+        s32 Refs;
+    } *Slots;
+} DirCache = {};
+
+/* NOTE: documents may be made on several threads at once (see prefetch.h) */
+static pthread_mutex_t DocCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline u32
+HashFileId(dev_t Device, ino_t Inode)
+{
+    u64 Hash = ((u64)Inode ^ ((u64)Device << 32)) * 0x9e3779b97f4a7c15;
+    return (u32)(Hash >> 32);
+}
+
 #if DEDUPLICATE_STRINGS
 struct hash_table {
     struct hash_pair {
@@ -166,11 +210,28 @@ Wipe(struct page *FirstPage, enum page_categories Type)
     }
 }
 
+static void
+InsertPage(struct page **pFirstPage, struct page *Page)
+{
+#if SORT_PAGES
+    struct page **pThat = pFirstPage;
+    while (*pThat && Page->Used > (*pThat)->Used) {
+        pThat = &(*pThat)->Next;
+    }
+
+    Page->Next = *pThat;
+    *pThat = Page;
+#else
+    Page->Next = *pFirstPage;
+    *pFirstPage = Page;
+#endif
+}
+
 static void *
 Reserve(u32 Size, enum page_categories Type)
 {
     Assert(Type < TOTAL_CATEGORIES);
-    struct page **pFirstPage = Category + Type;
+    struct page **pFirstPage = ThreadPages + Type;
     Size = Fit(Size, Type);
 
     struct page *Page = *pFirstPage;
@@ -189,14 +250,7 @@ Reserve(u32 Size, enum page_categories Type)
     if (Page->Next && Page->Used > Page->Next->Used) {
         Assert(Page == *pFirstPage);
         *pFirstPage = (*pFirstPage)->Next;
-
-        struct page **pThat = pFirstPage;
-        while (*pThat && Page->Used > (*pThat)->Used) {
-            pThat = &(*pThat)->Next;
-        }
-
-        Page->Next = *pThat;
-        *pThat = Page;
+        InsertPage(pFirstPage, Page);
     }
 #endif
 
@@ -204,6 +258,31 @@ Reserve(u32 Size, enum page_categories Type)
 }
 
 
+void
+BeginThreadPages(void)
+{
+    Assert(ThreadPages == Category);
+    ThreadPages = OwnPages;
+}
+
+void
+EndThreadPages(void)
+{
+    Assert(ThreadPages == OwnPages);
+    pthread_mutex_lock(&CategoryLock);
+    for (s32 Idx = 0; Idx < TOTAL_CATEGORIES; ++Idx) {
+        struct page *This, *Next;
+        for (This = OwnPages[Idx]; This; This = Next) {
+            Next = This->Next;
+            InsertPage(Category + Idx, This);
+        }
+        OwnPages[Idx] = 0;
+    }
+    pthread_mutex_unlock(&CategoryLock);
+    ThreadPages = Category;
+}
+
+
 void *
 ReserveData(u32 Sz)
 {
@@ -215,6 +294,8 @@ SaveStr(char *Str)
 {
     Assert(Str);
 #if DEDUPLICATE_STRINGS
+    /* NOTE: the table is shared by every thread */
+    pthread_mutex_lock(&CategoryLock);
     struct hash_pair *Entry = NotNull(FindOrReserve(Str));
     char *New = Entry->Str;
     if (New) {
@@ -226,6 +307,7 @@ SaveStr(char *Str)
         strncpy(New, Str, Sz);
         Entry->Str = New;
     }
+    pthread_mutex_unlock(&CategoryLock);
     return New;
 #else
     u32 Sz = strlen(Str) + 1;
@@ -235,6 +317,25 @@ SaveStr(char *Str)
 #endif
 }
 
+/* NOTE: the memory comes back zeroed */
+void *
+AllocTemp(umm Sz)
+{
+    return ZeroAlloc(Sz);
+}
+
+void *
+ResizeTemp(void *Temp, umm Sz)
+{
+    return Realloc(Temp, Sz);
+}
+
+void
+FreeTemp(void *Temp)
+{
+    free(Temp);
+}
+
 
 void
 PrintAllMemInfo(void)
@@ -274,6 +375,26 @@ PrintAllMemInfo(void)
     TotalSize += DocCache.Size * sizeof *DocCache.Data;
     TotalUsed += DocCache.Used * sizeof *DocCache.Data;
 
+    snprintf(Buf, sizeof Buf, "0x%lx", DocCache.Used * sizeof *DocCache.Index);
+    printf("(document index)     0                      %10s  ", Buf);
+    snprintf(Buf, sizeof Buf, "0x%lx", DocCache.IndexSize * sizeof *DocCache.Index);
+    printf("%10s  ", Buf);
+    snprintf(Buf, sizeof Buf, "(%lu documents)", DocCache.Used);
+    printf("%18s  %7.2f%%\n", Buf, 100.0*DocCache.Used/DocCache.IndexSize);
+
+    TotalSize += DocCache.IndexSize * sizeof *DocCache.Index;
+    TotalUsed += DocCache.Used * sizeof *DocCache.Index;
+
+    snprintf(Buf, sizeof Buf, "0x%lx", DirCache.Used * sizeof *DirCache.Slots);
+    printf("(directory cache)    0                      %10s  ", Buf);
+    snprintf(Buf, sizeof Buf, "0x%lx", DirCache.Size * sizeof *DirCache.Slots);
+    printf("%10s  ", Buf);
+    snprintf(Buf, sizeof Buf, "(%lu directories)", DirCache.Used);
+    printf("%18s  %7.2f%%\n", Buf, 100.0*DirCache.Used/DirCache.Size);
+
+    TotalSize += DirCache.Size * sizeof *DirCache.Slots;
+    TotalUsed += DirCache.Used * sizeof *DirCache.Slots;
+
     if (!DocCache.Data) {
         printf("      (document)  %18p\n", (void *)0);
     }
@@ -283,8 +404,16 @@ PrintAllMemInfo(void)
 
         umm TableSize = Table->Rows * Table->Cols * sizeof *Table->Cells;
         umm TableUsed = This->Rows * This->Cols * sizeof *Table->Cells;
-        umm DocumentSize = sizeof *This + TableSize;
-        umm DocumentUsed = sizeof *This + TableUsed;
+        struct number_columns *Numbers = &This->Numbers;
+        umm NumbersSize = (umm)Numbers->Cols * Numbers->Stride * (sizeof (f64) + 2*sizeof (u64)/64);
+        for (s32 Col = 0; Col < Numbers->Cols; ++Col) {
+            struct column_sums *Sums = Numbers->Sums[Col];
+            if (Sums) {
+                NumbersSize += sizeof *Sums + (umm)(This->Rows + 1) * (sizeof *Sums->Sums + sizeof *Sums->Counts);
+            }
+        }
+        umm DocumentSize = sizeof *This + TableSize + NumbersSize;
+        umm DocumentUsed = sizeof *This + TableUsed + NumbersSize;
 
         snprintf(Buf, sizeof Buf, "0x%lx", DocumentUsed);
         printf("      (document)  %4ld  %18p  %10s  ", Idx, This, Buf);
@@ -293,6 +422,71 @@ PrintAllMemInfo(void)
 
         TotalSize += DocumentSize;
         TotalUsed += DocumentUsed;
+
+        /* NOTE: only the blocks that are done are in use */
+        umm IndexSize = 0, IndexUsed = 0;
+        s32 NumIndexed = 0;
+        for (s32 Col = 0; Col < Numbers->Cols; ++Col) {
+            struct column_extremes *Extremes = Numbers->Extremes[Col];
+            if (Extremes) {
+                umm Entry = 2 * sizeof *Extremes->Mins;
+                IndexSize += sizeof *Extremes + (umm)Extremes->Levels * (Numbers->Stride/64) * Entry;
+                IndexUsed += sizeof *Extremes + (umm)Extremes->Levels * Extremes->Blocks * Entry;
+                ++NumIndexed;
+            }
+        }
+
+        if (NumIndexed) {
+            snprintf(Buf, sizeof Buf, "0x%lx", IndexUsed);
+            printf("   (range index)  %4ld  %18p  %10s  ", Idx, This, Buf);
+            snprintf(Buf, sizeof Buf, "0x%lx", IndexSize);
+            printf("%10s  ", Buf);
+            snprintf(Buf, sizeof Buf, "(%d columns)", NumIndexed);
+            printf("%18s  %7.2f%%\n", Buf, 100.0*IndexUsed/IndexSize);
+
+            TotalSize += IndexSize;
+            TotalUsed += IndexUsed;
+        }
+
+        /* NOTE: only the slots that hold a group are in use */
+        umm GroupsSize = 0, GroupsUsed = 0;
+        s32 NumGrouped = 0;
+        for (s32 Col = 0; This->Groups && Col < This->Cols; ++Col) {
+            struct group_index *Groups = This->Groups[Col];
+            if (Groups) {
+                umm Fixed = sizeof *Groups + Groups->NumRows * sizeof *Groups->Rows;
+                GroupsSize += Fixed + Groups->Size * sizeof *Groups->Slots;
+                GroupsUsed += Fixed + Groups->NumGroups * sizeof *Groups->Slots;
+                ++NumGrouped;
+            }
+        }
+
+        if (NumGrouped) {
+            snprintf(Buf, sizeof Buf, "0x%lx", GroupsUsed);
+            printf("   (group index)  %4ld  %18p  %10s  ", Idx, This, Buf);
+            snprintf(Buf, sizeof Buf, "0x%lx", GroupsSize);
+            printf("%10s  ", Buf);
+            snprintf(Buf, sizeof Buf, "(%d columns)", NumGrouped);
+            printf("%18s  %7.2f%%\n", Buf, 100.0*GroupsUsed/GroupsSize);
+
+            TotalSize += GroupsSize;
+            TotalUsed += GroupsUsed;
+        }
+
+        struct aggregate_memo *Memo = &This->Memo;
+        if (Memo->Size) {
+            umm MemoUsed = (u32)Memo->Used * sizeof *Memo->Entries;
+            umm MemoSize = (u32)Memo->Size * sizeof *Memo->Entries;
+            snprintf(Buf, sizeof Buf, "0x%lx", MemoUsed);
+            printf("(aggregate memo)  %4ld  %18p  %10s  ", Idx, This, Buf);
+            snprintf(Buf, sizeof Buf, "0x%lx", MemoSize);
+            printf("%10s  ", Buf);
+            snprintf(Buf, sizeof Buf, "(%lu/%lu hits)", Memo->Hits, Memo->Hits + Memo->Misses);
+            printf("%18s  %7.2f%%\n", Buf, 100.0*MemoUsed/MemoSize);
+
+            TotalSize += MemoSize;
+            TotalUsed += MemoUsed;
+        }
     }
 
 #if DEDUPLICATE_STRINGS
@@ -333,6 +527,50 @@ static void
 DeleteDocument(struct document *Doc)
 {
     if (Doc) {
+        ReleaseSharedDir(Doc->Dir);
+        UnloadSource(&Doc->Source);
+        free(Doc->Formulas);
+        free(Doc->FormulaIndex);
+        free(Doc->Nodes);
+        free(Doc->Program.Code);
+        free(Doc->Program.Consts);
+        free(Doc->Deps);
+        free(Doc->Links);
+        free(Doc->Numbers.Values);
+        free(Doc->Numbers.IsNumber);
+        free(Doc->Numbers.IsExpr);
+        free(Doc->Numbers.FirstExpr);
+        for (s32 Col = 0; Col < Doc->Numbers.Cols; ++Col) {
+            struct column_sums *Sums = Doc->Numbers.Sums[Col];
+            if (Sums) {
+                free(Sums->Sums);
+                free(Sums->Counts);
+                free(Sums);
+            }
+        }
+        free(Doc->Numbers.Sums);
+        for (s32 Col = 0; Col < Doc->Numbers.Cols; ++Col) {
+            struct column_extremes *Extremes = Doc->Numbers.Extremes[Col];
+            if (Extremes) {
+                free(Extremes->Mins);
+                free(Extremes->Maxes);
+                free(Extremes);
+            }
+        }
+        free(Doc->Numbers.Extremes);
+        if (Doc->Groups) {
+            for (s32 Col = 0; Col < Doc->Cols; ++Col) {
+                struct group_index *Groups = Doc->Groups[Col];
+                if (Groups) {
+                    free(Groups->Slots);
+                    free(Groups->Rows);
+                    free(Groups);
+                }
+            }
+            free(Doc->Groups);
+        }
+        free(Doc->Memo.Entries);
+        ReleaseLazyRows(Doc);
         free(Doc->Table.Columns);
         free(Doc->Table.Cells);
         free(Doc);
@@ -346,7 +584,11 @@ ReleaseAllMem(void)
         DeleteDocument(DocCache.Data[Idx]);
     }
     free(DocCache.Data);
+    free(DocCache.Index);
     DocCache = (struct doc_cache){};
+    Assert(!DirCache.Used);
+    free(DirCache.Slots);
+    DirCache = (struct dir_cache){};
 
     for (s32 Idx = 0; Idx < TOTAL_CATEGORIES; ++Idx) {
         struct page *This, *Next;
@@ -390,27 +632,144 @@ DumpMemInfo(enum page_categories Type, char *Prefix)
 }
 
 
+/* Read all of a file that cannot be mapped (e.g., a pipe) into one buffer. */
+static bool
+ReadSource(fd File, umm SizeHint, struct source *Out)
+{
+    umm Size = Max(SizeHint + 1, (umm)PAGE_SIZE);
+    umm Used = 0;
+    char *Data = Alloc(Size);
+    bool Ok = true;
+
+    for (;;) {
+        if (Used + 1 >= Size) {
+            Size *= 2;
+            Data = Realloc(Data, Size);
+        }
+
+        smm Got = read(File, Data + Used, Size - Used - 1);
+        if (Got > 0) {
+            Used += Got;
+        }
+        else if (Got == 0) {
+            break;
+        }
+        else if (errno != EINTR) {
+            LogError("read(%d, ...)", File);
+            Ok = false;
+            break;
+        }
+    }
+
+    if (!Ok) {
+        free(Data);
+    }
+    else {
+        Data[Used] = 0;
+        *Out = (struct source){ Data, Used, 0, 0 };
+    }
+    return Ok;
+}
+
+/* Regular files are mapped. Because the bytes past the end of a file in its
+ * last page are zero filled, we only map files whose size is not a multiple of
+ * the page size; this gives us our trailing 0 for free. Everything else falls
+ * back to one large read. */
+bool
+LoadSource(fd Dir, char *Path, struct source *Out)
+{
+    Assert(Path);
+    Assert(Out);
+
+    bool Ok = false;
+    struct stat Stat;
+    fd File = openat(Dir, Path, O_RDONLY);
+
+    if (File < 0) {
+        LogError("openat(%d, \"%s\", O_RDONLY)", Dir, Path);
+    }
+    else if (fstat(File, &Stat)) {
+        LogError("fstat(%d, ...)", File);
+        close(File);
+    }
+    else {
+        umm Size = S_ISREG(Stat.st_mode)? Stat.st_size: 0;
+        umm PageSize = sysconf(_SC_PAGESIZE);
+
+        if (Size && Size % PageSize) {
+            void *Map = mmap(0, Size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, File, 0);
+            if (Map == MAP_FAILED) {
+                LogError("mmap(0, %lu, ...)", Size);
+            }
+            else {
+                *Out = (struct source){ Map, Size, Map, Size };
+                Ok = true;
+            }
+        }
+
+        if (!Ok) {
+            Ok = ReadSource(File, Size, Out);
+        }
+        close(File);
+    }
+
+    return Ok;
+}
+
+void
+UnloadSource(struct source *Source)
+{
+    Assert(Source);
+    if (Source->Map) {
+        munmap(Source->Map, Source->MapSize);
+    }
+    else {
+        free(Source->Data);
+    }
+    *Source = (struct source){};
+}
+
+
+/* Returns the slot of the document made from the file Device, Inode, or the
+ * empty slot where it would go */
+static struct doc_slot *
+FindDocSlot(dev_t Device, ino_t Inode)
+{
+    umm Mask = DocCache.IndexSize - 1;
+    for (umm Idx = HashFileId(Device, Inode) & Mask;; Idx = (Idx + 1) & Mask) {
+        struct doc_slot *Slot = DocCache.Index + Idx;
+        if (!Slot->Doc || (Slot->Device == Device && Slot->Inode == Inode)) {
+            return Slot;
+        }
+    }
+}
+
 struct document *
 FindExistingDoc(dev_t Device, ino_t Inode)
 {
+    pthread_mutex_lock(&DocCacheLock);
     Assert(false
         || (!DocCache.Data && DocCache.Size == 0 && DocCache.Used == 0)
         || (DocCache.Data && DocCache.Used <= DocCache.Size)
     );
     struct document *Doc = 0;
-    for (umm Idx = 0; Idx < DocCache.Used; ++Idx) {
-        struct document *This = NotNull(DocCache.Data[Idx]);
-        if (This->Device == Device && This->Inode == Inode) {
-            Assert(!Doc);
-            Doc = This;
+    if (DocCache.Index) {
+        struct doc_slot *Slot = FindDocSlot(Device, Inode);
+        if (Slot->Doc) {
+            Doc = NotNull(DocCache.Data[Slot->Doc - 1]);
+            Assert(Doc->Device == Device && Doc->Inode == Inode);
         }
     }
+    pthread_mutex_unlock(&DocCacheLock);
     return Doc;
 }
 
+/* Returns a new document, which is found by the file Device, Inode from now
+ * on. Its contents are left to the caller. */
 struct document *
-AllocAndLogDoc()
+AllocAndLogDoc(dev_t Device, ino_t Inode)
 {
+    pthread_mutex_lock(&DocCacheLock);
     umm Idx = DocCache.Used++;
     if (DocCache.Used > DocCache.Size) {
         umm NewSize = !DocCache.Size
@@ -423,7 +782,117 @@ AllocAndLogDoc()
         DocCache.Size = NewSize;
         Assert(DocCache.Data);
     }
-    return DocCache.Data[Idx] = Alloc(sizeof (struct document));
+
+    if (2*DocCache.Used > DocCache.IndexSize) {
+        struct doc_slot *Old = DocCache.Index;
+        umm OldSize = DocCache.IndexSize;
+        DocCache.IndexSize = Max(2*DocCache.Size, OldSize? 2*OldSize: INIT_DOC_CACHE_SIZE);
+        DocCache.Index = ZeroAlloc(DocCache.IndexSize * sizeof *DocCache.Index);
+        for (umm Slot = 0; Slot < OldSize; ++Slot) {
+            if (Old[Slot].Doc) {
+                *FindDocSlot(Old[Slot].Device, Old[Slot].Inode) = Old[Slot];
+            }
+        }
+        free(Old);
+    }
+
+    struct doc_slot *Slot = FindDocSlot(Device, Inode);
+    Assert(!Slot->Doc);
+    *Slot = (struct doc_slot){ Device, Inode, Idx + 1 };
+    struct document *Doc = DocCache.Data[Idx] = Alloc(sizeof (struct document));
+    pthread_mutex_unlock(&DocCacheLock);
+    return Doc;
+}
+
+/* Returns the slot of the directory Device, Inode, or the empty slot where it
+ * would go */
+static struct dir_slot *
+FindDirSlot(dev_t Device, ino_t Inode)
+{
+    umm Mask = DirCache.Size - 1;
+    for (umm Idx = HashFileId(Device, Inode) & Mask;; Idx = (Idx + 1) & Mask) {
+        struct dir_slot *Slot = DirCache.Slots + Idx;
+        if (Slot->Dir < 0 || (Slot->Device == Device && Slot->Inode == Inode)) {
+            return Slot;
+        }
+    }
+}
+
+/* Returns the directory at Path, from Dir, as opened for every document in it,
+ * or -1. Each that is returned is to be given back to ReleaseSharedDir(). */
+fd
+OpenSharedDir(fd Dir, char *Path)
+{
+    struct stat Stat;
+    if (fstatat(Dir, Path, &Stat, 0)) {
+        LogError("fstatat(%d, \"%s\", ...)", Dir, Path);
+        return -1;
+    }
+
+    pthread_mutex_lock(&DocCacheLock);
+    if (2*(DirCache.Used + 1) > DirCache.Size) {
+        struct dir_slot *Old = DirCache.Slots;
+        umm OldSize = DirCache.Size;
+        DirCache.Size = OldSize? 2*OldSize: 16;
+        DirCache.Slots = Alloc(DirCache.Size * sizeof *DirCache.Slots);
+        for (umm Slot = 0; Slot < DirCache.Size; ++Slot) {
+            DirCache.Slots[Slot] = (struct dir_slot){ .Dir = -1 };
+        }
+        for (umm Slot = 0; Slot < OldSize; ++Slot) {
+            if (Old[Slot].Dir >= 0) {
+                *FindDirSlot(Old[Slot].Device, Old[Slot].Inode) = Old[Slot];
+            }
+        }
+        free(Old);
+    }
+
+    struct dir_slot *Slot = FindDirSlot(Stat.st_dev, Stat.st_ino);
+    if (Slot->Dir < 0) {
+        fd NewDir = openat(Dir, Path, O_DIRECTORY | O_RDONLY);
+        if (NewDir < 0) {
+            LogError("openat");
+            pthread_mutex_unlock(&DocCacheLock);
+            return -1;
+        }
+        *Slot = (struct dir_slot){ Stat.st_dev, Stat.st_ino, NewDir, 0 };
+        ++DirCache.Used;
+    }
+
+    ++Slot->Refs;
+    fd Shared = Slot->Dir;
+    pthread_mutex_unlock(&DocCacheLock);
+    return Shared;
+}
+
+void
+ReleaseSharedDir(fd Dir)
+{
+    struct stat Stat;
+    if (Dir < 0 || !DirCache.Slots) { /* nop */ }
+    else if (fstat(Dir, &Stat)) {
+        LogError("fstat(%d, ...)", Dir);
+    }
+    else {
+        pthread_mutex_lock(&DocCacheLock);
+        struct dir_slot *Slot = FindDirSlot(Stat.st_dev, Stat.st_ino);
+        Assert(Slot->Dir == Dir && Slot->Refs > 0);
+        if (--Slot->Refs == 0) {
+            close(Slot->Dir);
+            --DirCache.Used;
+
+            /* NOTE: the slots after it, up to the next empty one, are put back
+             * where a probe for them would find them */
+            umm Mask = DirCache.Size - 1;
+            umm Hole = Slot - DirCache.Slots;
+            DirCache.Slots[Hole].Dir = -1;
+            for (umm Idx = (Hole + 1) & Mask; DirCache.Slots[Idx].Dir >= 0; Idx = (Idx + 1) & Mask) {
+                struct dir_slot Moved = DirCache.Slots[Idx];
+                DirCache.Slots[Idx].Dir = -1;
+                *FindDirSlot(Moved.Device, Moved.Inode) = Moved;
+            }
+        }
+        pthread_mutex_unlock(&DocCacheLock);
+    }
 }
 
 
@@ -529,6 +998,11 @@ GetCell(struct document *Doc, s32 Col, s32 Row)
 {
     Assert(Doc);
     Assert(CellExists(Doc, Col, Row));
+#if USE_LAZY_ROWS
+    if (!RowLoaded(Doc, Row)) {
+        Doc->Lazy.Load(Doc, Row);
+    }
+#endif
     return Doc->Table.Cells + GetCellIdx(&Doc->Table, Col, Row);
 }
 
@@ -555,3 +1029,321 @@ ReserveCell(struct document *Doc, s32 Col, s32 Row)
     Assert(Doc->Table.Cells);
     return GetCell(Doc, Col, Row);
 }
+
+/* NOTE: whether the cells of Row are there to be read, as they always are
+ * unless Doc is loaded lazily */
+bool
+RowLoaded(struct document *Doc, s32 Row)
+{
+    struct lazy_rows *Lazy = &Doc->Lazy;
+    return !Lazy->Load || Row >= Lazy->NumRows || Lazy->Rows[Row].Loaded;
+}
+
+/* Returns the index of the new row, which is that of its line in order */
+s32
+AddLazyRow(struct document *Doc, struct lazy_row Row)
+{
+    Assert(Doc);
+    struct lazy_rows *Lazy = &Doc->Lazy;
+    if (Lazy->NumRows == Lazy->MaxRows) {
+        Lazy->MaxRows = Lazy->MaxRows? 2*Lazy->MaxRows: INIT_ROW_COUNT;
+        Lazy->Rows = Realloc(Lazy->Rows, Lazy->MaxRows * sizeof *Lazy->Rows);
+    }
+    s32 Idx = Lazy->NumRows++;
+    Lazy->Rows[Idx] = Row;
+    return Idx;
+}
+
+void
+ReleaseLazyRows(struct document *Doc)
+{
+    Assert(Doc);
+    free(Doc->Lazy.Delims);
+    free(Doc->Lazy.Rows);
+    FreeTemp(Doc->Lazy.Cycles.Stack);
+    FreeTemp(Doc->Lazy.Cycles.Frames);
+    FreeTemp(Doc->Lazy.Cycles.Cells);
+    Doc->Lazy = (struct lazy_rows){};
+}
+
+/* Room for up to Count formulas of a document. Cells point into this, so it
+ * is only ever allocated once. */
+struct formula *
+ReserveFormulas(struct document *Doc, s32 Count)
+{
+    Assert(Doc);
+    Assert(!Doc->Formulas);
+    Assert(Count >= 0);
+
+    /* NOTE: kept at most half full */
+    u32 IndexSize = NextPow2((u32)(2*Count + 1));
+    Doc->NumFormulas = 0;
+    Doc->Formulas = Alloc(Max(Count, 1) * sizeof *Doc->Formulas);
+    Doc->FormulaIndex = ZeroAlloc(IndexSize * sizeof *Doc->FormulaIndex);
+    Doc->FormulaIndexMask = IndexSize - 1;
+    return Doc->Formulas;
+}
+
+/* Formulas with identical text are shared. A new formula is left unparsed,
+ * which the caller is told by *Added. */
+struct formula *
+InternFormula(struct document *Doc, struct span Text, bool *Added)
+{
+    Assert(Doc);
+    Assert(Doc->FormulaIndex);
+    Assert(Added);
+
+    u32 Mask = Doc->FormulaIndexMask;
+    u32 Slot = HashSpan(Text) & Mask;
+    struct formula *Formula = nullptr;
+
+    for (;; Slot = (Slot+1) & Mask) {
+        u32 Entry = Doc->FormulaIndex[Slot];
+        if (!Entry) {
+            Assert((u32)Doc->NumFormulas < Mask/2 + 1);
+            Formula = Doc->Formulas + Doc->NumFormulas++;
+            *Formula = (struct formula){ .Text = Text };
+            Doc->FormulaIndex[Slot] = Doc->NumFormulas;
+            *Added = true;
+            break;
+        }
+        else if (SpanEq(Doc->Formulas[Entry-1].Text, Text)) {
+            Formula = Doc->Formulas + Entry - 1;
+            *Added = false;
+            break;
+        }
+    }
+
+    return Formula;
+}
+
+/* Returns the index of the first of Count new nodes, whose contents are left
+ * to the caller. Node 0 is always a null node. */
+u32
+ReserveNodes(struct document *Doc, u32 Count)
+{
+    Assert(Doc);
+    u32 Need = Doc->NumNodes + Count + !Doc->NumNodes;
+    if (Need > Doc->MaxNodes) {
+        Doc->MaxNodes = Max(NextPow2(Need), 256u);
+        Doc->Nodes = Realloc(Doc->Nodes, Doc->MaxNodes * sizeof *Doc->Nodes);
+    }
+    if (!Doc->NumNodes) {
+        Doc->Nodes[Doc->NumNodes++] = (struct expr_node){0};
+    }
+    u32 Idx = Doc->NumNodes;
+    Doc->NumNodes += Count;
+    return Idx;
+}
+
+/* Returns the index of the new instruction */
+s32
+EmitInst(struct document *Doc, struct vm_inst Inst)
+{
+    struct vm_program *Program = &NotNull(Doc)->Program;
+    if (Program->CodeUsed == Program->CodeSize) {
+        Program->CodeSize = Program->CodeSize? 2*Program->CodeSize: 64;
+        Program->Code = Realloc(Program->Code, Program->CodeSize * sizeof *Program->Code);
+    }
+    s32 Idx = Program->CodeUsed++;
+    Program->Code[Idx] = Inst;
+    return Idx;
+}
+
+/* Returns the index of the new constant */
+s32
+AddConst(struct document *Doc, struct expr_node *Node)
+{
+    struct vm_program *Program = &NotNull(Doc)->Program;
+    if (Program->NumConsts == Program->MaxConsts) {
+        Program->MaxConsts = Program->MaxConsts? 2*Program->MaxConsts: 16;
+        Program->Consts = Realloc(Program->Consts, Program->MaxConsts * sizeof *Program->Consts);
+    }
+    s32 Idx = Program->NumConsts++;
+    Program->Consts[Idx] = *NotNull(Node);
+    return Idx;
+}
+
+/* Returns the index of the new dependency */
+s32
+AddDep(struct document *Doc, struct cell_dep Dep)
+{
+    Assert(Doc);
+    if (Doc->NumDeps == Doc->MaxDeps) {
+        Doc->MaxDeps = Doc->MaxDeps? 2*Doc->MaxDeps: 16;
+        Doc->Deps = Realloc(Doc->Deps, Doc->MaxDeps * sizeof *Doc->Deps);
+    }
+    s32 Idx = Doc->NumDeps++;
+    Doc->Deps[Idx] = Dep;
+    return Idx;
+}
+
+/* Returns the index of the link to Reference, which is added unresolved when
+ * it is new. A reference is kept by copy, as a formula can make one up. */
+s32
+AddXenoLink(struct document *Doc, struct span Reference)
+{
+    Assert(Doc);
+    for (s32 Idx = 0; Idx < Doc->NumLinks; ++Idx) {
+        if (SpanEq(Doc->Links[Idx].Reference, Reference)) return Idx;
+    }
+
+    if (Doc->NumLinks == Doc->MaxLinks) {
+        Doc->MaxLinks = Doc->MaxLinks? 2*Doc->MaxLinks: 8;
+        Doc->Links = Realloc(Doc->Links, Doc->MaxLinks * sizeof *Doc->Links);
+    }
+    char *Str = ReserveData(Max(Reference.Len, 1));
+    memcpy(Str, Reference.Str, Reference.Len);
+
+    s32 Idx = Doc->NumLinks++;
+    Doc->Links[Idx] = (struct xeno_link){ .Reference = { Str, Reference.Len } };
+    return Idx;
+}
+
+/* Room for a copy of the numbers of every cell of a document, which must be
+ * done growing. It starts out with no numbers. */
+struct number_columns *
+ReserveNumberColumns(struct document *Doc)
+{
+    Assert(Doc);
+    Assert(!Doc->Numbers.Values);
+
+    struct number_columns *Numbers = &Doc->Numbers;
+    Numbers->Cols = Doc->Cols;
+    Numbers->Stride = (Doc->Rows + 63) & ~63;
+
+    umm Count = (umm)Numbers->Cols * Numbers->Stride;
+    Numbers->Values = ZeroAlloc(Max(Count, 1) * sizeof *Numbers->Values);
+    Numbers->IsNumber = ZeroAlloc(Max(Count/64, 1) * sizeof *Numbers->IsNumber);
+    Numbers->IsExpr = ZeroAlloc(Max(Count/64, 1) * sizeof *Numbers->IsExpr);
+    Numbers->FirstExpr = ZeroAlloc(Max(Numbers->Cols, 1) * sizeof *Numbers->FirstExpr);
+    Numbers->Sums = ZeroAlloc(Max(Numbers->Cols, 1) * sizeof *Numbers->Sums);
+    Numbers->Extremes = ZeroAlloc(Max(Numbers->Cols, 1) * sizeof *Numbers->Extremes);
+    return Numbers;
+}
+
+/* Room for the running sums of a column of a document, from its first row to
+ * its last. None of them are valid yet. */
+struct column_sums *
+ReserveColumnSums(struct document *Doc)
+{
+    Assert(Doc);
+
+    struct column_sums *Sums = Alloc(sizeof *Sums);
+    umm Count = Doc->Rows + 1;
+    *Sums = (struct column_sums){
+        .Sums = Alloc(Count * sizeof *Sums->Sums),
+        .Counts = Alloc(Count * sizeof *Sums->Counts),
+    };
+    Sums->Sums[0] = 0;
+    Sums->Counts[0] = 0;
+    return Sums;
+}
+
+/* Room for the range index of a column of a document, with a level for each
+ * power of two up to its number of blocks. None of them are in it yet. */
+struct column_extremes *
+ReserveColumnExtremes(struct document *Doc)
+{
+    Assert(Doc);
+    struct number_columns *Numbers = &Doc->Numbers;
+    s32 NumBlocks = Numbers->Stride/64;
+    Assert(NumBlocks > 0);
+
+    struct column_extremes *Extremes = Alloc(sizeof *Extremes);
+    s32 Levels = 32 - __builtin_clz(NumBlocks);
+    umm Count = (umm)Levels * NumBlocks;
+    *Extremes = (struct column_extremes){
+        .Levels = Levels,
+        .Mins = Alloc(Count * sizeof *Extremes->Mins),
+        .Maxes = Alloc(Count * sizeof *Extremes->Maxes),
+    };
+    return Extremes;
+}
+
+/* Room for the group index of each column of a document, which must be done
+ * growing. None of them are built yet. */
+struct group_index **
+ReserveGroups(struct document *Doc)
+{
+    Assert(Doc);
+    Assert(!Doc->Groups);
+    return ZeroAlloc(Max(Doc->Cols, 1) * sizeof *Doc->Groups);
+}
+
+/* Room for a group index of NumRows rows, with NumSlots slots for its groups,
+ * which must be a power of two. Every slot starts out empty. */
+struct group_index *
+ReserveGroupIndex(s32 NumSlots, s32 NumRows)
+{
+    Assert(NumSlots > 0 && !(NumSlots & (NumSlots - 1)));
+    Assert(NumRows >= 0);
+
+    struct group_index *Groups = Alloc(sizeof *Groups);
+    *Groups = (struct group_index){
+        .Size = NumSlots,
+        .Slots = Alloc(NumSlots * sizeof *Groups->Slots),
+        .NumRows = NumRows,
+        .Rows = Alloc(Max(NumRows, 1) * sizeof *Groups->Rows),
+    };
+    for (s32 Slot = 0; Slot < NumSlots; ++Slot) {
+        Groups->Slots[Slot] = (struct group_slot){ .Row = -1 };
+    }
+    return Groups;
+}
+
+/* Double the slots of a group index, each group keeping its hash */
+void
+GrowGroupIndex(struct group_index *Groups)
+{
+    Assert(Groups);
+    s32 OldSize = Groups->Size;
+    struct group_slot *Old = Groups->Slots;
+
+    Groups->Size = 2*OldSize;
+    Groups->Slots = Alloc(Groups->Size * sizeof *Groups->Slots);
+    for (s32 Slot = 0; Slot < Groups->Size; ++Slot) {
+        Groups->Slots[Slot] = (struct group_slot){ .Row = -1 };
+    }
+
+    /* NOTE: no two groups are the same, so only their hashes are compared */
+    u32 Mask = Groups->Size - 1;
+    for (s32 Slot = 0; Slot < OldSize; ++Slot) {
+        if (Old[Slot].Row >= 0) {
+            u32 Idx = Old[Slot].Hash & Mask;
+            while (Groups->Slots[Idx].Row >= 0) {
+                Idx = (Idx + 1) & Mask;
+            }
+            Groups->Slots[Idx] = Old[Slot];
+        }
+    }
+    free(Old);
+}
+
+/* Double the entries of an aggregate memo, each entry keeping its hash */
+void
+GrowAggregateMemo(struct aggregate_memo *Memo)
+{
+    Assert(Memo);
+    s32 OldSize = Memo->Size;
+    struct memo_entry *Old = Memo->Entries;
+
+    Memo->Size = OldSize? 2*OldSize: 64;
+    Memo->Entries = Alloc(Memo->Size * sizeof *Memo->Entries);
+    for (s32 Entry = 0; Entry < Memo->Size; ++Entry) {
+        Memo->Entries[Entry] = (struct memo_entry){ .Func = -1 };
+    }
+
+    /* NOTE: no two entries are the same, so only their hashes are compared */
+    u32 Mask = Memo->Size - 1;
+    for (s32 Entry = 0; Entry < OldSize; ++Entry) {
+        if (Old[Entry].Func >= 0) {
+            u32 Idx = Old[Entry].Hash & Mask;
+            while (Memo->Entries[Idx].Func >= 0) {
+                Idx = (Idx + 1) & Mask;
+            }
+            Memo->Entries[Idx] = Old[Entry];
+        }
+    }
+    free(Old);
+}
@@ -50,6 +50,25 @@ enum expr_error {
     ERROR_IMPL,     /* reach an unimplemented function or macro */
 };
 
+/* A cell's expression, parsed once when its document is loaded. Root indexes
+ * the document's nodes, and is 0 when Text could not be parsed. */
+struct formula {
+    struct span Text;
+    u32 Root;
+    s32 CodeAt; /* into the document's program */
+    s32 MaxStack;
+    s32 DepsAt, NumDeps; /* into the document's dependencies */
+    bool Dynamic; /* reads cells that are only known once it runs */
+    bool Running; /* the cell above it plus or minus cells of its row */
+    bool RowLocal; /* just arithmetic on numbers and cells of its row */
+    bool AnyRow; /* reads rows of its document that are only known once it runs */
+};
+
+enum cell_state {
+    CELL_STATE_STABLE = 0,
+    CELL_STATE_EVALUATING,
+};
+
 struct cell {
     struct fmt_header Fmt;
 
@@ -61,24 +80,54 @@ struct cell {
         CELL_NUMBER,
         CELL_EXPR,
         CELL_ERROR,
-    } Type;
-    enum cell_state {
-        CELL_STATE_STABLE = 0,
-        CELL_STATE_EVALUATING,
-    } State;
+    } Type: 8;
+    /* NOTE: an enum cell_state. It is not a bit-field, so that evaluating
+     * threads can change it atomically (see ClaimCell() in main.c) */
+    u8 State;
+    /* NOTE: kept after evaluation replaces the expression with its value */
+    struct formula *Formula;
     union {
-        char *AsString;
-        char *AsExpr;
+        struct span AsString;
+        struct span AsExpr;
         f64 AsNumber;
         enum expr_error AsError;
     };
 };
+static_assert(sizeof (struct cell) == 32);
 #define ERROR_CELL(V)  (struct cell){ .Type = CELL_ERROR, .AsError = (V) }
 #define NUMBER_CELL(V) (struct cell){ .Type = CELL_NUMBER, .AsNumber = (V) }
 #define STRING_CELL(V) (struct cell){ .Type = CELL_STRING, .AsString = (V) }
 #define EXPR_CELL(V)   (struct cell){ .Type = CELL_EXPR, .AsExpr = (V) }
 
 
+/* The raw bytes of a document. Cells point directly into this, so it must
+ * outlive the document. Data[Size] is always a readable 0 byte. When Map is
+ * set, Data lies somewhere inside of that mapping (see cache.c). */
+struct source {
+    char *Data;
+    umm Size;
+    void *Map;
+    umm MapSize;
+};
+
+bool LoadSource(fd Dir, char *Path, struct source *Out);
+void UnloadSource(struct source *Source);
+
+/* What FindCycles() has visited of a document's cells, which a document that is
+ * loaded lazily keeps from the rows it was run on to the next ones */
+struct cycle_search {
+    struct scc_cell {
+        u32 Index, Low; /* Index is 0 until visited */
+        bool OnStack, SelfRef;
+    } *Cells;
+    struct scc_frame {
+        s32 Cell;
+        s32 Dep; /* the next of its formula's dependencies to follow */
+    } *Frames;
+    s32 *Stack;
+    u32 NextIndex;
+};
+
 struct document {
     s32 Cols, Rows;
     struct table {
@@ -89,6 +138,7 @@ struct document {
     fd Dir;
     dev_t Device;
     ino_t Inode;
+    struct source Source;
 
     bool Summarized;
     struct cell_ref Summary;
@@ -96,17 +146,116 @@ struct document {
     s32 FirstBodyRow;
     s32 FirstFootRow;
 
+    s32 NumFormulas;
+    struct formula *Formulas;
+    u32 *FormulaIndex; /* by text; holds one more than the formula's index */
+    u32 FormulaIndexMask;
+
+    /* NOTE: every expression of the document, each one in post-order (see
+     * expr.h). Node 0 is a null node, so that an index of 0 means none. */
+    u32 NumNodes, MaxNodes;
+    struct expr_node *Nodes;
+    u32 NumFoldedNodes; /* removed by FoldExpr() */
+
+    /* NOTE: referred to by index, as these move while they are being filled */
+    struct vm_program {
+        struct vm_inst *Code;
+        struct expr_node *Consts;
+        s32 CodeUsed, CodeSize;
+        s32 NumConsts, MaxConsts;
+    } Program;
+
+    /* NOTE: what each formula reads; shared by every cell that holds it */
+    s32 NumDeps, MaxDeps;
+    struct cell_dep *Deps;
+
+    /* NOTE: each document that its formulas reference, by the path they give,
+     * which is only looked up the first time it is needed */
+    s32 NumLinks, MaxLinks;
+    struct xeno_link {
+        struct span Reference;
+        bool Resolved;
+        struct document *Doc; /* nullptr when there is no such document */
+    } *Links;
+
+    /* NOTE: a copy of the numbers among the cells, Stride rows to a column,
+     * with a bit for each cell in the bitmaps. A value is 0 where its cell is
+     * not a number (see numbers.c). */
+    struct number_columns {
+        s32 Cols, Stride; /* Stride is a multiple of 64 */
+        f64 *Values;
+        u64 *IsNumber;
+        u64 *IsExpr; /* not evaluated yet, or in the middle of it */
+        s32 *FirstExpr; /* of each column, no later than its first IsExpr */
+        struct column_sums {
+            s32 Valid; /* rows 0 to Valid-1 are in these */
+            f64 *Sums; /* of the first I rows, for each I */
+            s32 *Counts; /* of the numbers among those */
+        } **Sums; /* each built on first use */
+        struct column_extremes {
+            s32 Blocks; /* of 64 rows, from the first, that are in these */
+            s32 Levels;
+            f64 *Mins, *Maxes; /* of the 1<<K blocks from block I, at K*(Stride/64) + I */
+        } **Extremes; /* each built on first use */
+    } Numbers;
+
+    /* NOTE: the body rows of a column, grouped by what the column holds in
+     * them, for mask_sum (see groups.c) */
+    struct group_index {
+        s32 FirstRow, EndRow; /* the body it is over */
+        s32 NumGroups, Size; /* of Slots, a power of two */
+        struct group_slot {
+            u64 Hash;
+            s32 Row; /* the first of the group, or -1 for an empty slot */
+            s32 First, Count; /* of the group's rows in Rows */
+        } *Slots;
+        s32 NumRows;
+        s32 *Rows; /* of each group in turn, in order */
+    } **Groups; /* of each column, each built on first use */
+
+    /* NOTE: what aggregate functions gave over blocks whose cells were all
+     * done, which nothing changes any more (see memo.c) */
+    struct aggregate_memo {
+        s32 Used, Size; /* Size is 0 until it is first used, then a power of two */
+        u64 Hits, Misses;
+        struct memo_entry {
+            u64 Hash;
+            s32 Func; /* an enum expr_func, or -1 for an empty entry */
+            struct cell_ref First, Last;
+            f64 Value;
+        } *Entries;
+    } Memo;
+
+    /* NOTE: the lines of the rows of a document that is loaded lazily, each
+     * lexed the first time any cell of its row is got. Load is only set once
+     * the document is made, and is nullptr again after every row has been
+     * loaded, as it always is for any other document. */
+    struct lazy_rows {
+        void (*Load)(struct document *Doc, s32 Row);
+        u32 *Delims; /* as ScanDelims() found them */
+        s32 NumRows, MaxRows; /* any row past these has no line */
+        s32 NumLoaded;
+        struct lazy_row {
+            u32 Start, End; /* of its line */
+            u32 Delim; /* the first one of its line */
+            bool Loaded;
+        } *Rows;
+        struct cycle_search Cycles; /* as FindCycles() left it, once it has run */
+    } Lazy;
+
     /* TODO(lrak): better macro storage */
 #define MACRO_MAX_COUNT 32
     s32 NumMacros;
     struct macro_def {
-        char *Name;
-        struct expr_node *Body;
+        struct span Name;
+        u32 Body;
     } Macros[MACRO_MAX_COUNT];
 };
 
 struct document *FindExistingDoc(dev_t Device, ino_t Inode);
-struct document *AllocAndLogDoc();
+struct document *AllocAndLogDoc(dev_t Device, ino_t Inode);
+fd OpenSharedDir(fd Dir, char *Path);
+void ReleaseSharedDir(fd Dir);
 
 s32 ColumnExists(struct document *Doc, s32 Col);
 struct column *GetColumn(struct document *Doc, s32 Col);
@@ -117,6 +266,24 @@ s32 CellExists(struct document *Doc, s32 Col, s32 Row);
 struct cell *GetCell(struct document *Doc, s32 Col, s32 Row);
 struct cell *TryGetCell(struct document *Doc, s32 Col, s32 Row);
 struct cell *ReserveCell(struct document *Doc, s32 Col, s32 Row);
+bool RowLoaded(struct document *Doc, s32 Row);
+s32 AddLazyRow(struct document *Doc, struct lazy_row Row);
+void ReleaseLazyRows(struct document *Doc);
+
+struct formula *ReserveFormulas(struct document *Doc, s32 Count);
+struct formula *InternFormula(struct document *Doc, struct span Text, bool *Added);
+u32 ReserveNodes(struct document *Doc, u32 Count);
+s32 EmitInst(struct document *Doc, struct vm_inst Inst);
+s32 AddConst(struct document *Doc, struct expr_node *Node);
+s32 AddDep(struct document *Doc, struct cell_dep Dep);
+s32 AddXenoLink(struct document *Doc, struct span Reference);
+struct number_columns *ReserveNumberColumns(struct document *Doc);
+struct column_sums *ReserveColumnSums(struct document *Doc);
+struct column_extremes *ReserveColumnExtremes(struct document *Doc);
+struct group_index **ReserveGroups(struct document *Doc);
+struct group_index *ReserveGroupIndex(s32 NumSlots, s32 NumRows);
+void GrowGroupIndex(struct group_index *Groups);
+void GrowAggregateMemo(struct aggregate_memo *Memo);
 
 
 #define X_CATEGORIES\
@@ -133,6 +300,17 @@ enum page_categories {
 void *ReserveData(u32 Sz);
 char *SaveStr(char *Str);
 
+/* NOTE: between these, the calling thread reserves from pages of its own, which
+ * are then handed over to the main thread's. It must not be reserving while
+ * that happens. */
+void BeginThreadPages(void);
+void EndThreadPages(void);
+
+/* NOTE: for bookkeeping that does not outlive the work that asked for it */
+void *AllocTemp(umm Sz);
+void *ResizeTemp(void *Temp, umm Sz);
+void FreeTemp(void *Temp);
+
 void PrintAllMemInfo(void);
 void WipeAllMem(void);
 void ReleaseAllMem(void);
@@ -0,0 +1,93 @@
+#include "memo.h"
+
+#include "logging.h"
+#include "numbers.h"
+#include "util.h"
+
+#include <pthread.h>
+
+/* NOTE: taken to look up or fill in any document's memo */
+static pthread_mutex_t MemoLock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline u64
+HashAggregate(enum expr_func Func, struct cell_block Block)
+{
+    u64 Hash = ((u64)(u32)Block.FirstCol << 32 | (u32)Block.FirstRow) * 0x9e3779b97f4a7c15;
+    Hash ^= ((u64)(u32)Block.LastCol << 32 | (u32)Block.LastRow) * 0xc2b2ae3d27d4eb4f;
+    Hash ^= (u64)Func * 0x165667b19e3779f9;
+    return Hash ^ (Hash >> 31);
+}
+
+/* The entry of Func over Block, or the empty entry where it would go */
+static struct memo_entry *
+FindMemoEntry(struct aggregate_memo *Memo, enum expr_func Func, struct cell_block Block, u64 Hash)
+{
+    u32 Mask = Memo->Size - 1;
+    for (u32 Idx = Hash & Mask;; Idx = (Idx + 1) & Mask) {
+        struct memo_entry *Entry = Memo->Entries + Idx;
+        if (Entry->Func < 0) {
+            return Entry;
+        }
+        else if (Entry->Hash == Hash && Entry->Func == (s32)Func
+                && Entry->First.Col == Block.FirstCol && Entry->First.Row == Block.FirstRow
+                && Entry->Last.Col == Block.LastCol && Entry->Last.Row == Block.LastRow) {
+            return Entry;
+        }
+    }
+}
+
+/* Returns whether Func over Block is remembered, in which case it is put in
+ * *Out. Either way it counts toward the memo's hits or misses. */
+bool
+RecallAggregate(struct document *Doc, enum expr_func Func, struct cell_block Block, f64 *Out)
+{
+    struct aggregate_memo *Memo = &Doc->Memo;
+    u64 Hash = HashAggregate(Func, Block);
+    bool Found = false;
+
+    pthread_mutex_lock(&MemoLock);
+    if (Memo->Size) {
+        struct memo_entry *Entry = FindMemoEntry(Memo, Func, Block, Hash);
+        if (Entry->Func >= 0) {
+            *Out = Entry->Value;
+            Found = true;
+        }
+    }
+    ++*(Found? &Memo->Hits: &Memo->Misses);
+    pthread_mutex_unlock(&MemoLock);
+
+    return Found;
+}
+
+/* NOTE: another thread may have got to the same block first, which will have
+ * given the same value */
+void
+RememberAggregate(struct document *Doc, enum expr_func Func, struct cell_block Block, f64 Value)
+{
+    /* NOTE: the cells that are still being evaluated were read as empty, so
+     * the value only holds for good when there are none */
+    for (s32 Col = Block.FirstCol; Col <= Block.LastCol; ++Col) {
+        if (NextExprRow(Doc, Col, Block.FirstRow, Block.LastRow) <= Block.LastRow) return;
+    }
+
+    struct aggregate_memo *Memo = &Doc->Memo;
+    u64 Hash = HashAggregate(Func, Block);
+
+    pthread_mutex_lock(&MemoLock);
+    /* NOTE: kept at most half full */
+    if (2*(Memo->Used + 1) > Memo->Size) {
+        GrowAggregateMemo(Memo);
+    }
+
+    struct memo_entry *Entry = FindMemoEntry(Memo, Func, Block, Hash);
+    if (Entry->Func < 0) {
+        *Entry = (struct memo_entry){
+            .Hash = Hash, .Func = Func,
+            .First = { Block.FirstCol, Block.FirstRow },
+            .Last = { Block.LastCol, Block.LastRow },
+            .Value = Value,
+        };
+        ++Memo->Used;
+    }
+    pthread_mutex_unlock(&MemoLock);
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include "common.h"
+
+#include "expr.h"
+#include "mem.h"
+
+/* What the aggregate functions of a document give over its blocks, kept once
+ * every cell of the block is done, as then they can not change. A value is
+ * not kept while any of them are not. */
+bool RecallAggregate(struct document *Doc, enum expr_func Func, struct cell_block Block, f64 *Out);
+void RememberAggregate(struct document *Doc, enum expr_func Func, struct cell_block Block, f64 Value);
@@ -0,0 +1,724 @@
+#include "numbers.h"
+
+#include "logging.h"
+#include "util.h"
+
+#include <math.h>
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* NOTE: Values, IsNumber and IsExpr are only ever changed a cell at a time, by
+ * whichever thread evaluated it. Cells of one column share bitmap words, so
+ * those are changed atomically; a reader only cares for the bits of cells
+ * that are done, which nothing changes any more. A cell's IsExpr bit is
+ * cleared last, so whoever sees it cleared sees the rest of it. */
+static inline u64
+LoadBits(u64 *Word)
+{
+    return __atomic_load_n(Word, __ATOMIC_ACQUIRE);
+}
+
+/* The bits of the rows First to End-1 of one word, which has rows Base to
+ * Base+63 */
+static inline u64
+RowMask(s32 Base, s32 First, s32 End)
+{
+    s32 Lo = Max(First - Base, 0);
+    s32 Hi = Min(End - Base, 64);
+    u64 Below = (Hi == 64)? ~(u64)0: ((u64)1 << Hi) - 1;
+    return Below & ~(((u64)1 << Lo) - 1);
+}
+
+/* NOTE: unlike Min() and Max(), these keep a NaN once they have one. That is
+ * all that the spans and the range index tell of one; a range that has one is
+ * then taken apart (see ExtremeNumber()). */
+static inline f64 MinOrNaN(f64 A, f64 B) { return isnan(A)? A: Min(A, B); }
+static inline f64 MaxOrNaN(f64 A, f64 B) { return isnan(A)? A: Max(A, B); }
+
+#if USE_REGROUPED_SUMS
+[[maybe_unused]]
+static f64
+SumSpan_Scalar(f64 *Values, s32 Count)
+{
+    f64 Sum = 0;
+    for (s32 Idx = 0; Idx < Count; ++Idx) {
+        Sum += Values[Idx];
+    }
+    return Sum;
+}
+#endif
+
+[[maybe_unused]]
+static f64
+MinSpan_Scalar(f64 *Values, s32 Count)
+{
+    f64 Number = INFINITY;
+    for (s32 Idx = 0; Idx < Count; ++Idx) {
+        Number = MinOrNaN(Number, Values[Idx]);
+    }
+    return Number;
+}
+
+[[maybe_unused]]
+static f64
+MaxSpan_Scalar(f64 *Values, s32 Count)
+{
+    f64 Number = -INFINITY;
+    for (s32 Idx = 0; Idx < Count; ++Idx) {
+        Number = MaxOrNaN(Number, Values[Idx]);
+    }
+    return Number;
+}
+
+#if defined(__SSE2__)
+#if USE_REGROUPED_SUMS
+/* NOTE: these add the lanes apart and then together, which rounds apart from
+ * adding the values one at a time */
+static f64
+SumSpan_SSE2(f64 *Values, s32 Count)
+{
+    __m128d A = _mm_setzero_pd(), B = _mm_setzero_pd();
+    s32 Idx = 0;
+    for (; Idx + 4 <= Count; Idx += 4) {
+        A = _mm_add_pd(A, _mm_loadu_pd(Values + Idx));
+        B = _mm_add_pd(B, _mm_loadu_pd(Values + Idx + 2));
+    }
+    A = _mm_add_pd(A, B);
+    f64 Sum = _mm_cvtsd_f64(_mm_add_sd(A, _mm_unpackhi_pd(A, A)));
+    for (; Idx < Count; ++Idx) {
+        Sum += Values[Idx];
+    }
+    return Sum;
+}
+#endif
+
+static f64
+MinSpan_SSE2(f64 *Values, s32 Count)
+{
+    __m128d A = _mm_set1_pd(INFINITY), NaNs = _mm_setzero_pd();
+    s32 Idx = 0;
+    for (; Idx + 2 <= Count; Idx += 2) {
+        __m128d V = _mm_loadu_pd(Values + Idx);
+        A = _mm_min_pd(A, V);
+        NaNs = _mm_or_pd(NaNs, _mm_cmpunord_pd(V, V));
+    }
+    f64 Number = _mm_movemask_pd(NaNs)? NAN: _mm_cvtsd_f64(_mm_min_sd(A, _mm_unpackhi_pd(A, A)));
+    for (; Idx < Count; ++Idx) {
+        Number = MinOrNaN(Number, Values[Idx]);
+    }
+    return Number;
+}
+
+static f64
+MaxSpan_SSE2(f64 *Values, s32 Count)
+{
+    __m128d A = _mm_set1_pd(-INFINITY), NaNs = _mm_setzero_pd();
+    s32 Idx = 0;
+    for (; Idx + 2 <= Count; Idx += 2) {
+        __m128d V = _mm_loadu_pd(Values + Idx);
+        A = _mm_max_pd(A, V);
+        NaNs = _mm_or_pd(NaNs, _mm_cmpunord_pd(V, V));
+    }
+    f64 Number = _mm_movemask_pd(NaNs)? NAN: _mm_cvtsd_f64(_mm_max_sd(A, _mm_unpackhi_pd(A, A)));
+    for (; Idx < Count; ++Idx) {
+        Number = MaxOrNaN(Number, Values[Idx]);
+    }
+    return Number;
+}
+
+#if USE_REGROUPED_SUMS
+__attribute__((target("avx2")))
+static f64
+SumSpan_AVX2(f64 *Values, s32 Count)
+{
+    /* NOTE: four sums at once, to hide the latency of the adds */
+    __m256d A = _mm256_setzero_pd(), B = _mm256_setzero_pd();
+    __m256d C = _mm256_setzero_pd(), D = _mm256_setzero_pd();
+    s32 Idx = 0;
+    for (; Idx + 16 <= Count; Idx += 16) {
+        A = _mm256_add_pd(A, _mm256_loadu_pd(Values + Idx));
+        B = _mm256_add_pd(B, _mm256_loadu_pd(Values + Idx + 4));
+        C = _mm256_add_pd(C, _mm256_loadu_pd(Values + Idx + 8));
+        D = _mm256_add_pd(D, _mm256_loadu_pd(Values + Idx + 12));
+    }
+    for (; Idx + 4 <= Count; Idx += 4) {
+        A = _mm256_add_pd(A, _mm256_loadu_pd(Values + Idx));
+    }
+    A = _mm256_add_pd(_mm256_add_pd(A, B), _mm256_add_pd(C, D));
+    __m128d Half = _mm_add_pd(_mm256_castpd256_pd128(A), _mm256_extractf128_pd(A, 1));
+    f64 Sum = _mm_cvtsd_f64(_mm_add_sd(Half, _mm_unpackhi_pd(Half, Half)));
+    for (; Idx < Count; ++Idx) {
+        Sum += Values[Idx];
+    }
+    return Sum;
+}
+#endif
+
+__attribute__((target("avx2")))
+static f64
+MinSpan_AVX2(f64 *Values, s32 Count)
+{
+    __m256d A = _mm256_set1_pd(INFINITY), B = A, NaNs = _mm256_setzero_pd();
+    s32 Idx = 0;
+    for (; Idx + 8 <= Count; Idx += 8) {
+        __m256d V = _mm256_loadu_pd(Values + Idx), W = _mm256_loadu_pd(Values + Idx + 4);
+        A = _mm256_min_pd(A, V);
+        B = _mm256_min_pd(B, W);
+        NaNs = _mm256_or_pd(NaNs, _mm256_or_pd(_mm256_cmp_pd(V, V, _CMP_UNORD_Q), _mm256_cmp_pd(W, W, _CMP_UNORD_Q)));
+    }
+    A = _mm256_min_pd(A, B);
+    __m128d Half = _mm_min_pd(_mm256_castpd256_pd128(A), _mm256_extractf128_pd(A, 1));
+    f64 Number = _mm256_movemask_pd(NaNs)? NAN: _mm_cvtsd_f64(_mm_min_sd(Half, _mm_unpackhi_pd(Half, Half)));
+    for (; Idx < Count; ++Idx) {
+        Number = MinOrNaN(Number, Values[Idx]);
+    }
+    return Number;
+}
+
+__attribute__((target("avx2")))
+static f64
+MaxSpan_AVX2(f64 *Values, s32 Count)
+{
+    __m256d A = _mm256_set1_pd(-INFINITY), B = A, NaNs = _mm256_setzero_pd();
+    s32 Idx = 0;
+    for (; Idx + 8 <= Count; Idx += 8) {
+        __m256d V = _mm256_loadu_pd(Values + Idx), W = _mm256_loadu_pd(Values + Idx + 4);
+        A = _mm256_max_pd(A, V);
+        B = _mm256_max_pd(B, W);
+        NaNs = _mm256_or_pd(NaNs, _mm256_or_pd(_mm256_cmp_pd(V, V, _CMP_UNORD_Q), _mm256_cmp_pd(W, W, _CMP_UNORD_Q)));
+    }
+    A = _mm256_max_pd(A, B);
+    __m128d Half = _mm_max_pd(_mm256_castpd256_pd128(A), _mm256_extractf128_pd(A, 1));
+    f64 Number = _mm256_movemask_pd(NaNs)? NAN: _mm_cvtsd_f64(_mm_max_sd(Half, _mm_unpackhi_pd(Half, Half)));
+    for (; Idx < Count; ++Idx) {
+        Number = MaxOrNaN(Number, Values[Idx]);
+    }
+    return Number;
+}
+#endif
+
+typedef f64 span_func(f64 *Values, s32 Count);
+
+#if defined(__SSE2__)
+#define PickSpanFunc(Name) (__builtin_cpu_supports("avx2")? Name##_AVX2: Name##_SSE2)
+#else
+#define PickSpanFunc(Name) (Name##_Scalar)
+#endif
+
+static inline f64 *
+ColumnValues(struct number_columns *Numbers, s32 Col)
+{
+    return Numbers->Values + (umm)Col*Numbers->Stride;
+}
+
+static inline u64 *
+ColumnBits(struct number_columns *Numbers, u64 *Bits, s32 Col)
+{
+    return Bits + (umm)Col*Numbers->Stride/64;
+}
+
+/* Copy the value of a cell that has just been evaluated */
+void
+UpdateNumberColumn(struct document *Doc, s32 Col, s32 Row)
+{
+    struct number_columns *Numbers = &Doc->Numbers;
+    Assert(0 <= Col && Col < Numbers->Cols);
+    Assert(0 <= Row && Row < Numbers->Stride);
+
+    struct cell *Cell = GetCell(Doc, Col, Row);
+    u64 Bit = (u64)1 << (Row % 64);
+    u64 *IsNumber = ColumnBits(Numbers, Numbers->IsNumber, Col) + Row/64;
+    u64 *IsExpr = ColumnBits(Numbers, Numbers->IsExpr, Col) + Row/64;
+
+    if (Cell->Type == CELL_NUMBER) {
+        ColumnValues(Numbers, Col)[Row] = Cell->AsNumber;
+        __atomic_fetch_or(IsNumber, Bit, __ATOMIC_RELAXED);
+    }
+    else {
+        ColumnValues(Numbers, Col)[Row] = 0;
+        __atomic_fetch_and(IsNumber, ~Bit, __ATOMIC_RELAXED);
+    }
+
+    /* NOTE: once a cell is done it does not change again, so the running sums
+     * of its column, which only ever cover cells that are done, stay valid */
+    Assert(Cell->Type != CELL_EXPR);
+#if USE_PREFIX_SUMS
+    struct column_sums *Sums = __atomic_load_n(Numbers->Sums + Col, __ATOMIC_ACQUIRE);
+    Assert(!Sums || Row >= __atomic_load_n(&Sums->Valid, __ATOMIC_ACQUIRE));
+#endif
+#if USE_RANGE_INDEX
+    struct column_extremes *Extremes = __atomic_load_n(Numbers->Extremes + Col, __ATOMIC_ACQUIRE);
+    Assert(!Extremes || Row/64 >= __atomic_load_n(&Extremes->Blocks, __ATOMIC_ACQUIRE));
+#endif
+    __atomic_fetch_and(IsExpr, ~Bit, __ATOMIC_RELEASE);
+}
+
+/* Copy every cell of Doc, which must be done loading, into its number
+ * columns. From then on, each cell that is evaluated updates its own. Rows
+ * that are yet to be loaded count as expressions, until they are. */
+void
+FillNumberColumns(struct document *Doc)
+{
+    Assert(Doc);
+    struct number_columns *Numbers = ReserveNumberColumns(Doc);
+
+    for (s32 Col = 0; Col < Numbers->Cols; ++Col) {
+        f64 *Values = ColumnValues(Numbers, Col);
+        u64 *IsNumber = ColumnBits(Numbers, Numbers->IsNumber, Col);
+        u64 *IsExpr = ColumnBits(Numbers, Numbers->IsExpr, Col);
+
+        for (s32 Row = 0; Row < Doc->Rows; ++Row) {
+            u64 Bit = (u64)1 << (Row % 64);
+            if (!RowLoaded(Doc, Row)) {
+                IsExpr[Row/64] |= Bit;
+                continue;
+            }
+
+            struct cell *Cell = GetCell(Doc, Col, Row);
+            if (Cell->Type == CELL_NUMBER) {
+                Values[Row] = Cell->AsNumber;
+                IsNumber[Row/64] |= Bit;
+            }
+            else if (Cell->Type == CELL_EXPR) {
+                IsExpr[Row/64] |= Bit;
+            }
+        }
+    }
+}
+
+/* Copy the cells of Row, which has just been loaded, into the number columns
+ * that FillNumberColumns() left it out of */
+void
+FillNumberRow(struct document *Doc, s32 Row)
+{
+    struct number_columns *Numbers = &Doc->Numbers;
+    Assert(0 <= Row && Row < Numbers->Stride);
+    u64 Bit = (u64)1 << (Row % 64);
+
+    for (s32 Col = 0; Col < Numbers->Cols; ++Col) {
+        struct cell *Cell = GetCell(Doc, Col, Row);
+        if (Cell->Type == CELL_NUMBER) {
+            ColumnValues(Numbers, Col)[Row] = Cell->AsNumber;
+            ColumnBits(Numbers, Numbers->IsNumber, Col)[Row/64] |= Bit;
+        }
+        if (Cell->Type != CELL_EXPR) {
+            ColumnBits(Numbers, Numbers->IsExpr, Col)[Row/64] &= ~Bit;
+        }
+    }
+}
+
+/* Returns the first row from FirstRow on that holds an expression, or
+ * LastRow + 1 when there is none */
+s32
+NextExprRow(struct document *Doc, s32 Col, s32 FirstRow, s32 LastRow)
+{
+    struct number_columns *Numbers = &Doc->Numbers;
+    Assert(0 <= Col && Col < Numbers->Cols);
+    u64 *IsExpr = ColumnBits(Numbers, Numbers->IsExpr, Col);
+
+    /* NOTE: bits are only ever cleared once a column is filled, so there is
+     * nothing to find before the first one that was found last time */
+    s32 *FirstExpr = Numbers->FirstExpr + Col;
+    s32 Known = __atomic_load_n(FirstExpr, __ATOMIC_RELAXED);
+    s32 From = Max(FirstRow, Known);
+
+    s32 End = LastRow + 1;
+    s32 Found = End;
+    for (s32 Base = From & ~63; Base < End; Base += 64) {
+        u64 Bits = LoadBits(IsExpr + Base/64) & RowMask(Base, From, End);
+        if (Bits) {
+            Found = Base + __builtin_ctzll(Bits);
+            break;
+        }
+    }
+
+    if (From == Known && Found > Known) {
+        /* NOTE: a race with another thread can only leave this too early */
+        __atomic_store_n(FirstExpr, Found, __ATOMIC_RELAXED);
+    }
+    return Found;
+}
+
+#if USE_PREFIX_SUMS
+/* NOTE: taken to extend any column's running sums */
+static pthread_mutex_t SumsLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns the end of the rows from FirstRow up to LastRow that the running
+ * sums of Col cover, which are found in *Out. That is FirstRow itself when
+ * there are none.
+ *
+ * A column's sums are made for the first range over it that is worth it, and
+ * always start from its first row. They are extended up to the end of each
+ * range over it, as far as its cells are done. A running total down a column
+ * is then one more row each time, and summed in the same order as one row at
+ * a time would. Counts are exact, so any two of them give the count of the
+ * rows between; sums are not (see SumNumbers()). */
+static s32
+SummedRows(struct document *Doc, s32 Col, s32 FirstRow, s32 LastRow, struct column_sums **Out)
+{
+    struct number_columns *Numbers = &Doc->Numbers;
+    struct column_sums *Sums = __atomic_load_n(Numbers->Sums + Col, __ATOMIC_ACQUIRE);
+
+    if (!Sums && LastRow - FirstRow + 1 < MIN_PREFIX_ROWS) {
+        return FirstRow;
+    }
+
+    s32 Valid = Sums? __atomic_load_n(&Sums->Valid, __ATOMIC_ACQUIRE): 0;
+    if (!Sums || Valid <= LastRow) {
+        pthread_mutex_lock(&SumsLock);
+        if (!(Sums = Numbers->Sums[Col])) {
+            Sums = ReserveColumnSums(Doc);
+            __atomic_store_n(Numbers->Sums + Col, Sums, __ATOMIC_RELEASE);
+        }
+
+        f64 *Values = ColumnValues(Numbers, Col);
+        u64 *IsNumber = ColumnBits(Numbers, Numbers->IsNumber, Col);
+        Valid = Sums->Valid;
+        s32 Row = Valid;
+        s32 End = NextExprRow(Doc, Col, Row, LastRow);
+
+        f64 Sum = Sums->Sums[Valid];
+        s32 Count = Sums->Counts[Valid];
+        for (; Row < End; ++Row) {
+            Sum += Values[Row];
+            Count += (LoadBits(IsNumber + Row/64) >> (Row % 64)) & 1;
+            ++Valid;
+            Sums->Sums[Valid] = Sum;
+            Sums->Counts[Valid] = Count;
+        }
+
+        __atomic_store_n(&Sums->Valid, Valid, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&SumsLock);
+    }
+
+    *Out = Sums;
+    return Max(FirstRow, Min(LastRow + 1, Valid));
+}
+#endif
+
+s32
+CountNumbers(struct document *Doc, s32 Col, s32 FirstRow, s32 LastRow)
+{
+    struct number_columns *Numbers = &Doc->Numbers;
+    Assert(0 <= Col && Col < Numbers->Cols);
+    u64 *IsNumber = ColumnBits(Numbers, Numbers->IsNumber, Col);
+
+    s32 Count = 0;
+    if (FirstRow > LastRow) return 0;
+#if USE_PREFIX_SUMS
+    struct column_sums *Sums;
+    s32 Done = SummedRows(Doc, Col, FirstRow, LastRow, &Sums);
+    if (Done > FirstRow) {
+        Count = Sums->Counts[Done] - Sums->Counts[FirstRow];
+        FirstRow = Done;
+    }
+#endif
+
+    s32 End = LastRow + 1;
+    for (s32 Base = FirstRow & ~63; Base < End; Base += 64) {
+        Count += __builtin_popcountll(LoadBits(IsNumber + Base/64) & RowMask(Base, FirstRow, End));
+    }
+    return Count;
+}
+
+/* NOTE: the cells that are not numbers hold 0, which adds nothing. The rows
+ * are added onto Sum one at a time, in the order the cells would be, as adds
+ * done in any other order round apart from them. */
+f64
+SumNumbers(struct document *Doc, s32 Col, s32 FirstRow, s32 LastRow, f64 Sum)
+{
+    struct number_columns *Numbers = &Doc->Numbers;
+    Assert(0 <= Col && Col < Numbers->Cols);
+    Assert(LastRow < Numbers->Stride);
+
+    if (FirstRow > LastRow) return Sum;
+#if USE_PREFIX_SUMS
+    /* NOTE: the difference of two running sums rounds apart from adding up
+     * the rows between them, so they only stand in for a sum that has come to
+     * the same as they have by its first row. That is any sum from nothing
+     * whose rows before it are not numbers, as those add nothing. A running
+     * sum is never -0, which would add up apart from 0. */
+    struct column_sums *Sums;
+    s32 Done = SummedRows(Doc, Col, FirstRow, LastRow, &Sums);
+    if (Done > FirstRow && Sums->Sums[FirstRow] == Sum && !signbit(Sum)) {
+        Sum = Sums->Sums[Done];
+        FirstRow = Done;
+    }
+#endif
+
+    f64 *Values = ColumnValues(Numbers, Col);
+#if USE_REGROUPED_SUMS
+    if (FirstRow <= LastRow) {
+        Sum += PickSpanFunc(SumSpan)(Values + FirstRow, LastRow - FirstRow + 1);
+    }
+#else
+    for (s32 Row = FirstRow; Row <= LastRow; ++Row) {
+        Sum += Values[Row];
+    }
+#endif
+    return Sum;
+}
+
+/* The extreme of the numbers among the rows, which is Start when there are
+ * none. Runs of 64 numbers go through Span at once; the rest are picked out
+ * of their words a bit at a time. */
+static f64
+ScanExtreme(struct document *Doc, s32 Col, s32 FirstRow, s32 LastRow,
+        f64 Start, span_func *Span, bool IsMin)
+{
+    struct number_columns *Numbers = &Doc->Numbers;
+    Assert(0 <= Col && Col < Numbers->Cols);
+    Assert(LastRow < Numbers->Stride);
+    f64 *Values = ColumnValues(Numbers, Col);
+    u64 *IsNumber = ColumnBits(Numbers, Numbers->IsNumber, Col);
+
+    f64 Number = Start;
+    s32 End = LastRow + 1;
+    for (s32 Base = FirstRow & ~63; Base < End; Base += 64) {
+        u64 Mask = RowMask(Base, FirstRow, End);
+        u64 Bits = LoadBits(IsNumber + Base/64) & Mask;
+        if (Bits == Mask) {
+            s32 First = Base + __builtin_ctzll(Mask);
+            s32 Count = __builtin_popcountll(Mask);
+            f64 This = Span(Values + First, Count);
+            Number = IsMin? MinOrNaN(Number, This): MaxOrNaN(Number, This);
+        }
+        else for (; Bits; Bits &= Bits - 1) {
+            f64 This = Values[Base + __builtin_ctzll(Bits)];
+            Number = IsMin? MinOrNaN(Number, This): MaxOrNaN(Number, This);
+        }
+    }
+    return Number;
+}
+
+#if USE_RANGE_INDEX
+/* NOTE: taken to extend any column's range index */
+static pthread_mutex_t ExtremesLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns how many of the first Want blocks of Col its range index covers,
+ * which is found in *Out.
+ *
+ * A column's index is a sparse table over its blocks of 64 rows: level K
+ * holds the extremes of each run of 1<<K blocks. It starts from the first
+ * block and is extended up to the end of each range over the column, as far
+ * as whole blocks of it are done. Each new block only adds the one run of
+ * each level that ends with it. */
+static s32
+IndexedBlocks(struct document *Doc, s32 Col, s32 Want, struct column_extremes **Out)
+{
+    struct number_columns *Numbers = &Doc->Numbers;
+    struct column_extremes *Extremes = __atomic_load_n(Numbers->Extremes + Col, __ATOMIC_ACQUIRE);
+    s32 Blocks = Extremes? __atomic_load_n(&Extremes->Blocks, __ATOMIC_ACQUIRE): 0;
+
+    if (Blocks < Want) {
+        pthread_mutex_lock(&ExtremesLock);
+        if (!(Extremes = Numbers->Extremes[Col])) {
+            Extremes = ReserveColumnExtremes(Doc);
+            __atomic_store_n(Numbers->Extremes + Col, Extremes, __ATOMIC_RELEASE);
+        }
+
+        s32 NumBlocks = Numbers->Stride/64;
+        u64 *IsExpr = ColumnBits(Numbers, Numbers->IsExpr, Col);
+        for (Blocks = Extremes->Blocks; Blocks < Want && !LoadBits(IsExpr + Blocks); ++Blocks) {
+            s32 Base = Blocks*64;
+            Extremes->Mins[Blocks] = ScanExtreme(Doc, Col, Base, Base + 63, INFINITY, PickSpanFunc(MinSpan), true);
+            Extremes->Maxes[Blocks] = ScanExtreme(Doc, Col, Base, Base + 63, -INFINITY, PickSpanFunc(MaxSpan), false);
+
+            for (s32 K = 1; (1 << K) <= Blocks + 1; ++K) {
+                s32 First = Blocks + 1 - (1 << K), Half = 1 << (K - 1);
+                f64 *Mins = Extremes->Mins + K*NumBlocks, *Maxes = Extremes->Maxes + K*NumBlocks;
+                Mins[First] = MinOrNaN(Mins[First - NumBlocks], Mins[First + Half - NumBlocks]);
+                Maxes[First] = MaxOrNaN(Maxes[First - NumBlocks], Maxes[First + Half - NumBlocks]);
+            }
+        }
+
+        __atomic_store_n(&Extremes->Blocks, Blocks, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&ExtremesLock);
+    }
+
+    *Out = Extremes;
+    return Min(Blocks, Want);
+}
+#endif
+
+/* The last of the rows that holds a NaN, which must be there. *Last is
+ * whether no number comes after it. */
+static s32
+LastNaNRow(struct document *Doc, s32 Col, s32 FirstRow, s32 LastRow, bool *Last)
+{
+    struct number_columns *Numbers = &Doc->Numbers;
+    f64 *Values = ColumnValues(Numbers, Col);
+    u64 *IsNumber = ColumnBits(Numbers, Numbers->IsNumber, Col);
+
+    *Last = true;
+    for (s32 Base = LastRow & ~63; Base >= (FirstRow & ~63); Base -= 64) {
+        u64 Bits = LoadBits(IsNumber + Base/64) & RowMask(Base, FirstRow, LastRow + 1);
+        for (; Bits; Bits &= ~((u64)1 << (63 - __builtin_clzll(Bits)))) {
+            s32 Row = Base + 63 - __builtin_clzll(Bits);
+            if (isnan(Values[Row])) return Row;
+            *Last = false;
+        }
+    }
+    invalid_code_path;
+    return FirstRow;
+}
+
+/* The extreme of the numbers among the rows, which is Start when there are
+ * none. Whole blocks of a long enough range come out of the column's range
+ * index, two runs of them at most; the rest of it is scanned.
+ *
+ * Taken a cell at a time, Min() and Max() drop what they had for a NaN, and
+ * the NaN for the next number. So a range with a NaN comes to that NaN if it
+ * is its last number, or else to the extreme of the numbers after it. */
+static f64
+ExtremeNumber(struct document *Doc, s32 Col, s32 FirstRow, s32 LastRow,
+        f64 Start, span_func *Span, bool IsMin)
+{
+    f64 Number = Start;
+    s32 Row = FirstRow;
+#if USE_RANGE_INDEX
+    s32 FirstBlock = (FirstRow + 63)/64;
+    s32 EndBlock = (LastRow + 1)/64;
+    if (EndBlock - FirstBlock >= MIN_INDEX_BLOCKS) {
+        struct column_extremes *Extremes;
+        s32 Blocks = IndexedBlocks(Doc, Col, EndBlock, &Extremes);
+        if (Blocks > FirstBlock) {
+            s32 K = 31 - __builtin_clz(Blocks - FirstBlock);
+            f64 *Level = (IsMin? Extremes->Mins: Extremes->Maxes) + K*(Doc->Numbers.Stride/64);
+            f64 A = Level[FirstBlock], B = Level[Blocks - (1 << K)];
+            Number = IsMin? MinOrNaN(A, B): MaxOrNaN(A, B);
+
+            Number = ScanExtreme(Doc, Col, FirstRow, FirstBlock*64 - 1, Number, Span, IsMin);
+            Row = Blocks*64;
+        }
+    }
+#endif
+    Number = ScanExtreme(Doc, Col, Row, LastRow, Number, Span, IsMin);
+
+    if (isnan(Number)) {
+        bool Last;
+        Row = LastNaNRow(Doc, Col, FirstRow, LastRow, &Last);
+        Number = Last? ColumnValues(&Doc->Numbers, Col)[Row]
+            : ExtremeNumber(Doc, Col, Row + 1, LastRow, Start, Span, IsMin);
+    }
+    return Number;
+}
+
+f64
+MinNumber(struct document *Doc, s32 Col, s32 FirstRow, s32 LastRow)
+{
+    return ExtremeNumber(Doc, Col, FirstRow, LastRow, INFINITY, PickSpanFunc(MinSpan), true);
+}
+
+f64
+MaxNumber(struct document *Doc, s32 Col, s32 FirstRow, s32 LastRow)
+{
+    return ExtremeNumber(Doc, Col, FirstRow, LastRow, -INFINITY, PickSpanFunc(MaxSpan), false);
+}
+
+#if USE_ROW_LOCAL_SCAN
+/* NOTE: every instruction runs over the whole block at once, one lane per row.
+ * Each lane sees just the operations that Execute() would do, in the same
+ * order, so it gets the very same number. */
+[[gnu::always_inline]]
+static inline void
+RunLanes(struct number_columns *Numbers, struct vm_inst *Code, struct expr_node *Consts,
+        s32 Col, s32 Base, u64 Want, f64 *Out)
+{
+    f64 Lanes[MAX_ROW_LOCAL_DEPTH][64];
+    s32 Top = -1;
+
+    for (struct vm_inst *Inst = Code; Inst->Op != OP_HALT; ++Inst) {
+        switch (Inst->Op) {
+        case OP_PUSH: {
+            f64 Number = Consts[Inst->Arg].AsNumber;
+            f64 *Lane = Lanes[++Top];
+            for (s32 Idx = 0; Idx < 64; ++Idx) Lane[Idx] = Number;
+        } break;
+
+        case OP_CELL: {
+            s32 AtCol = Consts[Inst->Arg].AsCell.Col + ((Inst->Sub & VM_REL_COL)? Col: 0);
+            f64 *Values = ColumnValues(Numbers, AtCol) + Base;
+            f64 *Lane = Lanes[++Top];
+            /* NOTE: the rows not wanted may still be being evaluated */
+            for (s32 Idx = 0; Idx < 64; ++Idx) Lane[Idx] = ((Want >> Idx) & 1)? Values[Idx]: 0;
+        } break;
+
+        case OP_NEGATE: {
+            f64 *Lane = Lanes[Top];
+            for (s32 Idx = 0; Idx < 64; ++Idx) Lane[Idx] *= -1;
+        } break;
+
+        case OP_SET:
+            break;
+
+        case OP_ACCUM: {
+            f64 *Acc = Lanes[Top - 1], *Lane = Lanes[Top--];
+            switch (Inst->Sub) {
+            case EN_OP_ADD: for (s32 Idx = 0; Idx < 64; ++Idx) Acc[Idx] += Lane[Idx]; break;
+            case EN_OP_SUB: for (s32 Idx = 0; Idx < 64; ++Idx) Acc[Idx] -= Lane[Idx]; break;
+            case EN_OP_MUL: for (s32 Idx = 0; Idx < 64; ++Idx) Acc[Idx] *= Lane[Idx]; break;
+            case EN_OP_DIV: for (s32 Idx = 0; Idx < 64; ++Idx) Acc[Idx] /= Lane[Idx]; break;
+            default: invalid_code_path;
+            }
+        } break;
+
+        default: invalid_code_path;
+        }
+    }
+
+    Assert(Top == 0);
+    memcpy(Out, Lanes[0], sizeof Lanes[0]);
+}
+
+#if defined(__SSE2__)
+static void
+RunLanes_SSE2(struct number_columns *Numbers, struct vm_inst *Code, struct expr_node *Consts,
+        s32 Col, s32 Base, u64 Want, f64 *Out)
+{
+    RunLanes(Numbers, Code, Consts, Col, Base, Want, Out);
+}
+
+__attribute__((target("avx2")))
+static void
+RunLanes_AVX2(struct number_columns *Numbers, struct vm_inst *Code, struct expr_node *Consts,
+        s32 Col, s32 Base, u64 Want, f64 *Out)
+{
+    RunLanes(Numbers, Code, Consts, Col, Base, Want, Out);
+}
+#else
+static void
+RunLanes_Scalar(struct number_columns *Numbers, struct vm_inst *Code, struct expr_node *Consts,
+        s32 Col, s32 Base, u64 Want, f64 *Out)
+{
+    RunLanes(Numbers, Code, Consts, Col, Base, Want, Out);
+}
+#endif
+
+u64
+RunRowLocal(struct document *Doc, struct vm_inst *Code, struct expr_node *Consts,
+        s32 Col, s32 Base, u64 Want, f64 Out[static 64])
+{
+    struct number_columns *Numbers = &Doc->Numbers;
+    Assert(Base % 64 == 0 && Base < Numbers->Stride);
+
+    for (struct vm_inst *Inst = Code; Want && Inst->Op != OP_HALT; ++Inst) {
+        if (Inst->Op == OP_CELL) {
+            s32 AtCol = Consts[Inst->Arg].AsCell.Col + ((Inst->Sub & VM_REL_COL)? Col: 0);
+            if (!(0 <= AtCol && AtCol < Numbers->Cols)) return 0;
+
+            /* NOTE: only a cell that is done has its number for good */
+            Want &= ~LoadBits(ColumnBits(Numbers, Numbers->IsExpr, AtCol) + Base/64);
+            Want &= LoadBits(ColumnBits(Numbers, Numbers->IsNumber, AtCol) + Base/64);
+        }
+    }
+
+    if (Want) {
+        PickSpanFunc(RunLanes)(Numbers, Code, Consts, Col, Base, Want, Out);
+    }
+    return Want;
+}
+#endif
@@ -0,0 +1,28 @@
+#pragma once
+#include "common.h"
+
+#include "expr.h"
+#include "mem.h"
+
+/* The numbers of a document's cells, copied into columns of plain f64s as the
+ * cells get their values, so that the aggregate functions run over ranges
+ * without looking at a single cell (see struct number_columns). */
+void FillNumberColumns(struct document *Doc);
+void UpdateNumberColumn(struct document *Doc, s32 Col, s32 Row);
+void FillNumberRow(struct document *Doc, s32 Row);
+
+/* NOTE: each of these is over the rows FirstRow to LastRow of column Col,
+ * which must be cells of the document */
+s32 NextExprRow(struct document *Doc, s32 Col, s32 FirstRow, s32 LastRow);
+s32 CountNumbers(struct document *Doc, s32 Col, s32 FirstRow, s32 LastRow);
+f64 SumNumbers(struct document *Doc, s32 Col, s32 FirstRow, s32 LastRow, f64 Sum);
+f64 MinNumber(struct document *Doc, s32 Col, s32 FirstRow, s32 LastRow);
+f64 MaxNumber(struct document *Doc, s32 Col, s32 FirstRow, s32 LastRow);
+
+/* NOTE: Code is that of a formula of column Col that only reads numbers and
+ * cells of its own row (see IsRowLocalFormula()), and Want of the 64 rows from
+ * Base, which must be a multiple of 64, are the rows to evaluate it for. Returns
+ * those of them whose cells it reads are all numbers that are done, with their
+ * values in Out. */
+u64 RunRowLocal(struct document *Doc, struct vm_inst *Code, struct expr_node *Consts,
+        s32 Col, s32 Base, u64 Want, f64 Out[static 64]);
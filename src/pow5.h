@@ -0,0 +1,7 @@
+#pragma once
+#include "common.h"
+
+#define POW5_MIN_EXP (-342)
+#define POW5_MAX_EXP 308
+
+extern const u64 Pow5Table[POW5_MAX_EXP - POW5_MIN_EXP + 1][2];
@@ -0,0 +1,363 @@
+#include "prefetch.h"
+
+#include "cache.h"
+#include "logging.h"
+#include "uring.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum load_state {
+    LOAD_EMPTY = 0, /* the slot, that is */
+    LOAD_NONE,
+    LOAD_QUEUED,
+    LOAD_RUNNING,
+    LOAD_DONE,
+};
+
+/* NOTE: every file that a document has been or is being made from, by
+ * (dev, ino), and the queue of those still to be made. Everything here is
+ * behind Lock. */
+static struct loads {
+    pthread_mutex_t Lock;
+    pthread_cond_t Work; /* a job was queued, or it is time to quit */
+    pthread_cond_t Done; /* a load ended */
+
+    umm Used;
+    umm Size; /* a power of two, kept at least twice Used */
+    struct load_slot {
+        dev_t Device;
+        ino_t Inode;
+        u8 State; /* an enum load_state */
+        bool Reading; /* into Source, by ReadFiles() */
+        struct source Source; /* read ahead of its load, or empty */
+    } *Slots;
+
+    s32 FirstJob, NumJobs, MaxJobs;
+    struct load_job {
+        dev_t Device;
+        ino_t Inode;
+        fd Dir;
+        char *Path;
+    } *Jobs;
+
+    load_func *Load;
+    bool Quit;
+    s32 NumThreads;
+    pthread_t Threads[PREFETCH_THREADS];
+} Loads = {
+    .Lock = PTHREAD_MUTEX_INITIALIZER,
+    .Work = PTHREAD_COND_INITIALIZER,
+    .Done = PTHREAD_COND_INITIALIZER,
+};
+
+/* Returns the slot of the file Device, Inode, which is added when it is new */
+static struct load_slot *
+FindLoadSlot(dev_t Device, ino_t Inode)
+{
+    if (2*(Loads.Used + 1) > Loads.Size) {
+        struct load_slot *Old = Loads.Slots;
+        umm OldSize = Loads.Size;
+        Loads.Size = OldSize? 2*OldSize: 64;
+        Loads.Slots = NotNull(calloc(Loads.Size, sizeof *Loads.Slots));
+        for (umm Idx = 0; Idx < OldSize; ++Idx) {
+            if (Old[Idx].State != LOAD_EMPTY) {
+                *FindLoadSlot(Old[Idx].Device, Old[Idx].Inode) = Old[Idx];
+            }
+        }
+        free(Old);
+    }
+
+    umm Mask = Loads.Size - 1;
+    u64 Hash = ((u64)Inode ^ ((u64)Device << 32)) * 0x9e3779b97f4a7c15;
+    for (umm Idx = (Hash >> 32) & Mask;; Idx = (Idx + 1) & Mask) {
+        struct load_slot *Slot = Loads.Slots + Idx;
+        if (Slot->State == LOAD_EMPTY) {
+            *Slot = (struct load_slot){ Device, Inode, LOAD_NONE, false, {} };
+            ++Loads.Used;
+            return Slot;
+        }
+        if (Slot->Device == Device && Slot->Inode == Inode) {
+            return Slot;
+        }
+    }
+}
+
+bool
+BeginLoad(struct stat *Stat)
+{
+    bool Mine = false;
+    pthread_mutex_lock(&Loads.Lock);
+    for (;;) {
+        /* NOTE: the table may have grown while this waited */
+        struct load_slot *Slot = FindLoadSlot(Stat->st_dev, Stat->st_ino);
+        if (Slot->State == LOAD_RUNNING) {
+            pthread_cond_wait(&Loads.Done, &Loads.Lock);
+            continue;
+        }
+
+        Mine = Slot->State != LOAD_DONE;
+        if (Mine) Slot->State = LOAD_RUNNING;
+        break;
+    }
+    pthread_mutex_unlock(&Loads.Lock);
+    return Mine;
+}
+
+void
+EndLoad(struct stat *Stat)
+{
+    pthread_mutex_lock(&Loads.Lock);
+    struct load_slot *Slot = FindLoadSlot(Stat->st_dev, Stat->st_ino);
+    Assert(Slot->State == LOAD_RUNNING);
+    Slot->State = LOAD_DONE;
+    if (Slot->Source.Data) {
+        /* NOTE: the document was made without it, e.g. from the disk cache */
+        UnloadSource(&Slot->Source);
+    }
+    pthread_cond_broadcast(&Loads.Done);
+    pthread_mutex_unlock(&Loads.Lock);
+}
+
+static void *
+PrefetchWorker(void *Arg)
+{
+    (void)Arg;
+
+    /* NOTE: its pages are only handed over once StopPrefetch() joins it, as
+     * the main thread is not reserving then */
+    BeginThreadPages();
+    pthread_mutex_lock(&Loads.Lock);
+    for (;;) {
+        while (!Loads.Quit && Loads.FirstJob == Loads.NumJobs) {
+            pthread_cond_wait(&Loads.Work, &Loads.Lock);
+        }
+        if (Loads.Quit) break;
+
+        struct load_job Job = Loads.Jobs[Loads.FirstJob++];
+        if (Loads.FirstJob == Loads.NumJobs) {
+            Loads.FirstJob = Loads.NumJobs = 0;
+        }
+
+        /* NOTE: whoever got to it first is already making it */
+        bool Queued = FindLoadSlot(Job.Device, Job.Inode)->State == LOAD_QUEUED;
+        pthread_mutex_unlock(&Loads.Lock);
+        if (Queued) {
+            Loads.Load(Job.Dir, Job.Path);
+        }
+        free(Job.Path);
+        pthread_mutex_lock(&Loads.Lock);
+    }
+    pthread_mutex_unlock(&Loads.Lock);
+    EndThreadPages();
+    return nullptr;
+}
+
+void
+StartPrefetch(load_func *Load)
+{
+    Assert(!Loads.Load);
+    Loads.Load = NotNull(Load);
+}
+
+void
+StopPrefetch(void)
+{
+    pthread_mutex_lock(&Loads.Lock);
+    Loads.Quit = true;
+    pthread_cond_broadcast(&Loads.Work);
+    pthread_mutex_unlock(&Loads.Lock);
+
+    for (s32 Idx = 0; Idx < Loads.NumThreads; ++Idx) {
+        pthread_join(Loads.Threads[Idx], nullptr);
+    }
+    for (s32 Idx = Loads.FirstJob; Idx < Loads.NumJobs; ++Idx) {
+        free(Loads.Jobs[Idx].Path);
+    }
+    for (umm Idx = 0; Idx < Loads.Size; ++Idx) {
+        if (Loads.Slots[Idx].Source.Data) UnloadSource(&Loads.Slots[Idx].Source);
+    }
+    free(Loads.Jobs);
+    free(Loads.Slots);
+    CloseRing();
+    Loads = (struct loads){
+        .Lock = PTHREAD_MUTEX_INITIALIZER,
+        .Work = PTHREAD_COND_INITIALIZER,
+        .Done = PTHREAD_COND_INITIALIZER,
+    };
+}
+
+bool
+TakeSource(struct stat *Stat, struct source *Out)
+{
+    pthread_mutex_lock(&Loads.Lock);
+    struct load_slot *Slot = FindLoadSlot(Stat->st_dev, Stat->st_ino);
+    Assert(Slot->State == LOAD_RUNNING);
+    bool Taken = Slot->Source.Data;
+    if (Taken) {
+        *Out = Slot->Source;
+        Slot->Source = (struct source){};
+    }
+    pthread_mutex_unlock(&Loads.Lock);
+    return Taken;
+}
+
+/* Read those of the Count stated files that are yet to be made into the
+ * sources of their slots, all in one batch. A file whose entry in the disk
+ * cache was written after it last changed is left alone, as the cache is
+ * likely to have it. */
+static void
+ReadAhead(s32 Count, struct file_read *Files)
+{
+    struct file_read *Wanted = AllocTemp(Count * sizeof *Wanted);
+    s32 NumWanted = 0;
+
+    bool *Cached = AllocTemp(Count * sizeof *Cached);
+#if USE_DISK_CACHE
+    char (*Names)[64] = AllocTemp(Count * sizeof *Names);
+    struct file_read *Entries = AllocTemp(Count * sizeof *Entries);
+    s32 *EntryOf = AllocTemp(Count * sizeof *EntryOf);
+    s32 NumEntries = 0;
+    for (s32 Idx = 0; Idx < Count; ++Idx) {
+        if (Files[Idx].Stated && S_ISREG(Files[Idx].Stat.st_mode)) {
+            fd CacheDir = CacheEntry(&Files[Idx].Stat, Names[Idx], sizeof Names[Idx]);
+            if (CacheDir < 0) break;
+            EntryOf[NumEntries] = Idx;
+            Entries[NumEntries++] = (struct file_read){ .Dir = CacheDir, .Path = Names[Idx] };
+        }
+    }
+
+    StatFiles(NumEntries, Entries);
+    for (s32 Entry = 0; Entry < NumEntries; ++Entry) {
+        struct timespec Saved = Entries[Entry].Stat.st_mtim;
+        struct timespec Changed = Files[EntryOf[Entry]].Stat.st_ctim;
+        Cached[EntryOf[Entry]] = Entries[Entry].Stated
+            && (Saved.tv_sec > Changed.tv_sec
+                || (Saved.tv_sec == Changed.tv_sec && Saved.tv_nsec >= Changed.tv_nsec));
+    }
+    FreeTemp(EntryOf);
+    FreeTemp(Entries);
+    FreeTemp(Names);
+#endif
+
+    pthread_mutex_lock(&Loads.Lock);
+    for (s32 Idx = 0; Idx < Count; ++Idx) {
+        struct file_read *File = Files + Idx;
+        if (!File->Stated || !S_ISREG(File->Stat.st_mode)) continue;
+
+        struct load_slot *Slot = FindLoadSlot(File->Stat.st_dev, File->Stat.st_ino);
+        if (!Cached[Idx] && !Slot->Reading && !Slot->Source.Data
+                && (Slot->State == LOAD_NONE || Slot->State == LOAD_QUEUED)) {
+            Slot->Reading = true;
+            Wanted[NumWanted++] = *File;
+        }
+    }
+    pthread_mutex_unlock(&Loads.Lock);
+
+    ReadFiles(NumWanted, Wanted);
+
+    pthread_mutex_lock(&Loads.Lock);
+    for (s32 Idx = 0; Idx < NumWanted; ++Idx) {
+        struct file_read *File = Wanted + Idx;
+        struct load_slot *Slot = FindLoadSlot(File->Stat.st_dev, File->Stat.st_ino);
+        Slot->Reading = false;
+        if (!File->Read) {
+            /* nop. it is read when it is made */
+        }
+        else if (Slot->State == LOAD_NONE || Slot->State == LOAD_QUEUED) {
+            Slot->Source = File->Source;
+        }
+        else {
+            /* NOTE: someone got to it while it was being read */
+            UnloadSource(&File->Source);
+        }
+    }
+    pthread_mutex_unlock(&Loads.Lock);
+
+    FreeTemp(Cached);
+    FreeTemp(Wanted);
+}
+
+/* Stat the Count files at Paths, from Dir, at once, and read those that are
+ * yet to be made. When Queue is set, they are also queued to be made. */
+static void
+PrefetchFiles(fd Dir, s32 Count, char **Paths, bool Queue)
+{
+    struct file_read *Files = AllocTemp(Count * sizeof *Files);
+    for (s32 Idx = 0; Idx < Count; ++Idx) {
+        Files[Idx] = (struct file_read){ .Dir = Dir, .Path = Paths[Idx] };
+    }
+    /* NOTE: a file that cannot be stated is left to whoever reads it, to get
+     * the error. Without a ring to batch them in, the files are not read
+     * ahead, as they are mapped when they are made. */
+    if (StatFiles(Count, Files)) {
+        ReadAhead(Count, Files);
+    }
+
+    pthread_mutex_lock(&Loads.Lock);
+    for (s32 Idx = 0; Queue && Idx < Count; ++Idx) {
+        struct file_read *File = Files + Idx;
+        if (!File->Stated) continue;
+
+        struct load_slot *Slot = FindLoadSlot(File->Stat.st_dev, File->Stat.st_ino);
+        if (Loads.Quit || Slot->State != LOAD_NONE) continue;
+        Slot->State = LOAD_QUEUED;
+
+        if (Loads.NumJobs == Loads.MaxJobs) {
+            Loads.MaxJobs = Loads.MaxJobs? 2*Loads.MaxJobs: 16;
+            Loads.Jobs = NotNull(realloc(Loads.Jobs, Loads.MaxJobs * sizeof *Loads.Jobs));
+        }
+        Loads.Jobs[Loads.NumJobs++] = (struct load_job){
+            File->Stat.st_dev, File->Stat.st_ino, Dir, NotNull(strdup(File->Path)),
+        };
+
+        /* NOTE: a thread is started for each job, until there are enough */
+        if (Loads.NumThreads < PREFETCH_THREADS) {
+            if (pthread_create(Loads.Threads + Loads.NumThreads, nullptr, PrefetchWorker, nullptr)) {
+                LogError("pthread_create");
+            }
+            else {
+                ++Loads.NumThreads;
+            }
+        }
+        pthread_cond_signal(&Loads.Work);
+    }
+    pthread_mutex_unlock(&Loads.Lock);
+
+    FreeTemp(Files);
+}
+
+void
+PrefetchLinks(struct document *Doc, s32 First)
+{
+    if (!Loads.Load) return;
+
+    /* NOTE: in batches, so that the first are being made while the rest
+     * are read */
+    char *Paths[IO_RING_ENTRIES];
+    for (s32 Batch = First; Batch < Doc->NumLinks; Batch += IO_RING_ENTRIES) {
+        s32 Count = Min(Doc->NumLinks - Batch, IO_RING_ENTRIES);
+        for (s32 Idx = 0; Idx < Count; ++Idx) {
+            struct span Reference = Doc->Links[Batch + Idx].Reference;
+            Paths[Idx] = AllocTemp(Reference.Len + 1);
+            memcpy(Paths[Idx], Reference.Str, Reference.Len);
+        }
+        PrefetchFiles(Doc->Dir, Count, Paths, true);
+        for (s32 Idx = 0; Idx < Count; ++Idx) {
+            FreeTemp(Paths[Idx]);
+        }
+    }
+}
+
+void
+PreloadDocuments(fd Dir, s32 Count, char **Paths)
+{
+    if (!Loads.Load) return;
+
+    for (s32 First = 0; First < Count; First += IO_RING_ENTRIES) {
+        PrefetchFiles(Dir, Min(Count - First, IO_RING_ENTRIES), Paths + First, false);
+    }
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include "common.h"
+
+#include "mem.h"
+
+#include <sys/stat.h>
+
+/* The documents that a document references are made ahead of their first use,
+ * on a pool of threads of their own, while the rest of the program carries on.
+ * However many times a file is asked for, it is only made once. */
+typedef struct document *load_func(fd Dir, char *Path);
+void StartPrefetch(load_func *Load);
+void StopPrefetch(void);
+
+/* Queue the documents that the links of Doc from First on are to. Doc must be
+ * compiled, or at least the rows of it that made those links. */
+void PrefetchLinks(struct document *Doc, s32 First);
+
+/* Read ahead the Count files at Paths, from Dir, that documents are about to
+ * be made from (see uring.h) */
+void PreloadDocuments(fd Dir, s32 Count, char **Paths);
+
+/* NOTE: whoever would make the document of the file Stat is must call
+ * BeginLoad() first. When it returns true, the caller is the one to make it,
+ * and then calls EndLoad(). When it returns false, it has already been made,
+ * or failed to be, by someone else. */
+bool BeginLoad(struct stat *Stat);
+void EndLoad(struct stat *Stat);
+
+/* NOTE: for the caller of BeginLoad() to take the file's source if it was read
+ * ahead, in which case it returns true */
+bool TakeSource(struct stat *Stat, struct source *Out);
@@ -0,0 +1,230 @@
+#include "scan.h"
+
+#include "logging.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define SCAN_BLOCK 64
+
+struct block_masks {
+    u64 Tab;
+    u64 Line;
+    u64 NonNum;
+};
+
+static inline bool
+IsNumberChar(char C)
+{
+    return IsDigit(C) || C == ',' || C == '.' || C == '-';
+}
+
+[[maybe_unused]]
+static inline struct block_masks
+ScanBlock_Scalar(char *Block)
+{
+    struct block_masks Masks = {};
+    for (s32 Idx = 0; Idx < SCAN_BLOCK; ++Idx) {
+        u64 Bit = (u64)1 << Idx;
+        if (Block[Idx] == '\t') Masks.Tab |= Bit;
+        if (Block[Idx] == '\n') Masks.Line |= Bit;
+        if (!IsNumberChar(Block[Idx])) Masks.NonNum |= Bit;
+    }
+    return Masks;
+}
+
+#if defined(__SSE2__)
+static inline struct block_masks
+ScanBlock_SSE2(char *Block)
+{
+    const __m128i Tab = _mm_set1_epi8('\t');
+    const __m128i Line = _mm_set1_epi8('\n');
+    const __m128i Comma = _mm_set1_epi8(',');
+    const __m128i Dot = _mm_set1_epi8('.');
+    const __m128i Dash = _mm_set1_epi8('-');
+    const __m128i Lo = _mm_set1_epi8('0' - 1);
+    const __m128i Hi = _mm_set1_epi8('9' + 1);
+
+    struct block_masks Masks = {};
+    for (s32 Idx = 0; Idx < SCAN_BLOCK; Idx += 16) {
+        __m128i V = _mm_loadu_si128((__m128i *)(Block + Idx));
+        /* NOTE: bytes >= 0x80 are negative, so they are never digits */
+        __m128i Num = _mm_and_si128(_mm_cmpgt_epi8(V, Lo), _mm_cmplt_epi8(V, Hi));
+        Num = _mm_or_si128(Num, _mm_cmpeq_epi8(V, Comma));
+        Num = _mm_or_si128(Num, _mm_cmpeq_epi8(V, Dot));
+        Num = _mm_or_si128(Num, _mm_cmpeq_epi8(V, Dash));
+
+        Masks.Tab |= (u64)(u16)_mm_movemask_epi8(_mm_cmpeq_epi8(V, Tab)) << Idx;
+        Masks.Line |= (u64)(u16)_mm_movemask_epi8(_mm_cmpeq_epi8(V, Line)) << Idx;
+        Masks.NonNum |= (u64)(u16)~_mm_movemask_epi8(Num) << Idx;
+    }
+    return Masks;
+}
+
+__attribute__((target("avx2")))
+static inline struct block_masks
+ScanBlock_AVX2(char *Block)
+{
+    const __m256i Tab = _mm256_set1_epi8('\t');
+    const __m256i Line = _mm256_set1_epi8('\n');
+    const __m256i Comma = _mm256_set1_epi8(',');
+    const __m256i Dot = _mm256_set1_epi8('.');
+    const __m256i Dash = _mm256_set1_epi8('-');
+    const __m256i Lo = _mm256_set1_epi8('0' - 1);
+    const __m256i Hi = _mm256_set1_epi8('9' + 1);
+
+    struct block_masks Masks = {};
+    for (s32 Idx = 0; Idx < SCAN_BLOCK; Idx += 32) {
+        __m256i V = _mm256_loadu_si256((__m256i *)(Block + Idx));
+        __m256i Num = _mm256_and_si256(_mm256_cmpgt_epi8(V, Lo), _mm256_cmpgt_epi8(Hi, V));
+        Num = _mm256_or_si256(Num, _mm256_cmpeq_epi8(V, Comma));
+        Num = _mm256_or_si256(Num, _mm256_cmpeq_epi8(V, Dot));
+        Num = _mm256_or_si256(Num, _mm256_cmpeq_epi8(V, Dash));
+
+        Masks.Tab |= (u64)(u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(V, Tab)) << Idx;
+        Masks.Line |= (u64)(u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(V, Line)) << Idx;
+        Masks.NonNum |= (u64)(u32)~_mm256_movemask_epi8(Num) << Idx;
+    }
+    return Masks;
+}
+#endif
+
+/* Turn one block's masks into delimiter entries. Clean carries whether the
+ * current cell has been all number characters since its start. */
+static inline u32 *
+EmitBlock(u32 *Out, u32 Base, struct block_masks Masks, bool *Clean)
+{
+    u64 Delims = Masks.Tab | Masks.Line;
+    u64 NonNum = Masks.NonNum;
+
+    while (Delims) {
+        s32 Bit = __builtin_ctzll(Delims);
+        u64 Below = ((u64)1 << Bit) - 1;
+
+        u32 Entry = Base + Bit;
+        if (*Clean && !(NonNum & Below)) Entry |= DELIM_NUMERIC;
+        if (Masks.Line & ((u64)1 << Bit)) Entry |= DELIM_LINE;
+        *Out++ = Entry;
+
+        NonNum &= ~((Below << 1) | 1);
+        *Clean = true;
+        Delims &= Delims - 1;
+    }
+
+    *Clean = *Clean && !NonNum;
+    return Out;
+}
+
+/* Make sure one more block's worth of entries will fit */
+static u32 *
+ReserveBlock(struct delims *Out, u32 *Cur)
+{
+    umm Used = Cur - Out->Data;
+    if (Used + SCAN_BLOCK + 1 > Out->Size) {
+        Out->Size = 2*Out->Size + SCAN_BLOCK + 1;
+        Out->Data = NotNull(realloc(Out->Data, Out->Size * sizeof *Out->Data));
+    }
+    return Out->Data + Used;
+}
+
+[[gnu::always_inline]]
+static inline void
+ScanLoop(char *Data, umm Size, struct delims *Out,
+        struct block_masks (*ScanBlock)(char *))
+{
+    u32 *Cur = Out->Data;
+    bool Clean = true;
+    umm Base = 0;
+
+    for (; Base + SCAN_BLOCK <= Size; Base += SCAN_BLOCK) {
+        Cur = ReserveBlock(Out, Cur);
+        Cur = EmitBlock(Cur, Base, ScanBlock(Data + Base), &Clean);
+    }
+
+    Cur = ReserveBlock(Out, Cur);
+    if (Base < Size) {
+        char Tail[SCAN_BLOCK] = {};
+        memcpy(Tail, Data + Base, Size - Base);
+        struct block_masks Masks = ScanBlock(Tail);
+        Masks.NonNum &= ((u64)1 << (Size - Base)) - 1;
+        Cur = EmitBlock(Cur, Base, Masks, &Clean);
+    }
+
+    *Cur++ = Size | DELIM_LINE | (Clean? DELIM_NUMERIC: 0);
+    Out->Count = Cur - Out->Data;
+}
+
+#if !defined(__SSE2__)
+static void
+ScanAll_Scalar(char *Data, umm Size, struct delims *Out)
+{
+    ScanLoop(Data, Size, Out, ScanBlock_Scalar);
+}
+#else
+static void
+ScanAll_SSE2(char *Data, umm Size, struct delims *Out)
+{
+    ScanLoop(Data, Size, Out, ScanBlock_SSE2);
+}
+
+__attribute__((target("avx2")))
+static void
+ScanAll_AVX2(char *Data, umm Size, struct delims *Out)
+{
+    ScanLoop(Data, Size, Out, ScanBlock_AVX2);
+}
+#endif
+
+bool
+ScanDelims(char *Data, umm Size, struct delims *Out)
+{
+    Assert(Data);
+    Assert(Out);
+
+    bool Ok = false;
+    *Out = (struct delims){};
+
+    umm Lines = Size;
+    if (Size > MAX_SCAN_SIZE) {
+        Lines = MAX_SCAN_SIZE;
+        while (Lines && Data[Lines - 1] != '\n') --Lines;
+    }
+
+    if (!Lines && Size) {
+        LogWarn("Cannot scan a line of more than %u bytes", MAX_SCAN_SIZE);
+    }
+    else {
+        Size = Out->Scanned = Lines;
+
+        /* NOTE: a guess of one delimiter every 8 bytes; it grows as needed */
+        Out->Size = Size/8 + SCAN_BLOCK + 1;
+        Out->Data = NotNull(malloc(Out->Size * sizeof *Out->Data));
+
+#if defined(__SSE2__)
+        if (__builtin_cpu_supports("avx2")) {
+            ScanAll_AVX2(Data, Size, Out);
+        }
+        else {
+            ScanAll_SSE2(Data, Size, Out);
+        }
+#else
+        ScanAll_Scalar(Data, Size, Out);
+#endif
+        Ok = true;
+    }
+
+    return Ok;
+}
+
+void
+FreeDelims(struct delims *Delims)
+{
+    Assert(Delims);
+    free(Delims->Data);
+    *Delims = (struct delims){};
+}
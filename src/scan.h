@@ -0,0 +1,24 @@
+#pragma once
+#include "common.h"
+
+/* Every '\t' and '\n' of a buffer, in order, followed by one entry for the
+ * sentinel byte just past its end. The offset of each lives in the low bits.
+ * DELIM_NUMERIC is set when every byte since the previous delimiter could be
+ * part of a number, and DELIM_LINE is set for '\n' and for the sentinel. */
+#define DELIM_NUMERIC 0x80000000u
+#define DELIM_LINE    0x40000000u
+#define DELIM_OFFSET  0x3fffffffu
+#define MAX_SCAN_SIZE DELIM_OFFSET
+
+struct delims {
+    u32 *Data;
+    umm Count;
+    umm Size;
+    umm Scanned; /* bytes of the buffer, which are whole lines when not all of it */
+};
+
+/* NOTE: a buffer of more than MAX_SCAN_SIZE bytes is scanned as far as the
+ * last line that ends within them. The rest is left to be scanned on its own;
+ * this only fails when its first line alone is too long. */
+bool ScanDelims(char *Data, umm Size, struct delims *Out);
+void FreeDelims(struct delims *Delims);
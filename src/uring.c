@@ -0,0 +1,375 @@
+#include "uring.h"
+
+#include "logging.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#if USE_IO_URING
+/* NOTE: one ring for the whole program, set up the first time it is wanted
+ * and used by one batch at a time. Everything here is behind Lock. */
+static struct ring {
+    pthread_mutex_t Lock;
+    fd Ring; /* -1 until it is set up, -2 when it cannot be or has failed us */
+
+    u32 *SqHead, *SqTail, *SqArray, SqMask;
+    u32 *CqHead, *CqTail, CqMask;
+    struct io_uring_sqe *Sqes;
+    struct io_uring_cqe *Cqes;
+    u32 Entries;
+
+    void *SqMap, *CqMap;
+    umm SqMapSize, CqMapSize, SqesSize;
+} Ring = {
+    .Lock = PTHREAD_MUTEX_INITIALIZER,
+    .Ring = -1,
+};
+
+enum batch_op {
+    BATCH_STATX,
+    BATCH_OPENAT,
+    BATCH_READ,
+    BATCH_CLOSE,
+};
+
+/* NOTE: what the kernel fills in for each file while a batch is out */
+struct pending {
+    struct file_read *File;
+    fd Opened; /* or -1 */
+    char *Buffer;
+    struct statx Statx;
+};
+
+static void
+UnmapRing(void)
+{
+    if (Ring.Sqes) munmap(Ring.Sqes, Ring.SqesSize);
+    if (Ring.CqMap && Ring.CqMap != Ring.SqMap) munmap(Ring.CqMap, Ring.CqMapSize);
+    if (Ring.SqMap) munmap(Ring.SqMap, Ring.SqMapSize);
+    Ring.Sqes = nullptr;
+    Ring.SqMap = Ring.CqMap = nullptr;
+}
+
+/* Returns whether the ring is there to be used, setting it up if it is not
+ * yet. The kernel must be able to do all of enum batch_op. */
+static bool
+OpenRing(void)
+{
+    if (Ring.Ring != -1) {
+        return Ring.Ring >= 0;
+    }
+
+    Ring.Ring = -2;
+    struct io_uring_params Params = {};
+    fd NewRing = syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &Params);
+    if (NewRing < 0) {
+        /* nop. we go without */
+        return false;
+    }
+
+    Ring.SqMapSize = Params.sq_off.array + Params.sq_entries * sizeof (u32);
+    Ring.CqMapSize = Params.cq_off.cqes + Params.cq_entries * sizeof (struct io_uring_cqe);
+    Ring.SqesSize = Params.sq_entries * sizeof (struct io_uring_sqe);
+    bool Single = Params.features & IORING_FEAT_SINGLE_MMAP;
+    if (Single) {
+        Ring.SqMapSize = Ring.CqMapSize = Max(Ring.SqMapSize, Ring.CqMapSize);
+    }
+
+    bool Ok = true;
+    void *Map;
+    Map = mmap(0, Ring.SqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, NewRing, IORING_OFF_SQ_RING);
+    Ok &= Map != MAP_FAILED;
+    Ring.SqMap = Map == MAP_FAILED? nullptr: Map;
+    if (Single) {
+        Ring.CqMap = Ring.SqMap;
+    }
+    else {
+        Map = mmap(0, Ring.CqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, NewRing, IORING_OFF_CQ_RING);
+        Ok &= Map != MAP_FAILED;
+        Ring.CqMap = Map == MAP_FAILED? nullptr: Map;
+    }
+    Map = mmap(0, Ring.SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, NewRing, IORING_OFF_SQES);
+    Ok &= Map != MAP_FAILED;
+    Ring.Sqes = Map == MAP_FAILED? nullptr: Map;
+
+    if (Ok) {
+        umm ProbeSize = sizeof (struct io_uring_probe) + IORING_OP_LAST * sizeof (struct io_uring_probe_op);
+        struct io_uring_probe *Probe = AllocTemp(ProbeSize);
+        if (syscall(__NR_io_uring_register, NewRing, IORING_REGISTER_PROBE, Probe, IORING_OP_LAST)) {
+            Ok = false;
+        }
+        else for (s32 Op = 0; Op < 4; ++Op) {
+            u8 Code = (u8[]){ IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE }[Op];
+            Ok &= Code <= Probe->last_op && (Probe->ops[Code].flags & IO_URING_OP_SUPPORTED);
+        }
+        FreeTemp(Probe);
+    }
+
+    if (!Ok) {
+        UnmapRing();
+        close(NewRing);
+        return false;
+    }
+
+    char *Sq = Ring.SqMap, *Cq = Ring.CqMap;
+    Ring.SqHead  = (u32 *)(Sq + Params.sq_off.head);
+    Ring.SqTail  = (u32 *)(Sq + Params.sq_off.tail);
+    Ring.SqArray = (u32 *)(Sq + Params.sq_off.array);
+    Ring.SqMask  = *(u32 *)(Sq + Params.sq_off.ring_mask);
+    Ring.CqHead  = (u32 *)(Cq + Params.cq_off.head);
+    Ring.CqTail  = (u32 *)(Cq + Params.cq_off.tail);
+    Ring.CqMask  = *(u32 *)(Cq + Params.cq_off.ring_mask);
+    Ring.Cqes    = (struct io_uring_cqe *)(Cq + Params.cq_off.cqes);
+    Ring.Entries = Params.sq_entries;
+    Ring.Ring = NewRing;
+    return true;
+}
+
+static bool
+WantsOp(enum batch_op Op, struct pending *Pending)
+{
+    switch (Op) {
+    case BATCH_STATX:  return true;
+    case BATCH_OPENAT: return Pending->File->Stated && S_ISREG(Pending->File->Stat.st_mode);
+    case BATCH_READ:   return Pending->Opened >= 0;
+    case BATCH_CLOSE:  return Pending->Opened >= 0;
+    default_unreachable;
+    }
+    return false;
+}
+
+static void
+PrepareOp(enum batch_op Op, struct pending *Pending, struct io_uring_sqe *Sqe)
+{
+    struct file_read *File = Pending->File;
+    switch (Op) {
+    case BATCH_STATX:
+        Sqe->opcode = IORING_OP_STATX;
+        Sqe->fd = File->Dir;
+        Sqe->addr = (u64)File->Path;
+        Sqe->len = STATX_BASIC_STATS;
+        Sqe->off = (u64)&Pending->Statx;
+        break;
+
+    case BATCH_OPENAT:
+        Sqe->opcode = IORING_OP_OPENAT;
+        Sqe->fd = File->Dir;
+        Sqe->addr = (u64)File->Path;
+        Sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        break;
+
+    case BATCH_READ:
+        /* NOTE: one byte more than the file had, to tell if it grew */
+        Sqe->opcode = IORING_OP_READ;
+        Sqe->fd = Pending->Opened;
+        Sqe->addr = (u64)Pending->Buffer;
+        Sqe->len = File->Stat.st_size + 1;
+        Sqe->off = 0;
+        break;
+
+    case BATCH_CLOSE:
+        Sqe->opcode = IORING_OP_CLOSE;
+        Sqe->fd = Pending->Opened;
+        break;
+
+    default_unreachable;
+    }
+}
+
+static void
+CompleteOp(enum batch_op Op, struct pending *Pending, s32 Result)
+{
+    struct file_read *File = Pending->File;
+    switch (Op) {
+    case BATCH_STATX:
+        if (Result == 0) {
+            struct statx *X = &Pending->Statx;
+            File->Stated = true;
+            File->Stat = (struct stat){
+                .st_dev = makedev(X->stx_dev_major, X->stx_dev_minor),
+                .st_ino = X->stx_ino,
+                .st_mode = X->stx_mode,
+                .st_nlink = X->stx_nlink,
+                .st_uid = X->stx_uid,
+                .st_gid = X->stx_gid,
+                .st_size = X->stx_size,
+                .st_mtim = { X->stx_mtime.tv_sec, X->stx_mtime.tv_nsec },
+                .st_ctim = { X->stx_ctime.tv_sec, X->stx_ctime.tv_nsec },
+            };
+        }
+        break;
+
+    case BATCH_OPENAT:
+        Pending->Opened = Result >= 0? Result: -1;
+        break;
+
+    case BATCH_READ: {
+        umm Size = File->Stat.st_size;
+        if (Result >= 0 && (umm)Result == Size) {
+            Pending->Buffer[Size] = 0;
+            File->Source = (struct source){ Pending->Buffer, Size, 0, 0 };
+            File->Read = true;
+        }
+        else {
+            /* NOTE: it changed under us; whoever wants it reads it again */
+            free(Pending->Buffer);
+        }
+        Pending->Buffer = nullptr;
+    } break;
+
+    case BATCH_CLOSE:
+        Pending->Opened = -1;
+        break;
+
+    default_unreachable;
+    }
+}
+
+/* Submit Op for each of the Count files that want it, as many at a time as the
+ * ring takes, and wait for all of them. Returns false if the ring failed us,
+ * in which case some may still be outstanding, and the ring is shut for good
+ * so that no later batch reaps them as its own. */
+static bool
+RunBatch(enum batch_op Op, s32 Count, struct pending *Pending)
+{
+    s32 Next = 0;
+    while (Next < Count) {
+        u32 Tail = *Ring.SqTail;
+        u32 Queued = 0;
+        for (; Next < Count && Queued < Ring.Entries; ++Next) {
+            if (!WantsOp(Op, Pending + Next)) continue;
+
+            u32 At = (Tail + Queued++) & Ring.SqMask;
+            struct io_uring_sqe *Sqe = Ring.Sqes + At;
+            memset(Sqe, 0, sizeof *Sqe);
+            PrepareOp(Op, Pending + Next, Sqe);
+            Sqe->user_data = Next;
+            Ring.SqArray[At] = At;
+        }
+        __atomic_store_n(Ring.SqTail, Tail + Queued, __ATOMIC_RELEASE);
+
+        u32 Submit = Queued, Reaped = 0;
+        while (Reaped < Queued) {
+            s32 Entered = syscall(__NR_io_uring_enter, Ring.Ring, Submit, Queued - Reaped,
+                    IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (Entered < 0) {
+                if (errno == EINTR) continue;
+                LogError("io_uring_enter");
+                UnmapRing();
+                close(Ring.Ring);
+                Ring.Ring = -2;
+                return false;
+            }
+            Submit -= Min((u32)Entered, Submit);
+
+            u32 Head = *Ring.CqHead;
+            u32 CqTail = __atomic_load_n(Ring.CqTail, __ATOMIC_ACQUIRE);
+            for (; Head != CqTail; ++Head, ++Reaped) {
+                struct io_uring_cqe *Cqe = Ring.Cqes + (Head & Ring.CqMask);
+                CompleteOp(Op, Pending + Cqe->user_data, Cqe->res);
+            }
+            __atomic_store_n(Ring.CqHead, Head, __ATOMIC_RELEASE);
+        }
+    }
+    return true;
+}
+#endif
+
+bool
+StatFiles(s32 Count, struct file_read *Files)
+{
+    for (s32 Idx = 0; Idx < Count; ++Idx) {
+        Files[Idx].Stated = Files[Idx].Read = false;
+    }
+
+#if USE_IO_URING
+    pthread_mutex_lock(&Ring.Lock);
+    if (OpenRing()) {
+        struct pending *Pending = AllocTemp(Count * sizeof *Pending);
+        for (s32 Idx = 0; Idx < Count; ++Idx) {
+            Pending[Idx] = (struct pending){ .File = Files + Idx, .Opened = -1 };
+        }
+        bool Ok = RunBatch(BATCH_STATX, Count, Pending);
+        pthread_mutex_unlock(&Ring.Lock);
+
+        if (Ok) {
+            FreeTemp(Pending);
+            return true;
+        }
+        /* NOTE: the kernel may write to Pending still, as it takes the ring
+         * down after it is closed, so it is left. That happens once at most.
+         * The files are stated again one by one. */
+    }
+    else {
+        pthread_mutex_unlock(&Ring.Lock);
+    }
+#endif
+
+    for (s32 Idx = 0; Idx < Count; ++Idx) {
+        struct file_read *File = Files + Idx;
+        File->Stated = !fstatat(File->Dir, File->Path, &File->Stat, 0);
+    }
+    return false;
+}
+
+bool
+ReadFiles(s32 Count, struct file_read *Files)
+{
+    bool Any = false;
+#if USE_IO_URING
+    pthread_mutex_lock(&Ring.Lock);
+    if (OpenRing()) {
+        struct pending *Pending = AllocTemp(Count * sizeof *Pending);
+        for (s32 Idx = 0; Idx < Count; ++Idx) {
+            Files[Idx].Read = false;
+            Pending[Idx] = (struct pending){ .File = Files + Idx, .Opened = -1 };
+        }
+
+        bool Ok = RunBatch(BATCH_OPENAT, Count, Pending);
+        for (s32 Idx = 0; Ok && Idx < Count; ++Idx) {
+            if (Pending[Idx].Opened >= 0) {
+                Pending[Idx].Buffer = NotNull(malloc(Files[Idx].Stat.st_size + 1));
+            }
+        }
+        Ok = Ok && RunBatch(BATCH_READ, Count, Pending);
+        Ok = Ok && RunBatch(BATCH_CLOSE, Count, Pending);
+        pthread_mutex_unlock(&Ring.Lock);
+
+        for (s32 Idx = 0; Idx < Count; ++Idx) {
+            Any |= Files[Idx].Read;
+        }
+        /* NOTE: the kernel may write to the rest still (see StatFiles()) */
+        if (Ok) FreeTemp(Pending);
+        return Any;
+    }
+    pthread_mutex_unlock(&Ring.Lock);
+#else
+    (void)Count;
+    (void)Files;
+#endif
+    return Any;
+}
+
+void
+CloseRing(void)
+{
+#if USE_IO_URING
+    pthread_mutex_lock(&Ring.Lock);
+    if (Ring.Ring >= 0) {
+        UnmapRing();
+        close(Ring.Ring);
+    }
+    Ring.Ring = -1;
+    pthread_mutex_unlock(&Ring.Lock);
+#endif
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include "common.h"
+
+#include "mem.h"
+
+#include <sys/stat.h>
+
+/* Many files stated, opened and read at once, each step for all of them in a
+ * single trip to the kernel through io_uring. When the kernel does not have
+ * it (or will not give it to us) the files are stated one by one instead, and
+ * not read at all; whoever wanted them reads them as usual. */
+struct file_read {
+    fd Dir;
+    char *Path;
+
+    bool Stated; /* and then Stat is that of the file */
+    struct stat Stat;
+
+    bool Read; /* and then Source holds the whole file */
+    struct source Source;
+};
+
+/* NOTE: returns whether they were stated in one batch */
+bool StatFiles(s32 Count, struct file_read *Files);
+
+/* NOTE: only the regular files that were stated are read, into sources that
+ * are the caller's to unload. Returns false when none could be. */
+bool ReadFiles(s32 Count, struct file_read *Files);
+
+void CloseRing(void);
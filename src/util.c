@@ -1,8 +1,12 @@
 #include "util.h"
 
 #include "logging.h"
+#include "pow5.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
 
-#include <ctype.h>
 
 u8
 NextPow2_u8(u8 A)
@@ -54,35 +58,244 @@ NextPow2_u64(u64 A)
     return A | (A == 0);
 }
 
-/* TODO(lrak): precision problems? */
+/* Eight ASCII digits packed little endian into a u64 */
+static inline bool
+IsEightDigits(u64 Val)
+{
+    return ((Val & 0xf0f0f0f0f0f0f0f0) == 0x3030303030303030)
+        && (((Val + 0x0606060606060606) & 0xf0f0f0f0f0f0f0f0) == 0x3030303030303030);
+}
+
+static inline u32
+ParseEightDigits(u64 Val)
+{
+    constexpr u64 Mask = 0x000000ff000000ff;
+    constexpr u64 Mul1 = 100 + (1000000ull << 32);
+    constexpr u64 Mul2 = 1 + (10000ull << 32);
+    Val -= 0x3030303030303030;
+    Val = (Val * 10) + (Val >> 8);
+    Val = (((Val & Mask) * Mul1) + (((Val >> 16) & Mask) * Mul2)) >> 32;
+    return Val;
+}
+
+static inline f64
+F64FromBits(u64 Bits)
+{
+    f64 Value;
+    static_assert(sizeof Value == sizeof Bits);
+    memcpy(&Value, &Bits, sizeof Value);
+    return Value;
+}
+
+/* The Eisel-Lemire algorithm: the correctly rounded value of W * 10^Q, given
+ * that W is exact. See Lemire, "Number Parsing at a Gigabyte per Second" and
+ * Mushtak & Lemire, "Fast Number Parsing Without Fallback". */
+static f64
+EiselLemire(u64 W, s64 Q)
+{
+    f64 Value;
+
+    if (W == 0 || Q < POW5_MIN_EXP) {
+        Value = 0;
+    }
+    else if (Q > POW5_MAX_EXP) {
+        Value = INFINITY;
+    }
+    else {
+        const u64 *Pow5 = Pow5Table[Q - POW5_MIN_EXP];
+        s32 Lz = __builtin_clzll(W);
+        W <<= Lz;
+
+        unsigned __int128 First = (unsigned __int128)W * Pow5[0];
+        u64 Hi = First >> 64;
+        u64 Lo = First;
+        if ((Hi & 0x1ff) == 0x1ff) {
+            unsigned __int128 Second = (unsigned __int128)W * Pow5[1];
+            u64 SecondHi = Second >> 64;
+            Lo += SecondHi;
+            if (SecondHi > Lo) ++Hi;
+        }
+
+        s32 UpperBit = Hi >> 63;
+        s32 Shift = UpperBit + 64 - 52 - 3;
+        u64 Mantissa = Hi >> Shift;
+        s32 Power2 = (((152170 + 65536) * Q) >> 16) + 63 + UpperBit - Lz + 1023;
+
+        if (Power2 <= 0) {
+            /* subnormal */
+            if (-Power2 + 1 >= 64) {
+                Mantissa = 0;
+                Power2 = 0;
+            }
+            else {
+                Mantissa >>= -Power2 + 1;
+                Mantissa += Mantissa & 1;
+                Mantissa >>= 1;
+                Power2 = (Mantissa < ((u64)1 << 52))? 0: 1;
+            }
+        }
+        else {
+            /* only products that were exact can be exactly halfway */
+            if (Lo <= 1 && -4 <= Q && Q <= 23 && (Mantissa & 3) == 1) {
+                if ((Mantissa << Shift) == Hi) {
+                    Mantissa &= ~(u64)1;
+                }
+            }
+
+            Mantissa += Mantissa & 1;
+            Mantissa >>= 1;
+            if (Mantissa >= ((u64)2 << 52)) {
+                Mantissa = (u64)1 << 52;
+                ++Power2;
+            }
+
+            if (Power2 >= 0x7ff) {
+                Mantissa = 0;
+                Power2 = 0x7ff;
+            }
+        }
+
+        Mantissa &= ~((u64)1 << 52);
+        Value = F64FromBits(Mantissa | ((u64)Power2 << 52));
+    }
+
+    return Value;
+}
+
+/* The exact (and slow) path, for when more digits were given than fit in a
+ * u64 and they matter to the rounding.
+ * NOTE: we never call setlocale(), so strtod() always sees a '.' radix */
+static f64
+StrtodFallback(char *Str, char *End)
+{
+    char Small[128];
+    umm Size = End - Str + 1;
+    char *Buf = (Size <= sizeof Small)? Small: NotNull(malloc(Size));
+
+    char *Cur = Buf;
+    for (char *It = Str; It < End; ++It) {
+        if (*It != ',') *Cur++ = *It;
+    }
+    *Cur = 0;
+
+    f64 Value = strtod(Buf, 0);
+    if (Buf != Small) free(Buf);
+    return Value;
+}
+
+/* Accepts [-]d[,d]*[.d*], where the ','s are thousands seperators. The result
+ * is correctly rounded. */
 f64
-Str2f64(char *Str, char **Rhs)
+Str2f64(char *Str, char *End, char **Rhs)
 {
     Assert(Str);
+    Assert(Str <= End);
 
-    f64 Sign = 1;
-    f64 Num = 0;
+    /* NOTE: at most 19 significant digits are kept in Mantissa; the rest only
+     * adjust Exp10 (or mark the mantissa as Truncated) */
+    constexpr s32 MaxDigits = 19;
+    char *Cur = Str;
+    bool Negative = false;
+    u64 Mantissa = 0;
+    s32 NumDigits = 0;
+    s64 Exp10 = 0;
+    bool Truncated = false;
 
-    if (*Str == '-') {
-        Sign = -1;
-        ++Str;
+    if (Cur < End && *Cur == '-') {
+        Negative = true;
+        ++Cur;
     }
 
-    while (isdigit(*Str)) {
-        Num = 10*Num + (*Str++ - '0');
-        if (Str[0] == ',') ++Str;
+    while (Cur < End && IsDigit(*Cur)) {
+        u64 Chunk;
+        if (Mantissa && NumDigits + 8 <= MaxDigits && End - Cur >= 8
+                && (memcpy(&Chunk, Cur, sizeof Chunk), IsEightDigits(Chunk))) {
+            Mantissa = 100000000*Mantissa + ParseEightDigits(Chunk);
+            NumDigits += 8;
+            Cur += 8;
+        }
+        else {
+            u32 Digit = *Cur++ - '0';
+            if (NumDigits < MaxDigits) {
+                Mantissa = 10*Mantissa + Digit;
+                NumDigits += (Mantissa != 0);
+            }
+            else {
+                ++Exp10;
+                Truncated |= (Digit != 0);
+            }
+        }
+        if (Cur < End && *Cur == ',') ++Cur;
     }
 
-    if (*Str == '.') {
-        ++Str;
-        f64 Base = 0.1;
-        while (isdigit(*Str)) {
-            Assert(*Str);
-            Num += Base * (*Str++ - '0');
-            Base /= 10;
+    if (Cur < End && *Cur == '.') {
+        ++Cur;
+        while (Cur < End && IsDigit(*Cur)) {
+            u64 Chunk;
+            if (Mantissa && NumDigits + 8 <= MaxDigits && End - Cur >= 8
+                    && (memcpy(&Chunk, Cur, sizeof Chunk), IsEightDigits(Chunk))) {
+                Mantissa = 100000000*Mantissa + ParseEightDigits(Chunk);
+                NumDigits += 8;
+                Exp10 -= 8;
+                Cur += 8;
+            }
+            else {
+                u32 Digit = *Cur++ - '0';
+                if (NumDigits < MaxDigits) {
+                    Mantissa = 10*Mantissa + Digit;
+                    NumDigits += (Mantissa != 0);
+                    --Exp10;
+                }
+                else {
+                    Truncated |= (Digit != 0);
+                }
+            }
         }
     }
 
-    if (Rhs) *Rhs = Str;
-    return Sign * Num;
+    f64 Value = 0;
+    if (!Mantissa) {
+        /* nop */
+    }
+    else if (!Truncated && -22 <= Exp10 && Exp10 <= 22 && Mantissa <= ((u64)1 << 53)) {
+        /* both operands are exact, so the one rounding is correct */
+        static const f64 Pow10[] = {
+            1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+        };
+        Value = (f64)Mantissa;
+        Value = (Exp10 < 0)? Value / Pow10[-Exp10]: Value * Pow10[Exp10];
+    }
+    else {
+        Value = EiselLemire(Mantissa, Exp10);
+        if (Truncated && Value != EiselLemire(Mantissa + 1, Exp10)) {
+            Value = StrtodFallback(Negative? Str + 1: Str, Cur);
+        }
+    }
+
+    if (Rhs) *Rhs = Cur;
+    return Negative? -Value: Value;
+}
+
+bool
+SpanEq(struct span A, struct span B)
+{
+    return A.Len == B.Len && memcmp(A.Str, B.Str, A.Len) == 0;
+}
+
+bool
+SpanEqStr(struct span A, const char *B)
+{
+    return (umm)A.Len == strlen(B) && memcmp(A.Str, B, A.Len) == 0;
+}
+
+/* FNV-1a */
+u64
+HashSpan(struct span Span)
+{
+    u64 Hash = 0xcbf29ce484222325;
+    for (s32 Idx = 0; Idx < Span.Len; ++Idx) {
+        Hash = (Hash ^ (u8)Span.Str[Idx]) * 0x100000001b3;
+    }
+    return Hash;
 }
@@ -5,6 +5,12 @@
 
 #define StrEq(A,B) (strcmp(A,B) == 0)
 
+/* locale independent replacements for ctype.h */
+static inline bool IsDigit(char C) { return (u8)(C - '0') < 10; }
+static inline bool IsUpper(char C) { return (u8)(C - 'A') < 26; }
+static inline bool IsLower(char C) { return (u8)(C - 'a') < 26; }
+static inline bool IsSpace(char C) { return C == ' ' || (u8)(C - '\t') < 5; }
+
 #define Max(A,B) ({ typeof(A) _A = (A), _B = (B); (_A > _B)? _A: _B; })
 #define Min(A,B) ({ typeof(A) _A = (A), _B = (B); (_A < _B)? _A: _B; })
 
@@ -21,4 +27,9 @@ u64 NextPow2_u64(u64);
     , s8: NextPow2_u8, s16: NextPow2_u16, s32: NextPow2_u32, s64: NextPow2_u64 \
 )((A))
 
-f64 Str2f64(char *Str, char **Rhs);
+f64 Str2f64(char *Str, char *End, char **Rhs);
+
+#define SpanOf(S) ((struct span){ (S), sizeof (S) - 1 })
+bool SpanEq(struct span A, struct span B);
+bool SpanEqStr(struct span A, const char *B);
+u64 HashSpan(struct span Span);
@@ -0,0 +1,171 @@
+#include "common.h"
+
+#include "groups.h"
+#include "mem.h"
+#include "numbers.h"
+#include "util.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char _MsgBuf[512];
+
+/* A document of one column of Rows cells, which are Cells, that is done
+ * loading and evaluating */
+static struct document *
+MakeColumnDoc(struct cell *Cells, s32 Rows)
+{
+    static ino_t NextInode = 1;
+    struct document *Doc = AllocAndLogDoc(1, NextInode++);
+    *Doc = (struct document){0};
+
+    for (s32 Row = 0; Row < Rows; ++Row) {
+        *ReserveCell(Doc, 0, Row) = Cells[Row];
+    }
+    FillNumberColumns(Doc);
+    return Doc;
+}
+
+/* The group of Proto must be just the rows from FirstRow up to EndRow that
+ * CellsEq() says hold the same, in order, and there must be Expected of them */
+static char *
+TestFindGroup(struct document *Doc, s32 FirstRow, s32 EndRow, struct cell Proto, s32 Expected)
+{
+    s32 Count;
+    s32 *Rows = FindGroup(Doc, 0, FirstRow, EndRow, &Proto, &Count);
+    if (!Rows) {
+        return "FindGroup() gave nothing for cells that are all done";
+    }
+    if (Count != Expected) {
+        snprintf(_MsgBuf, sizeof _MsgBuf, "expected a group of %d rows, but got %d", Expected, Count);
+        return _MsgBuf;
+    }
+
+    s32 Idx = 0;
+    for (s32 Row = FirstRow; Row < EndRow; ++Row) {
+        if (!CellsEq(&Proto, GetCell(Doc, 0, Row))) continue;
+        if (Idx >= Count || Rows[Idx] != Row) {
+            snprintf(_MsgBuf, sizeof _MsgBuf, "expected row %d at %d of the group", Row, Idx);
+            return _MsgBuf;
+        }
+        ++Idx;
+    }
+    return 0;
+}
+
+char *
+StringGroups()
+{
+    struct cell Cells[] = {
+        STRING_CELL(SpanOf("name")),
+        STRING_CELL(SpanOf("apple")),
+        STRING_CELL(SpanOf("pear")),
+        STRING_CELL(SpanOf("apple")),
+        NUMBER_CELL(1),
+        STRING_CELL(SpanOf("1")),
+        STRING_CELL(SpanOf("applesauce")),
+        STRING_CELL(SpanOf("pear")),
+        STRING_CELL(SpanOf("apple")),
+        STRING_CELL(SpanOf("total")),
+    };
+    struct document *Doc = MakeColumnDoc(Cells, sArrayCount(Cells));
+
+    /* NOTE: only the body, which leaves out the first and last rows */
+    char *Msg = TestFindGroup(Doc, 1, 9, STRING_CELL(SpanOf("apple")), 3);
+    if (!Msg) Msg = TestFindGroup(Doc, 1, 9, STRING_CELL(SpanOf("pear")), 2);
+    if (!Msg) Msg = TestFindGroup(Doc, 1, 9, STRING_CELL(SpanOf("1")), 1);
+    if (!Msg) Msg = TestFindGroup(Doc, 1, 9, STRING_CELL(SpanOf("name")), 0);
+    if (!Msg) Msg = TestFindGroup(Doc, 1, 9, STRING_CELL(SpanOf("plum")), 0);
+    return Msg;
+}
+
+char *
+NumberGroups()
+{
+    struct cell Cells[] = {
+        NUMBER_CELL(0),
+        NUMBER_CELL(2.5),
+        NUMBER_CELL(-0.0),
+        NUMBER_CELL(NAN),
+        STRING_CELL(SpanOf("2.5")),
+        NUMBER_CELL(2.5),
+        NUMBER_CELL(NAN),
+        NUMBER_CELL(0),
+        (struct cell){ .Type = CELL_NULL },
+    };
+    struct document *Doc = MakeColumnDoc(Cells, sArrayCount(Cells));
+
+    /* NOTE: -0 equals 0, and NaN equals nothing, not even itself */
+    char *Msg = TestFindGroup(Doc, 0, 9, NUMBER_CELL(0), 3);
+    if (!Msg) Msg = TestFindGroup(Doc, 0, 9, NUMBER_CELL(-0.0), 3);
+    if (!Msg) Msg = TestFindGroup(Doc, 0, 9, NUMBER_CELL(2.5), 2);
+    if (!Msg) Msg = TestFindGroup(Doc, 0, 9, NUMBER_CELL(NAN), 0);
+    if (!Msg) Msg = TestFindGroup(Doc, 0, 9, NUMBER_CELL(7), 0);
+    if (!Msg) Msg = TestFindGroup(Doc, 0, 9, STRING_CELL(SpanOf("2.5")), 1);
+    return Msg;
+}
+
+/* More distinct values than the index starts with room for, so that it has to
+ * grow while it is built */
+char *
+ManyGroups()
+{
+    enum { Rows = 1000, Values = 97 };
+    struct cell Cells[Rows];
+    for (s32 Row = 0; Row < Rows; ++Row) {
+        Cells[Row] = NUMBER_CELL((Row * 31) % Values);
+    }
+    struct document *Doc = MakeColumnDoc(Cells, Rows);
+
+    for (s32 Value = 0; Value < Values; ++Value) {
+        s32 Expected = 0;
+        for (s32 Row = 0; Row < Rows; ++Row) {
+            Expected += Cells[Row].AsNumber == Value;
+        }
+        char *Msg = TestFindGroup(Doc, 0, Rows, NUMBER_CELL(Value), Expected);
+        if (Msg) return Msg;
+    }
+    return 0;
+}
+
+
+s32
+main(s32 ArgCount, char **argv)
+{
+    (void)ArgCount;
+    printf("----\nRunning: %s\n\n", argv[0]);
+
+    struct test {
+        char *(*Test)();
+        char *Name;
+    } Tests[] = {
+#define X(N) {N, #N}
+        X(StringGroups),
+        X(NumberGroups),
+        X(ManyGroups),
+#undef X
+        0
+    };
+
+    s32 TestsRun = 0;
+    s32 TestsFailed = 0;
+    for (struct test *This = Tests; This->Test; ++TestsRun, ++This) {
+        char *Message = This->Test();
+        if (Message) {
+            printf("FAILED %s: %s\n", This->Name, Message);
+            ++TestsFailed;
+        }
+        else {
+            printf("PASSED %s\n", This->Name);
+        }
+    }
+
+    printf("\n"
+            "passed  failed  total\n"
+            "------- ------- -------\n"
+            "%7d %7d %7d\n"
+            , TestsRun - TestsFailed, TestsFailed, TestsRun);
+
+    return TestsFailed == 0;
+}
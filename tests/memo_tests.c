@@ -0,0 +1,170 @@
+#include "common.h"
+
+#include "memo.h"
+#include "mem.h"
+#include "numbers.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static char _MsgBuf[512];
+
+enum { Cols = 2, Rows = 100, PendingRow = 50 };
+
+/* A document of two columns of numbers, whose second column has a cell that
+ * is still to be evaluated at PendingRow */
+static struct document *
+MakeMemoDoc(void)
+{
+    static ino_t NextInode = 1;
+    struct document *Doc = AllocAndLogDoc(2, NextInode++);
+    *Doc = (struct document){0};
+
+    for (s32 Col = 0; Col < Cols; ++Col) {
+        for (s32 Row = 0; Row < Rows; ++Row) {
+            *ReserveCell(Doc, Col, Row) = NUMBER_CELL(Col*Rows + Row);
+        }
+    }
+    GetCell(Doc, 1, PendingRow)->Type = CELL_EXPR;
+    FillNumberColumns(Doc);
+    return Doc;
+}
+
+static char *
+TestRecall(struct document *Doc, enum expr_func Func, struct cell_block Block, bool Expected, f64 Value)
+{
+    f64 Out = -1;
+    bool Found = RecallAggregate(Doc, Func, Block, &Out);
+    if (Found != Expected) {
+        snprintf(_MsgBuf, sizeof _MsgBuf,
+                "%d over (%d,%d):(%d,%d) expected %s, but got %s", Func,
+                Block.FirstCol, Block.FirstRow, Block.LastCol, Block.LastRow,
+                Expected? "a hit": "a miss", Found? "a hit": "a miss");
+        return _MsgBuf;
+    }
+    if (Found && Out != Value) {
+        snprintf(_MsgBuf, sizeof _MsgBuf, "expected %g, but got %g", Value, Out);
+        return _MsgBuf;
+    }
+    return 0;
+}
+
+/* Only the very function over the very block that was remembered is recalled */
+char *
+HitsAndMisses()
+{
+    struct document *Doc = MakeMemoDoc();
+    struct cell_block Block = { 0, 10, 0, 20 };
+
+    char *Msg = TestRecall(Doc, EF_SUM, Block, false, 0);
+    if (Msg) return Msg;
+    RememberAggregate(Doc, EF_SUM, Block, 165);
+
+    Msg = TestRecall(Doc, EF_SUM, Block, true, 165);
+    if (!Msg) Msg = TestRecall(Doc, EF_MIN, Block, false, 0);
+    if (!Msg) Msg = TestRecall(Doc, EF_SUM, (struct cell_block){ 0, 10, 0, 21 }, false, 0);
+    if (!Msg) Msg = TestRecall(Doc, EF_SUM, (struct cell_block){ 0, 11, 0, 20 }, false, 0);
+    if (!Msg) Msg = TestRecall(Doc, EF_SUM, (struct cell_block){ 0, 10, 1, 20 }, false, 0);
+    if (Msg) return Msg;
+
+    /* NOTE: what was kept first stays */
+    RememberAggregate(Doc, EF_SUM, Block, 0);
+    Msg = TestRecall(Doc, EF_SUM, Block, true, 165);
+    if (Msg) return Msg;
+
+    if (Doc->Memo.Hits != 2 || Doc->Memo.Misses != 5 || Doc->Memo.Used != 1) {
+        snprintf(_MsgBuf, sizeof _MsgBuf,
+                "expected 2 hits, 5 misses and 1 entry, but got %lu, %lu and %d",
+                Doc->Memo.Hits, Doc->Memo.Misses, Doc->Memo.Used);
+        return _MsgBuf;
+    }
+    return 0;
+}
+
+/* A block with a cell that is not done yet read it as empty, so what was
+ * given over it is not kept */
+char *
+PendingBlocksNotRemembered()
+{
+    struct document *Doc = MakeMemoDoc();
+    struct cell_block Pending[] = {
+        { 1, 0, 1, Rows - 1 },
+        { 0, PendingRow, 1, PendingRow },
+        { 1, PendingRow, 1, PendingRow },
+    };
+    struct cell_block Done[] = {
+        { 0, 0, 0, Rows - 1 },
+        { 1, 0, 1, PendingRow - 1 },
+        { 1, PendingRow + 1, 1, Rows - 1 },
+    };
+
+    for (s32 Idx = 0; Idx < sArrayCount(Pending); ++Idx) {
+        RememberAggregate(Doc, EF_SUM, Pending[Idx], Idx);
+        char *Msg = TestRecall(Doc, EF_SUM, Pending[Idx], false, 0);
+        if (Msg) return Msg;
+    }
+    for (s32 Idx = 0; Idx < sArrayCount(Done); ++Idx) {
+        RememberAggregate(Doc, EF_SUM, Done[Idx], Idx);
+        char *Msg = TestRecall(Doc, EF_SUM, Done[Idx], true, Idx);
+        if (Msg) return Msg;
+    }
+    return 0;
+}
+
+/* Enough blocks that the memo grows, none of which are lost when it does */
+char *
+ManyBlocksRemembered()
+{
+    struct document *Doc = MakeMemoDoc();
+    for (s32 Row = 0; Row < Rows; ++Row) {
+        RememberAggregate(Doc, EF_SUM, (struct cell_block){ 0, 0, 0, Row }, Row);
+        RememberAggregate(Doc, EF_AVERAGE, (struct cell_block){ 0, Row, 0, Rows - 1 }, -Row);
+    }
+    for (s32 Row = 0; Row < Rows; ++Row) {
+        char *Msg = TestRecall(Doc, EF_SUM, (struct cell_block){ 0, 0, 0, Row }, true, Row);
+        if (!Msg) Msg = TestRecall(Doc, EF_AVERAGE, (struct cell_block){ 0, Row, 0, Rows - 1 }, true, -Row);
+        if (Msg) return Msg;
+    }
+    return 0;
+}
+
+
+s32
+main(s32 ArgCount, char **argv)
+{
+    (void)ArgCount;
+    printf("----\nRunning: %s\n\n", argv[0]);
+
+    struct test {
+        char *(*Test)();
+        char *Name;
+    } Tests[] = {
+#define X(N) {N, #N}
+        X(HitsAndMisses),
+        X(PendingBlocksNotRemembered),
+        X(ManyBlocksRemembered),
+#undef X
+        0
+    };
+
+    s32 TestsRun = 0;
+    s32 TestsFailed = 0;
+    for (struct test *This = Tests; This->Test; ++TestsRun, ++This) {
+        char *Message = This->Test();
+        if (Message) {
+            printf("FAILED %s: %s\n", This->Name, Message);
+            ++TestsFailed;
+        }
+        else {
+            printf("PASSED %s\n", This->Name);
+        }
+    }
+
+    printf("\n"
+            "passed  failed  total\n"
+            "------- ------- -------\n"
+            "%7d %7d %7d\n"
+            , TestsRun - TestsFailed, TestsFailed, TestsRun);
+
+    return TestsFailed == 0;
+}
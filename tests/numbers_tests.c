@@ -0,0 +1,281 @@
+#include "common.h"
+
+#include "mem.h"
+#include "numbers.h"
+#include "util.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char _MsgBuf[512];
+
+/* A document of Cols columns of Rows numbers each, which are Values column by
+ * column, whose number columns are yet to be filled */
+static struct document *
+NewNumbersDoc(f64 *Values, s32 Cols, s32 Rows)
+{
+    static ino_t NextInode = 1;
+    struct document *Doc = AllocAndLogDoc(0, NextInode++);
+    *Doc = (struct document){0};
+
+    for (s32 Col = 0; Col < Cols; ++Col) {
+        for (s32 Row = 0; Row < Rows; ++Row) {
+            *ReserveCell(Doc, Col, Row) = NUMBER_CELL(Values[Col*Rows + Row]);
+        }
+    }
+    return Doc;
+}
+
+/* The same, done loading and evaluating */
+static struct document *
+MakeNumbersDoc(f64 *Values, s32 Cols, s32 Rows)
+{
+    struct document *Doc = NewNumbersDoc(Values, Cols, Rows);
+    FillNumberColumns(Doc);
+    return Doc;
+}
+
+/* Numbers of every size and sign, which round apart when added in another order */
+static void
+FillMixedNumbers(f64 *Values, s32 Count)
+{
+    u64 State = 0x2545f4914f6cdd1d;
+    for (s32 Idx = 0; Idx < Count; ++Idx) {
+        State ^= State << 13; State ^= State >> 7; State ^= State << 17;
+        f64 Number = (f64)(State % 1000) + 0.1;
+        for (s32 Exp = (State >> 16) % 20; Exp; --Exp) Number *= 10;
+        Values[Idx] = (State & (1 << 24))? -Number: Number;
+    }
+}
+
+/* The sum of the rows, added one cell at a time */
+static f64
+CellOrderSum(f64 *Values, s32 FirstRow, s32 LastRow, f64 Sum)
+{
+    for (s32 Row = FirstRow; Row <= LastRow; ++Row) {
+        Sum += Values[Row];
+    }
+    return Sum;
+}
+
+char *
+TestSumNumbers(struct document *Doc, f64 *Values, s32 FirstRow, s32 LastRow)
+{
+    f64 Expected = CellOrderSum(Values, FirstRow, LastRow, 0);
+    f64 Actual = SumNumbers(Doc, 0, FirstRow, LastRow, 0);
+    if (Actual != Expected) {
+        snprintf(_MsgBuf, sizeof _MsgBuf,
+                "SumNumbers(Doc, 0, %d, %d, 0) expected %a, but got %a",
+                FirstRow, LastRow, Expected, Actual);
+        return _MsgBuf;
+    }
+    return 0;
+}
+
+/* The vectorized kernels must not change what a sum rounds to */
+char *
+SumsInCellOrder()
+{
+    f64 Values[300];
+    FillMixedNumbers(Values, ArrayCount(Values));
+
+    for (s32 Rows = 1; Rows <= sArrayCount(Values); ++Rows) {
+        struct document *Doc = MakeNumbersDoc(Values, 1, Rows);
+        char *Msg = TestSumNumbers(Doc, Values, 0, Rows - 1);
+        if (Msg) return Msg;
+    }
+    return 0;
+}
+
+/* A large number leaves nothing of the small ones that follow it, in a sum
+ * that starts from it; one that starts after it must still count them all */
+char *
+SmallNumbersAfterLarge()
+{
+    f64 Values[100] = { 1e16 };
+    for (s32 Row = 1; Row < sArrayCount(Values); ++Row) {
+        Values[Row] = 1;
+    }
+
+    /* NOTE: which range comes first decides where the running sums start */
+    struct document *Doc = MakeNumbersDoc(Values, 1, ArrayCount(Values));
+    char *Msg = TestSumNumbers(Doc, Values, 0, 99);
+    if (!Msg) Msg = TestSumNumbers(Doc, Values, 1, 99);
+    if (Msg) return Msg;
+
+    Doc = MakeNumbersDoc(Values, 1, ArrayCount(Values));
+    Msg = TestSumNumbers(Doc, Values, 1, 99);
+    if (!Msg) Msg = TestSumNumbers(Doc, Values, 0, 99);
+    if (!Msg) Msg = TestSumNumbers(Doc, Values, 1, 99);
+    if (Msg) return Msg;
+
+    if (SumNumbers(Doc, 0, 1, 99, 0) != 99) {
+        return "SumNumbers(Doc, 0, 1, 99, 0) lost the small numbers";
+    }
+    return 0;
+}
+
+/* Every range, and ranges over several columns, sum as their cells would in
+ * turn, whatever running sums the ones before them left */
+char *
+SumsOfRangesInCellOrder()
+{
+    enum { Cols = 3, Rows = 200 };
+    f64 Values[Cols*Rows];
+    FillMixedNumbers(Values, ArrayCount(Values));
+    struct document *Doc = MakeNumbersDoc(Values, Cols, Rows);
+
+    for (s32 FirstRow = 0; FirstRow < Rows; FirstRow += 7) {
+        for (s32 LastRow = FirstRow; LastRow < Rows; LastRow += 13) {
+            char *Msg = TestSumNumbers(Doc, Values, FirstRow, LastRow);
+            if (Msg) return Msg;
+
+            f64 Expected = 0, Actual = 0;
+            for (s32 Col = 0; Col < Cols; ++Col) {
+                Expected = CellOrderSum(Values + Col*Rows, FirstRow, LastRow, Expected);
+                Actual = SumNumbers(Doc, Col, FirstRow, LastRow, Actual);
+            }
+            if (Actual != Expected) {
+                snprintf(_MsgBuf, sizeof _MsgBuf,
+                        "rows %d to %d of %d columns expected %a, but got %a",
+                        FirstRow, LastRow, Cols, Expected, Actual);
+                return _MsgBuf;
+            }
+        }
+    }
+    return 0;
+}
+
+/* A sum over the body of a column, below rows that are not numbers, comes
+ * before the running totals down it from its first row. Both are summed from
+ * the same running sums, which start from the first row. */
+char *
+BodySumBeforeRunningTotals()
+{
+    enum { Rows = 300, BodyRow = 2 };
+    f64 Values[Rows];
+    FillMixedNumbers(Values, Rows);
+
+    struct document *Doc = NewNumbersDoc(Values, 1, Rows);
+    for (s32 Row = 0; Row < BodyRow; ++Row) {
+        *GetCell(Doc, 0, Row) = (struct cell){ .Type = CELL_STRING };
+        Values[Row] = 0;
+    }
+    FillNumberColumns(Doc);
+
+    char *Msg = TestSumNumbers(Doc, Values, BodyRow, Rows - 1);
+    if (Msg) return Msg;
+
+    struct column_sums *Sums = Doc->Numbers.Sums[0];
+    if (!Sums || Sums->Valid != Rows) {
+        return "the sum over the body made no running sums down the column";
+    }
+
+    for (s32 Row = 0; Row < Rows; ++Row) {
+        Msg = TestSumNumbers(Doc, Values, 0, Row);
+        if (!Msg) Msg = TestSumNumbers(Doc, Values, BodyRow, Row);
+        if (Msg) return Msg;
+    }
+    return 0;
+}
+
+/* The extreme of the numbers among the rows, one cell at a time in turn */
+static f64
+CellOrderExtreme(f64 *Values, bool *IsNumber, s32 FirstRow, s32 LastRow, bool IsMin)
+{
+    f64 Number = IsMin? INFINITY: -INFINITY;
+    for (s32 Row = FirstRow; Row <= LastRow; ++Row) {
+        if (IsNumber[Row]) {
+            Number = IsMin? Min(Number, Values[Row]): Max(Number, Values[Row]);
+        }
+    }
+    return Number;
+}
+
+/* Long ranges, which take most of their blocks from the range index, end
+ * where they will and have runs of cells that are not numbers, or are NaN.
+ * They must come to just what their cells would in turn, down to the bits. */
+char *
+ExtremesOfLongRanges()
+{
+    enum { Rows = 1000 };
+    f64 Values[Rows];
+    bool IsNumber[Rows];
+    FillMixedNumbers(Values, Rows);
+
+    struct document *Doc = NewNumbersDoc(Values, 1, Rows);
+    for (s32 Row = 0; Row < Rows; ++Row) {
+        IsNumber[Row] = (Row / 50) % 7 != 3;
+        if (!IsNumber[Row]) {
+            *GetCell(Doc, 0, Row) = (struct cell){ .Type = CELL_STRING };
+        }
+        else if ((Row / 30) % 11 == 5 || Row == 700) {
+            GetCell(Doc, 0, Row)->AsNumber = Values[Row] = -NAN;
+        }
+    }
+    FillNumberColumns(Doc);
+
+    for (s32 FirstRow = 0; FirstRow < Rows - 300; FirstRow += 37) {
+        for (s32 LastRow = FirstRow + 299; LastRow < Rows; LastRow += 41) {
+            f64 Expected[2] = {
+                CellOrderExtreme(Values, IsNumber, FirstRow, LastRow, true),
+                CellOrderExtreme(Values, IsNumber, FirstRow, LastRow, false),
+            };
+            f64 Actual[2] = {
+                MinNumber(Doc, 0, FirstRow, LastRow),
+                MaxNumber(Doc, 0, FirstRow, LastRow),
+            };
+            if (memcmp(Expected, Actual, sizeof Expected)) {
+                snprintf(_MsgBuf, sizeof _MsgBuf,
+                        "rows %d to %d expected min %a and max %a, but got %a and %a",
+                        FirstRow, LastRow, Expected[0], Expected[1], Actual[0], Actual[1]);
+                return _MsgBuf;
+            }
+        }
+    }
+    return 0;
+}
+
+
+s32
+main(s32 ArgCount, char **argv)
+{
+    (void)ArgCount;
+    printf("----\nRunning: %s\n\n", argv[0]);
+
+    struct test {
+        char *(*Test)();
+        char *Name;
+    } Tests[] = {
+#define X(N) {N, #N}
+        X(SumsInCellOrder),
+        X(SmallNumbersAfterLarge),
+        X(SumsOfRangesInCellOrder),
+        X(BodySumBeforeRunningTotals),
+        X(ExtremesOfLongRanges),
+#undef X
+        0
+    };
+
+    s32 TestsRun = 0;
+    s32 TestsFailed = 0;
+    for (struct test *This = Tests; This->Test; ++TestsRun, ++This) {
+        char *Message = This->Test();
+        if (Message) {
+            printf("FAILED %s: %s\n", This->Name, Message);
+            ++TestsFailed;
+        }
+        else {
+            printf("PASSED %s\n", This->Name);
+        }
+    }
+
+    printf("\n"
+            "passed  failed  total\n"
+            "------- ------- -------\n"
+            "%7d %7d %7d\n"
+            , TestsRun - TestsFailed, TestsFailed, TestsRun);
+
+    return TestsFailed == 0;
+}
@@ -5,3 +5,38 @@ do
     [ -x "$file" ] || continue
     $VALGRIND "./$file"
 done
+
+# NOTE: each document is printed once on its own and once with --jobs, each
+# time without a disk cache, from one that is empty, and again from one that
+# holds it, and all of them must print just what its .out file holds
+[ -x "$TABULATE" ] || exit 0
+printf -- "----\nRunning: %s\n\n" "$TABULATE"
+
+cache=$(mktemp -d) || exit 1
+trap 'rm -rf "$cache"' EXIT
+
+run=0
+failed=0
+for doc in tests/docs/*.tab
+do
+    for jobs in 1 4
+    do
+        rm -rf "$cache/tabulate"
+        for pass in uncached cold warm
+        do
+            run=$((run + 1))
+            flags="--jobs $jobs"
+            [ "$pass" = uncached ] && flags="$flags --no-cache"
+            if XDG_CACHE_HOME="$cache" $VALGRIND "$TABULATE" $flags "$doc" 2>/dev/null | cmp -s - "${doc%.tab}.out"
+            then
+                echo "PASSED $doc --jobs $jobs ($pass)"
+            else
+                echo "FAILED $doc --jobs $jobs ($pass)"
+                failed=$((failed + 1))
+            fi
+        done
+    done
+done
+
+printf "\npassed  failed  total\n------- ------- -------\n%7d %7d %7d\n" \
+        $((run - failed)) $failed $run
@@ -3,6 +3,8 @@
 #include "util.h"
 
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define NOP
 
@@ -189,10 +191,10 @@ char *
 TestStr2f64(char *Str, f64 ExpectedRet, char ExpectedRhs)
 {
     char *Rhs, *Msg = 0;
-    f64 Actual = Str2f64(Str, &Rhs);
+    f64 Actual = Str2f64(Str, Str + strlen(Str), &Rhs);
     if (Actual != ExpectedRet) {
         snprintf(_MsgBuf, sizeof _MsgBuf,
-                "Str2f64(\"%s\" &Rhs) expected %f, but got %f",
+                "Str2f64(\"%s\" &Rhs) expected %a, but got %a",
                 Str, ExpectedRet, Actual);
         Msg = _MsgBuf;
     }
@@ -218,10 +220,78 @@ StringToF64()
     X("-.x", 0, 'x');
     X("-.1x", -0.1, 'x');
     X("-8.5", -8.5, 0);
+    X("1,234,567.89", 1234567.89, 0);
+    X("12,x", 12, 'x');
+    X("1.2.3", 1.2, '.');
 #undef X
     return 0;
 }
 
+char *
+StringToF64Rounding()
+{
+#define X(I,O) do { char *M = TestStr2f64(I,O,0); if (M) return M; } while (0)
+    /* the old digit-by-digit parse got these wrong */
+    X("0.3", 0.3);
+    X("0.7", 0.7);
+    X("1234.56", 1234.56);
+    X("0.000123", 0.000123);
+    X("98765432.1", 98765432.1);
+
+    /* eight digit chunks */
+    X("12345678901234567", 12345678901234567.0);
+    X("1.0000000000000002", 1.0000000000000002);
+    X("3.14159265358979323", 3.14159265358979323);
+
+    /* ties between doubles round to even */
+    X("9007199254740993", 9007199254740992.0);
+    X("9007199254740995", 9007199254740996.0);
+    X("9,007,199,254,740,993", 9007199254740992.0);
+    X("1.00000000000000011102230246251565404236316680908203125", 1.0);
+    X("1.00000000000000011102230246251565404236316680908203126", 1.0000000000000002);
+    X("1.00000000000000033306690738754696212708950042724609375", 1.0000000000000004);
+
+    /* more digits than fit in the mantissa */
+    X("123456789012345678901234567890", 123456789012345678901234567890.0);
+    X("0.1000000000000000055511151231257827021181583404541015625", 0.1);
+    X("-179769313486231570814527423731704356798070567525844996598917476803157260780028538760589558632766878171540458953514382464234321326889464182768467546703537516986049910576551282076245490090389328944075868508455133942304583236903222948165808559332123348274797826204144723168738177180919299881250404026184124858368",
+            -1.7976931348623157e308);
+#undef X
+    return 0;
+}
+
+/* Compare against the C library on numbers shaped like our documents' */
+char *
+StringToF64MatchesStrtod()
+{
+    u64 State = 0x2545f4914f6cdd1d;
+    for (s32 Idx = 0; Idx < 100000; ++Idx) {
+        char Buf[64];
+        State ^= State << 13; State ^= State >> 7; State ^= State << 17;
+        s32 Frac = State % 12;
+        s32 Digits = 1 + (State >> 8) % 24;
+        u64 Bits = State;
+
+        char *Cur = Buf;
+        for (s32 It = 0; It < Digits; ++It) {
+            if (It == Digits - Frac) *Cur++ = '.';
+            *Cur++ = '0' + Bits % 10;
+            Bits = (Bits / 10) ^ (State >> (It % 32));
+        }
+        *Cur = 0;
+
+        char *Rhs;
+        f64 Expected = strtod(Buf, 0);
+        f64 Actual = Str2f64(Buf, Cur, &Rhs);
+        if (Actual != Expected || Rhs != Cur) {
+            snprintf(_MsgBuf, sizeof _MsgBuf,
+                    "Str2f64(\"%s\") expected %a, but got %a", Buf, Expected, Actual);
+            return _MsgBuf;
+        }
+    }
+    return 0;
+}
+
 
 s32
 main(s32 ArgCount, char **argv)
@@ -239,6 +309,8 @@ main(s32 ArgCount, char **argv)
         X(PowersOfU32),
         X(PowersOfU64),
         X(StringToF64),
+        X(StringToF64Rounding),
+        X(StringToF64MatchesStrtod),
 #undef X
         0
     };